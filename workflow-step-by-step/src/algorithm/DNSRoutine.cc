@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <sys/un.h>
 #include "DNSRoutine.h"
 
@@ -34,6 +35,13 @@ void DNSRoutine::run(const DNSInput *in, DNSOutput *out)
 {
 	if (!in->host_.empty() && in->host_[0] == '/')
 	{
+		if (in->host_.size() >= sizeof (((struct sockaddr_un *)0)->sun_path))
+		{
+			errno = ENAMETOOLONG;
+			out->error_ = EAI_SYSTEM;
+			return;
+		}
+
 		out->error_ = 0;
 		out->addrinfo_ = (addrinfo*)malloc(sizeof (struct addrinfo) + sizeof (struct sockaddr_un));
 		out->addrinfo_->ai_flags = AI_ADDRCONFIG;
@@ -1,5 +1,10 @@
 #include <assert.h>
+#include <errno.h>
 #include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 #include "WFTaskError.h"
 #include "WFTaskFactory.h"
 #include "StringUtil.h"
@@ -10,6 +15,102 @@ using namespace protocol;
 
 #define HTTP_KEEPALIVE_DEFAULT	(60 * 1000)
 #define HTTP_KEEPALIVE_MAX		(300 * 1000)
+#define COALESCE_DISPATCH_CHUNK	64
+
+class ComplexHttpTask;
+
+/* A follower, completed once: by the leader's reply or by its own timer. */
+struct __coalesce_wait
+{
+	ComplexHttpTask *task;
+	std::atomic<bool> claimed;
+	std::atomic<int> ref;
+};
+
+struct __coalesce_flight
+{
+	std::string key;
+	std::vector<struct __coalesce_wait *> followers;
+	bool mapped;
+};
+
+static void __coalesce_release(struct __coalesce_wait *wait)
+{
+	if (--wait->ref == 0)
+		delete wait;
+}
+
+/* Requests in flight by key. A full flight stays with its leader, and the
+ * next identical request leads a new one in its place. */
+class __CoalesceMap
+{
+public:
+	static __CoalesceMap *get_instance()
+	{
+		static __CoalesceMap kInstance;
+		return &kInstance;
+	}
+
+	/* True if the task joined a flight. Otherwise it goes on the wire, as
+	 * the leader of *flight or alone if *flight is NULL. */
+	bool join(const std::string& key, struct __coalesce_wait *wait,
+			  struct __coalesce_flight **flight);
+
+	/* Takes the flight out of the map once its leader is done. */
+	void leave(struct __coalesce_flight *flight);
+
+private:
+	__CoalesceMap() : total_(0) { }
+
+private:
+	std::unordered_map<std::string, struct __coalesce_flight *> map_;
+	size_t total_;
+	std::mutex mutex_;
+};
+
+bool __CoalesceMap::join(const std::string& key, struct __coalesce_wait *wait,
+						 struct __coalesce_flight **flight)
+{
+	const auto *settings = WFGlobal::get_global_settings();
+	size_t followers_max = settings->coalesce_followers_max;
+	size_t total_max = settings->coalesce_total_max;
+	std::lock_guard<std::mutex> lock(mutex_);
+	struct __coalesce_flight *&entry = map_[key];
+
+	if (entry)
+	{
+		if (total_max != 0 && total_ >= total_max)
+		{
+			*flight = NULL;
+			return false;
+		}
+
+		if (followers_max == 0 || entry->followers.size() < followers_max)
+		{
+			entry->followers.push_back(wait);
+			total_++;
+			return true;
+		}
+
+		entry->mapped = false;
+	}
+
+	entry = new struct __coalesce_flight;
+	entry->key = key;
+	entry->mapped = true;
+	*flight = entry;
+	return false;
+}
+
+void __CoalesceMap::leave(struct __coalesce_flight *flight)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (flight->mapped)
+		map_.erase(flight->key);
+
+	total_ -= flight->followers.size();
+}
 
 class ComplexHttpTask : public WFComplexClientTask<HttpRequest, HttpResponse>
 {
@@ -29,17 +130,61 @@ protected:
 	virtual CommMessageOut *message_out();
 	virtual CommMessageIn *message_in();
 	virtual int keep_alive_timeout();
+	virtual int max_pipeline();
 	virtual bool init_success();
 	virtual void init_failed();
 	virtual bool finish_once();
+	virtual WFComplexClientTask *hedge_clone();
+	virtual bool coalesce_join();
 
 private:
 	bool need_redirect();
 	bool redirect_url(HttpResponse *client_resp);
 	void set_empty_request();
+	void share_reply(ComplexHttpTask *leader);
+	void coalesce_timeout();
 
 	int redirect_max_;
 	int redirect_count_;
+
+	friend class __CoalesceChunk;
+};
+
+/* Lets a range of followers go on when a handler thread takes it, through
+ * a timer that is due at once. */
+class __CoalesceChunk : public SleepSession
+{
+public:
+	__CoalesceChunk(std::vector<ComplexHttpTask *>::const_iterator begin,
+					std::vector<ComplexHttpTask *>::const_iterator end) :
+		followers(begin, end)
+	{
+	}
+
+	void run()
+	{
+		for (ComplexHttpTask *follower : this->followers)
+			follower->subtask_done();
+
+		delete this;
+	}
+
+private:
+	virtual int duration(struct timespec *value)
+	{
+		value->tv_sec = 0;
+		value->tv_nsec = 0;
+		return 0;
+	}
+
+	/* Even if the poller stopped, the followers must run to finish. */
+	virtual void handle(int /* state */, int /* error */)
+	{
+		this->run();
+	}
+
+private:
+	std::vector<ComplexHttpTask *> followers;
 };
 
 CommMessageOut *ComplexHttpTask::message_out()
@@ -143,11 +288,27 @@ int ComplexHttpTask::keep_alive_timeout()
 	return this->resp.is_keep_alive() ? this->keep_alive_timeo : 0;
 }
 
+int ComplexHttpTask::max_pipeline()
+{
+	const char *method = this->get_req()->get_method();
+
+	/* Only idempotent requests on a keep-alive connection are pipelined,
+	 * so that a request failed over to another connection is safe. */
+	if (this->keep_alive_timeo == 0 || !method)
+		return 1;
+
+	if (strcmp(method, HttpMethodGet) != 0 && strcmp(method, HttpMethodHead) != 0)
+		return 1;
+
+	return this->pipeline_depth;
+}
+
 bool ComplexHttpTask::init_success()
 {
 	HttpRequest *client_req = this->get_req();
 	std::string request_uri;
 	std::string header_host;
+	bool is_ssl = false;
 	bool is_unix = false;
 
 	//todo http+unix
@@ -165,6 +326,9 @@ bool ComplexHttpTask::init_success()
 		request_uri += uri_.query;
 	}
 
+	if (uri_.scheme && strcasecmp(uri_.scheme, "https") == 0)
+		is_ssl = true;
+
 	if (uri_.host && uri_.host[0])
 	{
 		header_host = uri_.host;
@@ -175,14 +339,14 @@ bool ComplexHttpTask::init_success()
 	if (!is_unix && uri_.port && uri_.port[0])
 	{
 		int port = atoi(uri_.port);
-		if (port != 80)
+		if (port != (is_ssl ? 443 : 80))
 		{
 			header_host += ":";
 			header_host += uri_.port;
 		}
 	}
 
-	this->WFComplexClientTask::set_type(TT_TCP);
+	this->WFComplexClientTask::set_type(is_ssl ? TT_TCP_SSL : TT_TCP);
 	client_req->set_request_uri(request_uri.c_str());
 	client_req->set_header_pair("Host", header_host.c_str());
 
@@ -277,6 +441,187 @@ bool ComplexHttpTask::redirect_url(HttpResponse *client_resp)
 	return false;
 }
 
+/* Retries are left to the user task, redirects to each attempt. */
+WFComplexClientTask<HttpRequest, HttpResponse> *ComplexHttpTask::hedge_clone()
+{
+	auto *task = new ComplexHttpTask(redirect_max_, 0, nullptr);
+	HttpRequest *client_req = task->get_req();
+	HttpHeaderCursor cursor(this->get_req());
+	struct HttpMessageHeader header;
+
+	client_req->set_method(this->req.get_method());
+	client_req->set_http_version(this->req.get_http_version());
+	while (cursor.next(&header))
+		client_req->add_header(&header);
+
+	if (!client_req->copy_output_body(&this->req))
+	{
+		delete task;
+		return NULL;
+	}
+
+	return task;
+}
+
+bool ComplexHttpTask::coalesce_join()
+{
+	HttpRequest *client_req = this->get_req();
+	const char *method = client_req->get_method();
+	HttpHeaderCursor cursor(client_req);
+	struct __coalesce_flight *flight;
+	struct __coalesce_wait *wait;
+	WFTimerTask *timer;
+	struct timespec ts;
+	std::string value;
+	std::string key;
+	long long timeout;
+
+	if (!method || !original_uri_.host ||
+		(strcmp(method, HttpMethodGet) != 0 && strcmp(method, HttpMethodHead) != 0))
+	{
+		return false;
+	}
+
+	key = method;
+	key += ' ';
+	if (original_uri_.scheme)
+		key += original_uri_.scheme;
+
+	key += "://";
+	key += original_uri_.host;
+	if (original_uri_.port)
+	{
+		key += ':';
+		key += original_uri_.port;
+	}
+
+	key += client_req->get_request_uri();
+	for (const auto& str : StringUtil::split_filter_empty(this->coalesce_headers, ','))
+	{
+		std::string name = StringUtil::strip(str);
+
+		key += '\n';
+		key += name;
+		key += ':';
+		cursor.rewind();
+		if (cursor.find(name, value))
+			key += value;
+	}
+
+	/* A follower waits as long as its own request could have taken on the
+	 * wire: its send timeout, if any, and then its receive timeout. */
+	wait = new struct __coalesce_wait;
+	wait->task = this;
+	wait->claimed = false;
+	wait->ref = 1;
+	timer = NULL;
+	if (this->receive_timeo >= 0)
+	{
+		timeout = this->receive_timeo;
+		if (this->send_timeo > 0)
+			timeout += this->send_timeo;
+
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000;
+		wait->ref++;
+		timer = new __WFTimerTask(&ts, WFGlobal::get_scheduler(),
+								  [wait](WFTimerTask *) {
+			if (!wait->claimed.exchange(true))
+				wait->task->coalesce_timeout();
+
+			__coalesce_release(wait);
+		});
+	}
+
+	/* Once joined, the follower is the flight's, and may be gone. */
+	if (__CoalesceMap::get_instance()->join(key, wait, &flight))
+	{
+		if (timer)
+			timer->start();
+
+		return true;
+	}
+
+	if (timer)
+		timer->dismiss();
+
+	delete wait;
+	if (flight)
+	{
+		/* Followers get the reply before the leader's callback may take it
+		 * apart, and go on after it, in chunks on the handler threads. */
+		this->callback = [flight, cb = std::move(this->callback)](WFHttpTask *task)
+		{
+			auto *leader = static_cast<ComplexHttpTask *>(task);
+			std::vector<ComplexHttpTask *> followers;
+			CommScheduler *scheduler;
+			__CoalesceChunk *chunk;
+			size_t begin;
+			size_t end;
+			size_t n;
+
+			__CoalesceMap::get_instance()->leave(flight);
+			followers.reserve(flight->followers.size());
+			for (struct __coalesce_wait *wait : flight->followers)
+			{
+				if (!wait->claimed.exchange(true))
+				{
+					wait->task->share_reply(leader);
+					followers.push_back(wait->task);
+				}
+
+				__coalesce_release(wait);
+			}
+
+			delete flight;
+			if (cb)
+				cb(task);
+
+			n = followers.size();
+			scheduler = WFGlobal::get_scheduler();
+			for (begin = COALESCE_DISPATCH_CHUNK; begin < n; begin = end)
+			{
+				end = begin + COALESCE_DISPATCH_CHUNK < n ? begin + COALESCE_DISPATCH_CHUNK : n;
+				chunk = new __CoalesceChunk(followers.cbegin() + begin,
+											followers.cbegin() + end);
+				if (scheduler->sleep(chunk) < 0)
+					chunk->run();
+			}
+
+			/* The first chunk goes on from this thread. */
+			end = COALESCE_DISPATCH_CHUNK < n ? COALESCE_DISPATCH_CHUNK : n;
+			for (begin = 0; begin < end; begin++)
+				followers[begin]->subtask_done();
+		};
+	}
+
+	return false;
+}
+
+void ComplexHttpTask::share_reply(ComplexHttpTask *leader)
+{
+	this->state = leader->state;
+	this->error = leader->error;
+	this->timeout_reason = leader->timeout_reason;
+
+	/* An incomplete reply of a failed leader is not shared. */
+	if (!this->resp.share_message(&leader->resp) &&
+		this->state == WFT_STATE_SUCCESS)
+	{
+		this->state = WFT_STATE_SYS_ERROR;
+		this->error = errno;
+	}
+}
+
+/* As a request on the wire that got no reply in its receive timeout. */
+void ComplexHttpTask::coalesce_timeout()
+{
+	this->state = WFT_STATE_SYS_ERROR;
+	this->error = ETIMEDOUT;
+	this->timeout_reason = TOR_TRANSMIT_TIMEOUT;
+	this->subtask_done();
+}
+
 void ComplexHttpTask::set_empty_request()
 {
 	HttpRequest *client_req = this->get_req();
@@ -0,0 +1,174 @@
+#ifndef _WFCOROUTINE_H_
+#define _WFCOROUTINE_H_
+
+/* co_await on tasks, series and parallels. Needs C++20 in the file that
+ * includes it; the library itself stays C++17 and does not use it.
+ *
+ *     WFCoroutine fetch(std::string url)
+ *     {
+ *         WFHttpTask *task = WFTaskFactory::create_http_task(url, 3, 0, nullptr);
+ *
+ *         co_await await_task(task);
+ *         if (task->get_state() == WFT_STATE_SUCCESS)
+ *             ...
+ *     }
+ *
+ * await_task() starts the task in a series of its own. The coroutine
+ * resumes from inside the task's callback, on the thread that finished
+ * it, so the task is valid until the next co_await and not after.
+ * Anything with set_callback() and start() works: WFNetworkTask,
+ * WFThreadTask, WFTimerTask, WFGraphTask, SeriesWork and ParallelWork,
+ * the last of which is the way to fan out. */
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <new>
+#include <coroutine>
+#include "Workflow.h"
+
+#define WFCO_FRAME_ALIGN		64
+#define WFCO_FRAME_CLASSES		16		/* frames up to 1KB are pooled */
+#define WFCO_FRAME_POOL_MAX		64		/* per size class and thread */
+
+/* Freed coroutine frames, kept per thread and size class for reuse. */
+class WFCoFramePool
+{
+public:
+	static void *alloc(size_t size)
+	{
+		size_t i = (size - 1) / WFCO_FRAME_ALIGN;
+		void *ptr;
+
+		if (i >= WFCO_FRAME_CLASSES)
+			return ::operator new(size);
+
+		ptr = WFCoFramePool::local()->get(i);
+		if (!ptr)
+			ptr = ::operator new((i + 1) * WFCO_FRAME_ALIGN);
+
+		return ptr;
+	}
+
+	static void free(void *ptr, size_t size)
+	{
+		size_t i = (size - 1) / WFCO_FRAME_ALIGN;
+
+		if (i >= WFCO_FRAME_CLASSES || !WFCoFramePool::local()->put(i, ptr))
+			::operator delete(ptr);
+	}
+
+private:
+	void *get(size_t i)
+	{
+		void *ptr = this->head[i];
+
+		if (ptr)
+		{
+			this->head[i] = *(void **)ptr;
+			this->count[i]--;
+		}
+
+		return ptr;
+	}
+
+	bool put(size_t i, void *ptr)
+	{
+		if (this->count[i] >= WFCO_FRAME_POOL_MAX)
+			return false;
+
+		*(void **)ptr = this->head[i];
+		this->head[i] = ptr;
+		this->count[i]++;
+		return true;
+	}
+
+	static WFCoFramePool *local()
+	{
+		static thread_local WFCoFramePool pool;
+		return &pool;
+	}
+
+	WFCoFramePool() : head(), count() { }
+
+	~WFCoFramePool()
+	{
+		void *ptr;
+		size_t i;
+
+		for (i = 0; i < WFCO_FRAME_CLASSES; i++)
+		{
+			while ((ptr = this->get(i)) != NULL)
+				::operator delete(ptr);
+
+			/* A frame freed later in this thread's exit is not kept. */
+			this->count[i] = WFCO_FRAME_POOL_MAX;
+		}
+	}
+
+private:
+	void *head[WFCO_FRAME_CLASSES];
+	int count[WFCO_FRAME_CLASSES];
+};
+
+/* A coroutine that runs as soon as it is called and frees itself when
+ * it returns. Nobody waits for it; report results through the tasks it
+ * awaits or through its arguments. */
+class WFCoroutine
+{
+public:
+	struct promise_type
+	{
+		WFCoroutine get_return_object() noexcept { return WFCoroutine(); }
+		std::suspend_never initial_suspend() noexcept { return { }; }
+		std::suspend_never final_suspend() noexcept { return { }; }
+		void return_void() noexcept { }
+		void unhandled_exception() noexcept { abort(); }
+
+		static void *operator new(size_t size)
+		{
+			return WFCoFramePool::alloc(size);
+		}
+
+		static void operator delete(void *ptr, size_t size)
+		{
+			WFCoFramePool::free(ptr, size);
+		}
+	};
+};
+
+template<class TASK>
+class WFTaskAwaiter
+{
+public:
+	bool await_ready() const noexcept { return false; }
+
+	/* The task may finish, and resume us on another thread, before
+	 * start() returns. So nothing of ours is touched after it. */
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		TASK *task = this->task;
+
+		task->set_callback([handle](auto *) { handle.resume(); });
+		task->start();
+	}
+
+	TASK *await_resume() const noexcept { return this->task; }
+
+public:
+	WFTaskAwaiter(TASK *task) { this->task = task; }
+
+private:
+	TASK *task;
+};
+
+template<class TASK>
+static inline WFTaskAwaiter<TASK> await_task(TASK *task)
+{
+	return WFTaskAwaiter<TASK>(task);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+#include <stddef.h>
+#include <vector>
+#include <utility>
+#include <functional>
+#include "WFTaskError.h"
+#include "WFGraphTask.h"
+
+/* First run: wait for the predecessors, the last of which resumes us.
+ * Second run, as the last task of the series: release the successors. */
+void WFGraphNode::dispatch()
+{
+	if (!this->entered)
+	{
+		this->entered = true;
+		if (__sync_sub_and_fetch(&this->value, 1) == 0)
+			this->subtask_done();
+	}
+	else
+	{
+		this->release_successors();
+		this->subtask_done();
+	}
+}
+
+SubTask *WFGraphNode::done()
+{
+	SeriesWork *series = series_of(this);
+
+	if (this->released)
+		delete this;
+
+	return series->pop();
+}
+
+void WFGraphNode::release_successors()
+{
+	WFGraphNode *node;
+	size_t i;
+
+	this->released = true;
+	for (i = 0; i < this->successors.size(); i++)
+	{
+		node = this->successors[i];
+		if (__sync_sub_and_fetch(&node->value, 1) == 0)
+			node->subtask_done();
+	}
+}
+
+/* Deleted unreleased after being reached only when its series was
+ * canceled. The successors still go on. */
+WFGraphNode::~WFGraphNode()
+{
+	if (this->entered && !this->released)
+		this->release_successors();
+}
+
+WFGraphNode& WFGraphTask::create_graph_node(SubTask *task)
+{
+	WFGraphNode *node = new WFGraphNode;
+	SeriesWork *series = Workflow::create_series_work(node, node, nullptr);
+
+	series->push_back(task);
+	node->index = this->nodes.size();
+	this->nodes.push_back(node);
+	this->parallel->add_series(series);
+	return *node;
+}
+
+/* Kahn's algorithm: a cycle is what is left after taking away, again and
+ * again, the nodes with no predecessor left. */
+bool WFGraphTask::has_cycle() const
+{
+	std::vector<size_t> indegree(this->nodes.size());
+	std::vector<size_t> ready;
+	WFGraphNode *node;
+	size_t visited = 0;
+	size_t i;
+
+	for (i = 0; i < this->nodes.size(); i++)
+	{
+		indegree[i] = this->nodes[i]->value - 1;
+		if (indegree[i] == 0)
+			ready.push_back(i);
+	}
+
+	while (!ready.empty())
+	{
+		node = this->nodes[ready.back()];
+		ready.pop_back();
+		visited++;
+		for (WFGraphNode *succ : node->successors)
+		{
+			if (--indegree[succ->index] == 0)
+				ready.push_back(succ->index);
+		}
+	}
+
+	return visited != this->nodes.size();
+}
+
+/* Runs twice, like the series it is in: first queues the parallel of all
+ * node series and itself again, then finishes after them. */
+void WFGraphTask::dispatch()
+{
+	SeriesWork *series = series_of(this);
+
+	if (this->parallel)
+	{
+		if (this->has_cycle())
+		{
+			this->state = WFT_STATE_TASK_ERROR;
+			this->error = WFT_ERR_GRAPH_CYCLE;
+		}
+		else
+		{
+			series->push_front(this);
+			series->push_front(this->parallel);
+			this->parallel = NULL;
+		}
+	}
+	else
+		this->state = WFT_STATE_SUCCESS;
+
+	this->subtask_done();
+}
+
+SubTask *WFGraphTask::done()
+{
+	SeriesWork *series = series_of(this);
+
+	if (this->state != WFT_STATE_UNDEFINED)
+	{
+		if (this->callback)
+			this->callback(this);
+
+		delete this;
+	}
+
+	return series->pop();
+}
+
+WFGraphTask::~WFGraphTask()
+{
+	size_t i;
+
+	if (this->parallel)
+	{
+		/* A node is first and last of its series. Delete it once. */
+		for (i = 0; i < this->parallel->size(); i++)
+			this->parallel->series_at(i)->unset_last_task();
+
+		this->parallel->dismiss();
+	}
+}
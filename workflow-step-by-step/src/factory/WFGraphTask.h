@@ -0,0 +1,117 @@
+#ifndef _WFGRAPHTASK_H_
+#define _WFGRAPHTASK_H_
+
+#include <stddef.h>
+#include <vector>
+#include <utility>
+#include <functional>
+#include "SubTask.h"
+#include "WFTask.h"
+#include "Workflow.h"
+
+/* A node runs its task once every node it succeeds has finished. Nodes
+ * are created by WFGraphTask::create_graph_node() and linked before the
+ * graph starts:
+ *     a.precede(b);  or  a-->b;
+ * A node whose series is canceled counts as finished. */
+class WFGraphNode : public SubTask
+{
+public:
+	void precede(WFGraphNode& node)
+	{
+		node.value++;
+		this->successors.push_back(&node);
+	}
+
+	void succeed(WFGraphNode& node)
+	{
+		node.precede(*this);
+	}
+
+protected:
+	virtual void dispatch();
+	virtual SubTask *done();
+
+private:
+	void release_successors();
+
+private:
+	std::vector<WFGraphNode *> successors;
+	size_t value;		/* unfinished predecessors, +1 until reached */
+	size_t index;		/* in the graph's node list */
+	bool entered;		/* ran as the first task of its series */
+	bool released;		/* successors counted down */
+
+protected:
+	WFGraphNode()
+	{
+		this->value = 1;
+		this->index = 0;
+		this->entered = false;
+		this->released = false;
+	}
+
+	virtual ~WFGraphNode();
+	friend class WFGraphTask;
+};
+
+static inline WFGraphNode& operator --(WFGraphNode& node, int)
+{
+	return node;
+}
+
+static inline WFGraphNode& operator > (WFGraphNode& prec, WFGraphNode& succ)
+{
+	prec.precede(succ);
+	return succ;
+}
+
+static inline WFGraphNode& operator < (WFGraphNode& succ, WFGraphNode& prec)
+{
+	succ.succeed(prec);
+	return prec;
+}
+
+static inline WFGraphNode& operator --(WFGraphNode& node)
+{
+	return node;
+}
+
+class WFGraphTask : public WFGenericTask
+{
+public:
+	/* 'task' runs in a series of its own, which the node starts and ends. */
+	WFGraphNode& create_graph_node(SubTask *task);
+
+public:
+	void set_callback(std::function<void (WFGraphTask *)> cb)
+	{
+		this->callback = std::move(cb);
+	}
+
+protected:
+	/* Checks for a cycle first. A graph with one fails with
+	 * WFT_STATE_TASK_ERROR and WFT_ERR_GRAPH_CYCLE, running no node. */
+	virtual void dispatch();
+	virtual SubTask *done();
+
+private:
+	bool has_cycle() const;
+
+protected:
+	ParallelWork *parallel;
+	std::vector<WFGraphNode *> nodes;
+	std::function<void (WFGraphTask *)> callback;
+
+public:
+	WFGraphTask(std::function<void (WFGraphTask *)>&& cb) :
+		callback(std::move(cb))
+	{
+		this->parallel = Workflow::create_parallel_work(nullptr);
+	}
+
+protected:
+	virtual ~WFGraphTask();
+};
+
+#endif
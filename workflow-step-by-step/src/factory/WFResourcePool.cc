@@ -0,0 +1,273 @@
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include "list.h"
+#include "CommScheduler.h"
+#include "WFGlobal.h"
+#include "WFResourcePool.h"
+
+class __WFPoolConditional : public WFConditional
+{
+public:
+	__WFPoolConditional(SubTask *task, void **resbuf, WFResourcePool *pool) :
+		WFConditional(task, resbuf)
+	{
+		this->pool = pool;
+	}
+
+	/* Only the pool signals. */
+	virtual void signal(void * /* res */) { }
+
+protected:
+	virtual void dispatch();
+
+private:
+	struct WFResourcePool::__pool_node node;
+	WFResourcePool *pool;
+
+	friend class WFResourcePool;
+};
+
+/* Signals a granted waiter from a handler thread, through a timer that
+ * is due at once, so that its series does not run in post(). */
+class __WFPoolGrant : public SleepSession
+{
+public:
+	__WFPoolGrant(WFConditional *cond, void *res)
+	{
+		this->cond = cond;
+		this->res = res;
+	}
+
+private:
+	virtual int duration(struct timespec *value)
+	{
+		value->tv_sec = 0;
+		value->tv_nsec = 0;
+		return 0;
+	}
+
+	virtual void handle(int /* state */, int /* error */)
+	{
+		WFConditional *cond = this->cond;
+		void *res = this->res;
+
+		delete this;
+		cond->WFConditional::signal(res);
+	}
+
+private:
+	WFConditional *cond;
+	void *res;
+};
+
+/* A waiter may be linked after a post already owes it a resource, so it
+ * calls grant() itself once it is in the queue. */
+void __WFPoolConditional::dispatch()
+{
+	WFResourcePool *pool = this->pool;
+
+	if (pool->value.fetch_sub(1) > 0)
+		this->WFConditional::signal(pool->pop());
+	else
+	{
+		pool->enqueue(&this->node);
+		pool->grant();
+	}
+
+	this->WFConditional::dispatch();
+}
+
+WFConditional *WFResourcePool::get(SubTask *task, void **resbuf)
+{
+	return new __WFPoolConditional(task, resbuf, this);
+}
+
+WFConditional *WFResourcePool::get(SubTask *task)
+{
+	return new __WFPoolConditional(task, NULL, this);
+}
+
+void WFResourcePool::post(void *res)
+{
+	this->push(res);
+	if (this->value.fetch_add(1) < 0)
+	{
+		this->owed.fetch_add(1);
+		this->grant();
+	}
+}
+
+/* Hands the owed resources to waiters, in FIFO order. Calls from posts
+ * and from newly linked waiters add up in 'granting', and are all served
+ * by the thread that raised it from zero, so the waiter queue has a single
+ * consumer at any time. A waiter counted but not linked yet is left to
+ * its own call. */
+void WFResourcePool::grant()
+{
+	CommScheduler *scheduler;
+	struct __pool_node *node;
+	__WFPoolConditional *cond;
+	__WFPoolGrant *session;
+	void *res;
+
+	if (this->granting.fetch_add(1) != 0)
+		return;
+
+	scheduler = WFGlobal::get_scheduler();
+	do
+	{
+		while (this->owed.load() > 0 && (node = this->dequeue()) != NULL)
+		{
+			this->owed.fetch_sub(1);
+			cond = list_entry(node, __WFPoolConditional, node);
+			res = this->pop();
+			session = new __WFPoolGrant(cond, res);
+			if (scheduler->sleep(session) < 0)
+			{
+				delete session;
+				cond->WFConditional::signal(res);
+			}
+		}
+	} while (this->granting.fetch_sub(1) != 1);
+}
+
+/* Bounded MPMC ring (Vyukov). Never full, since it holds at most the n
+ * resources of the pool, but a cell may lag behind its neighbours while
+ * another thread is between claiming and filling it. */
+void WFResourcePool::push(void *res)
+{
+	size_t pos = this->push_pos.load(std::memory_order_relaxed);
+	struct __pool_cell *cell;
+	intptr_t diff;
+
+	while (1)
+	{
+		cell = &this->cells[pos & this->mask];
+		diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+		if (diff == 0)
+		{
+			if (this->push_pos.compare_exchange_weak(pos, pos + 1,
+													 std::memory_order_relaxed))
+				break;
+		}
+		else
+		{
+			if (diff < 0)
+				sched_yield();
+
+			pos = this->push_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->res = res;
+	cell->seq.store(pos + 1, std::memory_order_release);
+}
+
+void *WFResourcePool::pop()
+{
+	size_t pos = this->pop_pos.load(std::memory_order_relaxed);
+	struct __pool_cell *cell;
+	intptr_t diff;
+	void *res;
+
+	while (1)
+	{
+		cell = &this->cells[pos & this->mask];
+		diff = (intptr_t)cell->seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+		if (diff == 0)
+		{
+			if (this->pop_pos.compare_exchange_weak(pos, pos + 1,
+													std::memory_order_relaxed))
+				break;
+		}
+		else
+		{
+			if (diff < 0)
+				sched_yield();
+
+			pos = this->pop_pos.load(std::memory_order_relaxed);
+		}
+	}
+
+	res = cell->res;
+	cell->seq.store(pos + this->mask + 1, std::memory_order_release);
+	return res;
+}
+
+/* Intrusive MPSC queue (Vyukov) with a stub node. */
+void WFResourcePool::enqueue(struct __pool_node *node)
+{
+	struct __pool_node *prev;
+
+	node->next.store(NULL, std::memory_order_relaxed);
+	prev = this->tail.exchange(node, std::memory_order_acq_rel);
+	prev->next.store(node, std::memory_order_release);
+}
+
+struct WFResourcePool::__pool_node *WFResourcePool::dequeue()
+{
+	struct __pool_node *head = this->head;
+	struct __pool_node *next = head->next.load(std::memory_order_acquire);
+
+	if (head == &this->stub)
+	{
+		if (!next)
+			return NULL;
+
+		this->head = next;
+		head = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (!next)
+	{
+		if (head != this->tail.load(std::memory_order_acquire))
+			return NULL;
+
+		this->enqueue(&this->stub);
+		next = head->next.load(std::memory_order_acquire);
+		if (!next)
+			return NULL;
+	}
+
+	this->head = next;
+	return head;
+}
+
+WFResourcePool::WFResourcePool(void *const *res, size_t n) :
+	value(n),
+	push_pos(n),
+	pop_pos(0),
+	tail(&this->stub),
+	owed(0),
+	granting(0)
+{
+	size_t size = 1;
+	size_t i;
+
+	while (size < n)
+		size <<= 1;
+
+	this->cells = new struct __pool_cell[size];
+	this->mask = size - 1;
+	for (i = 0; i < size; i++)
+	{
+		this->cells[i].seq.store(i < n ? i + 1 : i, std::memory_order_relaxed);
+		this->cells[i].res = i < n && res ? res[i] : NULL;
+	}
+
+	this->head = &this->stub;
+	this->stub.next.store(NULL, std::memory_order_relaxed);
+}
+
+WFResourcePool::WFResourcePool(size_t n) :
+	WFResourcePool(NULL, n)
+{
+}
+
+WFResourcePool::~WFResourcePool()
+{
+	delete []this->cells;
+}
+
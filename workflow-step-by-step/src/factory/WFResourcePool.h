@@ -0,0 +1,74 @@
+#ifndef _WFRESOURCEPOOL_H_
+#define _WFRESOURCEPOOL_H_
+
+#include <stddef.h>
+#include <atomic>
+#include "SubTask.h"
+#include "WFTask.h"
+
+/* A pool of n resources shared by tasks in any number of series:
+ *     WFConditional *cond = pool.get(task, &res);
+ *     series->push_back(cond);
+ * 'task' runs with a resource in 'res' once one is free, and posts it back
+ * with pool.post(res) when done. Without resources the pool is a plain
+ * semaphore of n slots. Waiting holds no thread, and neither get() nor
+ * post() takes a lock. A task that had to wait is started on a handler
+ * thread, not in the post() that freed its resource. */
+class WFResourcePool
+{
+public:
+	WFConditional *get(SubTask *task, void **resbuf);
+	WFConditional *get(SubTask *task);
+
+	/* Exactly once for each resource got. */
+	void post(void *res);
+
+private:
+	struct __pool_node
+	{
+		std::atomic<struct __pool_node *> next;
+	};
+
+	struct __pool_cell
+	{
+		std::atomic<size_t> seq;
+		void *res;
+	};
+
+private:
+	void *pop();
+	void push(void *res);
+	struct __pool_node *dequeue();
+	void enqueue(struct __pool_node *node);
+	void grant();
+
+private:
+	/* Free resources minus waiters. Negative while tasks wait. */
+	std::atomic<long> value;
+
+	/* Free resources, a bounded ring. */
+	struct __pool_cell *cells;
+	size_t mask;
+	std::atomic<size_t> push_pos;
+	std::atomic<size_t> pop_pos;
+
+	/* Waiters in FIFO order. Any thread may append; only the thread that
+	 * owns 'granting' takes them off. */
+	std::atomic<struct __pool_node *> tail;
+	struct __pool_node *head;
+	struct __pool_node stub;
+
+	/* Resources posted for waiters and not yet handed to one. */
+	std::atomic<long> owed;
+	std::atomic<long> granting;
+
+public:
+	WFResourcePool(void *const *res, size_t n);
+	WFResourcePool(size_t n);
+	~WFResourcePool();
+
+	friend class __WFPoolConditional;
+};
+
+#endif
+
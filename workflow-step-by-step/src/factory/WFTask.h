@@ -5,6 +5,7 @@
 #include <string.h>
 #include <assert.h>
 #include <atomic>
+#include <string>
 #include <utility>
 #include <functional>
 #include "Executor.h"
@@ -142,6 +143,39 @@ public:
 	void set_receive_timeout(int timeout) { this->receive_timeo = timeout; }
 	void set_keep_alive(int timeout) { this->keep_alive_timeo = timeout; }
 
+	/* Allow up to 'depth' requests in flight on one connection. Responses
+	 * are matched in order. 1 (default) disables pipelining. */
+	void set_pipeline_depth(int depth) { this->pipeline_depth = depth; }
+
+	/* Queue the request and let the poller write it together with other
+	 * requests on the same connection. Saves syscalls on small requests. */
+	void set_deferred_flush(bool flag) { this->deferred = flag; }
+
+	/* Client tasks only. If no reply came in 'delay' milliseconds, or in
+	 * the p95 latency of the upstream with delay == -1, send a second
+	 * attempt, to another server when there is one. The first reply wins
+	 * and the other is dropped. At most 'budget' hedges per request on
+	 * average. delay == 0 (default) disables. A hedged task has no peer
+	 * of its own: get_peer_addr() and get_task_seq() fail. */
+	void set_hedge(int delay, double budget)
+	{
+		this->hedge_delay = delay;
+		this->hedge_budget = budget;
+	}
+
+	/* Client tasks only. Identical requests in flight at the same time go
+	 * out once, and the others share its reply. For http, identity is the
+	 * method, the URL and the values of the headers named in 'key_headers',
+	 * separated by commas; only GET and HEAD are coalesced. A task that
+	 * shared a reply has no peer of its own, as with set_hedge(). One that
+	 * waits longer than its send and receive timeouts fails with ETIMEDOUT,
+	 * as it would on the wire. */
+	void set_coalesce(const std::string& key_headers)
+	{
+		this->coalesce = true;
+		this->coalesce_headers = key_headers;
+	}
+
 public:
 	void set_callback(std::function<void (WFNetworkTask<REQ, RESP> *)> cb)
 	{
@@ -152,6 +186,8 @@ protected:
 	virtual int send_timeout() { return this->send_timeo; }
 	virtual int receive_timeout() { return this->receive_timeo; }
 	virtual int keep_alive_timeout() { return this->keep_alive_timeo; }
+	virtual int max_pipeline() { return this->pipeline_depth; }
+	virtual int deferred_flush() { return this->deferred; }
 
 protected:
 	virtual SubTask *done()
@@ -169,6 +205,12 @@ protected:
 	int send_timeo;
 	int receive_timeo;
 	int keep_alive_timeo;
+	int pipeline_depth;
+	bool deferred;
+	int hedge_delay;
+	double hedge_budget;
+	bool coalesce;
+	std::string coalesce_headers;
 	REQ req;
 	RESP resp;
 	std::function<void (WFNetworkTask<REQ, RESP> *)> callback;
@@ -182,6 +224,11 @@ protected:
 		this->send_timeo = -1;
 		this->receive_timeo = -1;
 		this->keep_alive_timeo = 0;
+		this->pipeline_depth = 1;
+		this->deferred = false;
+		this->hedge_delay = 0;
+		this->hedge_budget = 0;
+		this->coalesce = false;
 		this->target = NULL;
 		this->timeout_reason = TOR_NOT_TIMEOUT;
 		this->state = WFT_STATE_UNDEFINED;
@@ -213,6 +260,12 @@ public:
 	int get_state() const { return this->state; }
 	int get_error() const { return this->error; }
 
+public:
+	void set_callback(std::function<void (WFTimerTask *)> cb)
+	{
+		this->callback = std::move(cb);
+	}
+
 protected:
 	virtual SubTask *done()
 	{
@@ -294,6 +347,104 @@ protected:
 	virtual ~WFGenericTask() { }
 };
 
+/* Finishes on the count that reaches the target value. Starting the task
+ * is a count of its own, so counts may come before or after it starts,
+ * but never more than target_value of them. */
+class WFCounterTask : public WFGenericTask
+{
+public:
+	virtual void count()
+	{
+		if (--this->value == 0)
+		{
+			this->state = WFT_STATE_SUCCESS;
+			this->subtask_done();
+		}
+	}
+
+public:
+	void set_callback(std::function<void (WFCounterTask *)> cb)
+	{
+		this->callback = std::move(cb);
+	}
+
+protected:
+	virtual void dispatch()
+	{
+		this->WFCounterTask::count();
+	}
+
+	virtual SubTask *done()
+	{
+		SeriesWork *series = series_of(this);
+
+		if (this->callback)
+			this->callback(this);
+
+		delete this;
+		return series->pop();
+	}
+
+protected:
+	std::atomic<unsigned int> value;
+	std::function<void (WFCounterTask *)> callback;
+
+public:
+	WFCounterTask(unsigned int target_value,
+				  std::function<void (WFCounterTask *)>&& cb) :
+		value(target_value + 1),
+		callback(std::move(cb))
+	{
+	}
+
+protected:
+	virtual ~WFCounterTask() { }
+};
+
+/* Stands in for 'task' in a series. Once it is both started and
+ * signaled, the task runs in its place; until then nothing waits on a
+ * thread. The message of the signal is stored to *msgbuf. */
+class WFConditional : public WFGenericTask
+{
+public:
+	virtual void signal(void *msg)
+	{
+		*this->msgbuf = msg;
+		if (this->flag.exchange(true))
+			this->subtask_done();
+	}
+
+protected:
+	virtual void dispatch()
+	{
+		series_of(this)->push_front(this->task);
+		this->task = NULL;
+		if (this->flag.exchange(true))
+			this->subtask_done();
+	}
+
+protected:
+	std::atomic<bool> flag;
+	SubTask *task;
+	void **msgbuf;
+	void *msg;
+
+public:
+	WFConditional(SubTask *task, void **msgbuf) :
+		flag(false)
+	{
+		this->task = task;
+		this->msgbuf = msgbuf ? msgbuf : &this->msg;
+	}
+
+protected:
+	/* Dismissed before it started; the task goes with it. */
+	virtual ~WFConditional()
+	{
+		delete this->task;
+	}
+};
+
 #include "WFTask.inl"
 
 #endif
\ No newline at end of file
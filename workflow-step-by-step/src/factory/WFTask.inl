@@ -7,7 +7,7 @@ int WFNetworkTask<REQ, RESP>::get_peer_addr(struct sockaddr *addr, socklen_t *ad
 
 	if (this->target)
 	{
-		this->target->get_addr(&p, &len);
+		this->get_peer_target()->get_addr(&p, &len);
 		if (*addrlen >= len)
 		{
 			memcpy(addr, p, len);
@@ -1,9 +1,12 @@
 #include <ctype.h>
+#include <errno.h>
+#include <string.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <string>
 #include <mutex>
+#include <unordered_map>
 #include "list.h"
 #include "rbtree.h"
 #include "DNSRoutine.h"
@@ -20,9 +23,225 @@ WFDNSTask *WFTaskFactory::create_dns_task(const std::string& host, unsigned shor
 	return task;
 }
 
+/********** Named counters **********/
+
+class __WFNamedCounterTask;
+
+struct __counter_list
+{
+	struct rb_node rb;
+	struct list_head head;
+	std::string name;
+};
+
+class __CounterMap
+{
+public:
+	static __CounterMap *get_instance()
+	{
+		static __CounterMap kInstance;
+		return &kInstance;
+	}
+
+	WFCounterTask *create(const std::string& name, unsigned int target_value,
+						  counter_callback_t&& cb);
+	void count(const std::string& name, unsigned int n);
+	void count(__WFNamedCounterTask *task);
+	void remove(__WFNamedCounterTask *task);
+
+private:
+	struct __counter_list *find(const std::string& name, bool insert);
+	void unlink(__WFNamedCounterTask *task);
+	static void fire(struct list_head *done);
+
+private:
+	__CounterMap() { root_.rb_node = NULL; }
+
+private:
+	struct rb_root root_;
+	std::mutex mutex_;
+};
+
+/* The counts by name are kept here, under the map's lock. The counter's
+ * own value is 1 for them all, plus 1 for being started. */
+class __WFNamedCounterTask : public WFCounterTask
+{
+public:
+	__WFNamedCounterTask(unsigned int target_value, counter_callback_t&& cb) :
+		WFCounterTask(1, std::move(cb))
+	{
+		this->left = target_value;
+		this->list = NULL;
+	}
+
+	virtual void count()
+	{
+		__CounterMap::get_instance()->count(this);
+	}
+
+protected:
+	/* Dismissed while it still waits for counts. */
+	virtual ~__WFNamedCounterTask()
+	{
+		if (this->list)
+			__CounterMap::get_instance()->remove(this);
+	}
+
+private:
+	struct list_head entry;
+	struct __counter_list *list;	/* NULL once all counts are in */
+	unsigned int left;
+
+	friend class __CounterMap;
+};
+
+struct __counter_list *__CounterMap::find(const std::string& name, bool insert)
+{
+	struct rb_node **p = &root_.rb_node;
+	struct rb_node *parent = NULL;
+	struct __counter_list *list;
+	int cmp;
+
+	while (*p)
+	{
+		parent = *p;
+		list = rb_entry(*p, struct __counter_list, rb);
+		cmp = name.compare(list->name);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return list;
+	}
+
+	if (!insert)
+		return NULL;
+
+	list = new struct __counter_list;
+	list->name = name;
+	INIT_LIST_HEAD(&list->head);
+	rb_link_node(&list->rb, parent, p);
+	rb_insert_color(&list->rb, &root_);
+	return list;
+}
+
+void __CounterMap::unlink(__WFNamedCounterTask *task)
+{
+	struct __counter_list *list = task->list;
+
+	list_del(&task->entry);
+	task->list = NULL;
+	if (list_empty(&list->head))
+	{
+		rb_erase(&list->rb, &root_);
+		delete list;
+	}
+}
+
+/* Outside the lock: a counter may finish, and run its series, right here. */
+void __CounterMap::fire(struct list_head *done)
+{
+	struct list_head *pos;
+	struct list_head *tmp;
+
+	list_for_each_safe(pos, tmp, done)
+		list_entry(pos, __WFNamedCounterTask, entry)->WFCounterTask::count();
+}
+
+WFCounterTask *__CounterMap::create(const std::string& name,
+								   unsigned int target_value,
+								   counter_callback_t&& cb)
+{
+	if (target_value == 0)
+		return new WFCounterTask(0, std::move(cb));
+
+	auto *task = new __WFNamedCounterTask(target_value, std::move(cb));
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	task->list = this->find(name, true);
+	list_add_tail(&task->entry, &task->list->head);
+	return task;
+}
+
+void __CounterMap::count(const std::string& name, unsigned int n)
+{
+	__WFNamedCounterTask *task;
+	struct __counter_list *list;
+	struct list_head done;
+	unsigned int k;
+
+	INIT_LIST_HEAD(&done);
+	mutex_.lock();
+	list = this->find(name, false);
+	while (list && n > 0)
+	{
+		task = list_entry(list->head.next, __WFNamedCounterTask, entry);
+		k = n < task->left ? n : task->left;
+		task->left -= k;
+		n -= k;
+		if (task->left == 0)
+		{
+			if (list->head.next == list->head.prev)
+				list = NULL;
+
+			this->unlink(task);
+			list_add_tail(&task->entry, &done);
+		}
+	}
+
+	mutex_.unlock();
+	__CounterMap::fire(&done);
+}
+
+void __CounterMap::count(__WFNamedCounterTask *task)
+{
+	bool finish = false;
+
+	mutex_.lock();
+	if (task->list && --task->left == 0)
+	{
+		this->unlink(task);
+		finish = true;
+	}
+
+	mutex_.unlock();
+	if (finish)
+		task->WFCounterTask::count();
+}
+
+void __CounterMap::remove(__WFNamedCounterTask *task)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	this->unlink(task);
+}
+
+WFCounterTask *WFTaskFactory::create_counter_task(const std::string& counter_name,
+												  unsigned int target_value,
+												  counter_callback_t callback)
+{
+	return __CounterMap::get_instance()->create(counter_name, target_value,
+												std::move(callback));
+}
+
+void WFTaskFactory::count_by_name(const std::string& counter_name, unsigned int n)
+{
+	__CounterMap::get_instance()->count(counter_name, n);
+}
+
 /********** RouterTask **********/
 void WFRouterTask::dispatch()
 {
+    /* A unix domain socket is its own address, no DNS or cache needed. */
+    if (!host_.empty() && host_.front() == '/')
+    {
+        insert_dns_ = false;
+        this->route_unix();
+        this->subtask_done();
+        return;
+    }
+
     insert_dns_ = true;
     if (dns_cache_level_ != DNS_CACHE_LEVEL_0)
     {
@@ -59,7 +278,7 @@ void WFRouterTask::dispatch()
                     addrinfo = &first;
                 }
 
-                if (route_manager->get(type_, addrinfo, info_, &endpoint_params_, route_result_) < 0)
+                if (route_manager->get(type_, addrinfo, info_, &endpoint_params_, host_, route_result_) < 0)
                 {
                     this->state = WFT_STATE_SYS_ERROR;
                     this->error = errno;
@@ -90,9 +309,6 @@ void WFRouterTask::dispatch()
             ret = inet_pton(AF_INET6, host_.c_str(), &addr);
         else if (isdigit(back) && isdigit(front))
             ret = inet_pton(AF_INET, host_.c_str(), &addr);
-
-        else if (front == '/')
-            ret = 1;
         else
             ret = 0;
         
@@ -133,6 +349,42 @@ SubTask* WFRouterTask::done()
 	return series->pop();
 }
 
+void WFRouterTask::route_unix()
+{
+	auto *route_manager = WFGlobal::get_route_manager();
+	struct sockaddr_un sun = { };
+	struct addrinfo addrinfo = { };
+
+	if (host_.size() >= sizeof sun.sun_path)
+	{
+		this->state = WFT_STATE_SYS_ERROR;
+		this->error = ENAMETOOLONG;
+		return;
+	}
+
+	/* Same address layout as DNSRoutine, so both share one router. */
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, host_.c_str(), host_.size());
+	addrinfo.ai_family = AF_UNIX;
+	addrinfo.ai_socktype = SOCK_STREAM;
+	addrinfo.ai_addrlen = sizeof sun;
+	addrinfo.ai_addr = (struct sockaddr *)&sun;
+
+	if (route_manager->get(type_, &addrinfo, info_, &endpoint_params_, host_, route_result_) < 0)
+	{
+		this->state = WFT_STATE_SYS_ERROR;
+		this->error = errno;
+	}
+	else if (!route_result_.request_object)
+	{
+		//should not happen
+		this->state = WFT_STATE_SYS_ERROR;
+		this->error = EAGAIN;
+	}
+	else
+		this->state = WFT_STATE_SUCCESS;
+}
+
 void WFRouterTask::dns_callback_internal(DNSOutput *dns_out, unsigned int ttl_default, unsigned int ttl_min)
 {
 	int dns_error = dns_out->get_error();
@@ -159,7 +411,7 @@ void WFRouterTask::dns_callback_internal(DNSOutput *dns_out, unsigned int ttl_de
 			auto *route_manager = WFGlobal::get_route_manager();
 			auto *dns_cache = WFGlobal::get_dns_cache();
 			const DNSHandle *addr_handle = dns_cache->put(host_, port_, addrinfo, (unsigned int)ttl_default, (unsigned int)ttl_min);
-			if (route_manager->get(type_, addrinfo, info_, &endpoint_params_, route_result_) < 0)
+			if (route_manager->get(type_, addrinfo, info_, &endpoint_params_, host_, route_result_) < 0)
 			{
 				this->state = WFT_STATE_SYS_ERROR;
 				this->error = errno;
@@ -200,4 +452,94 @@ void WFRouterTask::dns_callback(WFDNSTask *dns_task)
 		callback_(this);
 
 	delete this;
-}
\ No newline at end of file
+}
+
+/********** Hedged requests **********/
+
+#define HEDGE_TOKENS_MAX	10.0
+/* p95 is taken every HEDGE_P95_SAMPLES replies, over the last window. */
+#define HEDGE_P95_SAMPLES	128
+#define HEDGE_WINDOW		(64 * HEDGE_P95_SAMPLES)
+
+class __HedgeMap
+{
+public:
+	static __HedgeMap *get_instance()
+	{
+		static __HedgeMap kInstance;
+		return &kInstance;
+	}
+
+	__WFHedgeTarget *get(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		__WFHedgeTarget *&target = map_[name];
+
+		if (!target)
+			target = new __WFHedgeTarget;
+
+		return target;
+	}
+
+private:
+	~__HedgeMap()
+	{
+		for (auto& kv : map_)
+			delete kv.second;
+	}
+
+private:
+	std::unordered_map<std::string, __WFHedgeTarget *> map_;
+	std::mutex mutex_;
+};
+
+__WFHedgeTarget *__WFHedgeTarget::get(const ParsedURI& uri)
+{
+	std::string name(uri.host ? uri.host : "");
+
+	if (uri.port)
+	{
+		name += ':';
+		name += uri.port;
+	}
+
+	return __HedgeMap::get_instance()->get(name);
+}
+
+long long __WFHedgeTarget::start(int delay, double budget)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->tokens += budget;
+	if (this->tokens > HEDGE_TOKENS_MAX)
+		this->tokens = HEDGE_TOKENS_MAX;
+
+	if (delay > 0)
+		return delay * 1000LL;
+
+	return this->p95;
+}
+
+bool __WFHedgeTarget::acquire()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->tokens < 1.0)
+		return false;
+
+	this->tokens -= 1.0;
+	return true;
+}
+
+void __WFHedgeTarget::record(long long usec)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	this->hist.record(usec);
+	if (this->hist.count() % HEDGE_P95_SAMPLES == 0)
+	{
+		this->p95 = this->hist.percentile(95);
+		if (this->hist.count() >= HEDGE_WINDOW)
+			this->hist.reset();
+	}
+}
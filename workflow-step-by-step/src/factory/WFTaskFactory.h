@@ -6,6 +6,7 @@
 #include "HttpMessage.h"
 #include "DNSRoutine.h"
 #include "WFTask.h"
+#include "WFGraphTask.h"
 #include "Workflow.h"
 #include "EndpointParams.h"
 
@@ -20,6 +21,10 @@ using dns_callback_t = std::function<void (WFDNSTask *)>;
 
 using timer_callback_t = std::function<void (WFTimerTask *)>;
 
+using graph_callback_t = std::function<void (WFGraphTask *)>;
+
+using counter_callback_t = std::function<void (WFCounterTask *)>;
+
 class WFTaskFactory
 {
 public:
@@ -34,6 +39,41 @@ public:
 
 	static WFTimerTask *create_timer_task(unsigned int microseconds,
 										  timer_callback_t callback);									
+
+	static WFGraphTask *create_graph_task(graph_callback_t callback)
+	{
+		return new WFGraphTask(std::move(callback));
+	}
+
+	static WFCounterTask *create_counter_task(unsigned int target_value,
+											  counter_callback_t callback)
+	{
+		return new WFCounterTask(target_value, std::move(callback));
+	}
+
+	/* A counter that count_by_name() can reach. Counts by name go to the
+	 * counters of that name in the order they were created, each taking
+	 * as many as it still needs. */
+	static WFCounterTask *create_counter_task(const std::string& counter_name,
+											  unsigned int target_value,
+											  counter_callback_t callback);
+
+	static void count_by_name(const std::string& counter_name)
+	{
+		WFTaskFactory::count_by_name(counter_name, 1);
+	}
+
+	static void count_by_name(const std::string& counter_name, unsigned int n);
+
+	static WFConditional *create_conditional(SubTask *task)
+	{
+		return new WFConditional(task, NULL);
+	}
+
+	static WFConditional *create_conditional(SubTask *task, void **msgbuf)
+	{
+		return new WFConditional(task, msgbuf);
+	}
 };
 
 template<class INPUT, class OUTPUT>
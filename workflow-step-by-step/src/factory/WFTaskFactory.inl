@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <new>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <functional>
 #include <utility>
 #include "WFGlobal.h"
@@ -16,6 +18,7 @@
 #include "URIParser.h"
 #include "WFTaskError.h"
 #include "EndpointParams.h"
+#include "LatencyHistogram.h"
 
 class __WFTimerTask : public WFTimerTask
 {
@@ -88,6 +91,7 @@ public:
 private:
 	virtual void dispatch();
 	virtual SubTask *done();
+	void route_unix();
 	void  dns_callback(WFDNSTask *dns_task);
 	void dns_callback_internal(DNSOutput *dns_task, unsigned int ttl_default, unsigned int ttl_min);
 	
@@ -105,6 +109,34 @@ private:
 	router_callback_t callback_;
 };
 
+/* Latencies and hedge budget of one upstream, shared by its hedged tasks. */
+class __WFHedgeTarget
+{
+public:
+	/* A hedged request earns 'budget' hedges. Returns how long it waits
+	 * before hedging in microseconds, -1 until a p95 is known. */
+	long long start(int delay, double budget);
+
+	/* Takes one hedge from the budget. */
+	bool acquire();
+
+	void record(long long usec);
+
+	static __WFHedgeTarget *get(const ParsedURI& uri);
+
+private:
+	std::mutex mutex;
+	LatencyHistogram hist;
+	long long p95;
+	double tokens;
+
+public:
+	__WFHedgeTarget()
+	{
+		this->p95 = -1;
+		this->tokens = 0;
+	}
+};
 
 template<class REQ, class RESP, typename CTX = bool>
 class WFComplexClientTask : public WFClientTask<REQ, RESP>
@@ -122,7 +154,9 @@ public:
 		retry_times_(0),
 		is_retry_(false),
 		has_original_uri_(true),
-		redirect_(false)
+		redirect_(false),
+		delivered_(false),
+		hedge_avoid_(NULL)
 	{}
 
 protected:
@@ -132,6 +166,10 @@ protected:
 	virtual bool check_request() { return true; }
 	virtual SubTask *route();
 	virtual bool finish_once() { return true; }
+	/* A new task with a copy of the request, for hedging. */
+	virtual WFComplexClientTask *hedge_clone() { return NULL; }
+	/* Waits for the reply of an identical request in flight, if any. */
+	virtual bool coalesce_join() { return false; }
 
 public:
 	void set_info(const std::string& info)
@@ -246,6 +284,24 @@ private:
 	void router_callback(SubTask *task); // default: DNS
 	void switch_callback(WFTimerTask *task);
 
+	struct __hedge_ctx
+	{
+		std::mutex mutex;
+		WFComplexClientTask *task;	/* until a reply is delivered */
+		__WFHedgeTarget *target;
+		void *cookie;				/* upstream server of the first attempt */
+		int pending;				/* attempts in flight */
+		std::atomic<int> ref;
+	};
+
+	bool hedge();
+	WFComplexClientTask *hedge_attempt(struct __hedge_ctx *ctx, void *avoid);
+	static void hedge_callback(struct __hedge_ctx *ctx,
+							   const struct timespec *start,
+							   WFComplexClientTask *attempt);
+	static void hedge_timer(struct __hedge_ctx *ctx, WFTimerTask *timer);
+	static void hedge_release(struct __hedge_ctx *ctx);
+
 	RouteManager::RouteResult route_result_;
 	UpstreamManager::UpstreamResult upstream_result_;
 
@@ -259,6 +315,10 @@ private:
 	bool is_retry_;
 	bool has_original_uri_;
 	bool redirect_;
+	/* Replies come from other tasks on the wire: the attempts of a hedge,
+	 * or the leader of coalesced requests. */
+	bool delivered_;
+	void *hedge_avoid_;
 };
 
 template<class REQ, class RESP, typename CTX>
@@ -280,7 +340,7 @@ void WFComplexClientTask<REQ, RESP, CTX>::init(TransportType type, const struct
 	addrinfo.ai_socktype = SOCK_STREAM;
 	addrinfo.ai_protocol = 0;
 
-	if (WFGlobal::get_route_manager()->get(type, &addrinfo, info_, params, route_result_) < 0)
+	if (WFGlobal::get_route_manager()->get(type, &addrinfo, info_, params, "", route_result_) < 0)
 	{
 		this->state = WFT_STATE_SYS_ERROR;
 		this->error = errno;
@@ -352,7 +412,13 @@ void WFComplexClientTask<REQ, RESP, CTX>::init_with_uri()
 	route_result_.clear();
 	if (uri_.state == URI_STATE_SUCCESS && this->set_port())
 	{
-		int ret = UpstreamManager::choose(uri_, upstream_result_);
+		int ret;
+
+		if (hedge_avoid_)
+			ret = UpstreamManager::choose_another(uri_, hedge_avoid_, upstream_result_);
+		else
+			ret = UpstreamManager::choose(uri_, upstream_result_);
+
 		if (ret < 0)
 		{
 			this->state = WFT_STATE_SYS_ERROR;
@@ -476,6 +542,28 @@ void WFComplexClientTask<REQ, RESP, CTX>::dispatch()
 			return;
 		}
 
+		/* Only once; the leader retries and redirects on its own. A
+		 * follower may be done before coalesce_join() returns. */
+		if (this->coalesce && !is_sockaddr_)
+		{
+			int retry_times = retry_times_;
+
+			this->coalesce = false;
+			delivered_ = true;
+			this->disable_retry();
+			if (this->coalesce_join())
+				return;
+
+			delivered_ = false;
+			retry_times_ = retry_times;
+		}
+
+		if (this->hedge_delay != 0 && !is_sockaddr_ &&
+			uri_.state == URI_STATE_SUCCESS && this->hedge())
+		{
+			return;
+		}
+
 		if (is_sockaddr_ || uri_.state == URI_STATE_SUCCESS)
 		{
 			// 3. DNS route() or children route()
@@ -519,14 +607,35 @@ SubTask *WFComplexClientTask<REQ, RESP, CTX>::done()
 		return series->pop();
 	}
 
-	if (init_state_)
+	/* A reply of another task, which did the bookkeeping and redirects. */
+	if (delivered_)
+	{
+		if (this->state == WFT_STATE_SYS_ERROR && retry_times_ < retry_max_)
+			set_retry(original_uri_);
+	}
+	else if (init_state_)
 	{
 		// 2. children can set_redirect() here
 		bool is_user_request = this->finish_once();
+
+		if (this->target && WFGlobal::get_global_settings()->latency_stats)
+		{
+			CommTarget *peer = this->get_peer_target();
+
+			WFGlobal::get_latency_stats()->record(peer, this,
+					static_cast<CommSchedTarget *>(peer)->get_limit());
+		}
+
 		// 3. complex task success
 		if (this->state == WFT_STATE_SUCCESS)
 		{
-			RouteManager::notify_available(route_result_.cookie, this->target);
+			CommTarget *peer = this->get_peer_target();
+
+			/* Our address lost a connect race to another one. */
+			if (this->lost_connect_race())
+				RouteManager::notify_unavailable(route_result_.cookie, this->target);
+
+			RouteManager::notify_available(route_result_.cookie, peer);
 			UpstreamManager::notify_available(upstream_result_.cookie);
 			upstream_result_.clear();
 			// 4. children message out sth. else
@@ -549,23 +658,9 @@ SubTask *WFComplexClientTask<REQ, RESP, CTX>::done()
 		}
 	}
 
-	/*
-	 * When target is NULL, it's very likely that we are still in the
-	 * 'dispatch' thread. Running a timer will switch callback function
-	 * to a handler thread, and this can prevent stack overflow.
-	*/	
-	if (!this->target)
-	{
-		// auto&& cb = std::bind(&WFComplexClientTask::switch_callback,
-		// 					  this,
-		// 					  std::placeholders::_1);
-		// WFTimerTask *timer = WFTaskFactory::create_timer_task(0, std::move(cb));
-
-		// series->push_front(timer);
-	}
-	else 
-		this->switch_callback(NULL);
-
+	/* Without a target we are likely still in the dispatching thread.
+	 * subtask_done() keeps the stack bounded, so no thread switch. */
+	this->switch_callback(NULL);
 	return series->pop();
 }
 
@@ -583,6 +678,8 @@ void  WFComplexClientTask<REQ, RESP, CTX>::switch_callback(WFTimerTask *)
 	{
 		init_state_ = this->init_success() ? 1 : 0;
 		redirect_ = false;
+		/* The next round may go on the wire itself. */
+		delivered_ = false;
 		clear_resp();
 
 		this->target = NULL;
@@ -595,6 +692,144 @@ void  WFComplexClientTask<REQ, RESP, CTX>::switch_callback(WFTimerTask *)
 		delete this;
 }
 
+/* The user task never goes on the wire. Attempts with copies of its
+ * request do, and the first success, or the last failure, is moved into
+ * it. Losers run to their end and are dropped, as a session on the wire
+ * cannot be taken back from a shared connection. */
+template<class REQ, class RESP, typename CTX>
+bool WFComplexClientTask<REQ, RESP, CTX>::hedge()
+{
+	auto *ctx = new struct __hedge_ctx;
+	WFComplexClientTask *task;
+	long long delay;
+
+	ctx->task = this;
+	ctx->pending = 0;
+	ctx->ref = 1;
+	task = this->hedge_attempt(ctx, NULL);
+	if (!task)
+	{
+		delete ctx;
+		return false;
+	}
+
+	delivered_ = true;
+	ctx->target = __WFHedgeTarget::get(original_uri_);
+	ctx->cookie = task->upstream_result_.cookie;
+	delay = ctx->target->start(this->hedge_delay, this->hedge_budget);
+	if (delay >= 0)
+	{
+		ctx->ref++;
+		WFTaskFactory::create_timer_task((unsigned int)delay,
+			std::bind(&WFComplexClientTask::hedge_timer, ctx,
+					  std::placeholders::_1))->start();
+	}
+
+	/* May deliver to us at once. */
+	task->start();
+	hedge_release(ctx);
+	return true;
+}
+
+template<class REQ, class RESP, typename CTX>
+WFComplexClientTask<REQ, RESP, CTX> *
+WFComplexClientTask<REQ, RESP, CTX>::hedge_attempt(struct __hedge_ctx *ctx,
+												   void *avoid)
+{
+	WFComplexClientTask *task = this->hedge_clone();
+	struct timespec start;
+
+	if (!task)
+		return NULL;
+
+	task->user_data = this->user_data;
+	task->send_timeo = this->send_timeo;
+	task->receive_timeo = this->receive_timeo;
+	task->keep_alive_timeo = this->keep_alive_timeo;
+	task->pipeline_depth = this->pipeline_depth;
+	task->deferred = this->deferred;
+	task->prepare = this->prepare;
+	task->resp.set_size_limit(this->resp.get_size_limit());
+	task->type_ = type_;
+	task->info_ = info_;
+	task->first_addr_only_ = first_addr_only_;
+	task->hedge_avoid_ = avoid;
+	task->init(original_uri_);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	task->callback = [ctx, start](WFNetworkTask<REQ, RESP> *task) {
+		hedge_callback(ctx, &start, static_cast<WFComplexClientTask *>(task));
+	};
+	ctx->pending++;
+	ctx->ref++;
+	return task;
+}
+
+template<class REQ, class RESP, typename CTX>
+void WFComplexClientTask<REQ, RESP, CTX>::hedge_timer(struct __hedge_ctx *ctx,
+													  WFTimerTask *timer)
+{
+	WFComplexClientTask *task = NULL;
+
+	if (timer->get_state() == WFT_STATE_SUCCESS)
+	{
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		if (ctx->task && ctx->target->acquire())
+			task = ctx->task->hedge_attempt(ctx, ctx->cookie);
+	}
+
+	if (task)
+		task->start();
+
+	hedge_release(ctx);
+}
+
+template<class REQ, class RESP, typename CTX>
+void WFComplexClientTask<REQ, RESP, CTX>::hedge_callback(struct __hedge_ctx *ctx,
+														 const struct timespec *start,
+														 WFComplexClientTask *attempt)
+{
+	WFComplexClientTask *task = NULL;
+	int state = attempt->state;
+	struct timespec now;
+
+	if (state == WFT_STATE_SUCCESS)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ctx->target->record((now.tv_sec - start->tv_sec) * 1000000LL +
+							(now.tv_nsec - start->tv_nsec) / 1000);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		if (--ctx->pending == 0 || state == WFT_STATE_SUCCESS)
+		{
+			task = ctx->task;
+			ctx->task = NULL;
+		}
+	}
+
+	if (task)
+	{
+		task->resp = std::move(attempt->resp);
+		task->state = state;
+		task->error = attempt->error;
+		task->timeout_reason = attempt->timeout_reason;
+		task->subtask_done();
+	}
+
+	hedge_release(ctx);
+}
+
+template<class REQ, class RESP, typename CTX>
+void WFComplexClientTask<REQ, RESP, CTX>::hedge_release(struct __hedge_ctx *ctx)
+{
+	if (--ctx->ref == 0)
+		delete ctx;
+}
+
 /////////////////////////////////////////////
 
 template<class INPUT, class OUTPUT>
@@ -5,12 +5,78 @@
 #include <functional>
 #include <mutex>
 #include <fmt/core.h>
+#include "CommScheduler.h"
+#include "WFGlobal.h"
 #include "Workflow.h"
 
+#define SERIES_POOL_MAX		256
+
+/* Free list of SeriesWork memory, one per thread. */
+class __SeriesPool
+{
+public:
+	void *get()
+	{
+		void *ptr = this->head;
+
+		if (ptr)
+		{
+			this->head = *(void **)ptr;
+			this->count--;
+		}
+
+		return ptr;
+	}
+
+	bool put(void *ptr)
+	{
+		if (this->count >= SERIES_POOL_MAX)
+			return false;
+
+		*(void **)ptr = this->head;
+		this->head = ptr;
+		this->count++;
+		return true;
+	}
+
+	~__SeriesPool()
+	{
+		void *ptr;
+
+		while ((ptr = this->get()) != NULL)
+			::operator delete(ptr);
+
+		/* A series freed later in this thread's exit is not kept. */
+		this->count = SERIES_POOL_MAX;
+	}
+
+private:
+	void *head = NULL;
+	int count = 0;
+};
+
+static thread_local __SeriesPool __series_pool;
+
+void *SeriesWork::operator new(size_t size)
+{
+	void *ptr = NULL;
+
+	if (size == sizeof (SeriesWork))
+		ptr = __series_pool.get();
+
+	return ptr ? ptr : ::operator new(size);
+}
+
+void SeriesWork::operator delete(void *ptr, size_t size)
+{
+	if (size != sizeof (SeriesWork) || !__series_pool.put(ptr))
+		::operator delete(ptr);
+}
+
 SeriesWork::SeriesWork(SubTask *first, series_callback_t&& cb) :
-	queue(new SubTask *[4]),
 	callback(std::move(cb))
 {
+	this->queue = this->buffer;
 	this->queue_size = 4;
 	this->front = 0;
 	this->back = 0;
@@ -50,7 +116,9 @@ void SeriesWork::expand_queue()
 			j = 0;
 	} while (j != this->back);
 
-	delete []this->queue;
+	if (this->queue != this->buffer)
+		delete []this->queue;
+
 	this->queue = queue;
 	this->queue_size = size;
 	this->front = 0;
@@ -122,6 +190,7 @@ SubTask *SeriesWork::pop_task()
 	this->mutex.unlock();
 	if (!task)
 	{
+		TASK_TRACE_ASYNC_END("series", "series", this);
 		if (this->callback)
 			this->callback(this);
 
@@ -130,4 +199,173 @@ SubTask *SeriesWork::pop_task()
 	}
 
 	return task;
-}
\ No newline at end of file
+}
+ParallelWork::ParallelWork(parallel_callback_t&& cb) :
+	ParallelTask(new SubTask *[2 * 4], 0),
+	callback(std::move(cb))
+{
+	this->buf_size = 4;
+	this->all_series = (SeriesWork **)&this->subtasks[this->buf_size];
+	this->context = NULL;
+}
+
+ParallelWork::ParallelWork(SeriesWork *const all_series[], size_t n,
+						   parallel_callback_t&& cb) :
+	ParallelTask(new SubTask *[2 * (n > 4 ? n : 4)], n),
+	callback(std::move(cb))
+{
+	size_t i;
+
+	this->buf_size = (n > 4 ? n : 4);
+	this->all_series = (SeriesWork **)&this->subtasks[this->buf_size];
+	for (i = 0; i < n; i++)
+	{
+		assert(!all_series[i]->in_parallel);
+		all_series[i]->in_parallel = true;
+		this->all_series[i] = all_series[i];
+		this->subtasks[i] = all_series[i]->first;
+	}
+
+	this->context = NULL;
+}
+
+void ParallelWork::expand_buf()
+{
+	SubTask **buf;
+	size_t size;
+
+	this->buf_size *= 2;
+	buf = new SubTask *[2 * this->buf_size];
+	size = this->subtasks_nr * sizeof (void *);
+	memcpy(buf, this->subtasks, size);
+	memcpy(buf + this->buf_size, this->all_series, size);
+
+	delete []this->subtasks;
+	this->subtasks = buf;
+	this->all_series = (SeriesWork **)&buf[this->buf_size];
+}
+
+void ParallelWork::add_series(SeriesWork *series)
+{
+	if (this->subtasks_nr == this->buf_size)
+		this->expand_buf();
+
+	assert(!series->in_parallel);
+	series->in_parallel = true;
+	this->all_series[this->subtasks_nr] = series;
+	this->subtasks[this->subtasks_nr] = series->first;
+	this->subtasks_nr++;
+}
+
+#define PARALLEL_DISPATCH_CHUNK		256
+
+/* Starts a range of a parallel's series when a handler thread takes it,
+ * through a timer that is due at once. */
+class __ParallelChunk : public SleepSession
+{
+public:
+	__ParallelChunk(ParallelWork *parallel, size_t begin, size_t end)
+	{
+		this->parallel = parallel;
+		this->begin = begin;
+		this->end = end;
+	}
+
+private:
+	virtual int duration(struct timespec *value)
+	{
+		value->tv_sec = 0;
+		value->tv_nsec = 0;
+		return 0;
+	}
+
+	/* Even if the poller stopped, the series must run to finish. */
+	virtual void handle(int /* state */, int /* error */)
+	{
+		ParallelWork *parallel = this->parallel;
+		size_t begin = this->begin;
+		size_t end = this->end;
+
+		delete this;
+		parallel->dispatch_range(begin, end);
+	}
+
+private:
+	ParallelWork *parallel;
+	size_t begin;
+	size_t end;
+};
+
+/* The first chunk goes last, from this thread, so the parallel can not
+ * finish while we still look at it. */
+void ParallelWork::dispatch()
+{
+	size_t n = this->subtasks_nr;
+	CommScheduler *scheduler;
+	__ParallelChunk *chunk;
+	size_t begin;
+	size_t end;
+
+	if (__builtin_expect(__task_trace_on, 0))
+	{
+		for (begin = 0; begin < n; begin++)
+			TASK_TRACE_ASYNC_BEGIN("series", "series", this->all_series[begin]);
+	}
+
+	this->prepare();
+	if (n <= PARALLEL_DISPATCH_CHUNK)
+	{
+		if (n != 0)
+			this->dispatch_range(0, n);
+		else
+			this->subtask_done();
+
+		return;
+	}
+
+	scheduler = WFGlobal::get_scheduler();
+	for (begin = PARALLEL_DISPATCH_CHUNK; begin < n; begin = end)
+	{
+		end = begin + PARALLEL_DISPATCH_CHUNK < n ? begin + PARALLEL_DISPATCH_CHUNK : n;
+		chunk = new __ParallelChunk(this, begin, end);
+		if (scheduler->sleep(chunk) < 0)
+		{
+			delete chunk;
+			break;
+		}
+	}
+
+	if (begin < n)
+		this->dispatch_range(begin, n);
+
+	this->dispatch_range(0, PARALLEL_DISPATCH_CHUNK);
+}
+
+SubTask *ParallelWork::done()
+{
+	SeriesWork *series = series_of(this);
+	size_t i;
+
+	if (this->callback)
+		this->callback(this);
+
+	for (i = 0; i < this->subtasks_nr; i++)
+		delete this->all_series[i];
+
+	this->subtasks_nr = 0;
+	delete this;
+	return series->pop();
+}
+
+ParallelWork::~ParallelWork()
+{
+	size_t i;
+
+	for (i = 0; i < this->subtasks_nr; i++)
+	{
+		this->all_series[i]->in_parallel = false;
+		this->all_series[i]->dismiss_recursive();
+	}
+
+	delete []this->subtasks;
+}
@@ -6,7 +6,9 @@
 #include <utility>
 #include <functional>
 #include <mutex>
+#include <typeinfo>
 #include "SubTask.h"
+#include "TaskTrace.h"
 #include "logger.h"
 
 class SeriesWork;
@@ -50,6 +52,8 @@ public:
     void start()
     {
         assert(!this->in_parallel);
+        TASK_TRACE_ASYNC_BEGIN("series", "series", this);
+        TASK_TRACE_ASYNC_BEGIN("task", typeid(*this->first).name(), this->first);
         this->first->dispatch();
     }
 
@@ -99,11 +103,18 @@ private:
 		this->last = last;
 	}
 
+	void unset_last_task() { this->last = NULL; }
+
 private:
 	SubTask *pop_task();
 	void expand_queue();
 	void dismiss_recursive();
 
+private:
+	/* Freed series are kept per thread for the next one. */
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
 private:
     SubTask *first;
     SubTask *last;
@@ -116,11 +127,17 @@ private:
     void *context;
     std::mutex mutex;
     series_callback_t callback;
+    SubTask *buffer[4];		/* the queue until it grows */
 
 private:
 	SeriesWork(SubTask *first, series_callback_t&& callback);
-	~SeriesWork() { delete []this->queue; }
+	~SeriesWork()
+	{
+		if (this->queue != this->buffer)
+			delete []this->queue;
+	}
 	friend class ParallelWork;
+	friend class WFGraphTask;
 	friend class Workflow;
 };
 
@@ -140,6 +157,92 @@ static inline SeriesWork& operator << (SeriesWork& series, SubTask *task)
 	return series;
 }
 
+class ParallelWork : public ParallelTask
+{
+public:
+	void start()
+	{
+		assert(!series_of(this));
+		Workflow::start_series_work(this, nullptr);
+	}
+
+	/* Call dismiss() only when you don't want to start a created parallel. */
+	void dismiss()
+	{
+		assert(!series_of(this));
+		delete this;
+	}
+
+public:
+	void add_series(SeriesWork *series);
+
+public:
+	void *get_context() const { return this->context; }
+	void set_context(void *context) { this->context = context; }
+
+public:
+	SeriesWork *series_at(size_t index)
+	{
+		if (index < this->subtasks_nr)
+			return this->all_series[index];
+		else
+			return NULL;
+	}
+
+	const SeriesWork *series_at(size_t index) const
+	{
+		if (index < this->subtasks_nr)
+			return this->all_series[index];
+		else
+			return NULL;
+	}
+
+	SeriesWork& operator[] (size_t index)
+	{
+		return *this->series_at(index);
+	}
+
+	const SeriesWork& operator[] (size_t index) const
+	{
+		return *this->series_at(index);
+	}
+
+	size_t size() const { return this->subtasks_nr; }
+
+public:
+	void set_callback(parallel_callback_t callback)
+	{
+		this->callback = std::move(callback);
+	}
+
+public:
+	/* Above PARALLEL_DISPATCH_CHUNK series, chunks of them start on the
+	 * handler threads instead of all on the calling one. */
+	virtual void dispatch();
+
+protected:
+	virtual SubTask *done();
+
+protected:
+	void *context;
+	parallel_callback_t callback;
+
+private:
+	void expand_buf();
+
+private:
+	size_t buf_size;
+	SeriesWork **all_series;
+
+protected:
+	ParallelWork(parallel_callback_t&& callback);
+	ParallelWork(SeriesWork *const all_series[], size_t n,
+				 parallel_callback_t&& callback);
+	virtual ~ParallelWork();
+	friend class __ParallelChunk;
+	friend class Workflow;
+};
+
 inline SeriesWork *
 Workflow::create_series_work(SubTask *first, series_callback_t callback)
 {
@@ -149,7 +252,10 @@ Workflow::create_series_work(SubTask *first, series_callback_t callback)
 inline void
 Workflow::start_series_work(SubTask *first, series_callback_t callback)
 {
-	new SeriesWork(first, std::move(callback));
+	SeriesWork *series = new SeriesWork(first, std::move(callback));
+
+	TASK_TRACE_ASYNC_BEGIN("series", "series", series);
+	TASK_TRACE_ASYNC_BEGIN("task", typeid(*first).name(), first);
 	first->dispatch();
 }
 
@@ -168,7 +274,31 @@ Workflow::start_series_work(SubTask *first, SubTask *last,
 {
 	SeriesWork *series = new SeriesWork(first, std::move(callback));
 	series->set_last_task(last);
+	TASK_TRACE_ASYNC_BEGIN("series", "series", series);
+	TASK_TRACE_ASYNC_BEGIN("task", typeid(*first).name(), first);
 	first->dispatch();
 }
 
+inline ParallelWork *
+Workflow::create_parallel_work(parallel_callback_t callback)
+{
+	return new ParallelWork(std::move(callback));
+}
+
+inline ParallelWork *
+Workflow::create_parallel_work(SeriesWork *const all_series[], size_t n,
+							   parallel_callback_t callback)
+{
+	return new ParallelWork(all_series, n, std::move(callback));
+}
+
+inline void
+Workflow::start_parallel_work(SeriesWork *const all_series[], size_t n,
+							  parallel_callback_t callback)
+{
+	ParallelWork *parallel = new ParallelWork(all_series, n,
+											  std::move(callback));
+	Workflow::start_series_work(parallel, nullptr);
+}
+
 #endif
\ No newline at end of file
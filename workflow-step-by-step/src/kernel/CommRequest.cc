@@ -1,6 +1,22 @@
 #include <errno.h>
 #include "CommScheduler.h"
 #include "CommRequest.h"
+#include "TaskTrace.h"
+
+/* Nested in the span of the task, on the thread that handles it. */
+static void __trace_phase(const CommRequest *req, const char *name,
+						  int from, int to)
+{
+	const struct timespec *begin = req->get_phase_time(from);
+	const struct timespec *end = req->get_phase_time(to);
+	const SubTask *task = req;
+
+	if (begin && end)
+	{
+		__task_trace_event('b', "task", name, task, begin);
+		__task_trace_event('e', "task", name, task, end);
+	}
+}
 
 void CommRequest::handle(int state, int error)
 {
@@ -13,9 +29,32 @@ void CommRequest::handle(int state, int error)
 	else
 		this->timeout_reason = TOR_TRANSMIT_TIMEOUT;
 
+	/* Targets handed out by the scheduler are always CommSchedTargets. */
+	static_cast<CommSchedTarget *>(this->target)->feedback(state,
+		this->get_phase_elapsed(CS_PHASE_ACQUIRE, CS_PHASE_COMPLETE));
+	if (__builtin_expect(__task_trace_on, 0))
+	{
+		__trace_phase(this, "wait", CS_PHASE_START, CS_PHASE_ACQUIRE);
+		__trace_phase(this, "connect", CS_PHASE_CONNECT_START, CS_PHASE_CONNECT_END);
+		__trace_phase(this, "request", CS_PHASE_WRITE_START, CS_PHASE_FIRST_BYTE);
+		__trace_phase(this, "receive", CS_PHASE_FIRST_BYTE, CS_PHASE_COMPLETE);
+	}
+
 	this->subtask_done();
 }
 
+long long CommRequest::get_phase_elapsed(int from, int to) const
+{
+	const struct timespec *begin = this->get_phase_time(from);
+	const struct timespec *end = this->get_phase_time(to);
+
+	if (!begin || !end)
+		return -1;
+
+	return (end->tv_sec - begin->tv_sec) * 1000000LL +
+		   (end->tv_nsec - begin->tv_nsec) / 1000;
+}
+
 void CommRequest::dispatch()
 {
 	if (this->scheduler->request(this, this->object, this->wait_timeout, &this->target) < 0)
@@ -22,6 +22,10 @@ public:
 	int get_wait_timeout() const { return this->wait_timeout; }
 	void set_wait_timeout(int timeout) { this->wait_timeout = timeout; }
 
+	/* Microseconds between two phases (CS_PHASE_*) of the last attempt,
+	 * or -1 if either was not reached. Call in callback. */
+	long long get_phase_elapsed(int from, int to) const;
+
 public:
 	virtual void dispatch();
 
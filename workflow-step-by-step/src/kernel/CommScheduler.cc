@@ -1,20 +1,100 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include "list.h"
 #include "CommScheduler.h"
 
-#define PTHREAD_COND_TIMEDWAIT(cond, mutex, abstime) \
-	((abstime) ? pthread_cond_timedwait(cond, mutex, abstime) : \
-				 pthread_cond_wait(cond, mutex))
+struct __sched_waiter
+{
+	struct list_head list;
+	long long deadline;		/* nanoseconds, CLOCK_MONOTONIC */
+	CommSchedTarget *target;
+	int granted;			/* futex word, set under 'wait_mutex' */
+};
+
+struct __tg_array
+{
+	struct __tg_array *prev;
+	int size;
+	int capacity;
+	CommSchedTarget *targets[1];
+};
+
+#define EWMA_SHIFT			3		/* a new result weighs 1/8 */
+#define EWMA_FADE_MS		2000	/* idle averages halve this often */
+#define ERROR_RATE_ONE		1024
+#define ERROR_COST			8		/* all failing costs 1 + 8 times */
+
+/* Gradient limiter, after Netflix concurrency-limits. Each window the
+ * limit becomes limit * min_rtt * TOLERANCE / rtt (gradient clamped to
+ * [0.5, 1]) plus sqrt(limit) of queueing room, smoothed by SMOOTHING. */
+#define ADAPTIVE_INITIAL_LIMIT	20
+#define ADAPTIVE_WINDOW_MS		100
+#define ADAPTIVE_WINDOW_MIN		10		/* results before a window closes */
+#define ADAPTIVE_TOLERANCE		2.0
+#define ADAPTIVE_SMOOTHING		0.2
+#define ADAPTIVE_BACKOFF		0.9		/* on a window with failures */
+#define ADAPTIVE_MIN_RTT_MS		30000	/* relearn the lowest RTT this often */
+
+static __thread unsigned int __p2c_seed;
+
+static long long __get_coarse_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* A target nobody picks gets no new results. Fading its averages makes
+ * it worth a probe again after a while. */
+static long long __ewma_fade(long long value, long long since, long long now)
+{
+	long long halves = (now - since) / EWMA_FADE_MS;
+
+	if (halves <= 0)
+		return value;
+
+	return halves < 63 ? value >> halves : 0;
+}
 
-static struct timespec *__get_abstime(int timeout, struct timespec *ts)
+static void __ewma_update(long long *avg, long long sample, long long since,
+						  long long now, bool first_sets)
+{
+	long long old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+	long long cur;
+	long long val;
+
+	do
+	{
+		cur = __ewma_fade(old, since, now);
+		if (cur == 0 && first_sets)
+			val = sample;
+		else
+			val = cur + (sample - cur) / (1 << EWMA_SHIFT);
+	} while (!__atomic_compare_exchange_n(avg, &old, val, true,
+										  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* 'timeout' milliseconds after 'start', both on CLOCK_MONOTONIC. */
+static struct timespec *__get_abstime(const struct timespec *start, int timeout,
+									  struct timespec *ts)
 {
 	if (timeout < 0)
 		return NULL;
 
-	clock_gettime(CLOCK_REALTIME, ts);
+	*ts = *start;
 	ts->tv_sec += timeout / 1000;
 	ts->tv_nsec += timeout % 1000 * 1000000;
 	if (ts->tv_nsec >= 1000000000)
@@ -26,6 +106,171 @@ static struct timespec *__get_abstime(int timeout, struct timespec *ts)
 	return ts;
 }
 
+/* Microseconds from now to 'abstime', negative once it has passed. */
+static long long __get_remaining_us(const struct timespec *abstime)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (abstime->tv_sec - now.tv_sec) * 1000000LL +
+		   (abstime->tv_nsec - now.tv_nsec) / 1000;
+}
+
+/* Sleep while '*addr' is still 'val'. 'abstime' is on CLOCK_MONOTONIC. */
+static int __futex_wait(int *addr, int val, const struct timespec *abstime)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, abstime,
+				   NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void __futex_wake(int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int CommSchedObject::init_wait()
+{
+	int ret = pthread_mutex_init(&this->wait_mutex, NULL);
+
+	if (ret == 0)
+	{
+		INIT_LIST_HEAD(&this->wait_list);
+		this->wait_cnt = 0;
+		return 0;
+	}
+
+	errno = ret;
+	return -1;
+}
+
+void CommSchedObject::deinit_wait()
+{
+	pthread_mutex_destroy(&this->wait_mutex);
+}
+
+/* While anyone waits, newcomers queue up behind instead of taking a slot
+ * a release is about to hand over. The wait ends 'wait_timeout' after
+ * 'start', when the request began. */
+CommTarget *CommSchedObject::acquire(int wait_timeout,
+									 const struct timespec *start)
+{
+	CommSchedTarget *target;
+	struct timespec ts;
+
+	if (wait_timeout == 0 || __atomic_load_n(&this->wait_cnt, __ATOMIC_SEQ_CST) == 0)
+	{
+		target = this->try_acquire();
+		if (target)
+			return target;
+
+		if (wait_timeout == 0)
+		{
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+
+	return this->wait(__get_abstime(start, wait_timeout, &ts));
+}
+
+/* A waiter is counted before it tries, and a release frees its slot
+ * before it looks for waiters. So either the try sees the free slot, or
+ * the release sees the waiter, and finds it queued once it has the lock. */
+CommTarget *CommSchedObject::wait(const struct timespec *abstime)
+{
+	struct __sched_waiter waiter;
+	struct __sched_waiter *entry;
+	struct list_head *pos;
+	struct list_head *prev;
+	long long remaining = 0;
+	long long estimate = 0;
+	int ahead = 0;
+	int ret;
+
+	waiter.deadline = abstime ? abstime->tv_sec * 1000000000LL + abstime->tv_nsec
+							  : LLONG_MAX;
+	waiter.target = NULL;
+	waiter.granted = 0;
+
+	pthread_mutex_lock(&this->wait_mutex);
+	__sync_add_and_fetch(&this->wait_cnt, 1);
+	if (list_empty(&this->wait_list))
+		waiter.target = this->try_acquire();
+
+	if (!waiter.target)
+	{
+		/* Behind everyone due no later than us. */
+		list_for_each_prev(pos, &this->wait_list)
+		{
+			entry = list_entry(pos, struct __sched_waiter, list);
+			if (entry->deadline <= waiter.deadline)
+				break;
+		}
+
+		if (abstime)
+		{
+			for (prev = pos; prev != &this->wait_list; prev = prev->prev)
+				ahead++;
+
+			estimate = this->wait_estimate(ahead);
+			remaining = __get_remaining_us(abstime);
+		}
+
+		/* Turned away at once rather than timing out in the queue. What
+		 * is left of the deadline counts, not the whole timeout. */
+		if (!abstime || (remaining > 0 && estimate <= remaining))
+		{
+			list_add(&waiter.list, pos);
+			while (!waiter.granted)
+			{
+				pthread_mutex_unlock(&this->wait_mutex);
+				ret = __futex_wait(&waiter.granted, 0, abstime);
+				pthread_mutex_lock(&this->wait_mutex);
+				if (ret < 0 && errno == ETIMEDOUT && !waiter.granted)
+				{
+					list_del(&waiter.list);
+					break;
+				}
+			}
+		}
+	}
+
+	__sync_sub_and_fetch(&this->wait_cnt, 1);
+	pthread_mutex_unlock(&this->wait_mutex);
+	if (!waiter.target)
+		errno = ETIMEDOUT;
+
+	return waiter.target;
+}
+
+/* Hand free slots to the waiters, head first. The granted waiter only
+ * returns after taking 'wait_mutex', so its futex word is still there
+ * when we wake it. */
+void CommSchedObject::grant_waiters()
+{
+	struct __sched_waiter *waiter;
+	CommSchedTarget *target;
+
+	if (__atomic_load_n(&this->wait_cnt, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	pthread_mutex_lock(&this->wait_mutex);
+	while (!list_empty(&this->wait_list))
+	{
+		target = this->try_acquire();
+		if (!target)
+			break;
+
+		waiter = list_entry(this->wait_list.next, struct __sched_waiter, list);
+		list_del(&waiter->list);
+		waiter->target = target;
+		__atomic_store_n(&waiter->granted, 1, __ATOMIC_RELEASE);
+		__futex_wake(&waiter->granted);
+	}
+
+	pthread_mutex_unlock(&this->wait_mutex);
+}
+
 int CommSchedTarget::init(const struct sockaddr *addr, socklen_t addrlen, int connect_timeout, int response_timeout, size_t max_connections)
 {
 	int ret;
@@ -39,21 +284,25 @@ int CommSchedTarget::init(const struct sockaddr *addr, socklen_t addrlen, int co
 	if (this->CommTarget::init(addr, addrlen, connect_timeout, response_timeout) >= 0)
 	{
 		ret = pthread_mutex_init(&this->mutex, NULL);
-		if (ret == 0)
+		if (ret == 0 && this->init_wait() < 0)
 		{
-			ret = pthread_cond_init(&this->cond, NULL);
-			if (ret == 0)
-			{
-				this->max_load = max_connections;
-				this->cur_load = 0;
-				this->wait_cnt = 0;
-				this->group = NULL;
-				return 0;
-			}
-
+			ret = errno;
 			pthread_mutex_destroy(&this->mutex);
 		}
 
+		if (ret == 0)
+		{
+			this->max_load = max_connections;
+			this->cur_load = 0;
+			this->latency = 0;
+			this->error_rate = 0;
+			this->feedback_time = 0;
+			this->limit = max_connections;
+			this->adaptive = false;
+			this->group = NULL;
+			return 0;
+		}
+
 		errno = ret;
 		this->CommTarget::deinit();
 	}
@@ -63,97 +312,214 @@ int CommSchedTarget::init(const struct sockaddr *addr, socklen_t addrlen, int co
 
 void CommSchedTarget::deinit()
 {
-	pthread_cond_destroy(&this->cond);
+	this->deinit_wait();
 	pthread_mutex_destroy(&this->mutex);
 	this->CommTarget::deinit();
 }
 
-CommTarget *CommSchedTarget::acquire(int wait_timeout)
+void CommSchedTarget::feedback(int state, long long usec)
 {
-	pthread_mutex_t *mutex = &this->mutex;
-	int ret;
+	long long since = __atomic_load_n(&this->feedback_time, __ATOMIC_RELAXED);
+	long long now = __get_coarse_ms();
 
-	pthread_mutex_lock(mutex);
-	if (this->group)
+	if (state == CS_STATE_SUCCESS)
 	{
-		mutex = &this->group->mutex;
-		pthread_mutex_lock(mutex);
-		pthread_mutex_unlock(&this->mutex);
+		if (usec >= 0)
+			__ewma_update(&this->latency, usec, since, now, true);
+
+		__ewma_update(&this->error_rate, 0, since, now, false);
 	}
+	else if (state == CS_STATE_ERROR)
+		__ewma_update(&this->error_rate, ERROR_RATE_ONE, since, now, false);
+	else
+		return;
 
-	if (this->cur_load >= this->max_load)
-	{
-		if (wait_timeout != 0)
-		{
-			struct timespec ts;
-			struct timespec *abstime = __get_abstime(wait_timeout, &ts);
+	__atomic_store_n(&this->feedback_time, now, __ATOMIC_RELAXED);
+	if (this->adaptive)
+		this->adapt_limit(state, usec, now);
+}
 
-			do
-			{
-				this->wait_cnt++;
-				ret = PTHREAD_COND_TIMEDWAIT(&this->cond, mutex, abstime);
-				this->wait_cnt--;
-			} while (this->cur_load >= this->max_load && ret == 0);
-		}
-		else
-			ret = EAGAIN;
+void CommSchedTarget::set_adaptive_limit(bool enable)
+{
+	size_t limit = this->max_load;
+
+	pthread_mutex_lock(&this->mutex);
+	if (enable && limit > ADAPTIVE_INITIAL_LIMIT)
+		limit = ADAPTIVE_INITIAL_LIMIT;
+
+	this->limit_estimate = limit;
+	this->min_rtt = 0;
+	this->min_rtt_time = 0;
+	this->window_start = 0;
+	this->window_sum = 0;
+	this->window_min = 0;
+	this->window_cnt = 0;
+	this->window_errors = 0;
+	this->window_peak = 0;
+	__atomic_store_n(&this->limit, limit, __ATOMIC_RELAXED);
+	__atomic_store_n(&this->adaptive, enable, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&this->mutex);
+	this->wake();
+}
+
+void CommSchedTarget::adapt_limit(int state, long long usec, long long now)
+{
+	size_t load = __atomic_load_n(&this->cur_load, __ATOMIC_RELAXED) + 1;
+	size_t peak = __atomic_load_n(&this->window_peak, __ATOMIC_RELAXED);
+	long long min;
+
+	if (state == CS_STATE_SUCCESS && usec >= 0)
+	{
+		/* 0 means no sample in 'window_min'. */
+		if (usec == 0)
+			usec = 1;
+
+		__sync_add_and_fetch(&this->window_sum, usec);
+		__sync_add_and_fetch(&this->window_cnt, 1);
+		min = __atomic_load_n(&this->window_min, __ATOMIC_RELAXED);
+		while ((min == 0 || usec < min) &&
+			   !__atomic_compare_exchange_n(&this->window_min, &min, usec,
+											true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
 	}
+	else
+		__sync_add_and_fetch(&this->window_errors, 1);
+
+	while (load > peak &&
+		   !__atomic_compare_exchange_n(&this->window_peak, &peak, load, true,
+										__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	if (now - __atomic_load_n(&this->window_start, __ATOMIC_RELAXED) < ADAPTIVE_WINDOW_MS ||
+		__atomic_load_n(&this->window_cnt, __ATOMIC_RELAXED) +
+		__atomic_load_n(&this->window_errors, __ATOMIC_RELAXED) < ADAPTIVE_WINDOW_MIN)
+		return;
 
-	if (this->cur_load < this->max_load)
+	/* Someone else is closing this window. */
+	if (pthread_mutex_trylock(&this->mutex) != 0)
+		return;
+
+	if (this->adaptive && now - this->window_start >= ADAPTIVE_WINDOW_MS)
+		this->update_limit(now);
+
+	pthread_mutex_unlock(&this->mutex);
+}
+
+void CommSchedTarget::update_limit(long long now)
+{
+	long long sum = __sync_lock_test_and_set(&this->window_sum, 0);
+	long long min = __sync_lock_test_and_set(&this->window_min, 0);
+	int cnt = __sync_lock_test_and_set(&this->window_cnt, 0);
+	int errors = __sync_lock_test_and_set(&this->window_errors, 0);
+	size_t peak = __sync_lock_test_and_set(&this->window_peak, 0);
+	double limit = this->limit_estimate;
+	double target;
+	double gradient;
+	size_t old;
+	size_t cur;
+
+	this->window_start = now;
+	if (errors > 0)
+		target = limit * ADAPTIVE_BACKOFF;
+	else if (cnt > 0 && min > 0)
 	{
-		this->cur_load++;
-		if (this->group)
+		if (this->min_rtt == 0 || min < this->min_rtt ||
+			now - this->min_rtt_time >= ADAPTIVE_MIN_RTT_MS)
 		{
-			this->group->cur_load++;
-			this->group->heapify(this->index);
+			this->min_rtt = min;
+			this->min_rtt_time = now;
 		}
 
-		ret = 0;
-	}
+		gradient = this->min_rtt * ADAPTIVE_TOLERANCE * cnt / sum;
+		if (gradient > 1.0)
+			gradient = 1.0;
+		else if (gradient < 0.5)
+			gradient = 0.5;
 
-	pthread_mutex_unlock(mutex);
-	if (ret)
-	{
-		errno = ret;
-		return NULL;
+		target = limit * gradient + sqrt(limit);
+		/* Not using half of it, so the window says nothing about more. */
+		if (target > limit && peak * 2 < limit)
+			target = limit;
+
+		target = limit * (1 - ADAPTIVE_SMOOTHING) + target * ADAPTIVE_SMOOTHING;
 	}
+	else
+		return;
+
+	if (target > this->max_load)
+		target = this->max_load;
+	else if (target < 1.0)
+		target = 1.0;
+
+	this->limit_estimate = target;
+	cur = (size_t)target;
+	old = __atomic_exchange_n(&this->limit, cur, __ATOMIC_RELAXED);
+	if (cur > old)
+		this->wake();
+}
+
+long long CommSchedTarget::get_latency() const
+{
+	return __ewma_fade(__atomic_load_n(&this->latency, __ATOMIC_RELAXED),
+					   __atomic_load_n(&this->feedback_time, __ATOMIC_RELAXED),
+					   __get_coarse_ms());
+}
 
-	return this;
+int CommSchedTarget::get_error_rate() const
+{
+	return __ewma_fade(__atomic_load_n(&this->error_rate, __ATOMIC_RELAXED),
+					   __atomic_load_n(&this->feedback_time, __ATOMIC_RELAXED),
+					   __get_coarse_ms());
 }
 
-void CommSchedTarget::release()
+CommSchedTarget *CommSchedTarget::try_acquire()
 {
-	pthread_mutex_t *mutex = &this->mutex;
+	size_t load = __atomic_load_n(&this->cur_load, __ATOMIC_RELAXED);
+	size_t old;
 
-	pthread_mutex_lock(mutex);
-	if (this->group)
+	while (load < __atomic_load_n(&this->limit, __ATOMIC_RELAXED))
 	{
-		mutex = &this->group->mutex;
-		pthread_mutex_lock(mutex);
-		pthread_mutex_unlock(&this->mutex);
+		old = __sync_val_compare_and_swap(&this->cur_load, load, load + 1);
+		if (old == load)
+			return this;
+
+		load = old;
 	}
 
-	this->cur_load--;
-	if (this->wait_cnt > 0)
-		pthread_cond_signal(&this->cond);
+	return NULL;
+}
 
-	if (this->group)
-	{
-		this->group->cur_load--;
-		if (this->wait_cnt == 0 && this->group->wait_cnt > 0)
-			pthread_cond_signal(&this->group->cond);
+/* Slots free up at limit / latency per microsecond. */
+long long CommSchedTarget::wait_estimate(int position)
+{
+	return this->get_latency() * (position + 1) /
+		   __atomic_load_n(&this->limit, __ATOMIC_RELAXED);
+}
 
-		this->group->heap_adjust(this->index);
-	}
+/* A slot may be free: waiters on the target come before its group's. */
+void CommSchedTarget::wake()
+{
+	CommSchedGroup *group;
 
-	pthread_mutex_unlock(mutex);
+	this->grant_waiters();
+	group = __atomic_load_n(&this->group, __ATOMIC_ACQUIRE);
+	if (group)
+		group->grant_waiters();
+}
+
+void CommSchedTarget::release()
+{
+	__sync_sub_and_fetch(&this->cur_load, 1);
+	this->wake();
 }
 
 int CommSchedGroup::target_cmp(CommSchedTarget *target1,
 							   CommSchedTarget *target2)
 {
-	size_t load1 = target1->cur_load * target2->max_load;
-	size_t load2 = target2->cur_load * target1->max_load;
+	size_t load1 = __atomic_load_n(&target1->cur_load, __ATOMIC_RELAXED) *
+				   __atomic_load_n(&target2->limit, __ATOMIC_RELAXED);
+	size_t load2 = __atomic_load_n(&target2->cur_load, __ATOMIC_RELAXED) *
+				   __atomic_load_n(&target1->limit, __ATOMIC_RELAXED);
 
 	if (load1 < load2)
 		return -1;
@@ -163,153 +529,68 @@ int CommSchedGroup::target_cmp(CommSchedTarget *target1,
 		return 0;
 }
 
-void CommSchedGroup::heap_adjust(int index)
+double CommSchedGroup::target_cost(CommSchedTarget *target, long long now)
 {
-	CommSchedTarget *target = this->tg_heap[index];
-	CommSchedTarget *parent;
-
-	while (index > 0)
-	{
-		parent = this->tg_heap[(index - 1) / 2];
-		if (CommSchedGroup::target_cmp(target, parent) < 0)
-		{
-			this->tg_heap[index] = parent;
-			parent->index = index;
-			index = (index - 1) / 2;
-		}
-		else
-			break;
-	}
-
-	this->tg_heap[index] = target;
-	target->index = index;
+	long long since = __atomic_load_n(&target->feedback_time, __ATOMIC_RELAXED);
+	long long latency = __atomic_load_n(&target->latency, __ATOMIC_RELAXED);
+	long long errors = __atomic_load_n(&target->error_rate, __ATOMIC_RELAXED);
+	size_t load = __atomic_load_n(&target->cur_load, __ATOMIC_RELAXED);
+
+	latency = __ewma_fade(latency, since, now);
+	errors = __ewma_fade(errors, since, now);
+	return (double)(latency + 1) * (load + 1) *
+		   (ERROR_RATE_ONE + ERROR_COST * errors) / ERROR_RATE_ONE;
 }
 
-/* Fastest heapify ever. */
-void CommSchedGroup::heapify(int top)
+static struct __tg_array *__tg_array_create(int capacity,
+											struct __tg_array *prev)
 {
-	CommSchedTarget *target = this->tg_heap[top];
-	int last = this->heap_size - 1;
-	CommSchedTarget **child;
-	int i;
-
-	while (i = 2 * top + 1, i < last)
-	{
-		child = &this->tg_heap[i];
-		if (CommSchedGroup::target_cmp(child[0], target) < 0)
-		{
-			if (CommSchedGroup::target_cmp(child[1], child[0]) < 0)
-			{
-				this->tg_heap[top] = child[1];
-				child[1]->index = top;
-				top = i + 1;
-			}
-			else
-			{
-				this->tg_heap[top] = child[0];
-				child[0]->index = top;
-				top = i;
-			}
-		}
-		else
-		{
-			if (CommSchedGroup::target_cmp(child[1], target) < 0)
-			{
-				this->tg_heap[top] = child[1];
-				child[1]->index = top;
-				top = i + 1;
-			}
-			else
-			{
-				this->tg_heap[top] = target;
-				target->index = top;
-				return;
-			}
-		}
-	}
+	size_t size = offsetof(struct __tg_array, targets) +
+				  capacity * sizeof (void *);
+	struct __tg_array *array = (struct __tg_array *)malloc(size);
 
-	if (i == last)
+	if (array)
 	{
-		child = &this->tg_heap[i];
-		if (CommSchedGroup::target_cmp(child[0], target) < 0)
+		array->prev = prev;
+		array->capacity = capacity;
+		array->size = 0;
+		if (prev)
 		{
-			this->tg_heap[top] = child[0];
-			child[0]->index = top;
-			top = i;
+			memcpy(array->targets, prev->targets, prev->size * sizeof (void *));
+			array->size = prev->size;
 		}
 	}
 
-	this->tg_heap[top] = target;
-	target->index = top;
-}
-
-int CommSchedGroup::heap_insert(CommSchedTarget *target)
-{
-	if (this->heap_size == this->heap_buf_size)
-	{
-		int new_size = 2 * this->heap_buf_size;
-		void *new_base = realloc(this->tg_heap, new_size * sizeof (void *));
-
-		if (new_base)
-		{
-			this->tg_heap = (CommSchedTarget **)new_base;
-			this->heap_buf_size = new_size;
-		}
-		else
-			return -1;
-	}
-
-	this->tg_heap[this->heap_size] = target;
-	target->index = this->heap_size;
-	this->heap_adjust(this->heap_size);
-	this->heap_size++;
-	return 0;
-}
-
-void CommSchedGroup::heap_remove(int index)
-{
-	CommSchedTarget *target;
-
-	this->heap_size--;
-	if (index != this->heap_size)
-	{
-		target = this->tg_heap[this->heap_size];
-		this->tg_heap[index] = target;
-		target->index = index;
-		this->heap_adjust(index);
-		this->heapify(target->index);
-	}
+	return array;
 }
 
 #define COMMGROUP_INIT_SIZE		4
 
 int CommSchedGroup::init()
 {
-	size_t size = COMMGROUP_INIT_SIZE * sizeof (void *);
 	int ret;
 
-	this->tg_heap = (CommSchedTarget **)malloc(size);
-	if (this->tg_heap)
+	this->tg_array = __tg_array_create(COMMGROUP_INIT_SIZE, NULL);
+	if (this->tg_array)
 	{
 		ret = pthread_mutex_init(&this->mutex, NULL);
-		if (ret == 0)
+		if (ret == 0 && this->init_wait() < 0)
 		{
-			ret = pthread_cond_init(&this->cond, NULL);
-			if (ret == 0)
-			{
-				this->heap_buf_size = COMMGROUP_INIT_SIZE;
-				this->heap_size = 0;
-				this->max_load = 0;
-				this->cur_load = 0;
-				this->wait_cnt = 0;
-				return 0;
-			}
-
+			ret = errno;
 			pthread_mutex_destroy(&this->mutex);
 		}
 
+		if (ret == 0)
+		{
+			this->next = 0;
+			this->policy = CSG_POLICY_LEAST_LOAD;
+			this->max_load = 0;
+			this->cur_load = 0;
+			return 0;
+		}
+
 		errno = ret;
-		free(this->tg_heap);
+		free(this->tg_array);
 	}
 
 	return -1;
@@ -317,27 +598,44 @@ int CommSchedGroup::init()
 
 void CommSchedGroup::deinit()
 {
-	pthread_cond_destroy(&this->cond);
+	struct __tg_array *array = this->tg_array;
+	struct __tg_array *prev;
+
+	this->deinit_wait();
 	pthread_mutex_destroy(&this->mutex);
-	free(this->tg_heap);
+	while (array)
+	{
+		prev = array->prev;
+		free(array);
+		array = prev;
+	}
 }
 
 int CommSchedGroup::add(CommSchedTarget *target)
 {
+	struct __tg_array *array;
 	int ret = -1;
 
 	pthread_mutex_lock(&target->mutex);
 	pthread_mutex_lock(&this->mutex);
 	if (target->group == NULL && target->wait_cnt == 0)
 	{
-		if (this->heap_insert(target) >= 0)
+		array = this->tg_array;
+		if (array->size == array->capacity)
 		{
-			target->group = this;
-			this->max_load += target->max_load;
-			this->cur_load += target->cur_load;
-			if (this->wait_cnt > 0 && this->cur_load < this->max_load)
-				pthread_cond_signal(&this->cond);
+			array = __tg_array_create(2 * array->capacity, array);
+			if (array)
+				__atomic_store_n(&this->tg_array, array, __ATOMIC_RELEASE);
+		}
 
+		if (array)
+		{
+			target->index = array->size;
+			__atomic_store_n(&array->targets[array->size], target,
+							 __ATOMIC_RELAXED);
+			__atomic_store_n(&array->size, array->size + 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&target->group, this, __ATOMIC_RELEASE);
+			this->grant_waiters();
 			ret = 0;
 		}
 	}
@@ -355,16 +653,23 @@ int CommSchedGroup::add(CommSchedTarget *target)
 
 int CommSchedGroup::remove(CommSchedTarget *target)
 {
+	struct __tg_array *array;
+	CommSchedTarget *last;
 	int ret = -1;
 
 	pthread_mutex_lock(&target->mutex);
 	pthread_mutex_lock(&this->mutex);
 	if (target->group == this && target->wait_cnt == 0)
 	{
-		this->heap_remove(target->index);
-		this->max_load -= target->max_load;
-		this->cur_load -= target->cur_load;
-		target->group = NULL;
+		/* A reader in between may see 'last' twice, which is harmless. */
+		array = this->tg_array;
+		last = array->targets[array->size - 1];
+		last->index = target->index;
+		__atomic_store_n(&array->targets[target->index], last,
+						 __ATOMIC_RELAXED);
+		__atomic_store_n(&array->size, array->size - 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&target->group, (CommSchedGroup *)NULL,
+						 __ATOMIC_RELEASE);
 		ret = 0;
 	}
 	else if (target->group != this)
@@ -377,46 +682,156 @@ int CommSchedGroup::remove(CommSchedTarget *target)
 	return ret;
 }
 
-CommTarget *CommSchedGroup::acquire(int wait_timeout)
+size_t CommSchedGroup::get_max_load()
 {
-	pthread_mutex_t *mutex = &this->mutex;
+	struct __tg_array *array = __atomic_load_n(&this->tg_array, __ATOMIC_ACQUIRE);
+	int size = __atomic_load_n(&array->size, __ATOMIC_ACQUIRE);
+	size_t limit = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		limit += __atomic_load_n(&array->targets[i]->limit, __ATOMIC_RELAXED);
+
+	return limit;
+}
+
+size_t CommSchedGroup::get_cur_load()
+{
+	struct __tg_array *array = __atomic_load_n(&this->tg_array, __ATOMIC_ACQUIRE);
+	int size = __atomic_load_n(&array->size, __ATOMIC_ACQUIRE);
+	size_t load = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		load += __atomic_load_n(&array->targets[i]->cur_load, __ATOMIC_RELAXED);
+
+	return load;
+}
+
+/* The least loaded member with a free slot. Scans start at a rotating
+ * position, so that equally loaded members take turns. */
+CommSchedTarget *CommSchedGroup::choose_least_load(struct __tg_array *array,
+												   int size)
+{
+	unsigned int start = __atomic_load_n(&this->next, __ATOMIC_RELAXED);
 	CommSchedTarget *target;
-	int ret;
+	CommSchedTarget *best = NULL;
+	int i;
 
-	pthread_mutex_lock(mutex);
-	if (this->cur_load >= this->max_load)
+	__atomic_store_n(&this->next, start + 1, __ATOMIC_RELAXED);
+	for (i = 0; i < size; i++)
 	{
-		if (wait_timeout != 0)
-		{
-			struct timespec ts;
-			struct timespec *abstime = __get_abstime(wait_timeout, &ts);
+		target = __atomic_load_n(&array->targets[(start + i) % size],
+								 __ATOMIC_RELAXED);
+		if (__atomic_load_n(&target->cur_load, __ATOMIC_RELAXED) >=
+			__atomic_load_n(&target->limit, __ATOMIC_RELAXED))
+			continue;
+
+		if (!best || CommSchedGroup::target_cmp(target, best) < 0)
+			best = target;
+	}
 
-			do
-			{
-				this->wait_cnt++;
-				ret = PTHREAD_COND_TIMEDWAIT(&this->cond, mutex, abstime);
-				this->wait_cnt--;
-			} while (this->cur_load >= this->max_load && ret == 0);
-		}
-		else
-			ret = EAGAIN;
+	return best;
+}
+
+/* The cheaper of two random members. Falls back to a scan when neither
+ * has a free slot. */
+CommSchedTarget *CommSchedGroup::choose_least_latency(struct __tg_array *array,
+													  int size)
+{
+	CommSchedTarget *target1;
+	CommSchedTarget *target2;
+	long long now;
+	int i, j;
+
+	if (size < 2)
+		return this->choose_least_load(array, size);
+
+	if (__p2c_seed == 0)
+		__p2c_seed = (unsigned int)(uintptr_t)&__p2c_seed ^ (unsigned int)time(NULL);
+
+	i = rand_r(&__p2c_seed) % size;
+	j = rand_r(&__p2c_seed) % (size - 1);
+	if (j >= i)
+		j++;
+
+	target1 = __atomic_load_n(&array->targets[i], __ATOMIC_RELAXED);
+	target2 = __atomic_load_n(&array->targets[j], __ATOMIC_RELAXED);
+	if (__atomic_load_n(&target1->cur_load, __ATOMIC_RELAXED) >=
+		__atomic_load_n(&target1->limit, __ATOMIC_RELAXED))
+		target1 = NULL;
+
+	if (__atomic_load_n(&target2->cur_load, __ATOMIC_RELAXED) >=
+		__atomic_load_n(&target2->limit, __ATOMIC_RELAXED))
+		target2 = NULL;
+
+	if (!target1 || !target2)
+	{
+		if (target1 || target2)
+			return target1 ? target1 : target2;
+
+		return this->choose_least_load(array, size);
 	}
 
-	if (this->cur_load < this->max_load)
+	now = __get_coarse_ms();
+	if (CommSchedGroup::target_cost(target2, now) <
+		CommSchedGroup::target_cost(target1, now))
+		return target2;
+
+	return target1;
+}
+
+CommSchedTarget *CommSchedGroup::try_acquire()
+{
+	struct __tg_array *array;
+	CommSchedTarget *best;
+	int size;
+
+	while (1)
 	{
-		target = this->tg_heap[0];
-		target->cur_load++;
-		this->cur_load++;
-		this->heapify(0);
-		ret = 0;
+		array = __atomic_load_n(&this->tg_array, __ATOMIC_ACQUIRE);
+		size = __atomic_load_n(&array->size, __ATOMIC_ACQUIRE);
+		if (this->policy == CSG_POLICY_LEAST_LATENCY)
+			best = this->choose_least_latency(array, size);
+		else
+			best = this->choose_least_load(array, size);
+
+		if (!best)
+			return NULL;
+
+		if (best->try_acquire())
+		{
+			if (__atomic_load_n(&best->group, __ATOMIC_ACQUIRE) == this)
+				return best;
+
+			/* Removed from the group while we chose it. Not a full
+			 * release(), as we may hold our 'wait_mutex', and the new
+			 * group's would be taken after it. */
+			__sync_sub_and_fetch(&best->cur_load, 1);
+			best->grant_waiters();
+		}
 	}
+}
 
-	pthread_mutex_unlock(mutex);
-	if (ret)
+/* Members free slots at limit / latency per microsecond each. */
+long long CommSchedGroup::wait_estimate(int position)
+{
+	struct __tg_array *array = __atomic_load_n(&this->tg_array, __ATOMIC_ACQUIRE);
+	int size = __atomic_load_n(&array->size, __ATOMIC_ACQUIRE);
+	CommSchedTarget *target;
+	long long latency;
+	double rate = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
 	{
-		errno = ret;
-		return NULL;
+		target = __atomic_load_n(&array->targets[i], __ATOMIC_RELAXED);
+		latency = target->get_latency();
+		if (latency == 0)
+			return 0;
+
+		rate += (double)__atomic_load_n(&target->limit, __ATOMIC_RELAXED) / latency;
 	}
 
-	return target;
-}
\ No newline at end of file
+	return rate > 0 ? (long long)((position + 1) / rate) : 0;
+}
@@ -6,18 +6,41 @@
 #include <pthread.h>
 #include "Communicator.h"
 
+class CommSchedTarget;
+
 class CommSchedObject
 {
 public:
-	size_t get_max_load() { return this->max_load; }
-	size_t get_cur_load() { return this->cur_load; }
+	/* The load it may take now. An adaptive target's current limit. */
+	virtual size_t get_max_load() { return this->max_load; }
+	virtual size_t get_cur_load() { return this->cur_load; }
 
 private:
-	virtual CommTarget *acquire(int wait_timeout) = 0;
+	CommTarget *acquire(int wait_timeout, const struct timespec *start);
+
+protected:
+	/* Take one unit of load without blocking. NULL if none is free. */
+	virtual CommSchedTarget *try_acquire() = 0;
+
+	/* Expected microseconds until the waiter at 'position' of the queue
+	 * gets a slot, 0 if unknown. */
+	virtual long long wait_estimate(int position) = 0;
+
+	/* Waiters are queued by deadline, those without one last, and in
+	 * arrival order among equal deadlines. A release hands its slot to
+	 * the head. One that could not be served in time is turned away
+	 * before queueing, with ETIMEDOUT. */
+	int init_wait();
+	void deinit_wait();
+	CommTarget *wait(const struct timespec *abstime);
+	void grant_waiters();
 
 protected:
 	size_t max_load;
 	size_t cur_load;
+	struct list_head wait_list;
+	pthread_mutex_t wait_mutex;
+	int wait_cnt;
 
 public:
 	virtual ~CommSchedObject() { }
@@ -32,19 +55,83 @@ public:
 	int init(const struct sockaddr *addr, socklen_t addrlen, int connect_timeout, int response_timeout, size_t max_connections);
 	void deinit();
 
+	/* Idle connections kept open in background, at most max_connections.
+	 * Each is replaced after 'keep_alive_timeout' ms idle. */
+	void set_min_idle_connections(size_t n, int keep_alive_timeout)
+	{
+		this->set_min_idle(n < this->max_load ? n : this->max_load,
+						   keep_alive_timeout);
+	}
+
+	/* Race new connections against 'next' and the ones after it. */
+	void set_race_target(CommSchedTarget *next, int delay)
+	{
+		this->set_race(next, delay);
+	}
+
+	/* Record the result of one request: its state (CS_STATE_*) and the
+	 * microseconds it took, or -1 if unknown. */
+	void feedback(int state, long long usec);
+
+	/* Moving averages of the response time in microseconds, and of the
+	 * error rate in 1/1024. Both fade while no result is recorded. */
+	long long get_latency() const;
+	int get_error_rate() const;
+
+	/* Let the load limit follow the latency: it grows while response
+	 * times stay near the lowest seen, and shrinks as they rise or
+	 * requests fail. max_connections stays the upper bound. */
+	void set_adaptive_limit(bool enable);
+
+	/* Current cap of the load. max_connections unless adaptive. */
+	size_t get_limit() const { return this->limit; }
+	virtual size_t get_max_load() { return this->get_limit(); }
+
 private:
-	virtual CommTarget *acquire(int wait_timeout); /* final */
 	virtual void release(); /* final */
 
+private:
+	virtual CommSchedTarget *try_acquire();
+	virtual long long wait_estimate(int position);
+	void wake();
+	void adapt_limit(int state, long long usec, long long now);
+	void update_limit(long long now);
+
+private:
+	long long latency;
+	long long error_rate;
+	long long feedback_time;	/* milliseconds, CLOCK_MONOTONIC_COARSE */
+
+private:
+	/* Adaptive limit. Results are summed per window without lock. The
+	 * one that closes a window updates the limit under 'mutex'. */
+	size_t limit;
+	bool adaptive;
+	double limit_estimate;
+	long long min_rtt;
+	long long min_rtt_time;
+	long long window_start;
+	long long window_sum;
+	long long window_min;
+	int window_cnt;
+	int window_errors;
+	size_t window_peak;
+
 private:
 	CommSchedGroup *group;
 	int index;
-	int wait_cnt;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	pthread_mutex_t mutex;	/* only for joining or leaving a group */
 	friend class CommSchedGroup;
 };
 
+struct __tg_array;
+
+/* How a group chooses a member. LEAST_LOAD takes the lowest
+ * cur_load/limit. LEAST_LATENCY compares two random members by
+ * response time x load x errors (power of two choices). */
+#define CSG_POLICY_LEAST_LOAD		0
+#define CSG_POLICY_LEAST_LATENCY	1
+
 class CommSchedGroup : public CommSchedObject
 {
 public:
@@ -53,23 +140,31 @@ public:
 	int add(CommSchedTarget *target);
 	int remove(CommSchedTarget *target);
 
-private:
-	virtual CommTarget *acquire(int wait_timeout); /* final */
+	void set_policy(int policy) { this->policy = policy; }
+	int get_policy() const { return this->policy; }
+
+	/* Sums over the members: their current limits and their load. Both
+	 * are snapshots. */
+	virtual size_t get_max_load();
+	virtual size_t get_cur_load();
 
 private:
-	CommSchedTarget **tg_heap;
-	int heap_size;
-	int heap_buf_size;
-	int wait_cnt;
+	/* Members are read without lock by acquire(). add() and remove()
+	 * serialize on 'mutex' and publish a grown array by pointer swap.
+	 * Replaced arrays are kept until deinit(), as a reader may still be
+	 * scanning them. */
+	struct __tg_array *tg_array;
+	unsigned int next;		/* where the next scan starts */
+	int policy;
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 
 private:
 	static int target_cmp(CommSchedTarget *target1, CommSchedTarget *target2);
-	void heapify(int top);
-	void heap_adjust(int from);
-	int heap_insert(CommSchedTarget *target);
-	void heap_remove(int index);
+	static double target_cost(CommSchedTarget *target, long long now);
+	CommSchedTarget *choose_least_load(struct __tg_array *array, int size);
+	CommSchedTarget *choose_least_latency(struct __tg_array *array, int size);
+	virtual CommSchedTarget *try_acquire();
+	virtual long long wait_estimate(int position);
 	friend class CommSchedTarget;
 };
 
@@ -86,13 +181,17 @@ public:
 		this->comm.deinit();
 	}
 
-	/* wait_timeout in microseconds, -1 for no timeout. */
+	/* wait_timeout in milliseconds, -1 for no timeout. It runs from the
+	 * call, so time spent getting in line counts against it. */
 	int request(CommSession *session, CommSchedObject *object,
 				int wait_timeout, CommTarget **target)
 	{
 		int ret = -1;
 
-		*target = object->acquire(wait_timeout);
+		session->clear_phase_time(CS_PHASE_START);
+		session->set_phase_time(CS_PHASE_START);
+		*target = object->acquire(wait_timeout,
+								  session->get_phase_time(CS_PHASE_START));
 		if (*target)
 		{
 			ret = this->comm.request(session, *target);
@@ -103,6 +202,23 @@ public:
 		return ret;
 	}
 
+	/* Fill the target's idle pool without waiting for a request. */
+	int prewarm(CommSchedTarget *target)
+	{
+		return this->comm.prewarm(target);
+	}
+
+	/* Graceful shutdown, see Communicator::drain(). */
+	int drain(int timeout)
+	{
+		return this->comm.drain(timeout);
+	}
+
+	size_t get_inflight() const
+	{
+		return this->comm.get_inflight();
+	}
+
 	/* for sleepers. */
 	int sleep(SleepSession *session)
 	{
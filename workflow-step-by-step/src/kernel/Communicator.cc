@@ -37,6 +37,44 @@ struct CommConnEntry
     CommSession *session;
     CommTarget *target;
     mpoller_t *mpoller;
+    /* Sessions in flight, oldest first. session == pipeline[pipe_head]. */
+#define COMM_PIPELINE_MAX		16
+    struct list_head pipe_list;
+    CommSession *pipeline[COMM_PIPELINE_MAX];
+    int pipe_head;
+    int pipe_cnt;
+    int pipe_depth;
+    /* Multiplexed sessions waiting for reply, keyed by seq. pipe_list links
+     * the entry into target's mux_list instead of pipe_list. */
+    struct rb_root mux_tree;
+    int mux_cnt;
+    int mux_max;
+    SSL *ssl;
+    /* The address we connect to, and the race it runs in, if any. */
+    CommTarget *peer;
+    CommConnRace *race;
+    /* Bytes not written yet, in order: messages of deferred-flush sessions,
+     * flushed by the poller, and the rest of a write the socket took only
+     * in part, written by the poller when the socket can take more. */
+    struct poller_flush flush;
+    struct poller_flush write_flush;
+    char *wbuf;
+    size_t wpos;
+    size_t wlen;
+    size_t wsize;
+    int wblocked;
+    /* Received bytes of the current message not consumed yet, and why
+     * reading is paused. paused_list links entries paused by the limits. */
+#define CONN_PAUSE_USER		1
+#define CONN_PAUSE_LIMIT	2
+    size_t recv_buffered;
+    size_t recv_limit;
+    int paused;
+    struct list_head paused_list;
+    /* In the communicator's list of its poller thread, for drain(). */
+    Communicator *comm;
+    struct CommConnList *conn_list_head;
+    struct list_head conn_list;
     /* Connection entry's mutex is for client session only. */
     pthread_mutex_t mutex;
 };
@@ -65,7 +103,22 @@ int CommTarget::init(const struct sockaddr *addr, socklen_t addrlen, int connect
 			this->addrlen = addrlen;
 			this->connect_timeout = connect_timeout;
 			this->response_timeout = response_timeout;
+			this->ssl_connect_timeout = 0;
+			this->ssl_ctx = NULL;
+			this->ssl_session = NULL;
+			this->race_next = NULL;
+			this->race_delay = 0;
+			this->max_receive_buffer = 0;
+			this->inflight = 0;
 			INIT_LIST_HEAD(&this->idle_list);
+			INIT_LIST_HEAD(&this->pipe_list);
+			INIT_LIST_HEAD(&this->mux_list);
+			this->idle_cnt = 0;
+			this->warming_cnt = 0;
+			this->min_idle = 0;
+			this->keep_alive_timeout = -1;
+			this->prewarm_backoff = 0;
+			this->prewarm_timer = 0;
 			return 0;
 		}
 
@@ -78,16 +131,209 @@ int CommTarget::init(const struct sockaddr *addr, socklen_t addrlen, int connect
 
 void CommTarget::deinit()
 {
+	if (this->ssl_session)
+		SSL_SESSION_free(this->ssl_session);
+
 	pthread_mutex_destroy(&this->mutex);
 	free(this->addr);
 }
 
+int CommTarget::ssl_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	CommTarget *target = (CommTarget *)SSL_get_app_data(ssl);
+	SSL_SESSION *old;
+
+	if (!target)
+		return 0;
+
+	/* Called by the poller thread with no lock held. We keep the ref. */
+	pthread_mutex_lock(&target->mutex);
+	old = target->ssl_session;
+	target->ssl_session = session;
+	pthread_mutex_unlock(&target->mutex);
+	if (old)
+		SSL_SESSION_free(old);
+
+	return 1;
+}
+
+void CommTarget::enable_ssl_session_cache(SSL_CTX *ssl_ctx)
+{
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT |
+											SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, CommTarget::ssl_new_session);
+}
+
 int CommMessageIn::feedback(const char *buf, size_t size)
 {
 	struct CommConnEntry *entry = this->entry;
+
+	if (entry->ssl)
+		return SSL_write(entry->ssl, buf, size);
+
 	return write(entry->sockfd, buf, size);
 }
 
+/* Unconsumed received bytes on all connections, and the limit. */
+static size_t __recv_buffered;
+static size_t __recv_buffer_max;
+static int __paused_cnt;
+static LIST_HEAD(__paused_list);
+static pthread_mutex_t __paused_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct CommConnList
+{
+	struct list_head list;
+	pthread_mutex_t mutex;
+};
+
+static void __conn_pause(struct CommConnEntry *entry, int reason)
+{
+	pthread_mutex_lock(&__paused_mutex);
+	if (entry->paused == CONN_PAUSE_LIMIT)
+	{
+		/* Only resume() undoes a pause asked by the message. */
+		if (reason == CONN_PAUSE_USER)
+		{
+			list_del(&entry->paused_list);
+			__paused_cnt--;
+			entry->paused = reason;
+		}
+	}
+	else if (!entry->paused)
+	{
+		if (reason == CONN_PAUSE_LIMIT)
+		{
+			list_add_tail(&entry->paused_list, &__paused_list);
+			__paused_cnt++;
+		}
+
+		entry->paused = reason;
+		mpoller_pause(entry->sockfd, entry->mpoller);
+	}
+
+	pthread_mutex_unlock(&__paused_mutex);
+}
+
+static int __conn_resume(struct CommConnEntry *entry)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&__paused_mutex);
+	if (entry->paused)
+	{
+		if (entry->paused == CONN_PAUSE_LIMIT)
+		{
+			list_del(&entry->paused_list);
+			__paused_cnt--;
+		}
+
+		entry->paused = 0;
+		ret = mpoller_resume(entry->sockfd, entry->mpoller);
+	}
+
+	pthread_mutex_unlock(&__paused_mutex);
+	return ret;
+}
+
+/* Resume connections paused by the limits, if they are under them now. */
+static void __conn_resume_limited()
+{
+	struct CommConnEntry *entry;
+	struct list_head *pos, *tmp;
+
+	if (__paused_cnt == 0)
+		return;
+
+	if (__recv_buffer_max > 0 && __recv_buffered > __recv_buffer_max)
+		return;
+
+	pthread_mutex_lock(&__paused_mutex);
+	list_for_each_safe(pos, tmp, &__paused_list)
+	{
+		entry = list_entry(pos, struct CommConnEntry, paused_list);
+		if (entry->recv_limit == 0 || entry->recv_buffered <= entry->recv_limit)
+		{
+			list_del(pos);
+			__paused_cnt--;
+			entry->paused = 0;
+			mpoller_resume(entry->sockfd, entry->mpoller);
+		}
+	}
+
+	pthread_mutex_unlock(&__paused_mutex);
+}
+
+static void __conn_release_buffered(struct CommConnEntry *entry)
+{
+	size_t n = __sync_lock_test_and_set(&entry->recv_buffered, 0);
+
+	if (n > 0)
+	{
+		__sync_sub_and_fetch(&__recv_buffered, n);
+		__conn_resume_limited();
+	}
+}
+
+void CommMessageIn::consume(size_t size)
+{
+	struct CommConnEntry *entry = this->entry;
+
+	__sync_sub_and_fetch(&entry->recv_buffered, size);
+	__sync_sub_and_fetch(&__recv_buffered, size);
+	__conn_resume_limited();
+}
+
+int CommMessageIn::resume()
+{
+	return __conn_resume(this->entry);
+}
+
+void Communicator::set_max_receive_buffer(size_t size)
+{
+	__recv_buffer_max = size;
+}
+
+/* Feed the message, counting what it keeps toward the receive limits. */
+int Communicator::append_message(CommMessageIn *in, const void *buf, size_t *size)
+{
+	struct CommConnEntry *entry = in->entry;
+	int reason = 0;
+	int ret;
+
+	ret = in->append(buf, size);
+	if (ret == CM_APPEND_PAUSE)
+	{
+		reason = CONN_PAUSE_USER;
+		ret = 0;
+	}
+
+	if (ret > 0)
+	{
+		/* The rest of the last chunk may complete a paused message. */
+		if (entry->paused)
+			__conn_resume(entry);
+
+		__conn_release_buffered(entry);
+	}
+	else if (ret == 0)
+	{
+		__sync_add_and_fetch(&entry->recv_buffered, *size);
+		__sync_add_and_fetch(&__recv_buffered, *size);
+		if (!reason)
+		{
+			if ((entry->recv_limit > 0 && entry->recv_buffered > entry->recv_limit) ||
+				(__recv_buffer_max > 0 && __recv_buffered > __recv_buffer_max))
+				reason = CONN_PAUSE_LIMIT;
+		}
+
+		if (reason)
+			__conn_pause(entry, reason);
+	}
+
+	return ret;
+}
+
 CommSession::~CommSession()
 {
 	struct CommConnEntry *entry;
@@ -169,23 +415,233 @@ int Communicator::first_timeout_recv(CommSession *session)
 
 void Communicator::release_conn(struct CommConnEntry *entry)
 {
+	pthread_mutex_lock(&__paused_mutex);
+	if (entry->paused == CONN_PAUSE_LIMIT)
+	{
+		list_del(&entry->paused_list);
+		__paused_cnt--;
+	}
+
+	pthread_mutex_unlock(&__paused_mutex);
+	__conn_release_buffered(entry);
+	pthread_mutex_lock(&entry->conn_list_head->mutex);
+	list_del(&entry->conn_list);
+	pthread_mutex_unlock(&entry->conn_list_head->mutex);
+	if (entry->ssl)
+		SSL_free(entry->ssl);
+
 	delete entry->conn;
 	close(entry->sockfd);
+	if (__sync_sub_and_fetch(&entry->comm->conns, 1) == 0 &&
+		entry->comm->draining)
+		entry->comm->drain_signal();
+
+	free(entry->wbuf);
 	free(entry);
 }
 
+/* One TLS record can carry 16KB. Gather small vectors into it. */
+#define SSL_WRITE_BUFSIZE	(16 * 1024)
+
+/* Like writev(), but on TLS connections too. */
+ssize_t Communicator::send_vectors(const struct iovec vectors[], int cnt,
+								   struct CommConnEntry *entry)
+{
+	char buf[SSL_WRITE_BUFSIZE];
+	ssize_t total = 0;
+	size_t off = 0;
+	size_t len;
+	size_t n;
+	int ret;
+	int i;
+
+	/* With kTLS the kernel encrypts, so plain writev() is fine. */
+	if (!entry->ssl || BIO_get_ktls_send(SSL_get_wbio(entry->ssl)))
+		return writev(entry->sockfd, vectors, cnt);
+
+	i = 0;
+	while (i < cnt)
+	{
+		len = 0;
+		while (i < cnt && len < SSL_WRITE_BUFSIZE)
+		{
+			n = vectors[i].iov_len - off;
+			if (n > SSL_WRITE_BUFSIZE - len)
+				n = SSL_WRITE_BUFSIZE - len;
+
+			memcpy(buf + len, (char *)vectors[i].iov_base + off, n);
+			len += n;
+			off += n;
+			if (off == vectors[i].iov_len)
+			{
+				off = 0;
+				i++;
+			}
+		}
+
+		if (len == 0)
+			break;
+
+		ret = SSL_write(entry->ssl, buf, len);
+		if (ret <= 0)
+		{
+			if (total > 0)
+				break;
+
+			switch (SSL_get_error(entry->ssl, ret))
+			{
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				errno = EAGAIN;
+				break;
+			case SSL_ERROR_SYSCALL:
+				break;
+			default:
+				errno = EPROTO;
+				break;
+			}
+
+			return -1;
+		}
+
+		total += ret;
+		if ((size_t)ret < len)
+			break;
+	}
+
+	return total;
+}
+
+/* Append to the connection's write buffer. Called with entry->mutex held,
+ * or before the entry is shared. */
+int Communicator::buffer_vectors(const struct iovec vectors[], int cnt,
+								 struct CommConnEntry *entry)
+{
+	size_t size = 0;
+	char *buf;
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		size += vectors[i].iov_len;
+
+	/* Drop what is written already before growing. */
+	if (entry->wpos > 0 && entry->wlen + size > entry->wsize)
+	{
+		entry->wlen -= entry->wpos;
+		memmove(entry->wbuf, entry->wbuf + entry->wpos, entry->wlen);
+		entry->wpos = 0;
+	}
+
+	size += entry->wlen;
+	if (size > entry->wsize)
+	{
+		if (size < 2 * entry->wsize)
+			size = 2 * entry->wsize;
+
+		buf = (char *)realloc(entry->wbuf, size);
+		if (!buf)
+			return -1;
+
+		entry->wbuf = buf;
+		entry->wsize = size;
+	}
+
+	for (i = 0; i < cnt; i++)
+	{
+		memcpy(entry->wbuf + entry->wlen, vectors[i].iov_base, vectors[i].iov_len);
+		entry->wlen += vectors[i].iov_len;
+	}
+
+	return 0;
+}
+
+/* Write the buffer. What the socket doesn't take is written by the poller
+ * when it can take more. Called with entry->mutex held. */
+void Communicator::write_buffered(struct CommConnEntry *entry)
+{
+	struct iovec vector;
+	ssize_t n;
+
+	vector.iov_base = entry->wbuf + entry->wpos;
+	vector.iov_len = entry->wlen - entry->wpos;
+	n = Communicator::send_vectors(&vector, 1, entry);
+	if (n >= 0 || errno == EAGAIN)
+	{
+		if (n > 0)
+			entry->wpos += n;
+
+		if (entry->wpos == entry->wlen)
+		{
+			entry->wpos = 0;
+			entry->wlen = 0;
+			return;
+		}
+
+		entry->wblocked = 1;
+		if (mpoller_flush_writable(&entry->write_flush, entry->sockfd,
+								   entry->mpoller) >= 0)
+			return;
+
+		/* Not in the poller any more. Its result fails the sessions. */
+	}
+	else
+	{
+		entry->error = errno;
+		entry->state = CONN_STATE_ERROR;
+		mpoller_del(entry->sockfd, entry->mpoller);
+	}
+
+	entry->wblocked = 0;
+	entry->wpos = 0;
+	entry->wlen = 0;
+}
+
+void Communicator::write_conn(struct poller_flush *flush)
+{
+	struct CommConnEntry *entry = list_entry(flush, struct CommConnEntry,
+											 write_flush);
+
+	/* The connection is in the poller, so the entry is alive. */
+	pthread_mutex_lock(&entry->mutex);
+	entry->wblocked = 0;
+	if (entry->state != CONN_STATE_ERROR)
+		Communicator::write_buffered(entry);
+	else
+	{
+		entry->wpos = 0;
+		entry->wlen = 0;
+	}
+
+	pthread_mutex_unlock(&entry->mutex);
+}
+
+/* Write the message, or as much as the socket takes and buffer the rest.
+ * Returns 0, or -1 if the connection failed. */
 int Communicator::send_message_sync(struct iovec vectors[], int cnt, struct CommConnEntry *entry)
 {
-	CommSession *session = entry->session;
-	int timeout;
 	ssize_t n;
 	int i;
 
+	/* Earlier bytes are not written yet. Keep the order. */
+	if (entry->wlen > 0)
+	{
+		if (Communicator::buffer_vectors(vectors, cnt, entry) < 0)
+			return -1;
+
+		this->start_receive(entry);
+		return 0;
+	}
+
 	while (1)
 	{
-		n = writev(entry->sockfd, vectors, cnt <= IOV_MAX ? cnt : IOV_MAX);
+		n = Communicator::send_vectors(vectors, cnt <= IOV_MAX ? cnt : IOV_MAX, entry);
 		if (n < 0)
-			return errno == EAGAIN ? cnt : -1;
+		{
+			if (errno != EAGAIN)
+				return -1;
+
+			break;
+		}
 
 		for (i = 0; i < cnt; i++)
 		{
@@ -199,16 +655,31 @@ int Communicator::send_message_sync(struct iovec vectors[], int cnt, struct Comm
 			}
 		}
 
+		vectors += i;
 		cnt -= i;
-		if (cnt == 0)
+		if (cnt == 0 || i < IOV_MAX)
 			break;
+	}
 
-		if (i < IOV_MAX)
-			return cnt;
+	if (cnt > 0)
+	{
+		if (Communicator::buffer_vectors(vectors, cnt, entry) < 0)
+			return -1;
 
-		vectors += i;
+		/* Before connected, it is armed when added to the poller. */
+		entry->wblocked = 1;
+		mpoller_flush_writable(&entry->write_flush, entry->sockfd, this->mpoller);
 	}
-	
+
+	this->start_receive(entry);
+	return 0;
+}
+
+void Communicator::start_receive(struct CommConnEntry *entry)
+{
+	CommSession *session = entry->session;
+	int timeout;
+
 	if (entry->state == CONN_STATE_IDLE)
 	{
 		timeout = session->first_timeout();
@@ -224,18 +695,83 @@ int Communicator::send_message_sync(struct iovec vectors[], int cnt, struct Comm
 	}
 
 	entry->state = CONN_STATE_RECEIVING;
+}
+
+/* Copy the message into the connection's write buffer, and let the poller
+ * flush it with one send() after the current loop iteration. Called with
+ * entry->mutex held, or before the entry is shared. */
+int Communicator::send_message_deferred(struct iovec vectors[], int cnt,
+										struct CommConnEntry *entry)
+{
+	if (Communicator::buffer_vectors(vectors, cnt, entry) < 0)
+		return -1;
+
+	/* A write waiting for the socket takes these along, and a connection
+	 * not in the poller yet gets its write armed when added. Otherwise the
+	 * queued flush holds a reference. */
+	if (entry->state == CONN_STATE_CONNECTING)
+		entry->wblocked = 1;
+	else if (!entry->wblocked)
+	{
+		__sync_add_and_fetch(&entry->ref, 1);
+		if (mpoller_flush(&entry->flush, entry->sockfd, this->mpoller) == 0)
+			__sync_sub_and_fetch(&entry->ref, 1);
+	}
+
+	this->start_receive(entry);
 	return 0;
 }
 
+void Communicator::flush_conn(struct poller_flush *flush)
+{
+	struct CommConnEntry *entry = list_entry(flush, struct CommConnEntry, flush);
+
+	pthread_mutex_lock(&entry->mutex);
+	/* Once blocked, the write callback takes over. */
+	if (entry->wlen > 0 && !entry->wblocked)
+	{
+		if (entry->state != CONN_STATE_ERROR)
+			Communicator::write_buffered(entry);
+		else
+		{
+			entry->wpos = 0;
+			entry->wlen = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&entry->mutex);
+	if (__sync_sub_and_fetch(&entry->ref, 1) == 0)
+		Communicator::release_conn(entry);
+}
+
 #define ENCODE_IOV_MAX		8192
 
-int Communicator::send_message(struct CommConnEntry *entry)
+/* A reply on a multiplexed connection, before we know whose it is. */
+#define COMM_MUX_HEAD_MAX	64
+
+struct CommMuxMessage
 {
-	struct iovec vectors[ENCODE_IOV_MAX];
-	struct iovec *end;
-	int cnt;
+	poller_message_t base;
+	struct CommConnEntry *entry;
+	CommSession *session;
+	CommMessageIn *in;
+	size_t head_len;
+	char head[COMM_MUX_HEAD_MAX];
+};
+
+static inline int __pipe_depth(int depth)
+{
+	if (depth <= 1)
+		return 1;
+
+	return depth < COMM_PIPELINE_MAX ? depth : COMM_PIPELINE_MAX;
+}
+
+/* Returns the number of vectors, or -1 if the message fails. */
+int Communicator::encode_message(CommSession *session, struct iovec vectors[])
+{
+	int cnt = session->out->encode(vectors, ENCODE_IOV_MAX);
 
-	cnt = entry->session->out->encode(vectors, ENCODE_IOV_MAX);
 	if ((unsigned int)cnt > ENCODE_IOV_MAX)
 	{
 		if (cnt > ENCODE_IOV_MAX)
@@ -243,8 +779,37 @@ int Communicator::send_message(struct CommConnEntry *entry)
 		return -1;
 	}
 
-	end = vectors + cnt;
-	return this->send_message_sync(vectors, cnt, entry);	
+	return cnt;
+}
+
+/* Returns 0, or -1 if the connection failed. */
+int Communicator::write_message(CommSession *session, struct iovec vectors[],
+								int cnt, struct CommConnEntry *entry)
+{
+	int ret;
+
+	session->set_phase_time(CS_PHASE_WRITE_START);
+	/* TLS records are written by SSL_write(), never deferred. */
+	if (session->deferred_flush() && !entry->ssl)
+		ret = this->send_message_deferred(vectors, cnt, entry);
+	else
+		ret = this->send_message_sync(vectors, cnt, entry);
+
+	if (ret == 0)
+		session->set_phase_time(CS_PHASE_WRITE_END);
+
+	return ret;
+}
+
+int Communicator::send_message(CommSession *session, struct CommConnEntry *entry)
+{
+	struct iovec vectors[ENCODE_IOV_MAX];
+	int cnt = Communicator::encode_message(session, vectors);
+
+	if (cnt < 0)
+		return -1;
+
+	return this->write_message(session, vectors, cnt, entry);
 }
 
 void Communicator::handle_incoming_reply(struct poller_result *res)
@@ -258,7 +823,7 @@ void Communicator::handle_incoming_reply(struct poller_result *res)
 	switch (res->state)
 	{
 	case PR_ST_SUCCESS:
-		session = entry->session;
+		session = ((CommMessageIn *)res->data.message)->session;
 		state = CS_STATE_SUCCESS;
 		pthread_mutex_lock(&target->mutex);
 		if (entry->state == CONN_STATE_SUCCESS)
@@ -268,6 +833,7 @@ void Communicator::handle_incoming_reply(struct poller_result *res)
 			{
 				entry->state = CONN_STATE_IDLE;
 				list_add(&entry->list, &target->idle_list);
+				target->idle_cnt++;
 			}
 			else
 				entry->state = CONN_STATE_CLOSING;
@@ -293,6 +859,7 @@ void Communicator::handle_incoming_reply(struct poller_result *res)
 		{
 		case CONN_STATE_IDLE:
 			list_del(&entry->list);
+			target->idle_cnt--;
 			break;
 
 		case CONN_STATE_ERROR:
@@ -309,6 +876,9 @@ void Communicator::handle_incoming_reply(struct poller_result *res)
 			break;
 		}
 
+		if (entry && !list_empty(&entry->pipe_list))
+			list_del_init(&entry->pipe_list);
+
 		pthread_mutex_unlock(&target->mutex);
 		pthread_mutex_unlock(mutex);
 		break;
@@ -319,7 +889,22 @@ void Communicator::handle_incoming_reply(struct poller_result *res)
 		if (session)
 		{
 			target->release();
-			session->handle(state, res->error);
+			this->handle_session(session, state, res->error);
+			if (res->state != PR_ST_SUCCESS)
+				this->fail_pipeline(entry, state, res->error);
+		}
+		else if (target->min_idle > 0 && state == CS_STATE_ERROR &&
+				 !this->stop_flag)
+		{
+			/* Idle too long: replace it. Closed by the peer: back off. */
+			pthread_mutex_lock(&target->mutex);
+			if (res->state == PR_ST_ERROR && res->error == ETIMEDOUT)
+				target->prewarm_backoff = 0;
+			else
+				this->prewarm_later(target);
+
+			pthread_mutex_unlock(&target->mutex);
+			this->prewarm(target);
 		}
 
 		if (__sync_sub_and_fetch(&entry->ref, 1) == 0)
@@ -333,27 +918,99 @@ void Communicator::handle_read_result(struct poller_result *res)
 
 	if (res->state != PR_ST_MODIFIED)
 	{
-		this->handle_incoming_reply(res);
+		if (entry->mux_max > 0)
+			this->handle_mux_reply(res);
+		else
+			this->handle_incoming_reply(res);
 	}
 }
 
-void Communicator::handle_connect_result(struct poller_result *res)
+void Communicator::handle_prewarm_result(struct poller_result *res)
 {
 	struct CommConnEntry *entry = (struct CommConnEntry *)res->data.context;
-	CommSession *session = entry->session;
 	CommTarget *target = entry->target;
-	int timeout;
-	int state;
-	int ret;
 
-	switch (res->state)
+	pthread_mutex_lock(&target->mutex);
+	target->warming_cnt--;
+	if (res->state == PR_ST_FINISHED)
 	{
-	case PR_ST_FINISHED:
-		if ((session->out = session->message_out()) != NULL)
+		res->data.operation = PD_OP_READ;
+		res->data.message = NULL;
+		entry->state = CONN_STATE_IDLE;
+		if (mpoller_add(&res->data, target->keep_alive_timeout, this->mpoller) >= 0)
 		{
-			ret = this->send_message(entry);
-			if (ret == 0)
-			{
+			list_add(&entry->list, &target->idle_list);
+			target->idle_cnt++;
+			if (this->stop_flag)
+				mpoller_del(res->data.fd, this->mpoller);
+
+			entry = NULL;
+		}
+	}
+
+	if (entry && res->state != PR_ST_DELETED && res->state != PR_ST_STOPPED)
+		this->prewarm_later(target);
+
+	pthread_mutex_unlock(&target->mutex);
+	if (entry)
+		this->release_conn(entry);
+}
+
+void Communicator::handle_connect_result(struct poller_result *res)
+{
+	struct CommConnEntry *entry = (struct CommConnEntry *)res->data.context;
+	CommSession *session = entry->session;
+	CommTarget *target = entry->target;
+	int timeout;
+	int state;
+	int ret;
+
+	if (entry->race && !this->handle_race_result(res))
+		return;
+
+	/* TCP is up. Do the TLS handshake before anything else. */
+	if (entry->ssl && res->data.operation == PD_OP_CONNECT &&
+		res->state == PR_ST_FINISHED)
+	{
+		res->data.operation = PD_OP_SSL_CONNECT;
+		res->data.ssl = entry->ssl;
+		if (mpoller_add(&res->data, target->ssl_connect_timeout, this->mpoller) >= 0)
+		{
+			if (this->stop_flag)
+				mpoller_del(res->data.fd, this->mpoller);
+
+			return;
+		}
+
+		res->state = PR_ST_ERROR;
+		res->error = errno;
+		if (entry->race && !this->handle_race_result(res))
+			return;
+	}
+
+	if (!session)
+	{
+		this->handle_prewarm_result(res);
+		return;
+	}
+
+	if (res->state == PR_ST_FINISHED)
+		session->set_phase_time(CS_PHASE_CONNECT_END);
+
+	if (entry->mux_max > 0)
+	{
+		this->handle_mux_connect(res);
+		return;
+	}
+
+	switch (res->state)
+	{
+	case PR_ST_FINISHED:
+		if ((session->out = session->message_out()) != NULL)
+		{
+			ret = this->send_message(session, entry);
+			if (ret == 0)
+			{
 				res->data.operation = PD_OP_READ;
 				res->data.message = NULL;
 				timeout = session->first_timeout();
@@ -365,20 +1022,34 @@ void Communicator::handle_connect_result(struct poller_result *res)
 					session->begin_time.tv_nsec = -1;
 				}
 			}
-			else if (ret > 0)
-				break;
 		}
 		else
 			ret = -1;
 
 		if (ret >= 0)
 		{
-			if (mpoller_add(&res->data, timeout, this->mpoller) >= 0)
+			/* One SSL can't be read and written by two threads at once. */
+			if (!entry->ssl)
+				entry->pipe_depth = __pipe_depth(session->max_pipeline());
+
+			pthread_mutex_lock(&target->mutex);
+			ret = mpoller_add(&res->data, timeout, this->mpoller);
+			if (ret >= 0)
 			{
+				if (entry->wblocked)
+					mpoller_flush_writable(&entry->write_flush, entry->sockfd,
+										   this->mpoller);
+
+				if (entry->pipe_depth > 1)
+					list_add_tail(&entry->pipe_list, &target->pipe_list);
+
 				if (this->stop_flag)
 					mpoller_del(res->data.fd, this->mpoller);
-				break;
 			}
+
+			pthread_mutex_unlock(&target->mutex);
+			if (ret >= 0)
+				break;
 		}
 
 		res->error = errno;
@@ -391,7 +1062,7 @@ void Communicator::handle_connect_result(struct poller_result *res)
 			state = CS_STATE_STOPPED;
 
 		target->release();
-		session->handle(state, res->error);
+		this->handle_session(session, state, res->error);
 		this->release_conn(entry);
 		break;
 	}
@@ -410,6 +1081,7 @@ void Communicator::handler_thread_routine(void *context)
 			comm->handle_read_result(res);
 			break;
 		case PD_OP_CONNECT:
+		case PD_OP_SSL_CONNECT:
 			comm->handle_connect_result(res);
 			break;
 		case PD_OP_TIMER:
@@ -428,16 +1100,31 @@ int Communicator::append(const void *buf, size_t *size, poller_message_t *msg)
 	int timeout;
 	int ret;
 
-	ret = in->append(buf, size);
+	ret = Communicator::append_message(in, buf, size);
 	if (ret > 0)
 	{
-		entry->state = CONN_STATE_SUCCESS;
 		timeout = session->keep_alive_timeout();
 		session->timeout = timeout; /* Reuse session's timeout field. */
-		if (timeout == 0)
+		if (entry->pipe_depth > 1 && Communicator::pipe_next(entry, timeout == 0))
 		{
-			mpoller_del(entry->sockfd, entry->mpoller);
-			return ret;
+			/* One more result for this connection. */
+			__sync_add_and_fetch(&entry->ref, 1);
+			if (timeout == 0)
+			{
+				mpoller_del(entry->sockfd, entry->mpoller);
+				return ret;
+			}
+
+			timeout = Communicator::first_timeout_recv(entry->session);
+		}
+		else
+		{
+			entry->state = CONN_STATE_SUCCESS;
+			if (timeout == 0)
+			{
+				mpoller_del(entry->sockfd, entry->mpoller);
+				return ret;
+			}
 		}
 	}
 	else if (ret == 0 && session->timeout != 0)
@@ -460,6 +1147,9 @@ poller_message_t *Communicator::create_message(void *context)
 	struct CommConnEntry *entry = (struct CommConnEntry *)context;
 	CommSession *session;
 
+	if (entry->mux_max > 0)
+		return Communicator::create_mux_message(entry);
+
 	if (entry->state == CONN_STATE_IDLE)
 	{
 		pthread_mutex_t *mutex;
@@ -477,11 +1167,13 @@ poller_message_t *Communicator::create_message(void *context)
 	}
 
 	session = entry->session;
+	session->set_phase_time(CS_PHASE_FIRST_BYTE);
 	session->in = session->message_in();
 	if (session->in)
 	{
 		session->in->poller_message_t::append = Communicator::append;
 		session->in->entry = entry;
+		session->in->session = session;
 	}
 
 	return session->in;
@@ -552,6 +1244,53 @@ int Communicator::create_poller(size_t poller_threads)
 	return -1;
 }
 
+/* A list of connections for each poller thread, so that connects and
+ * releases on different threads don't share a lock. */
+int Communicator::create_conn_lists(size_t n)
+{
+	pthread_condattr_t attr;
+	size_t i;
+	int ret;
+
+	this->conn_lists = (struct CommConnList *)malloc(n * sizeof (struct CommConnList));
+	if (!this->conn_lists)
+		return -1;
+
+	for (i = 0; i < n; i++)
+	{
+		INIT_LIST_HEAD(&this->conn_lists[i].list);
+		pthread_mutex_init(&this->conn_lists[i].mutex, NULL);
+	}
+
+	pthread_mutex_init(&this->drain_mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&this->drain_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret == 0)
+		return 0;
+
+	errno = ret;
+	pthread_mutex_destroy(&this->drain_mutex);
+	for (i = 0; i < n; i++)
+		pthread_mutex_destroy(&this->conn_lists[i].mutex);
+
+	free(this->conn_lists);
+	return -1;
+}
+
+void Communicator::destroy_conn_lists()
+{
+	size_t i;
+
+	pthread_cond_destroy(&this->drain_cond);
+	pthread_mutex_destroy(&this->drain_mutex);
+	for (i = 0; i < this->mpoller->nthreads; i++)
+		pthread_mutex_destroy(&this->conn_lists[i].mutex);
+
+	free(this->conn_lists);
+}
+
 int Communicator::init(size_t poller_threads, size_t handler_threads)
 {
 	if (poller_threads == 0 || handler_threads == 0)
@@ -562,10 +1301,16 @@ int Communicator::init(size_t poller_threads, size_t handler_threads)
 
 	if (this->create_poller(poller_threads) >= 0)
 	{
-		if (this->create_handler_threads(handler_threads) >= 0)
+		if (this->create_conn_lists(poller_threads) >= 0)
 		{
+			this->conns = 0;
 			this->stop_flag = 0;
-			return 0;
+			this->draining = 0;
+			this->inflight = 0;
+			if (this->create_handler_threads(handler_threads) >= 0)
+				return 0;
+
+			this->destroy_conn_lists();
 		}
 
 		mpoller_stop(this->mpoller);
@@ -576,12 +1321,92 @@ int Communicator::init(size_t poller_threads, size_t handler_threads)
 	return -1;
 }
 
+/* The last request or connection to go while draining wakes drain(). */
+void Communicator::drain_signal()
+{
+	pthread_mutex_lock(&this->drain_mutex);
+	pthread_cond_broadcast(&this->drain_cond);
+	pthread_mutex_unlock(&this->drain_mutex);
+}
+
+/* Wait until '*cnt' is 0. Returns -1 if the deadline passes first. */
+int Communicator::drain_wait(size_t *cnt, const struct timespec *deadline)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&this->drain_mutex);
+	while (*cnt > 0)
+	{
+		if (deadline->tv_sec < 0)
+			pthread_cond_wait(&this->drain_cond, &this->drain_mutex);
+		else if (pthread_cond_timedwait(&this->drain_cond, &this->drain_mutex,
+										deadline) == ETIMEDOUT)
+		{
+			ret = -1;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&this->drain_mutex);
+	return ret;
+}
+
+int Communicator::drain(int timeout)
+{
+	struct CommConnEntry *entry;
+	struct list_head *pos;
+	struct timespec deadline;
+	size_t i;
+	int ret = 0;
+
+	deadline.tv_sec = -1;
+	if (timeout >= 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += timeout % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	/* Seen by every release after this, which then signals. */
+	this->draining = 1;
+	__sync_synchronize();
+	ret = this->drain_wait(&this->inflight, &deadline);
+
+	/* Send FIN on every connection. Idle ones are closed when the peer
+	 * closes, busy ones can still read their replies. */
+	for (i = 0; i < this->mpoller->nthreads; i++)
+	{
+		pthread_mutex_lock(&this->conn_lists[i].mutex);
+		list_for_each(pos, &this->conn_lists[i].list)
+		{
+			entry = list_entry(pos, struct CommConnEntry, conn_list);
+			shutdown(entry->sockfd, SHUT_WR);
+		}
+
+		pthread_mutex_unlock(&this->conn_lists[i].mutex);
+	}
+
+	if (this->drain_wait(&this->conns, &deadline) < 0)
+		ret = -1;
+
+	if (ret < 0)
+		errno = ETIMEDOUT;
+
+	return ret;
+}
+
 void Communicator::deinit()
 {
 	this->stop_flag = 1;
 	mpoller_stop(this->mpoller);
 	poller_queue_set_nonblock(this->queue);
 	thrdpool_destroy(NULL, this->thrdpool);
+	this->destroy_conn_lists();
 	mpoller_destroy(this->mpoller);
 	poller_queue_destroy(this->queue);
 }
@@ -607,14 +1432,46 @@ int Communicator::nonblock_connect(CommTarget *target)
 	return -1;
 }
 
+SSL *Communicator::create_ssl(int sockfd, CommTarget *target)
+{
+	SSL *ssl = SSL_new(target->ssl_ctx);
+
+	if (ssl)
+	{
+		if (SSL_set_fd(ssl, sockfd) > 0 && target->init_ssl(ssl) >= 0)
+		{
+			SSL_set_connect_state(ssl);
+			/* The rest of a blocked write is retried from our buffer. */
+			SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+			SSL_set_app_data(ssl, target);
+			pthread_mutex_lock(&target->mutex);
+			if (target->ssl_session)
+				SSL_set_session(ssl, target->ssl_session);
+
+			pthread_mutex_unlock(&target->mutex);
+			return ssl;
+		}
+
+		SSL_free(ssl);
+	}
+
+	errno = ENOMEM;
+	return NULL;
+}
+
 struct CommConnEntry *Communicator::launch_conn(CommSession *session,
-												CommTarget *target)
+												CommTarget *target,
+												CommTarget *peer)
 {
 	struct CommConnEntry *entry;
 	int sockfd;
 	int ret;
 
-	sockfd = this->nonblock_connect(target);
+	/* Racing attempts keep the time of the first one. */
+	if (session && !session->get_phase_time(CS_PHASE_CONNECT_START))
+		session->set_phase_time(CS_PHASE_CONNECT_START);
+
+	sockfd = this->nonblock_connect(peer);
 	if (sockfd >= 0)
 	{
 		entry = (struct CommConnEntry *)malloc(sizeof (struct CommConnEntry));
@@ -623,7 +1480,15 @@ struct CommConnEntry *Communicator::launch_conn(CommSession *session,
 			ret = pthread_mutex_init(&entry->mutex, NULL);
 			if (ret == 0)
 			{
-				entry->conn = target->new_connection(sockfd);
+				entry->ssl = NULL;
+				if (target->ssl_ctx)
+					entry->ssl = Communicator::create_ssl(sockfd, target);
+
+				if (!target->ssl_ctx || entry->ssl)
+					entry->conn = target->new_connection(sockfd);
+				else
+					entry->conn = NULL;
+
 				if (entry->conn)
 				{
 					entry->seq = 0;
@@ -634,9 +1499,41 @@ struct CommConnEntry *Communicator::launch_conn(CommSession *session,
 					entry->sockfd = sockfd;
 					entry->state = CONN_STATE_CONNECTING;
 					entry->ref = 1;
+					INIT_LIST_HEAD(&entry->pipe_list);
+					entry->pipeline[0] = session;
+					entry->pipe_head = 0;
+					entry->pipe_cnt = 1;
+					entry->pipe_depth = 1;
+					entry->mux_tree.rb_node = NULL;
+					entry->mux_cnt = 0;
+					entry->mux_max = 0;
+					entry->peer = peer;
+					entry->race = NULL;
+					entry->flush.queued = 0;
+					entry->flush.flush = Communicator::flush_conn;
+					entry->write_flush.queued = 0;
+					entry->write_flush.flush = Communicator::write_conn;
+					entry->wbuf = NULL;
+					entry->wpos = 0;
+					entry->wlen = 0;
+					entry->wsize = 0;
+					entry->wblocked = 0;
+					entry->recv_buffered = 0;
+					entry->recv_limit = target->max_receive_buffer;
+					entry->paused = 0;
+					entry->comm = this;
+					entry->conn_list_head = &this->conn_lists[(unsigned int)sockfd %
+															  this->mpoller->nthreads];
+					pthread_mutex_lock(&entry->conn_list_head->mutex);
+					list_add_tail(&entry->conn_list, &entry->conn_list_head->list);
+					pthread_mutex_unlock(&entry->conn_list_head->mutex);
+					__sync_add_and_fetch(&this->conns, 1);
 					return entry;
 				}
 
+				if (entry->ssl)
+					SSL_free(entry->ssl);
+
 				pthread_mutex_destroy(&entry->mutex);
 			}
 			else
@@ -662,6 +1559,7 @@ struct CommConnEntry *Communicator::get_idle_conn(CommTarget *target)
 		if (mpoller_set_timeout(entry->sockfd, -1, this->mpoller) >= 0)
 		{
 			list_del(pos);
+			target->idle_cnt--;
 			return entry;
 		}
 	}
@@ -673,21 +1571,40 @@ struct CommConnEntry *Communicator::get_idle_conn(CommTarget *target)
 int Communicator::request_idle_conn(CommSession *session, CommTarget *target)
 {
 	struct CommConnEntry *entry;
+	int refill;
 	int ret = -1;
 
 	pthread_mutex_lock(&target->mutex);
 	entry = this->get_idle_conn(target);
 	if (entry)
+	{
 		pthread_mutex_lock(&entry->mutex);
+		entry->pipeline[0] = session;
+		entry->pipe_head = 0;
+		entry->pipe_cnt = 1;
+		entry->pipe_depth = entry->ssl ? 1 : __pipe_depth(session->max_pipeline());
+		if (entry->pipe_depth > 1)
+			list_add_tail(&entry->pipe_list, &target->pipe_list);
+
+		/* The peer kept it open till we needed it. */
+		target->prewarm_backoff = 0;
+	}
+
+	refill = (target->idle_cnt + target->warming_cnt < target->min_idle &&
+			  !target->prewarm_timer);
 	pthread_mutex_unlock(&target->mutex);
+	if (refill)
+		this->prewarm(target);
+
 	if (entry)
 	{
 		entry->session = session;
+		session->peer = entry->peer;
 		session->conn = entry->conn;
 		session->seq = entry->seq++;
 		session->out = session->message_out();
 		if (session->out)
-			ret = this->send_message(entry);
+			ret = this->send_message(session, entry);
 
 		if (ret < 0)
 		{
@@ -703,47 +1620,1000 @@ int Communicator::request_idle_conn(CommSession *session, CommTarget *target)
 	return ret;
 }
 
-int Communicator::request(CommSession *session, CommTarget *target)
+int Communicator::request_pipe_conn(CommSession *session, CommTarget *target)
 {
-	struct CommConnEntry *entry;
-	struct poller_data data;
-	int errno_bak;
-	int ret;
+	struct CommConnEntry *entry = NULL;
+	struct list_head *pos;
+	struct iovec vectors[ENCODE_IOV_MAX];
+	int cnt = -1;
+	int ret = -1;
+	int i;
 
-	if (session->passive)
+	pthread_mutex_lock(&target->mutex);
+	list_for_each(pos, &target->pipe_list)
 	{
-		errno = EINVAL;
-		return -1;
+		entry = list_entry(pos, struct CommConnEntry, pipe_list);
+		if (entry->pipe_cnt < entry->pipe_depth)
+		{
+			pthread_mutex_lock(&entry->mutex);
+			if (entry->state == CONN_STATE_RECEIVING &&
+				entry->pipe_cnt < entry->pipe_depth)
+			{
+				i = (entry->pipe_head + entry->pipe_cnt) % COMM_PIPELINE_MAX;
+				entry->pipeline[i] = session;
+				entry->pipe_cnt++;
+				break;
+			}
+
+			pthread_mutex_unlock(&entry->mutex);
+		}
+
+		entry = NULL;
 	}
 
-	errno_bak = errno;
-	session->target = target;
-	session->out = NULL;
-	session->in = NULL;
-	ret = this->request_idle_conn(session, target);
-	while (ret < 0)
+	pthread_mutex_unlock(&target->mutex);
+	if (entry)
 	{
-		entry = this->launch_conn(session, target);
-		if (entry)
+		session->peer = entry->peer;
+		session->conn = entry->conn;
+		session->seq = entry->seq++;
+		session->out = session->message_out();
+		if (session->out)
+			cnt = Communicator::encode_message(session, vectors);
+
+		if (cnt >= 0)
 		{
-			session->conn = entry->conn;
-			session->seq = entry->seq++;
-			data.operation = PD_OP_CONNECT;
-			data.fd = entry->sockfd;
-			data.context = entry;
-			if (mpoller_add(&data, target->connect_timeout, this->mpoller) >= 0)
-				break;
+			if (this->write_message(session, vectors, cnt, entry) < 0)
+			{
+				entry->error = errno;
+				mpoller_del(entry->sockfd, this->mpoller);
+				entry->state = CONN_STATE_ERROR;
+			}
 
-			this->release_conn(entry);
+			ret = 0;
+		}
+		else
+		{
+			/* A bad message fails its own request, not the ones before
+			 * it on the connection. It is the last one. */
+			entry->pipe_cnt--;
 		}
 
-		session->conn = NULL;
-		session->seq = 0;
-		return -1;
+		pthread_mutex_unlock(&entry->mutex);
 	}
+	else
+		errno = ENOENT;
 
-	errno = errno_bak;
-	return 0;
+	return ret;
+}
+
+int Communicator::pipe_next(struct CommConnEntry *entry, int closing)
+{
+	CommTarget *target = entry->target;
+	int more;
+
+	pthread_mutex_lock(&target->mutex);
+	pthread_mutex_lock(&entry->mutex);
+	if (++entry->pipe_head == COMM_PIPELINE_MAX)
+		entry->pipe_head = 0;
+
+	entry->pipe_cnt--;
+	more = entry->pipe_cnt > 0;
+	if (more)
+	{
+		entry->session = entry->pipeline[entry->pipe_head];
+		if (closing)
+		{
+			/* Peer closes after this response. Let the rest retry. */
+			entry->error = ECONNRESET;
+			entry->state = CONN_STATE_ERROR;
+		}
+	}
+
+	if ((!more || closing) && !list_empty(&entry->pipe_list))
+		list_del_init(&entry->pipe_list);
+
+	pthread_mutex_unlock(&entry->mutex);
+	pthread_mutex_unlock(&target->mutex);
+	return more;
+}
+
+void Communicator::fail_pipeline(struct CommConnEntry *entry, int state, int error)
+{
+	CommSession *session;
+
+	while (entry->pipe_cnt > 1)
+	{
+		if (++entry->pipe_head == COMM_PIPELINE_MAX)
+			entry->pipe_head = 0;
+
+		entry->pipe_cnt--;
+		session = entry->pipeline[entry->pipe_head];
+		entry->target->release();
+		this->handle_session(session, state, error);
+	}
+}
+
+void Communicator::mux_insert(CommSession *session, struct CommConnEntry *entry)
+{
+	struct rb_node **p = &entry->mux_tree.rb_node;
+	struct rb_node *parent = NULL;
+	CommSession *cur;
+
+	while (*p)
+	{
+		parent = *p;
+		cur = rb_entry(*p, CommSession, mux_rb);
+		if (session->seq < cur->seq)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&session->mux_rb, parent, p);
+	rb_insert_color(&session->mux_rb, &entry->mux_tree);
+	entry->mux_cnt++;
+}
+
+int Communicator::mux_route(struct CommMuxMessage *mux)
+{
+	struct CommConnEntry *entry = mux->entry;
+	CommSession *session = NULL;
+	struct rb_node *p;
+	long long seq;
+	int ret = -1;
+
+	pthread_mutex_lock(&entry->mutex);
+	p = entry->mux_tree.rb_node;
+	if (p)
+	{
+		session = rb_entry(rb_first(&entry->mux_tree), CommSession, mux_rb);
+		ret = session->reply_seq(mux->head, mux->head_len, &seq);
+		session = NULL;
+		while (ret > 0 && p)
+		{
+			session = rb_entry(p, CommSession, mux_rb);
+			if (seq < session->seq)
+				p = p->rb_left;
+			else if (seq > session->seq)
+				p = p->rb_right;
+			else
+				break;
+		}
+
+		if (ret > 0 && p)
+			rb_erase(p, &entry->mux_tree);
+		else if (ret > 0)
+			ret = -1;
+	}
+
+	pthread_mutex_unlock(&entry->mutex);
+	if (ret > 0)
+	{
+		mux->session = session;
+		session->set_phase_time(CS_PHASE_FIRST_BYTE);
+		session->in = session->message_in();
+		if (session->in)
+		{
+			session->in->entry = entry;
+			session->in->session = session;
+			mux->in = session->in;
+		}
+		else
+			ret = -1;
+	}
+	else if (ret < 0)
+		errno = EBADMSG;
+
+	return ret;
+}
+
+void Communicator::mux_done(struct CommMuxMessage *mux)
+{
+	struct CommConnEntry *entry = mux->entry;
+	CommTarget *target = entry->target;
+	int timeout;
+
+	/* The connection stays in poller, so the result takes one more ref. */
+	__sync_add_and_fetch(&entry->ref, 1);
+	pthread_mutex_lock(&target->mutex);
+	pthread_mutex_lock(&entry->mutex);
+	if (--entry->mux_cnt == 0)
+	{
+		timeout = mux->session->keep_alive_timeout();
+		if (timeout == 0)
+		{
+			list_del_init(&entry->pipe_list);
+			entry->state = CONN_STATE_CLOSING;
+		}
+	}
+	else
+		timeout = target->response_timeout;
+
+	pthread_mutex_unlock(&entry->mutex);
+	pthread_mutex_unlock(&target->mutex);
+	if (timeout == 0)
+		mpoller_del(entry->sockfd, entry->mpoller);
+	else
+		mpoller_set_timeout(entry->sockfd, timeout, entry->mpoller);
+}
+
+int Communicator::mux_append(const void *buf, size_t *size, poller_message_t *msg)
+{
+	struct CommMuxMessage *mux = (struct CommMuxMessage *)msg;
+	size_t len;
+	size_t n;
+	int ret;
+
+	if (mux->in)
+		ret = Communicator::append_message(mux->in, buf, size);
+	else
+	{
+		/* Buffer the head of a reply until we know its session. */
+		n = COMM_MUX_HEAD_MAX - mux->head_len;
+		if (n > *size)
+			n = *size;
+
+		memcpy(mux->head + mux->head_len, buf, n);
+		mux->head_len += n;
+		*size = n;
+		ret = Communicator::mux_route(mux);
+		if (ret == 0 && mux->head_len == COMM_MUX_HEAD_MAX)
+		{
+			errno = EBADMSG;
+			return -1;
+		}
+
+		if (ret <= 0)
+			return ret;
+
+		len = mux->head_len;
+		ret = Communicator::append_message(mux->in, mux->head, &len);
+		if (ret > 0)
+		{
+			/* Bytes before this call are consumed already. */
+			if (mux->head_len - len > n)
+			{
+				errno = EBADMSG;
+				return -1;
+			}
+
+			*size = n - (mux->head_len - len);
+		}
+	}
+
+	if (ret > 0)
+		Communicator::mux_done(mux);
+
+	return ret;
+}
+
+poller_message_t *Communicator::create_mux_message(struct CommConnEntry *entry)
+{
+	struct CommMuxMessage *mux;
+
+	if (entry->state != CONN_STATE_RECEIVING)
+	{
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	mux = (struct CommMuxMessage *)malloc(sizeof (struct CommMuxMessage));
+	if (mux)
+	{
+		mux->base.append = Communicator::mux_append;
+		mux->entry = entry;
+		mux->session = NULL;
+		mux->in = NULL;
+		mux->head_len = 0;
+	}
+
+	return (poller_message_t *)mux;
+}
+
+void Communicator::fail_mux(struct CommConnEntry *entry, CommSession *session,
+							int state, int error)
+{
+	CommTarget *target = entry->target;
+	struct rb_root root;
+	struct rb_node *p;
+
+	pthread_mutex_lock(&target->mutex);
+	pthread_mutex_lock(&entry->mutex);
+	if (!list_empty(&entry->pipe_list))
+		list_del_init(&entry->pipe_list);
+
+	if (entry->state == CONN_STATE_ERROR)
+	{
+		state = CS_STATE_ERROR;
+		error = entry->error;
+	}
+
+	entry->state = CONN_STATE_CLOSING;
+	root = entry->mux_tree;
+	entry->mux_tree.rb_node = NULL;
+	entry->mux_cnt = 0;
+	pthread_mutex_unlock(&entry->mutex);
+	pthread_mutex_unlock(&target->mutex);
+
+	if (session)
+	{
+		target->release();
+		this->handle_session(session, state, error);
+	}
+
+	while ((p = rb_first(&root)) != NULL)
+	{
+		rb_erase(p, &root);
+		session = rb_entry(p, CommSession, mux_rb);
+		target->release();
+		this->handle_session(session, state, error);
+	}
+}
+
+void Communicator::handle_mux_reply(struct poller_result *res)
+{
+	struct CommConnEntry *entry = (struct CommConnEntry *)res->data.context;
+	struct CommMuxMessage *mux = (struct CommMuxMessage *)res->data.message;
+	CommTarget *target = entry->target;
+	CommSession *session = NULL;
+	int state;
+
+	if (mux)
+	{
+		session = mux->session;
+		free(mux);
+	}
+
+	switch (res->state)
+	{
+	case PR_ST_SUCCESS:
+		target->release();
+		this->handle_session(session, CS_STATE_SUCCESS, 0);
+		break;
+
+	case PR_ST_FINISHED:
+		res->error = ECONNRESET;
+		if (1)
+	case PR_ST_ERROR:
+			state = CS_STATE_ERROR;
+		else
+	case PR_ST_DELETED:
+	case PR_ST_STOPPED:
+			state = CS_STATE_STOPPED;
+
+		this->fail_mux(entry, session, state, res->error);
+		break;
+	}
+
+	if (__sync_sub_and_fetch(&entry->ref, 1) == 0)
+		this->release_conn(entry);
+}
+
+void Communicator::handle_mux_connect(struct poller_result *res)
+{
+	struct CommConnEntry *entry = (struct CommConnEntry *)res->data.context;
+	CommTarget *target = entry->target;
+	struct iovec vectors[ENCODE_IOV_MAX];
+	CommSession *session;
+	struct rb_node *p;
+	long long seq;
+	int error;
+	int state;
+	int cnt;
+	int ret;
+
+	switch (res->state)
+	{
+	case PR_ST_FINISHED:
+		res->data.operation = PD_OP_READ;
+		res->data.message = NULL;
+		ret = 0;
+		pthread_mutex_lock(&entry->mutex);
+		/* Send everyone who joined while we were connecting. */
+		p = rb_first(&entry->mux_tree);
+		while (p)
+		{
+			session = rb_entry(p, CommSession, mux_rb);
+			cnt = -1;
+			session->out = session->message_out();
+			if (session->out)
+				cnt = Communicator::encode_message(session, vectors);
+
+			if (cnt < 0)
+			{
+				/* A bad message fails its own session only. Others may
+				 * join meanwhile, and are still sent from here. */
+				error = errno;
+				seq = session->seq;
+				rb_erase(p, &entry->mux_tree);
+				entry->mux_cnt--;
+				entry->state = CONN_STATE_CONNECTING;
+				pthread_mutex_unlock(&entry->mutex);
+				target->release();
+				this->handle_session(session, CS_STATE_ERROR, error);
+				pthread_mutex_lock(&entry->mutex);
+				p = rb_first(&entry->mux_tree);
+				while (p && rb_entry(p, CommSession, mux_rb)->seq < seq)
+					p = rb_next(p);
+
+				continue;
+			}
+
+			ret = this->write_message(session, vectors, cnt, entry);
+			if (ret < 0)
+				break;
+
+			p = rb_next(p);
+		}
+
+		if (ret == 0)
+			ret = mpoller_add(&res->data, target->response_timeout, this->mpoller);
+
+		if (ret >= 0)
+		{
+			if (entry->wblocked)
+				mpoller_flush_writable(&entry->write_flush, entry->sockfd,
+									   this->mpoller);
+
+			entry->state = CONN_STATE_RECEIVING;
+			if (this->stop_flag)
+				mpoller_del(res->data.fd, this->mpoller);
+		}
+
+		pthread_mutex_unlock(&entry->mutex);
+		if (ret >= 0)
+			break;
+
+		res->error = errno;
+		if (1)
+	case PR_ST_ERROR:
+			state = CS_STATE_ERROR;
+		else
+	case PR_ST_DELETED:
+	case PR_ST_STOPPED:
+			state = CS_STATE_STOPPED;
+
+		this->fail_mux(entry, NULL, state, res->error);
+		this->release_conn(entry);
+		break;
+	}
+}
+
+int Communicator::request_mux_conn(CommSession *session, CommTarget *target)
+{
+	struct CommConnEntry *entry = NULL;
+	struct iovec vectors[ENCODE_IOV_MAX];
+	struct list_head *pos;
+	int cnt = -1;
+	int ret = 0;
+
+	pthread_mutex_lock(&target->mutex);
+	list_for_each(pos, &target->mux_list)
+	{
+		entry = list_entry(pos, struct CommConnEntry, pipe_list);
+		if (entry->mux_cnt < entry->mux_max)
+		{
+			pthread_mutex_lock(&entry->mutex);
+			if ((entry->state == CONN_STATE_CONNECTING ||
+				 entry->state == CONN_STATE_RECEIVING) &&
+				entry->mux_cnt < entry->mux_max)
+			{
+				session->conn = entry->conn;
+				session->seq = entry->seq++;
+				Communicator::mux_insert(session, entry);
+				break;
+			}
+
+			pthread_mutex_unlock(&entry->mutex);
+		}
+
+		entry = NULL;
+	}
+
+	pthread_mutex_unlock(&target->mutex);
+	if (!entry)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* A connecting one sends for us when connected. */
+	if (entry->state == CONN_STATE_RECEIVING)
+	{
+		session->out = session->message_out();
+		if (session->out)
+			cnt = Communicator::encode_message(session, vectors);
+
+		if (cnt >= 0)
+		{
+			if (entry->mux_cnt == 1)
+				mpoller_set_timeout(entry->sockfd, target->response_timeout, this->mpoller);
+
+			if (this->write_message(session, vectors, cnt, entry) < 0)
+			{
+				entry->error = errno;
+				mpoller_del(entry->sockfd, this->mpoller);
+				entry->state = CONN_STATE_ERROR;
+			}
+		}
+		else
+		{
+			/* A bad message fails its own request, not the others on
+			 * the connection. */
+			rb_erase(&session->mux_rb, &entry->mux_tree);
+			entry->mux_cnt--;
+			ret = -1;
+		}
+	}
+
+	pthread_mutex_unlock(&entry->mutex);
+	return ret;
+}
+
+int Communicator::request_mux(CommSession *session, CommTarget *target)
+{
+	struct CommConnEntry *entry;
+	struct poller_data data;
+	int ret;
+
+	if (this->request_mux_conn(session, target) >= 0)
+		return 0;
+
+	/* Its message failed. A new connection wouldn't help. */
+	if (errno == ENOENT)
+		entry = this->launch_conn(session, target, target);
+	else
+		entry = NULL;
+
+	if (entry)
+	{
+		entry->mux_max = session->max_multiplex();
+		session->conn = entry->conn;
+		session->seq = entry->seq++;
+		Communicator::mux_insert(session, entry);
+		data.operation = PD_OP_CONNECT;
+		data.fd = entry->sockfd;
+		data.ssl = NULL;
+		data.context = entry;
+		pthread_mutex_lock(&target->mutex);
+		ret = mpoller_add(&data, target->connect_timeout, this->mpoller);
+		if (ret >= 0)
+			list_add_tail(&entry->pipe_list, &target->mux_list);
+
+		pthread_mutex_unlock(&target->mutex);
+		if (ret >= 0)
+			return 0;
+
+		this->release_conn(entry);
+	}
+
+	session->conn = NULL;
+	session->seq = 0;
+	return -1;
+}
+
+int Communicator::request(CommSession *session, CommTarget *target)
+{
+	/* Counted before the check, so that drain() can't miss it. */
+	__sync_add_and_fetch(&this->inflight, 1);
+	if (!this->draining)
+	{
+		__sync_add_and_fetch(&target->inflight, 1);
+		if (this->request_session(session, target) >= 0)
+			return 0;
+
+		__sync_sub_and_fetch(&target->inflight, 1);
+	}
+	else
+		errno = ESHUTDOWN;
+
+	this->release_inflight();
+	return -1;
+}
+
+void Communicator::release_inflight()
+{
+	int errno_bak = errno;
+
+	if (__sync_sub_and_fetch(&this->inflight, 1) == 0 && this->draining)
+		this->drain_signal();
+
+	errno = errno_bak;
+}
+
+void Communicator::handle_session(CommSession *session, int state, int error)
+{
+	/* The target may be gone after handle(), this communicator not. */
+	__sync_sub_and_fetch(&session->target->inflight, 1);
+	session->set_phase_time(CS_PHASE_COMPLETE);
+	session->handle(state, error);
+	this->release_inflight();
+}
+
+int Communicator::request_session(CommSession *session, CommTarget *target)
+{
+	struct CommConnEntry *entry;
+	struct poller_data data;
+	int errno_bak;
+	int ret;
+
+	if (session->passive)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	errno_bak = errno;
+	session->clear_phase_time(CS_PHASE_ACQUIRE);
+	session->set_phase_time(CS_PHASE_ACQUIRE);
+	session->target = target;
+	session->peer = target;
+	session->race_lost = 0;
+	session->out = NULL;
+	session->in = NULL;
+	/* Over TLS, a multiplexed session simply gets a connection of its own. */
+	if (session->max_multiplex() > 0 && !target->ssl_ctx)
+	{
+		ret = this->request_mux(session, target);
+		if (ret >= 0)
+			errno = errno_bak;
+
+		return ret;
+	}
+
+	ret = this->request_idle_conn(session, target);
+	if (ret < 0 && session->max_pipeline() > 1 && !target->ssl_ctx)
+	{
+		ret = this->request_pipe_conn(session, target);
+		/* Its message failed. A new connection wouldn't help. */
+		if (ret < 0 && errno != ENOENT)
+			return -1;
+	}
+
+	if (ret < 0 && target->race_next && target->race_delay > 0)
+		ret = this->request_race(session, target);
+
+	while (ret < 0)
+	{
+		entry = this->launch_conn(session, target, target);
+		if (entry)
+		{
+			session->conn = entry->conn;
+			session->seq = entry->seq++;
+			data.operation = PD_OP_CONNECT;
+			data.fd = entry->sockfd;
+			data.ssl = NULL;
+			data.context = entry;
+			if (mpoller_add(&data, target->connect_timeout, this->mpoller) >= 0)
+				break;
+
+			this->release_conn(entry);
+		}
+
+		session->conn = NULL;
+		session->seq = 0;
+		return -1;
+	}
+
+	errno = errno_bak;
+	return 0;
+}
+
+/* Refill the pool no sooner than PREWARM_BACKOFF_MIN ms after a failure,
+ * and double that on each failure in a row, up to PREWARM_BACKOFF_MAX. */
+#define PREWARM_BACKOFF_MIN		100
+#define PREWARM_BACKOFF_MAX		(30 * 1000)
+
+class CommPrewarmTimer : public SleepSession
+{
+private:
+	virtual int duration(struct timespec *value)
+	{
+		value->tv_sec = this->delay / 1000;
+		value->tv_nsec = this->delay % 1000 * 1000000;
+		return 0;
+	}
+
+	virtual void handle(int state, int /* error */)
+	{
+		this->comm->handle_prewarm_timer(this->target, state);
+		delete this;
+	}
+
+public:
+	Communicator *comm;
+	CommTarget *target;
+	int delay;
+
+public:
+	CommPrewarmTimer(Communicator *comm, CommTarget *target, int delay)
+	{
+		this->comm = comm;
+		this->target = target;
+		this->delay = delay;
+	}
+};
+
+class CommConnRace : public SleepSession
+{
+private:
+	virtual int duration(struct timespec *value)
+	{
+		value->tv_sec = this->target->race_delay / 1000;
+		value->tv_nsec = this->target->race_delay % 1000 * 1000000;
+		return 0;
+	}
+
+	virtual void handle(int state, int /* error */)
+	{
+		this->comm->handle_race_timer(this, state);
+	}
+
+public:
+	/* Take the next address in the ring, NULL when back to the start. */
+	CommTarget *take_next()
+	{
+		CommTarget *peer = this->next;
+
+		this->next = peer->race_next;
+		if (this->next == this->target)
+			this->next = NULL;
+
+		return peer;
+	}
+
+public:
+	Communicator *comm;
+	CommSession *session;
+	CommTarget *target;
+	CommTarget *next;
+	struct list_head attempt_list;
+	int attempts;
+	int done;
+	int ref;
+	pthread_mutex_t mutex;
+
+public:
+	CommConnRace(Communicator *comm, CommSession *session, CommTarget *target) :
+		mutex(PTHREAD_MUTEX_INITIALIZER)
+	{
+		this->comm = comm;
+		this->session = session;
+		this->target = target;
+		this->next = target->race_next;
+		INIT_LIST_HEAD(&this->attempt_list);
+		this->attempts = 0;
+		this->done = 0;
+		this->ref = 1;
+	}
+};
+
+/* Start an attempt to 'peer', or to the addresses after it if that fails
+ * at once (unreachable network etc.). Called with race->mutex held. */
+int Communicator::launch_race(CommConnRace *race, CommTarget *peer)
+{
+	struct CommConnEntry *entry;
+	struct poller_data data;
+
+	while (1)
+	{
+		entry = this->launch_conn(race->session, race->target, peer);
+		if (entry)
+		{
+			entry->race = race;
+			data.operation = PD_OP_CONNECT;
+			data.fd = entry->sockfd;
+			data.ssl = NULL;
+			data.context = entry;
+			if (mpoller_add(&data, peer->connect_timeout, this->mpoller) >= 0)
+			{
+				list_add_tail(&entry->list, &race->attempt_list);
+				race->attempts++;
+				race->ref++;
+				return 0;
+			}
+
+			this->release_conn(entry);
+		}
+
+		if (!race->next)
+			return -1;
+
+		peer = race->take_next();
+	}
+}
+
+int Communicator::request_race(CommSession *session, CommTarget *target)
+{
+	CommConnRace *race = new CommConnRace(this, session, target);
+	int last;
+	int ret;
+
+	pthread_mutex_lock(&race->mutex);
+	ret = this->launch_race(race, target);
+	if (ret >= 0)
+	{
+		/* The next address starts when this timer fires. */
+		race->ref++;
+		if (this->sleep(race) < 0)
+			race->ref--;
+	}
+
+	last = (--race->ref == 0);
+	pthread_mutex_unlock(&race->mutex);
+	if (last)
+		delete race;
+
+	return ret;
+}
+
+void Communicator::handle_race_timer(CommConnRace *race, int state)
+{
+	int last;
+
+	pthread_mutex_lock(&race->mutex);
+	if (!race->done && race->next && state == SS_STATE_COMPLETE &&
+		!this->stop_flag)
+	{
+		this->launch_race(race, race->take_next());
+		if (race->next)
+		{
+			race->ref++;
+			if (this->sleep(race) < 0)
+				race->ref--;
+		}
+	}
+
+	last = (--race->ref == 0);
+	pthread_mutex_unlock(&race->mutex);
+	if (last)
+		delete race;
+}
+
+/* Return 1 if this attempt goes on as the session's connection. */
+int Communicator::handle_race_result(struct poller_result *res)
+{
+	struct CommConnEntry *entry = (struct CommConnEntry *)res->data.context;
+	CommConnRace *race = entry->race;
+	int finished = (res->state == PR_ST_FINISHED);
+	struct CommConnEntry *other;
+	struct list_head *pos;
+	int last;
+	int ret = 0;
+
+	pthread_mutex_lock(&race->mutex);
+	/* TCP is up, but it doesn't win before TLS is up, too. */
+	if (finished && entry->ssl && res->data.operation == PD_OP_CONNECT &&
+		!race->done)
+	{
+		pthread_mutex_unlock(&race->mutex);
+		return 1;
+	}
+
+	list_del(&entry->list);
+	race->attempts--;
+	if (!race->done)
+	{
+		/* A failed attempt starts the next one at once. */
+		if (!finished && race->next && !this->stop_flag)
+			this->launch_race(race, race->take_next());
+
+		if (finished || race->attempts == 0)
+		{
+			race->done = 1;
+			entry->race = NULL;
+			entry->session->peer = entry->peer;
+			entry->session->race_lost = (entry->peer != race->target);
+			entry->session->conn = entry->conn;
+			entry->session->seq = entry->seq++;
+			ret = 1;
+			/* Cancel the losers. */
+			list_for_each(pos, &race->attempt_list)
+			{
+				other = list_entry(pos, struct CommConnEntry, list);
+				mpoller_del(other->sockfd, this->mpoller);
+			}
+		}
+	}
+
+	last = (--race->ref == 0);
+	pthread_mutex_unlock(&race->mutex);
+	if (last)
+		delete race;
+
+	if (!ret)
+		this->release_conn(entry);
+
+	return ret;
+}
+
+int Communicator::prewarm(CommTarget *target)
+{
+	struct CommConnEntry *entry;
+	struct poller_data data;
+	size_t n = 0;
+
+	if (this->draining)
+		return 0;
+
+	pthread_mutex_lock(&target->mutex);
+	/* While backing off, the timer refills. */
+	if (target->idle_cnt + target->warming_cnt < target->min_idle &&
+		!target->prewarm_timer)
+	{
+		n = target->min_idle - target->idle_cnt - target->warming_cnt;
+		target->warming_cnt += n;
+	}
+
+	pthread_mutex_unlock(&target->mutex);
+	while (n > 0)
+	{
+		entry = this->launch_conn(NULL, target, target);
+		if (!entry)
+			break;
+
+		data.operation = PD_OP_CONNECT;
+		data.fd = entry->sockfd;
+		data.ssl = NULL;
+		data.context = entry;
+		if (mpoller_add(&data, target->connect_timeout, this->mpoller) < 0)
+		{
+			this->release_conn(entry);
+			break;
+		}
+
+		n--;
+	}
+
+	if (n == 0)
+		return 0;
+
+	pthread_mutex_lock(&target->mutex);
+	target->warming_cnt -= n;
+	this->prewarm_later(target);
+	pthread_mutex_unlock(&target->mutex);
+	return -1;
+}
+
+/* Called with target->mutex held. Failures while the timer is on count
+ * as one. */
+void Communicator::prewarm_later(CommTarget *target)
+{
+	CommPrewarmTimer *timer;
+	int delay = target->prewarm_backoff;
+
+	if (target->prewarm_timer || this->draining || this->stop_flag)
+		return;
+
+	if (delay == 0)
+		delay = PREWARM_BACKOFF_MIN;
+	else if (delay < PREWARM_BACKOFF_MAX / 2)
+		delay *= 2;
+	else
+		delay = PREWARM_BACKOFF_MAX;
+
+	target->prewarm_backoff = delay;
+	timer = new CommPrewarmTimer(this, target, delay);
+	target->prewarm_timer = 1;
+	if (this->sleep(timer) < 0)
+	{
+		target->prewarm_timer = 0;
+		delete timer;
+	}
+}
+
+void Communicator::handle_prewarm_timer(CommTarget *target, int state)
+{
+	/* Stopped: the target may be gone already. */
+	if (state != SS_STATE_COMPLETE)
+		return;
+
+	pthread_mutex_lock(&target->mutex);
+	target->prewarm_timer = 0;
+	pthread_mutex_unlock(&target->mutex);
+	if (!this->stop_flag)
+		this->prewarm(target);
 }
 
 int Communicator::sleep(SleepSession *session)
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <errno.h>
 #include <time.h>
 #include <stddef.h>
 #include <pthread.h>
@@ -32,6 +33,26 @@ public:
         *addrlen = this->addrlen;
     }
 
+    /* Talk TLS to this target. Call after init() and before any request. */
+    void set_ssl(SSL_CTX *ssl_ctx, int ssl_connect_timeout)
+    {
+        this->ssl_ctx = ssl_ctx;
+        this->ssl_connect_timeout = ssl_connect_timeout;
+    }
+
+    SSL_CTX *get_ssl_ctx() const { return this->ssl_ctx; }
+
+    /* Let every target using 'ssl_ctx' keep its last TLS session, so that
+     * reconnects resume instead of doing a full handshake. */
+    static void enable_ssl_session_cache(SSL_CTX *ssl_ctx);
+
+    /* Requests on this target not handled yet. */
+    size_t get_inflight() const { return this->inflight; }
+
+    /* Stop reading a connection while more than 'size' received bytes are
+     * not consumed by its message. 0 (default) for no limit. */
+    void set_max_receive_buffer(size_t size) { this->max_receive_buffer = size; }
+
 private:
     virtual int create_connect_fd()
     {
@@ -43,23 +64,66 @@ private:
         return new CommConnection;
     }
 
+    /* Per connection SSL settings, such as SNI. */
+    virtual int init_ssl(SSL *ssl) { return 0; }
+
+    static int ssl_new_session(SSL *ssl, SSL_SESSION *session);
+
 public:
     virtual void release() {}
 
+protected:
+    /* Number of idle connections the communicator keeps ready in background.
+     * One idle longer than 'keep_alive_timeout' ms (-1 for no limit) is
+     * closed and replaced. */
+    void set_min_idle(size_t min_idle, int keep_alive_timeout)
+    {
+        this->min_idle = min_idle;
+        this->keep_alive_timeout = keep_alive_timeout;
+    }
+
+    /* Happy eyeballs (RFC 8305). A new connection also races the targets
+     * linked by 'next' (a ring back to this one), starting one more every
+     * 'delay' ms, and the first that connects wins. */
+    void set_race(CommTarget *next, int delay)
+    {
+        this->race_next = next;
+        this->race_delay = delay;
+    }
+
 private:
     struct sockaddr *addr;
     socklen_t addrlen;
     int connect_timeout;
     int response_timeout;
+    int ssl_connect_timeout;
+    SSL_CTX *ssl_ctx;
+    SSL_SESSION *ssl_session;
+    CommTarget *race_next;
+    int race_delay;
+    size_t max_receive_buffer;
+    size_t inflight;
 
 private:
     struct list_head idle_list;
+    struct list_head pipe_list;
+    struct list_head mux_list;
+    size_t idle_cnt;
+    size_t warming_cnt;
+    size_t min_idle;
+    int keep_alive_timeout;
+    /* Delay before refilling the pool after the peer closed or refused a
+     * connection. Doubles on each failure, 0 after a good one. */
+    int prewarm_backoff;
+    int prewarm_timer;
     pthread_mutex_t mutex;
 
 public:
     virtual ~CommTarget() {}
     friend class CommSession;
     friend class Communicator;
+    friend class CommConnRace;
+    friend class CommPrewarmTimer;
 };
 
 class CommMessageOut
@@ -71,6 +135,12 @@ public:
     friend class Communicator;
 };
 
+class CommSession;
+
+/* Returned by CommMessageIn::append(): all data is taken, the message is
+ * not complete, and the connection is not read again until resume(). */
+#define CM_APPEND_PAUSE		(-2)
+
 class CommMessageIn : private poller_message_t
 {
 private:
@@ -79,8 +149,19 @@ protected:
     /* Send small packet while receiving. Call only in append(). */
 	int feedback(const char *buf, size_t size);
 
+public:
+	/* A streaming message hands received data to its user. Tell that
+	 * 'size' bytes are gone, so they no longer count toward the receive
+	 * buffer limits. Call only before the message completes. */
+	void consume(size_t size);
+
+	/* Read again after append() returned CM_APPEND_PAUSE. Call only
+	 * before the message completes. */
+	int resume();
+
 private:
     struct CommConnEntry *entry;
+    CommSession *session;
 public:
 	virtual ~CommMessageIn() { }
 	friend class Communicator;
@@ -91,6 +172,17 @@ public:
 #define CS_STATE_STOPPED	2
 #define CS_STATE_TOREPLY	3	/* for service session only. */
 
+/* Phases of a client session, stamped with CLOCK_MONOTONIC. */
+#define CS_PHASE_START			0	/* waiting for a target (CommScheduler) */
+#define CS_PHASE_ACQUIRE		1	/* got a target, requesting a connection */
+#define CS_PHASE_CONNECT_START	2	/* only when a new connection is made */
+#define CS_PHASE_CONNECT_END	3
+#define CS_PHASE_WRITE_START	4
+#define CS_PHASE_WRITE_END		5	/* queued, if deferred or the socket is full */
+#define CS_PHASE_FIRST_BYTE		6
+#define CS_PHASE_COMPLETE		7
+#define CS_PHASE_MAX			8
+
 class CommSession
 {
 private:
@@ -100,6 +192,26 @@ private:
     virtual int receive_timeout() { return -1; }
     virtual int keep_alive_timeout() { return 0; }
     virtual int first_timeout() { return 0; } /* for client session only. */
+    /* Max requests in flight on one connection. Responses must arrive in
+     * request order. For client session only. */
+    virtual int max_pipeline() { return 1; }
+    /* Multiplexed client session: many sessions share one connection and
+     * replies are routed by sequence id (get_seq()), in any order. Return
+     * the max sessions on one connection, or 0 for a normal session. */
+    virtual int max_multiplex() { return 0; }
+    /* For multiplexed session only. Find the sequence id of the reply that
+     * starts at 'buf'. Return 1 if found, 0 if more data is needed, -1 on
+     * error. May be called on any session sharing the connection. */
+    virtual int reply_seq(const void *buf, size_t size, long long *seq)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    /* Return non-zero to queue the request on its connection instead of
+     * writing it at once. The poller writes everything queued on a
+     * connection with one write() per loop iteration, and the rest when
+     * the socket can take more. Not for TLS. */
+    virtual int deferred_flush() { return 0; }
     virtual void handle(int state, int error) = 0;
 
 protected:
@@ -108,23 +220,60 @@ protected:
 	CommMessageOut *get_message_out() const { return this->out; }
 	CommMessageIn *get_message_in() const { return this->in; }
 	long long get_seq() const { return this->seq; }
+	/* The target whose address we are connected to. Not get_target() if
+	 * a racing connect to another address won. */
+	CommTarget *get_peer_target() const { return this->peer; }
+	/* The last request ran a connect race, and get_target() lost it. Not
+	 * set for a connection reused after a race. */
+	bool lost_connect_race() const { return this->race_lost; }
+
+public:
+	/* Time of a phase (CS_PHASE_*) of the last request, or NULL if the
+	 * phase was not reached. Call only in handle(). */
+	const struct timespec *get_phase_time(int phase) const
+	{
+		const struct timespec *ts = &this->phase_time[phase];
+		return ts->tv_nsec >= 0 ? ts : NULL;
+	}
+
+private:
+	void set_phase_time(int phase)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &this->phase_time[phase]);
+	}
+
+	void clear_phase_time(int from)
+	{
+		for (int i = from; i < CS_PHASE_MAX; i++)
+			this->phase_time[i].tv_nsec = -1;
+	}
 
 private:
     CommTarget *target;
+    CommTarget *peer;
+    int race_lost;
     CommConnection *conn;
     CommMessageIn *in;
     CommMessageOut *out;
     long long seq;
+    struct rb_node mux_rb;
 
 private:
     struct timespec begin_time;
     int timeout;
     int passive;
+    struct timespec phase_time[CS_PHASE_MAX];
 
 public:
-    CommSession() { this->passive = 0; }
+    CommSession()
+    {
+        this->passive = 0;
+        this->race_lost = 0;
+        this->clear_phase_time(CS_PHASE_START);
+    }
     virtual ~CommSession();
     friend class Communicator;
+    friend class CommScheduler;
 };
 
 #define SS_STATE_COMPLETE	0
@@ -144,6 +293,9 @@ public:
 
 # include "IOService_linux.h"
 
+class CommConnRace;
+class CommPrewarmTimer;
+
 class Communicator
 {
 public:
@@ -154,31 +306,134 @@ public:
 
 	int sleep(SleepSession *session);
 
+	/* Open connections until the target has 'min_idle' idle ones. */
+	int prewarm(CommTarget *target);
+
+	/* Reject new requests (ESHUTDOWN), wait for the in-flight ones, then
+	 * close connections with a FIN and wait for them to go. 'timeout' in
+	 * milliseconds, -1 for no limit. Returns -1 with ETIMEDOUT if time ran
+	 * out first. Call before deinit(). */
+	int drain(int timeout);
+
+	/* Requests not handled yet, on all targets. */
+	size_t get_inflight() const { return this->inflight; }
+
+	/* Stop reading connections while more than 'size' received bytes,
+	 * summed over all connections, are not consumed. 0 for no limit. */
+	static void set_max_receive_buffer(size_t size);
+
 private:
 	poller_queue_t *queue;
 	mpoller_t *mpoller;
 	thrdpool_t *thrdpool;
 	int stop_flag;
+	int draining;
+	size_t inflight;
+	/* Client connections, a list for each poller thread, for drain(). */
+	struct CommConnList *conn_lists;
+	size_t conns;
+	pthread_mutex_t drain_mutex;
+	pthread_cond_t drain_cond;
 
 private:
 	int create_poller(size_t poller_threads);
 
 	int create_handler_threads(size_t handler_threads);
 
+	int create_conn_lists(size_t n);
+
+	void destroy_conn_lists();
+
+	void drain_signal();
+
+	void release_inflight();
+
+	int drain_wait(size_t *cnt, const struct timespec *deadline);
+
 	int nonblock_connect(CommTarget *target);
 
-	struct CommConnEntry *launch_conn(CommSession *session, CommTarget *target);
+	friend class CommConnRace;
+	friend class CommPrewarmTimer;
+
+	static SSL *create_ssl(int sockfd, CommTarget *target);
+
+	/* Connect to the address of 'peer' for 'target'. */
+	struct CommConnEntry *launch_conn(CommSession *session, CommTarget *target,
+									  CommTarget *peer);
+
+	int request_session(CommSession *session, CommTarget *target);
+
+	void handle_session(CommSession *session, int state, int error);
+
+	int request_race(CommSession *session, CommTarget *target);
+
+	int launch_race(CommConnRace *race, CommTarget *peer);
+
+	void handle_race_timer(CommConnRace *race, int state);
 
-	void release_conn(struct CommConnEntry *entry);
+	int handle_race_result(struct poller_result *res);
+
+	static void release_conn(struct CommConnEntry *entry);
+
+	static int append_message(CommMessageIn *in, const void *buf, size_t *size);
+
+	static int buffer_vectors(const struct iovec vectors[], int cnt,
+							  struct CommConnEntry *entry);
+
+	static void write_buffered(struct CommConnEntry *entry);
+
+	static void write_conn(struct poller_flush *flush);
 
 	int send_message_sync(struct iovec vectors[], int cnt, struct CommConnEntry *entry);
 
-	int send_message(struct CommConnEntry *entry);
+	int send_message_deferred(struct iovec vectors[], int cnt,
+							  struct CommConnEntry *entry);
+
+	void start_receive(struct CommConnEntry *entry);
+
+	static void flush_conn(struct poller_flush *flush);
+
+	static ssize_t send_vectors(const struct iovec vectors[], int cnt,
+								struct CommConnEntry *entry);
+
+	static int encode_message(CommSession *session, struct iovec vectors[]);
+
+	int write_message(CommSession *session, struct iovec vectors[], int cnt,
+					  struct CommConnEntry *entry);
+
+	int send_message(CommSession *session, struct CommConnEntry *entry);
 
 	struct CommConnEntry *get_idle_conn(CommTarget *target);
 
 	int request_idle_conn(CommSession *session, CommTarget *target);
 
+	int request_pipe_conn(CommSession *session, CommTarget *target);
+
+	void fail_pipeline(struct CommConnEntry *entry, int state, int error);
+
+	static int pipe_next(struct CommConnEntry *entry, int closing);
+
+	int request_mux(CommSession *session, CommTarget *target);
+
+	int request_mux_conn(CommSession *session, CommTarget *target);
+
+	void handle_mux_connect(struct poller_result *res);
+
+	void handle_mux_reply(struct poller_result *res);
+
+	void fail_mux(struct CommConnEntry *entry, CommSession *session,
+				  int state, int error);
+
+	static void mux_insert(CommSession *session, struct CommConnEntry *entry);
+
+	static int mux_route(struct CommMuxMessage *mux);
+
+	static void mux_done(struct CommMuxMessage *mux);
+
+	static int mux_append(const void *buf, size_t *size, poller_message_t *msg);
+
+	static poller_message_t *create_mux_message(struct CommConnEntry *entry);
+
 	void handle_incoming_reply(struct poller_result *res);
 
 	void handle_read_result(struct poller_result *res);
@@ -187,6 +442,12 @@ private:
 
 	void handle_connect_result(struct poller_result *res);
 
+	void handle_prewarm_result(struct poller_result *res);
+
+	void prewarm_later(CommTarget *target);
+
+	void handle_prewarm_timer(CommTarget *target, int state);
+
 	static void handler_thread_routine(void *context);
 
 	static int first_timeout(CommSession *session);
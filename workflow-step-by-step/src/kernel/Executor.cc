@@ -1,9 +1,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <typeinfo>
 #include "list.h"
 #include "thrdpool.h"
 #include "Executor.h"
+#include "TaskTrace.h"
 
 struct ExecTaskEntry
 {
@@ -77,7 +79,9 @@ void Executor::executor_thread_routine(void *context)
 		free(entry);
 
 	pthread_mutex_unlock(&queue->mutex);
+	TASK_TRACE_BEGIN("execute", typeid(*session).name());
 	session->execute();
+	TASK_TRACE_END("execute");
 	session->handle(ES_STATE_FINISHED, 0);
 }
 
@@ -1,25 +1,60 @@
+#include <stdlib.h>
+#include <typeinfo>
 #include "SubTask.h"
+#include "TaskTrace.h"
 #include "logger.h"
 
+#define PARALLEL_FANOUT		64
+#define CACHE_LINE_SIZE		64
+#define SUBTASK_NEST_MAX	32
+
+struct __parallel_counter
+{
+	size_t nleft;
+	char pad[CACHE_LINE_SIZE - sizeof (size_t)];
+};
+
+/* Per thread trampoline of subtask_done(). */
+static __thread int __nest_depth;
+static __thread SubTask *__deferred_head;
+static __thread SubTask *__deferred_tail;
+
 void SubTask::subtask_done()
 {
     SubTask *cur = this;
     ParallelTask *parent;
     SubTask **entry;
 
+    __nest_depth++;
     while (1) {
         parent = cur->parent;
         entry = cur->entry;
+        TASK_TRACE_ASYNC_END("task", typeid(*cur).name(), cur);
+        TASK_TRACE_BEGIN("done", typeid(*cur).name());
         cur = cur->done();
+        TASK_TRACE_END("done");
         if (cur) {
             cur->parent = parent;
             cur->entry = entry;
             if (parent)
-                *entry = parent;
-            cur->dispatch();
+                *entry = cur;
+            if (__nest_depth > SUBTASK_NEST_MAX)
+            {
+                cur->next = NULL;
+                if (__deferred_head)
+                    __deferred_tail->next = cur;
+                else
+                    __deferred_head = cur;
+                __deferred_tail = cur;
+            }
+            else
+            {
+                TASK_TRACE_ASYNC_BEGIN("task", typeid(*cur).name(), cur);
+                cur->dispatch();
+            }
         } else if (parent)
         {
-            if (__sync_sub_and_fetch(&parent->nleft, 1) == 0)
+            if (parent->child_done(entry))
             {
                 cur = parent;
                 continue;
@@ -27,23 +62,106 @@ void SubTask::subtask_done()
         }
         break;
     }
+
+    /* The outermost one runs what the nested ones left, each of which
+     * may nest up to the limit again. */
+    if (__nest_depth == 1)
+    {
+        while (__deferred_head)
+        {
+            cur = __deferred_head;
+            __deferred_head = cur->next;
+            TASK_TRACE_ASYNC_BEGIN("task", typeid(*cur).name(), cur);
+            cur->dispatch();
+        }
+    }
+
+    __nest_depth--;
 }
 
-void ParallelTask::dispatch()
+/* Each level of the tree counts the nodes of the one below, grouped by
+ * PARALLEL_FANOUT, until a level has at most PARALLEL_FANOUT nodes. Those
+ * are counted by 'nleft'. Without memory for the tree, all count on
+ * 'nleft' alone. */
+void ParallelTask::prepare()
 {
-    SubTask **end = this->subtasks + this->subtasks_nr;
-    SubTask **p = this->subtasks;
+	struct __parallel_counter *node;
+	size_t total = 0;
+	size_t n, i;
 
-    this->nleft = this->subtasks_nr;
-    if (this->nleft != 0) 
-    {
-        do
-        {
-            (*p)->parent = this;
-            (*p)->entry = p;
-            (*p)->dispatch();
-        } while (++p != end);
-    } else {
+	this->counters = NULL;
+	this->nleft = this->subtasks_nr;
+	if (this->subtasks_nr <= PARALLEL_FANOUT)
+		return;
+
+	for (n = this->subtasks_nr; n > PARALLEL_FANOUT; n = (n + PARALLEL_FANOUT - 1) / PARALLEL_FANOUT)
+		total += (n + PARALLEL_FANOUT - 1) / PARALLEL_FANOUT;
+
+	node = (struct __parallel_counter *)aligned_alloc(CACHE_LINE_SIZE,
+									total * sizeof (struct __parallel_counter));
+	if (!node)
+		return;
+
+	this->counters = node;
+	for (n = this->subtasks_nr; n > PARALLEL_FANOUT; n = (n + PARALLEL_FANOUT - 1) / PARALLEL_FANOUT)
+	{
+		for (i = 0; i < n; i += PARALLEL_FANOUT)
+		{
+			node->nleft = n - i < PARALLEL_FANOUT ? n - i : PARALLEL_FANOUT;
+			node++;
+		}
+	}
+
+	this->nleft = n;
+}
+
+void ParallelTask::dispatch_range(size_t begin, size_t end)
+{
+	SubTask **last = this->subtasks + end;
+	SubTask **p = this->subtasks + begin;
+
+	while (p != last)
+	{
+		(*p)->parent = this;
+		(*p)->entry = p;
+		TASK_TRACE_ASYNC_BEGIN("task", typeid(**p).name(), *p);
+		(*p)->dispatch();
+		p++;
+	}
+}
+
+bool ParallelTask::child_done(SubTask **entry)
+{
+	struct __parallel_counter *node = this->counters;
+	size_t index;
+	size_t n;
+
+	if (node)
+	{
+		index = entry - this->subtasks;
+		for (n = this->subtasks_nr; n > PARALLEL_FANOUT; n = (n + PARALLEL_FANOUT - 1) / PARALLEL_FANOUT)
+		{
+			index /= PARALLEL_FANOUT;
+			if (__sync_sub_and_fetch(&node[index].nleft, 1) != 0)
+				return false;
+
+			node += (n + PARALLEL_FANOUT - 1) / PARALLEL_FANOUT;
+		}
+	}
+
+	if (__sync_sub_and_fetch(&this->nleft, 1) != 0)
+		return false;
+
+	free(this->counters);
+	this->counters = NULL;
+	return true;
+}
+
+void ParallelTask::dispatch()
+{
+    this->prepare();
+    if (this->subtasks_nr != 0)
+        this->dispatch_range(0, this->subtasks_nr);
+    else
         this->subtask_done();
-    }
-}
\ No newline at end of file
+}
@@ -4,6 +4,7 @@
 #include <stddef.h>
 
 class ParallelTask;
+struct __parallel_counter;
 
 class SubTask
 {
@@ -14,6 +15,9 @@ private:
     virtual SubTask *done() = 0;
 
 protected:
+    /* Completions that finish synchronously nest up to SUBTASK_NEST_MAX
+     * deep. Beyond that, the next dispatch() is queued on the thread and
+     * run by the outermost subtask_done() once the stack unwinds. */
     void subtask_done();
 
 public:
@@ -25,6 +29,7 @@ private:
     ParallelTask *parent;
     SubTask **entry;
     void *pointer;
+    SubTask *next;		/* in the thread's queue of deferred dispatches */
 
 public:
 	SubTask()
@@ -32,6 +37,7 @@ public:
 		this->parent = NULL;
 		this->entry = NULL;
 		this->pointer = NULL;
+		this->next = NULL;
 	}
 
     virtual ~SubTask() { }
@@ -45,6 +51,7 @@ public:
 	{
 		this->subtasks = subtasks;
 		this->subtasks_nr = n;
+		this->counters = NULL;
 	}
 
     SubTask **get_subtasks(size_t *n)
@@ -62,11 +69,26 @@ public:
 public:
 	virtual void dispatch();
 
+protected:
+	/* For dispatch() overrides: prepare() once, then dispatch_range() so
+	 * that every subtask is dispatched exactly once, from any threads.
+	 * The task may finish, and be gone, as soon as the last one is. */
+	void prepare();
+	void dispatch_range(size_t begin, size_t end);
+
 protected:
 	SubTask **subtasks;
 	size_t subtasks_nr;
 
 private:
+	/* Whether the subtask at 'entry' was the last to finish. */
+	bool child_done(SubTask **entry);
+
+private:
+	/* Above PARALLEL_FANOUT subtasks, they count down in a tree of
+	 * counters on separate cache lines, each shared by at most
+	 * PARALLEL_FANOUT of them, and only its root touches 'nleft'. */
+	struct __parallel_counter *counters;
 	size_t nleft;
 	friend class SubTask;
 };
@@ -0,0 +1,193 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cxxabi.h>
+#include "TaskTrace.h"
+
+struct __trace_event
+{
+	long long ts;
+	const void *id;
+	const char *cat;
+	const char *name;
+	char phase;
+};
+
+/* Written only by its thread. Once listed, never freed, since the thread
+ * may be gone but its events still wanted, or still writing a last one
+ * after a restart. */
+struct __trace_buffer
+{
+	struct __trace_buffer *next;
+	unsigned int gen;
+	int tid;
+	size_t mask;
+	size_t count;
+	struct __trace_event events[1];
+};
+
+int __task_trace_on;
+
+static unsigned int __trace_gen;
+static size_t __trace_size;
+static struct __trace_buffer *__trace_buffers;
+static __thread struct __trace_buffer *__trace_local;
+
+static struct __trace_buffer *__trace_buffer_get()
+{
+	struct __trace_buffer *buf = __trace_local;
+	unsigned int gen = __atomic_load_n(&__trace_gen, __ATOMIC_ACQUIRE);
+	size_t size = __trace_size;
+
+	if (buf && buf->gen == gen)
+		return buf;
+
+	if (buf && buf->mask + 1 == size)
+	{
+		buf->count = 0;
+		__atomic_store_n(&buf->gen, gen, __ATOMIC_RELEASE);
+		return buf;
+	}
+
+	buf = (struct __trace_buffer *)malloc(offsetof(struct __trace_buffer, events) +
+										  size * sizeof (struct __trace_event));
+	if (!buf)
+		return NULL;
+
+	buf->gen = gen;
+	buf->tid = (int)syscall(SYS_gettid);
+	buf->mask = size - 1;
+	buf->count = 0;
+	buf->next = __atomic_load_n(&__trace_buffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&__trace_buffers, &buf->next, buf, 1,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	__trace_local = buf;
+	return buf;
+}
+
+void __task_trace_event(char phase, const char *cat, const char *name,
+						const void *id, const struct timespec *ts)
+{
+	struct __trace_buffer *buf = __trace_buffer_get();
+	struct __trace_event *event;
+	struct timespec now;
+
+	if (!buf)
+		return;
+
+	if (!ts)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ts = &now;
+	}
+
+	event = &buf->events[buf->count & buf->mask];
+	event->ts = ts->tv_sec * 1000000000LL + ts->tv_nsec;
+	event->id = id;
+	event->cat = cat;
+	event->name = name;
+	event->phase = phase;
+	__atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+}
+
+int task_trace_start(size_t events)
+{
+	size_t size = 1;
+
+	if (events == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (size < events)
+		size <<= 1;
+
+	__atomic_store_n(&__task_trace_on, 0, __ATOMIC_RELAXED);
+	__trace_size = size;
+	__atomic_add_fetch(&__trace_gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&__task_trace_on, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void task_trace_stop()
+{
+	__atomic_store_n(&__task_trace_on, 0, __ATOMIC_RELEASE);
+}
+
+static void __trace_write_name(FILE *fp, const char *name)
+{
+	char *demangled = NULL;
+	const char *p;
+
+	/* Class names from typeid, plain or in a namespace. */
+	if (isdigit(*name) || *name == 'N')
+		demangled = abi::__cxa_demangle(name, NULL, NULL, NULL);
+
+	p = demangled ? demangled : name;
+
+	for (; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			fputc('\\', fp);
+
+		fputc(*p, fp);
+	}
+
+	free(demangled);
+}
+
+int task_trace_flush(const char *path)
+{
+	unsigned int gen = __atomic_load_n(&__trace_gen, __ATOMIC_ACQUIRE);
+	struct __trace_buffer *buf;
+	struct __trace_event *event;
+	const char *sep = "";
+	size_t count;
+	size_t i;
+	int pid = getpid();
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	buf = __atomic_load_n(&__trace_buffers, __ATOMIC_ACQUIRE);
+	for (; buf; buf = buf->next)
+	{
+		if (__atomic_load_n(&buf->gen, __ATOMIC_ACQUIRE) != gen)
+			continue;
+
+		count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+		i = count > buf->mask + 1 ? count - buf->mask - 1 : 0;
+		for (; i < count; i++)
+		{
+			event = &buf->events[i & buf->mask];
+			fprintf(fp, "%s\n{\"ph\":\"%c\",\"cat\":\"%s\",\"name\":\"",
+					sep, event->phase, event->cat);
+			__trace_write_name(fp, event->name);
+			fprintf(fp, "\",\"ts\":%lld.%03lld,\"pid\":%d,\"tid\":%d",
+					event->ts / 1000, event->ts % 1000, pid, buf->tid);
+			if (event->id)
+				fprintf(fp, ",\"id\":\"%p\"", event->id);
+
+			fputc('}', fp);
+			sep = ",";
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) != 0)
+		return -1;
+
+	return 0;
+}
+
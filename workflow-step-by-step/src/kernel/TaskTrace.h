@@ -0,0 +1,54 @@
+#ifndef _TASKTRACE_H_
+#define _TASKTRACE_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* Timeline of tasks and series, written in the Chrome trace event format
+ * for chrome://tracing or ui.perfetto.dev:
+ *     task_trace_start(TASK_TRACE_EVENTS_DEFAULT);
+ *     ...
+ *     task_trace_stop();
+ *     task_trace_flush("workflow.json");
+ * A task shows as an async span from dispatch to done, with the wait,
+ * connect, request and receive phases of network tasks nested in it.
+ * done() itself, callbacks included, and thread task routines show as
+ * spans on the thread that ran them. Each thread records into a ring of
+ * its own and keeps the newest events. When off, each trace point costs
+ * one load and branch. */
+
+#define TASK_TRACE_EVENTS_DEFAULT	(64 * 1024)
+
+/* Room for 'events' per thread, rounded up to a power of 2. Events of any
+ * earlier run are dropped. */
+int task_trace_start(size_t events);
+void task_trace_stop();
+
+/* Events of the current or last run, best written after stopping. */
+int task_trace_flush(const char *path);
+
+extern int __task_trace_on;
+
+/* 'name' and 'cat' must outlive the trace; mangled type names are
+ * demangled on flush. 'ts' is CLOCK_MONOTONIC, or NULL for now. */
+void __task_trace_event(char phase, const char *cat, const char *name,
+						const void *id, const struct timespec *ts);
+
+#define TASK_TRACE(phase, cat, name, id, ts) \
+do { \
+	if (__builtin_expect(__task_trace_on, 0)) \
+		__task_trace_event(phase, cat, name, id, ts); \
+} while (0)
+
+/* Spans nested on the calling thread. */
+#define TASK_TRACE_BEGIN(cat, name)	TASK_TRACE('B', cat, name, NULL, NULL)
+#define TASK_TRACE_END(cat)			TASK_TRACE('E', cat, "", NULL, NULL)
+
+/* Spans of an object across threads, matched by cat and id. */
+#define TASK_TRACE_ASYNC_BEGIN(cat, name, id) \
+	TASK_TRACE('b', cat, name, id, NULL)
+#define TASK_TRACE_ASYNC_END(cat, name, id) \
+	TASK_TRACE('e', cat, name, id, NULL)
+
+#endif
+
@@ -88,6 +88,15 @@ static inline void list_del(struct list_head *entry) {
     __list_del(entry->prev, entry->next);
 }
 
+/**
+ * list_del_init - deletes entry from list and reinitialize it.
+ * @entry: the element to delete from the list.
+ */
+static inline void list_del_init(struct list_head *entry) {
+    __list_del(entry->prev, entry->next);
+    INIT_LIST_HEAD(entry);
+}
+
 /** 
  * list_move - delete from one list and add as another's head
  * @node: the entry to move
@@ -183,7 +192,7 @@ static inline void list_splice_init(struct list_head *list,
  * @head: the head for your list.
  */
 #define list_for_each_prev(pos, head) \
-    for (pos = (head)->prev; pos != (head); pso = pos->prev)
+    for (pos = (head)->prev; pos != (head); pos = pos->prev)
 
 /**
  * list_for_each_safe - iterate over a list safe against removal of list entry
@@ -54,6 +54,32 @@ static inline int mpoller_set_timeout(int fd, int timeout, mpoller_t *mpoller)
 	return poller_set_timeout(fd, timeout, mpoller->poller[index]);
 }
 
+static inline int mpoller_flush(struct poller_flush *flush, int fd,
+								mpoller_t *mpoller)
+{
+	unsigned int index = (unsigned int)fd % mpoller->nthreads;
+	return poller_flush(flush, mpoller->poller[index]);
+}
+
+static inline int mpoller_flush_writable(struct poller_flush *flush, int fd,
+										 mpoller_t *mpoller)
+{
+	unsigned int index = (unsigned int)fd % mpoller->nthreads;
+	return poller_flush_writable(flush, fd, mpoller->poller[index]);
+}
+
+static inline int mpoller_pause(int fd, mpoller_t *mpoller)
+{
+	unsigned int index = (unsigned int)fd % mpoller->nthreads;
+	return poller_pause(fd, mpoller->poller[index]);
+}
+
+static inline int mpoller_resume(int fd, mpoller_t *mpoller)
+{
+	unsigned int index = (unsigned int)fd % mpoller->nthreads;
+	return poller_resume(fd, mpoller->poller[index]);
+}
+
 static inline int mpoller_add_timer(void *context, const struct timespec *value, mpoller_t *mpoller)
 {
 	static unsigned int n = 0;
@@ -14,6 +14,7 @@
 #define POLLER_NODES_MAX		65536
 #define POLLER_EVENTS_MAX		256
 #define POLLER_NODE_ERROR		((struct __poller_node *)-1)
+#define POLLER_FLUSH_WAKEUP		((struct __poller_node *)1)
 
 typedef struct __poller poller_t;
 
@@ -29,9 +30,11 @@ struct __poller_node
 	};
 	char in_rbtree;
 	char removed;
+	char paused;
 	int event;
 	struct timespec timeout;
 	struct __poller_node *res;
+	struct poller_flush *writable;
 };
 
 static inline int __poller_create_pfd()
@@ -354,6 +357,12 @@ int __poller_data_get_event(int *event, const struct poller_data *data)
 	case PD_OP_CONNECT:
 		*event = EPOLLOUT | EPOLLET;
 		return 0;
+	case PD_OP_SSL_CONNECT:
+		*event = EPOLLOUT | EPOLLET;
+		return 0;
+	default:
+		errno = EINVAL;
+		return -1;
 	}
 }
 
@@ -423,7 +432,9 @@ int poller_add(const struct poller_data *data, int timeout, poller_t *poller)
 		node->event = event;
 		node->in_rbtree = 0;
 		node->removed = 0;
+		node->paused = 0;
 		node->res = res;
+		node->writable = NULL;
 		if (timeout >= 0)
 			__poller_node_set_timeout(timeout, node);
 
@@ -558,6 +569,7 @@ poller_t *poller_create(const struct poller_params *params)
 		poller->tree_first = NULL;
 		INIT_LIST_HEAD(&poller->timeo_list);
 		INIT_LIST_HEAD(&poller->no_timeo_list);
+		INIT_LIST_HEAD(&poller->flush_list);
 		poller->nodes[poller->timerfd] = POLLER_NODE_ERROR;
 		poller->nodes[poller->pfd] = POLLER_NODE_ERROR;
 		poller->stopped = 1;
@@ -697,16 +709,109 @@ static void __poller_handle_connect(struct __poller_node *node,
     __poller_add_result(node, poller);
 }
 
+/* Wait for the event SSL asks for. Return 0 if we should wait, -1 on error. */
+static int __poller_handle_ssl_error(struct __poller_node *node, int ret,
+									 poller_t *poller)
+{
+	int error = SSL_get_error(node->data.ssl, ret);
+	int event;
+
+	switch (error)
+	{
+	case SSL_ERROR_WANT_READ:
+		event = EPOLLIN | EPOLLET;
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		event = EPOLLOUT | EPOLLET;
+		break;
+	case SSL_ERROR_ZERO_RETURN:
+		errno = 0;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0)
+			errno = ECONNRESET;
+		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (event == node->event)
+		return 0;
+
+	pthread_mutex_lock(&poller->mutex);
+	if (!node->removed)
+	{
+		ret = __poller_mod_fd(node->data.fd, node->event, event, node, poller);
+		if (ret >= 0)
+			node->event = event;
+	}
+	else
+		ret = 0;
+
+	pthread_mutex_unlock(&poller->mutex);
+	return ret;
+}
+
+static void __poller_handle_ssl_connect(struct __poller_node *node,
+										poller_t *poller)
+{
+	int ret = SSL_connect(node->data.ssl);
+
+	if (ret <= 0)
+	{
+		if (__poller_handle_ssl_error(node, ret, poller) >= 0)
+			return;
+	}
+
+	if (__poller_remove_node(node, poller))
+		return;
+
+	if (ret > 0)
+	{
+		node->error = 0;
+		node->state = PR_ST_FINISHED;
+	}
+	else
+	{
+		node->error = errno ? errno : EPROTO;
+		node->state = PR_ST_ERROR;
+	}
+
+	__poller_add_result(node, poller);
+}
+
 static void __poller_handle_read(struct __poller_node *node, poller_t *poller)
 {
     ssize_t nleft;
     size_t n;
     char *p;
 
+    /* Paused nodes still get EPOLLHUP/EPOLLERR. Leave them to resume. */
+    if (node->paused)
+        return;
+
     while (1) 
     {
         p = poller->buf;
-        nleft = read(node->data.fd, p, POLLER_BUFSIZE);
+		if (node->data.ssl)
+		{
+			nleft = SSL_read(node->data.ssl, p, POLLER_BUFSIZE);
+			if (nleft <= 0)
+			{
+				if (__poller_handle_ssl_error(node, nleft, poller) >= 0)
+					return;
+
+				/* Peer closed the TLS session cleanly. */
+				if (errno == 0)
+					nleft = 0;
+				else
+					nleft = -1;
+			}
+		}
+		else
+			nleft = read(node->data.fd, p, POLLER_BUFSIZE);
+
 		if (nleft < 0)
 		{
 			if (errno == EAGAIN)
@@ -729,6 +834,11 @@ static void __poller_handle_read(struct __poller_node *node, poller_t *poller)
         
         if (nleft < 0)
             break;
+
+        /* The message asked us to stop reading. Data already read has
+         * been consumed, the rest stays in the socket. */
+        if (node->paused)
+            return;
     }
 
     if (__poller_remove_node(node, poller))
@@ -782,6 +892,28 @@ static void __poller_handle_write(struct __poller_node *node, poller_t *poller)
     }
 }         
 
+/* The socket of a node being read can take more data. Stop watching for
+ * that and run the callback waiting for it. */
+static void __poller_handle_writable(struct __poller_node *node,
+									 poller_t *poller)
+{
+	struct poller_flush *flush = NULL;
+
+	pthread_mutex_lock(&poller->mutex);
+	if (!node->removed && (node->event & EPOLLOUT))
+	{
+		node->event &= ~EPOLLOUT;
+		__poller_mod_fd(node->data.fd, node->event | EPOLLOUT,
+						node->paused ? EPOLLET : node->event, node, poller);
+		flush = node->writable;
+		node->writable = NULL;
+	}
+
+	pthread_mutex_unlock(&poller->mutex);
+	if (flush)
+		flush->flush(flush);
+}
+
 static int __poller_handle_pipe(poller_t *poller)
 {
     struct __poller_node **node = (struct __poller_node **)poller->buf;
@@ -792,7 +924,9 @@ static int __poller_handle_pipe(poller_t *poller)
     n = read(poller->pipe_rd, node, POLLER_BUFSIZE) / sizeof(void *);
     for (i = 0; i < n; i++)
     {
-        if (node[i])
+        if (node[i] == POLLER_FLUSH_WAKEUP)
+            continue;
+        else if (node[i])
             __poller_add_result(node[i], poller);
         else
             stop = 1;
@@ -800,6 +934,29 @@ static int __poller_handle_pipe(poller_t *poller)
     return stop;
 }
 
+static void __poller_handle_flush(poller_t *poller)
+{
+	struct poller_flush *flush;
+
+	/* Take one at a time, so a flush queued again by another thread while
+	 * its callback is running is never linked into two lists. */
+	while (1)
+	{
+		pthread_mutex_lock(&poller->mutex);
+		if (list_empty(&poller->flush_list))
+		{
+			pthread_mutex_unlock(&poller->mutex);
+			break;
+		}
+
+		flush = list_entry(poller->flush_list.next, struct poller_flush, list);
+		list_del(&flush->list);
+		flush->queued = 0;
+		pthread_mutex_unlock(&poller->mutex);
+		flush->flush(flush);
+	}
+}
+
 static void __poller_handle_timeout(const struct __poller_node *time_node, poller_t *poller)
 {
 	struct __poller_node *node;
@@ -878,10 +1035,20 @@ static void *__poller_thread_routine(void *arg)
 				switch (node->data.operation)
 				{
 				case PD_OP_READ:
-					__poller_handle_read(node, poller);
+					/* Write first. Reading may end the node. */
+					if (events[i].events & EPOLLOUT)
+						__poller_handle_writable(node, poller);
+
+					if (events[i].events & ~EPOLLOUT)
+						__poller_handle_read(node, poller);
+
 					break;
                 case PD_OP_CONNECT:
                     __poller_handle_connect(node, poller);
+                    break;
+				case PD_OP_SSL_CONNECT:
+					__poller_handle_ssl_connect(node, poller);
+					break;
 				default:
 					break;
 				}
@@ -889,15 +1056,17 @@ static void *__poller_thread_routine(void *arg)
 			{
 				has_pipe_event = 1;
 			}
+		}
 
-			if (has_pipe_event)
-			{
-				if (__poller_handle_pipe(poller))
-					break;
-			}
-
-			__poller_handle_timeout(&time_node, poller);
+		/* The pipe is blocking, so read it once per iteration only. */
+		if (has_pipe_event)
+		{
+			if (__poller_handle_pipe(poller))
+				break;
 		}
+
+		__poller_handle_timeout(&time_node, poller);
+		__poller_handle_flush(poller);
 	}
 	return NULL;
 }
@@ -946,6 +1115,7 @@ void poller_stop(poller_t *poller)
 	write(poller->pipe_wr, &p, sizeof (void *)); // 写管道，通知poller_wait线程处理终止
 	pthread_join(poller->tid, NULL); // 等待线程结束
 	poller->stopped = 1;
+	__poller_handle_flush(poller);
 
 	pthread_mutex_lock(&poller->mutex);
 	poller->nodes[poller->pipe_rd] = NULL;
@@ -967,7 +1137,6 @@ void poller_stop(poller_t *poller)
 	{
 		node = list_entry(pos, struct __poller_node, list);
 		list_del(&node->list);
-		__poller_add_result(node, poller);
 		if (node->data.fd >= 0)
 		{
 			poller->nodes[node->data.fd] = NULL;
@@ -1014,7 +1183,9 @@ int poller_mod(const struct poller_data *data,  int timeout, poller_t *poller)
 		node->event = event;
 		node->in_rbtree = 0;
 		node->removed = 0;
+		node->paused = 0;
 		node->res = res;
+		node->writable = NULL;
 		if (timeout >= 0)
 		 	__poller_node_set_timeout(timeout, node);
 		
@@ -1111,6 +1282,7 @@ int poller_add_timer(void *context, const struct timespec *value, poller_t *poll
 	node->data.context = context;
 	node->in_rbtree = 0;
 	node->removed = 0;
+	node->paused = 0;
 	node->res = NULL;
 
 	clock_gettime(CLOCK_MONOTONIC, &node->timeout);
@@ -1126,4 +1298,129 @@ int poller_add_timer(void *context, const struct timespec *value, poller_t *poll
 	__poller_insert_node(node, poller);
 	pthread_mutex_unlock(&poller->mutex);
 	return 0;
-}
\ No newline at end of file
+}
+
+int poller_flush(struct poller_flush *flush, poller_t *poller)
+{
+	void *p = POLLER_FLUSH_WAKEUP;
+	int wakeup = 0;
+
+	pthread_mutex_lock(&poller->mutex);
+	if (flush->queued)
+	{
+		pthread_mutex_unlock(&poller->mutex);
+		return 0;
+	}
+
+	/* Only the first flush of an iteration needs to wake the poller up. */
+	if (list_empty(&poller->flush_list))
+		wakeup = 1;
+
+	list_add_tail(&flush->list, &poller->flush_list);
+	flush->queued = 1;
+	pthread_mutex_unlock(&poller->mutex);
+	if (wakeup)
+		write(poller->pipe_wr, &p, sizeof (void *));
+
+	return 1;
+}
+
+int poller_pause(int fd, poller_t *poller)
+{
+	struct __poller_node *node;
+
+	if ((size_t)fd >= poller->params.max_open_files)
+	{
+		errno = fd < 0 ? EBADF : EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&poller->mutex);
+	node = poller->nodes[fd];
+	if (node && node != POLLER_NODE_ERROR &&
+		node->data.operation == PD_OP_READ)
+	{
+		/* Keep EPOLLET, so a hang-up while paused is reported once. A
+		 * write waiting for the socket goes on. */
+		if (!node->paused)
+		{
+			__poller_mod_fd(fd, node->event, EPOLLET | (node->event & EPOLLOUT),
+							node, poller);
+			node->paused = 1;
+		}
+	}
+	else
+	{
+		node = NULL;
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&poller->mutex);
+	return -!node;
+}
+
+int poller_resume(int fd, poller_t *poller)
+{
+	struct __poller_node *node;
+
+	if ((size_t)fd >= poller->params.max_open_files)
+	{
+		errno = fd < 0 ? EBADF : EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&poller->mutex);
+	node = poller->nodes[fd];
+	if (node && node != POLLER_NODE_ERROR &&
+		node->data.operation == PD_OP_READ)
+	{
+		/* EPOLL_CTL_MOD re-checks readiness, so pending data is reported. */
+		if (node->paused)
+		{
+			node->paused = 0;
+			__poller_mod_fd(fd, EPOLLET | (node->event & EPOLLOUT), node->event,
+							node, poller);
+		}
+	}
+	else
+	{
+		node = NULL;
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&poller->mutex);
+	return -!node;
+}
+
+int poller_flush_writable(struct poller_flush *flush, int fd, poller_t *poller)
+{
+	struct __poller_node *node;
+	int event;
+
+	if ((size_t)fd >= poller->params.max_open_files)
+	{
+		errno = fd < 0 ? EBADF : EMFILE;
+		return -1;
+	}
+
+	pthread_mutex_lock(&poller->mutex);
+	node = poller->nodes[fd];
+	if (node && node != POLLER_NODE_ERROR &&
+		node->data.operation == PD_OP_READ)
+	{
+		/* EPOLL_CTL_MOD re-checks readiness, so a socket that is writable
+		 * already is reported at once. */
+		node->writable = flush;
+		node->event |= EPOLLOUT;
+		event = node->paused ? EPOLLET | EPOLLOUT : node->event;
+		__poller_mod_fd(fd, node->event & ~EPOLLOUT, event, node, poller);
+	}
+	else
+	{
+		node = NULL;
+		errno = ENOENT;
+	}
+
+	pthread_mutex_unlock(&poller->mutex);
+	return -!node;
+}
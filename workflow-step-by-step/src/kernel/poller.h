@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <openssl/ssl.h>
 #include "rbtree.h"
 #include "list.h"
 
@@ -24,12 +25,15 @@ struct poller_data
     #define PD_OP_WRITE			2
     #define PD_OP_LISTEN		3
     #define PD_OP_CONNECT		4
+    #define PD_OP_SSL_READ		PD_OP_READ
+    #define PD_OP_SSL_CONNECT	7
     #define PD_OP_EVENT			8
     #define PD_OP_NOTIFY		9
     #define PD_OP_TIMER			10
     short operation;
     unsigned short iovcnt;
     int fd;
+    SSL *ssl;
     union
     {
         void *(*accept)(const struct sockaddr*, socklen_t, int, void *);
@@ -57,6 +61,17 @@ struct poller_result
 	struct poller_data data;
 };
 
+/* A deferred flush queued on a poller. The callback runs in the poller
+ * thread once per loop iteration, after all events have been handled.
+ * Given to poller_flush_writable(), it runs once the socket can be
+ * written instead, and is not queued. */
+struct poller_flush
+{
+    struct list_head list;
+    int queued;
+    void (*flush)(struct poller_flush *);
+};
+
 struct poller_params
 {
     size_t max_open_files;
@@ -96,6 +111,7 @@ struct __poller
     struct rb_node *tree_first;
     struct list_head timeo_list;
     struct list_head no_timeo_list;
+    struct list_head flush_list;
     struct __poller_node **nodes;
     pthread_mutex_t mutex;
     char buf[POLLER_BUFSIZE];
@@ -118,6 +134,10 @@ int poller_mod(const struct poller_data *data, int timeout, poller_t *poller);
 
 int poller_set_timeout(int fd, int timeout, poller_t *poller);
 int poller_add_timer(void *context, const struct timespec *timeout, poller_t *poller);
+int poller_flush(struct poller_flush *flush, poller_t *poller);
+int poller_flush_writable(struct poller_flush *flush, int fd, poller_t *poller);
+int poller_pause(int fd, poller_t *poller);
+int poller_resume(int fd, poller_t *poller);
 
 poller_queue_t *poller_queue_create(size_t maxlen);
 struct poller_result *poller_queue_get(poller_queue_t *queue);
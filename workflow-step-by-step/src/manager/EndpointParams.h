@@ -23,6 +23,12 @@ struct EndpointParams
 	int connect_timeout;
 	int response_timeout;
 	int ssl_connect_timeout;
+	size_t min_idle_connections;
+	int idle_keep_alive_timeout;	///< ms a pre-warmed connection stays idle before it is replaced
+	int connection_attempt_delay;	///< ms between racing connects, 0 to disable
+	size_t max_receive_buffer;		///< unconsumed received bytes per connection, 0 for no limit
+	int select_policy;				///< CSG_POLICY_* choosing among resolved addresses
+	bool adaptive_limit;			///< adapt the load limit to latency, max_connections is the cap
 };
 
 static constexpr struct EndpointParams ENDPOINT_PARAMS_DEFAULT =
@@ -31,6 +37,12 @@ static constexpr struct EndpointParams ENDPOINT_PARAMS_DEFAULT =
 	.connect_timeout		= 10 * 1000,
 	.response_timeout		= 10 * 1000,
 	.ssl_connect_timeout	= 10 * 1000,
+	.min_idle_connections	= 0,
+	.idle_keep_alive_timeout	= 60 * 1000,
+	.connection_attempt_delay	= 250,
+	.max_receive_buffer		= 0,
+	.select_policy			= 0,
+	.adaptive_limit			= false,
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,226 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+#include <functional>
+#include "Mutex.h"
+#include "LatencyStats.h"
+
+static const struct
+{
+	int from;
+	int to;
+} __phase_range[LATENCY_PHASE_MAX] =
+{
+	{	CS_PHASE_START,			CS_PHASE_ACQUIRE		},
+	{	CS_PHASE_CONNECT_START,	CS_PHASE_CONNECT_END	},
+	{	CS_PHASE_WRITE_START,	CS_PHASE_WRITE_END		},
+	{	CS_PHASE_WRITE_END,		CS_PHASE_FIRST_BYTE		},
+	{	CS_PHASE_FIRST_BYTE,	CS_PHASE_COMPLETE		},
+	{	CS_PHASE_ACQUIRE,		CS_PHASE_COMPLETE		},
+};
+
+static inline int64_t __elapsed_usec(const struct timespec *from,
+									 const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000LL +
+		   (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+bool LatencyStats::Address::operator== (const Address& other) const
+{
+	return this->len == other.len &&
+		   memcmp(&this->addr, &other.addr, this->len) == 0;
+}
+
+size_t LatencyStats::AddressHash::operator() (const Address& key) const
+{
+	std::string_view bytes((const char *)&key.addr, key.len);
+
+	return std::hash<std::string_view>()(bytes);
+}
+
+LatencyStats::LatencyStats() :
+	rwlock_(PTHREAD_RWLOCK_INITIALIZER)
+{
+}
+
+LatencyStats::Entry *LatencyStats::get_entry(const CommTarget *peer)
+{
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+	Address key;
+
+	peer->get_addr(&addr, &addrlen);
+	if (addrlen > sizeof key.addr)
+		return NULL;
+
+	key.len = addrlen;
+	memcpy(&key.addr, addr, addrlen);
+	{
+		ReadLock lock(rwlock_);
+		auto it = entries_.find(key);
+
+		if (it != entries_.end())
+			return it->second;
+	}
+
+	WriteLock lock(rwlock_);
+	auto ret = entries_.emplace(key, nullptr);
+
+	if (ret.second)
+		ret.first->second = new Entry;
+
+	return ret.first->second;
+}
+
+/* Only for the readers. Recording never goes by name. */
+LatencyStats::Entry *LatencyStats::find_entry(const std::string& peer)
+{
+	ReadLock lock(rwlock_);
+
+	for (const auto& kv : entries_)
+	{
+		if (peer_name((const struct sockaddr *)&kv.first.addr) == peer)
+			return kv.second;
+	}
+
+	return NULL;
+}
+
+void LatencyStats::record(const CommTarget *peer, const CommSession *session,
+						  size_t limit)
+{
+	const struct timespec *from;
+	const struct timespec *to;
+	int64_t usec[LATENCY_PHASE_MAX];
+	Entry *entry;
+	int i;
+
+	for (i = 0; i < LATENCY_PHASE_MAX; i++)
+	{
+		from = session->get_phase_time(__phase_range[i].from);
+		to = session->get_phase_time(__phase_range[i].to);
+		usec[i] = from && to ? __elapsed_usec(from, to) : -1;
+	}
+
+	entry = this->get_entry(peer);
+	if (!entry)
+		return;
+
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	for (i = 0; i < LATENCY_PHASE_MAX; i++)
+	{
+		if (usec[i] >= 0)
+			entry->hist[i].record(usec[i]);
+	}
+
+	if (limit)
+		entry->limit = limit;
+}
+
+bool LatencyStats::get(const std::string& peer, int phase, LatencyHistogram& hist)
+{
+	Entry *entry = this->find_entry(peer);
+
+	if (!entry || phase < 0 || phase >= LATENCY_PHASE_MAX)
+		return false;
+
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	hist = entry->hist[phase];
+	return true;
+}
+
+size_t LatencyStats::get_limit(const std::string& peer)
+{
+	Entry *entry = this->find_entry(peer);
+
+	if (!entry)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	return entry->limit;
+}
+
+std::vector<std::string> LatencyStats::get_peers()
+{
+	std::vector<std::string> peers;
+	ReadLock lock(rwlock_);
+
+	for (const auto& kv : entries_)
+		peers.push_back(peer_name((const struct sockaddr *)&kv.first.addr));
+
+	return peers;
+}
+
+void LatencyStats::reset()
+{
+	ReadLock lock(rwlock_);
+
+	for (const auto& kv : entries_)
+	{
+		std::lock_guard<std::mutex> entry_lock(kv.second->mutex);
+
+		for (int i = 0; i < LATENCY_PHASE_MAX; i++)
+			kv.second->hist[i].reset();
+	}
+}
+
+std::string LatencyStats::peer_name(const CommTarget *target)
+{
+	const struct sockaddr *addr;
+	socklen_t addrlen;
+
+	target->get_addr(&addr, &addrlen);
+	return peer_name(addr);
+}
+
+std::string LatencyStats::peer_name(const struct sockaddr *addr)
+{
+	char buf[INET6_ADDRSTRLEN + 8];
+	unsigned short port = 0;
+	const char *ip = NULL;
+
+	switch (addr->sa_family)
+	{
+	case AF_INET:
+		ip = inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr,
+					   buf, sizeof buf);
+		port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+		break;
+	case AF_INET6:
+		ip = inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr,
+					   buf + 1, sizeof buf - 1);
+		if (ip)
+		{
+			buf[0] = '[';
+			strcat(buf, "]");
+			ip = buf;
+		}
+
+		port = ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+		break;
+	case AF_UNIX:
+		return ((const struct sockaddr_un *)addr)->sun_path;
+	default:
+		break;
+	}
+
+	if (!ip)
+		return std::string();
+
+	return std::string(ip) + ":" + std::to_string(port);
+}
+
+LatencyStats::~LatencyStats()
+{
+	for (const auto& kv : entries_)
+		delete kv.second;
+
+	pthread_rwlock_destroy(&rwlock_);
+}
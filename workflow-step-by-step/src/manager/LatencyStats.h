@@ -0,0 +1,85 @@
+#ifndef _LATENCYSTATS_H_
+#define _LATENCYSTATS_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include "Communicator.h"
+#include "LatencyHistogram.h"
+
+/**
+ * @file   LatencyStats.h
+ * @brief  Per-target histograms of client request phases
+ */
+
+#define LATENCY_PHASE_WAIT		0	///< CommScheduler queueing
+#define LATENCY_PHASE_CONNECT	1	///< TCP and TLS handshake, new connections only
+#define LATENCY_PHASE_SEND		2
+#define LATENCY_PHASE_SERVER	3	///< request written to first byte of reply
+#define LATENCY_PHASE_RECEIVE	4
+#define LATENCY_PHASE_TOTAL		5	///< target acquired to complete
+#define LATENCY_PHASE_MAX		6
+
+// Thread safety: YES
+class LatencyStats
+{
+public:
+	/// Add the phases of the session's last request to the histograms of
+	/// the address of 'peer', the target it was sent to. 'limit' is the
+	/// peer's current load limit, 0 if unknown.
+	void record(const CommTarget *peer, const CommSession *session,
+				size_t limit = 0);
+
+	/// Copy the histogram of one phase. Returns false if peer is unknown.
+	bool get(const std::string& peer, int phase, LatencyHistogram& hist);
+
+	/// Load limit of the peer at its last record, 0 if unknown.
+	size_t get_limit(const std::string& peer);
+
+	/// Names of the recorded peers, "ip:port" or a unix socket path.
+	std::vector<std::string> get_peers();
+	void reset();
+
+	/// "ip:port" of a target's address.
+	static std::string peer_name(const CommTarget *target);
+	static std::string peer_name(const struct sockaddr *addr);
+
+private:
+	/* Entries are keyed by the raw address, so that recording neither
+	 * formats a name nor allocates. Names are made when listed. */
+	struct Address
+	{
+		socklen_t len;
+		struct sockaddr_storage addr;
+
+		bool operator== (const Address& other) const;
+	};
+
+	struct AddressHash
+	{
+		size_t operator() (const Address& key) const;
+	};
+
+	struct Entry
+	{
+		std::mutex mutex;
+		LatencyHistogram hist[LATENCY_PHASE_MAX];
+		size_t limit = 0;
+	};
+
+	Entry *get_entry(const CommTarget *peer);
+	Entry *find_entry(const std::string& peer);
+
+	pthread_rwlock_t rwlock_;
+	std::unordered_map<Address, Entry *, AddressHash> entries_;
+
+public:
+	LatencyStats();
+	~LatencyStats();
+};
+
+#endif
@@ -22,6 +22,7 @@
 
 #define GET_CURRENT_SECOND	std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
 #define MTTR_SECOND			30
+#define UNIX_SOCKET_BUFSIZE	(512 * 1024)
 
 struct RouterParams
 {
@@ -30,7 +31,15 @@ struct RouterParams
 	uint64_t md5_16;
 	int connect_timeout;
 	int response_timeout;
+	int ssl_connect_timeout;
 	size_t max_connections;
+	size_t min_idle_connections;
+	int idle_keep_alive_timeout;
+	int connection_attempt_delay;
+	size_t max_receive_buffer;
+	int select_policy;
+	bool adaptive_limit;
+	const std::string *hostname;
 };
 
 class Router
@@ -98,8 +107,21 @@ int Router::init(const struct RouterParams *params)
 	this->group = new CommSchedGroup();
 	if (this->group->init() >= 0)
 	{
+		this->group->set_policy(params->select_policy);
 		if (this->add_group_targets(params) >= 0)
 		{
+			/* Link all addresses into a ring for racing connects. */
+			if (params->connection_attempt_delay > 0)
+			{
+				size_t n = this->targets.size();
+
+				for (size_t i = 0; i < n; i++)
+				{
+					this->targets[i]->set_race_target(this->targets[(i + 1) % n],
+													  params->connection_attempt_delay);
+				}
+			}
+
 			this->request_object = this->group;
 			this->md5_16 = params->md5_16;
 			return 0;
@@ -251,6 +273,25 @@ private:
 	}
 };
 
+/* Local peers: the socket buffer is the only queue between the two ends,
+ * so let a whole burst of requests fit. The kernel caps it to wmem_max. */
+class RouteTargetUnix : public RouteManager::RouteTarget
+{
+private:
+	virtual int create_connect_fd()
+	{
+		int size = UNIX_SOCKET_BUFSIZE;
+		int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (sockfd >= 0)
+		{
+			setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (int));
+			setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (int));
+		}
+
+		return sockfd;
+	}
+};
 
 static inline int __addr_cmp(const struct addrinfo *x, const struct addrinfo *y)
 {
@@ -270,12 +311,19 @@ static inline bool __addr_less(const struct addrinfo *x, const struct addrinfo *
 
 static uint64_t __generate_key(TransportType type,
 							   const struct addrinfo *addrinfo,
-							   const std::string& other_info)
+							   const std::string& other_info,
+							   const std::string& hostname)
 {
 	std::string str = "TT";
 
 	str += std::to_string(type);
 	str += '\n';
+	/* SNI and TLS sessions belong to the host name, not the address. */
+	if (type == TT_TCP_SSL || type == TT_SCTP_SSL)
+	{
+		str += hostname;
+		str += '\n';
+	}
 	if (!other_info.empty())
 	{
 		str += other_info;
@@ -301,6 +349,7 @@ int RouteManager::get(TransportType type,
 					  const struct addrinfo *addrinfo,
 					  const std::string& other_info,
 					  const struct EndpointParams *endpoint_params,
+					  const std::string& hostname,
 					  RouteResult& result)
 {
 	result.cookie = NULL;
@@ -311,7 +360,7 @@ int RouteManager::get(TransportType type,
 		return -1;
 	}
 
-	uint64_t md5_16 = __generate_key(type, addrinfo, other_info);
+	uint64_t md5_16 = __generate_key(type, addrinfo, other_info, hostname);
 	rb_node **p = &cache_.rb_node;
 	rb_node *parent = NULL;
 	Router *router;
@@ -342,7 +391,15 @@ int RouteManager::get(TransportType type,
 			.md5_16					=	md5_16,
 			.connect_timeout		=	endpoint_params->connect_timeout,
 			.response_timeout		=	endpoint_params->response_timeout,
-			.max_connections		=	endpoint_params->max_connections
+			.ssl_connect_timeout	=	endpoint_params->ssl_connect_timeout,
+			.max_connections		=	endpoint_params->max_connections,
+			.min_idle_connections	=	endpoint_params->min_idle_connections,
+			.idle_keep_alive_timeout	=	endpoint_params->idle_keep_alive_timeout,
+			.connection_attempt_delay	=	endpoint_params->connection_attempt_delay,
+			.max_receive_buffer		=	endpoint_params->max_receive_buffer,
+			.select_policy			=	endpoint_params->select_policy,
+			.adaptive_limit			=	endpoint_params->adaptive_limit,
+			.hostname				=	&hostname
 		};
 
 		if (StringUtil::start_with(other_info, "?maxconn="))
@@ -386,13 +443,16 @@ RouteManager::~RouteManager()
 CommSchedTarget *Router::create_target(const struct RouterParams *params,
 									   const struct addrinfo *addr)
 {
-	CommSchedTarget *target;
+	RouteManager::RouteTarget *target;
 
 	switch (params->transport_type)
 	{
 	case TT_TCP:
 	case TT_TCP_SSL:
-		target = new RouteTargetTCP();
+		if (addr->ai_family == AF_UNIX)
+			target = new RouteTargetUnix();
+		else
+			target = new RouteTargetTCP();
 		break;
 	case TT_UDP:
 		target = new RouteTargetUDP();
@@ -409,7 +469,26 @@ CommSchedTarget *Router::create_target(const struct RouterParams *params,
 	if (target->init(addr->ai_addr, addr->ai_addrlen, params->connect_timeout, params->response_timeout, params->max_connections) < 0)
 	{
 		delete target;
-		target = NULL;
+		return NULL;
+	}
+
+	if (params->transport_type == TT_TCP_SSL ||
+		params->transport_type == TT_SCTP_SSL)
+	{
+		target->sni = *params->hostname;
+		target->set_ssl(WFGlobal::get_ssl_client_ctx(),
+						params->ssl_connect_timeout);
+	}
+
+	target->set_max_receive_buffer(params->max_receive_buffer);
+	if (params->adaptive_limit)
+		target->set_adaptive_limit(true);
+
+	if (params->min_idle_connections > 0)
+	{
+		target->set_min_idle_connections(params->min_idle_connections,
+										 params->idle_keep_alive_timeout);
+		WFGlobal::get_scheduler()->prewarm(target);
 	}
 
 	return target;
@@ -6,6 +6,7 @@
 #include <netdb.h>
 #include <string>
 #include <mutex>
+#include <openssl/ssl.h>
 #include "rbtree.h"
 #include "WFConnection.h"
 #include "EndpointParams.h"
@@ -28,6 +29,7 @@ public:
 	{
 	public:
 		int state;
+		std::string sni;
 
 	private:
 		virtual CommConnection *new_connection(int)
@@ -35,12 +37,21 @@ public:
 			return new WFConnection;
 		}
 
+		virtual int init_ssl(SSL *ssl)
+		{
+			if (!this->sni.empty() &&
+				SSL_set_tlsext_host_name(ssl, this->sni.c_str()) <= 0)
+				return -1;
+
+			return 0;
+		}
+
 	public:
 		RouteTarget() : state(0) { }
 	};
 
 public:
-	int get(TransportType type, const struct addrinfo *addrinfo, const std::string& other_info, const struct EndpointParams *endpoint_params, RouteResult& result);
+	int get(TransportType type, const struct addrinfo *addrinfo, const std::string& other_info, const struct EndpointParams *endpoint_params, const std::string& hostname, RouteResult& result);
 
 	RouteManager()
 	{
@@ -89,6 +89,7 @@ public:
 	void disable_server(const std::string& address);
 	void enable_server(const std::string& address);
 	const UpstreamAddress *get(const ParsedURI& uri);
+	const UpstreamAddress *get_another(const UpstreamAddress *ua);
 	int set_select_callback(upstream_route_t&& select_callback);
 	int set_consistent_mode(upstream_route_t&& consistent_callback);
 	int set_attr(bool try_another, upstream_route_t rehash_callback);
@@ -195,6 +196,13 @@ UpstreamAddress::UpstreamAddress(const std::string& address,
 	if (this->params.group_id < 0)
 		this->params.group_id = -1;
 
+	if (address[0] == '/')
+	{
+		/* A unix socket path may contain ':', and has no port. */
+		arr.clear();
+		arr.push_back(address);
+	}
+
 	if (arr.size() == 0)
 		this->host = "";
 	else
@@ -661,6 +669,31 @@ const UpstreamAddress *Upstream::get(const ParsedURI& uri)
 	return ua;
 }
 
+/* An alive master at another address than 'ua', or NULL. */
+const UpstreamAddress *Upstream::get_another(const UpstreamAddress *ua)
+{
+	ReadLock lock(rwlock_);
+	unsigned int n = (unsigned int)masters_.size();
+	unsigned int start;
+
+	if (n <= 1)
+		return NULL;
+
+	start = rand() % n;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		const auto *master = masters_[(start + i) % n];
+
+		if (master->address != ua->address &&
+			master->fail_count < master->params.max_fails)
+		{
+			return master;
+		}
+	}
+
+	return NULL;
+}
+
 int Upstream::set_select_callback(upstream_route_t&& select_callback)
 {
 	WriteLock lock(rwlock_);
@@ -824,6 +857,38 @@ public:
 			return 0;
 		}
 
+		return fill_result(ua, uri, result);
+	}
+
+	int upstream_choose_another(ParsedURI& uri, void *cookie,
+								UpstreamManager::UpstreamResult& result)
+	{
+		const UpstreamAddress *ua = NULL;
+
+		if (cookie && uri.state == URI_STATE_SUCCESS && uri.host)
+		{
+			Upstream *upstream = NULL;
+			{
+				ReadLock lock(rwlock_);
+				auto it = upstream_map_.find(uri.host);
+				if (it != upstream_map_.end())
+					upstream = &it->second;
+			}
+
+			if (upstream)
+				ua = upstream->get_another((const UpstreamAddress *)cookie);
+		}
+
+		if (!ua)
+			return upstream_choose(uri, result);
+
+		return fill_result(ua, uri, result);
+	}
+
+private:
+	static int fill_result(const UpstreamAddress *ua, ParsedURI& uri,
+						   UpstreamManager::UpstreamResult& result)
+	{
 		char *host = NULL;
 		char *port = NULL;
 
@@ -888,4 +953,11 @@ int UpstreamManager::choose(ParsedURI& uri, UpstreamResult& result)
 {
 	auto *manager = __UpstreamManager::get_instance();
 	return manager->upstream_choose(uri, result);
-}
\ No newline at end of file
+}
+
+int UpstreamManager::choose_another(ParsedURI& uri, void *cookie,
+									UpstreamResult& result)
+{
+	auto *manager = __UpstreamManager::get_instance();
+	return manager->upstream_choose_another(uri, cookie, result);
+}
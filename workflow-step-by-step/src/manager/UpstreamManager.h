@@ -247,6 +247,9 @@ public:
 
 	/// @brief Internal use only
 	static int choose(ParsedURI& uri, UpstreamResult& result);
+	/// @brief Internal use only, an alive master other than 'cookie',
+	///        or as choose() if there is none
+	static int choose_another(ParsedURI& uri, void *cookie, UpstreamResult& result);
 	/// @brief Internal use only
 	static void notify_unavailable(void *cookie);
 	/// @brief Internal use only
@@ -89,6 +89,43 @@ private:
 	// int sync_max_;
 };
 
+class __SSLManager
+{
+public:
+	static __SSLManager *get_instance()
+	{
+		static __SSLManager kInstance;
+		return &kInstance;
+	}
+
+	SSL_CTX *get_ssl_client_ctx() { return ssl_client_ctx_; }
+
+private:
+	__SSLManager()
+	{
+		ssl_client_ctx_ = SSL_CTX_new(TLS_client_method());
+		if (ssl_client_ctx_ == NULL)
+			abort();
+
+		/* Large messages are written in 16KB pieces, and may stop half way. */
+		SSL_CTX_set_mode(ssl_client_ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+										  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+		/* Let the kernel do record encryption where it can. */
+		SSL_CTX_set_options(ssl_client_ctx_, SSL_OP_ENABLE_KTLS);
+#endif
+		CommTarget::enable_ssl_session_cache(ssl_client_ctx_);
+	}
+
+	~__SSLManager()
+	{
+		SSL_CTX_free(ssl_client_ctx_);
+	}
+
+private:
+	SSL_CTX *ssl_client_ctx_;
+};
+
 class __DNSManager
 {
 public:
@@ -154,6 +191,8 @@ private:
 		const auto *settings = __WFGlobal::get_instance()->get_global_settings();
 		int ret = scheduler_.init(settings->poller_threads, settings->handler_threads);
 
+		Communicator::set_max_receive_buffer(settings->max_receive_buffer);
+
 		if (ret < 0)
 			abort();
 	}
@@ -211,6 +250,26 @@ private:
 	DNSCache dns_cache_;
 };
 
+class __LatencyStats
+{
+public:
+	static __LatencyStats *get_instance()
+	{
+		static __LatencyStats kInstance;
+		return &kInstance;
+	}
+
+	LatencyStats *get_latency_stats() { return &latency_stats_; }
+
+private:
+	__LatencyStats() { }
+
+	~__LatencyStats() { }
+
+private:
+	LatencyStats latency_stats_;
+};
+
 class __ExecManager
 {
 protected:
@@ -308,6 +367,11 @@ const char *WFGlobal::get_default_port(const std::string& scheme)
 	return __WFGlobal::get_instance()->get_default_port(scheme);
 }
 
+SSL_CTX *WFGlobal::get_ssl_client_ctx()
+{
+	return __SSLManager::get_instance()->get_ssl_client_ctx();
+}
+
 ExecQueue *WFGlobal::get_dns_queue()
 {
 	return __CommManager::get_instance()->get_dns_queue();
@@ -318,7 +382,27 @@ Executor *WFGlobal::get_dns_executor()
 	return __CommManager::get_instance()->get_dns_executor();
 }
 
+int WFGlobal::drain(int timeout)
+{
+	return __CommManager::get_instance()->get_scheduler()->drain(timeout);
+}
+
+size_t WFGlobal::get_inflight()
+{
+	return __CommManager::get_instance()->get_scheduler()->get_inflight();
+}
+
+LatencyStats *WFGlobal::get_latency_stats()
+{
+	return __LatencyStats::get_instance()->get_latency_stats();
+}
+
 const WFGlobalSettings *WFGlobal::get_global_settings()
 {
 	return __WFGlobal::get_instance()->get_global_settings();
 }
+
+void WORKFLOW_library_init(const struct WFGlobalSettings *settings)
+{
+	__WFGlobal::get_instance()->set_global_settings(settings);
+}
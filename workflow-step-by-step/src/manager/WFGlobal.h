@@ -13,6 +13,7 @@
 #include "RouteManager.h"
 #include "Executor.h"
 #include "EndpointParams.h"
+#include "LatencyStats.h"
 
 /**
  * @file    WFGlobal.h
@@ -34,6 +35,10 @@ struct WFGlobalSettings
 	int poller_threads;
 	int handler_threads;
 	int compute_threads;			///< auto-set by system CPU number if value<=0
+	bool latency_stats;				///< keep per-target phase histograms of client tasks
+	size_t max_receive_buffer;		///< unconsumed received bytes of all connections, 0 for no limit
+	size_t coalesce_followers_max;	///< tasks sharing the reply of one request, 0 for no limit
+	size_t coalesce_total_max;		///< tasks sharing replies of all requests, 0 for no limit
 };
 
 /**
@@ -48,6 +53,10 @@ static constexpr struct WFGlobalSettings GLOBAL_SETTINGS_DEFAULT =
 	.poller_threads		=	1,
 	.handler_threads	=	1,
 	.compute_threads	=	-1,
+	.latency_stats		=	false,
+	.max_receive_buffer	=	0,
+	.coalesce_followers_max	=	1024,
+	.coalesce_total_max		=	64 * 1024,
 };
 
 /**
@@ -87,6 +96,25 @@ public:
 
     static const char *get_error_string(int state, int error);
 
+    /**
+	 * @brief      get phase histograms of client tasks, by peer "ip:port"
+	 * @note       only filled when settings latency_stats is true
+	 */
+	static LatencyStats *get_latency_stats();
+
+    /**
+	 * @brief      graceful shutdown: reject new network requests, wait for
+	 *             in-flight ones, then close connections with a FIN
+	 * @param[in]  timeout          milliseconds, -1 for no limit
+	 * @return     0 when drained, -1 with errno ETIMEDOUT when time ran out
+	 */
+	static int drain(int timeout);
+    /**
+	 * @brief      number of network requests not finished yet
+	 * @note       per target: CommTarget::get_inflight()
+	 */
+	static size_t get_inflight();
+
 public:
 	/// @brief Internal use only
 	static CommScheduler *get_scheduler();
@@ -95,6 +123,8 @@ public:
 	/// @brief Internal use only
 	static RouteManager *get_route_manager();
 	/// @brief Internal use only
+	static SSL_CTX *get_ssl_client_ctx();
+	/// @brief Internal use only
 	static ExecQueue *get_dns_queue();
 	/// @brief Internal use only
 	static Executor *get_dns_executor();
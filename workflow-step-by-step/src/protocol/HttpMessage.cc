@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <new>
+#include <atomic>
 #include "HttpMessage.h"
 
 namespace protocol
@@ -59,6 +61,131 @@ void HttpMessage::clear_output_body()
     this->output_body_size = 0;
 }
 
+bool HttpMessage::copy_output_body(const HttpMessage *msg)
+{
+    size_t n = sizeof (struct HttpMessageBlock) + msg->output_body_size;
+    struct HttpMessageBlock *block;
+    struct HttpMessageBlock *entry;
+    struct list_head *pos;
+    char *ptr;
+
+    this->clear_output_body();
+    if (msg->output_body_size == 0)
+        return true;
+
+    block = (struct HttpMessageBlock *)malloc(n);
+    if (!block)
+        return false;
+
+    block->ptr = block + 1;
+    block->size = msg->output_body_size;
+    ptr = (char *)block->ptr;
+    list_for_each(pos, &msg->output_body)
+    {
+        entry = list_entry(pos, struct HttpMessageBlock, list);
+        memcpy(ptr, entry->ptr, entry->size);
+        ptr += entry->size;
+    }
+
+    list_add_tail(&block->list, &this->output_body);
+    this->output_body_size = block->size;
+    return true;
+}
+
+struct HttpMessageBuffer
+{
+    std::atomic<int> ref;
+    void *msgbuf;
+};
+
+void HttpMessage::release_buffer()
+{
+    if (this->buffer)
+    {
+        /* Not ours to free in http_parser_deinit(). */
+        this->parser->msgbuf = NULL;
+        if (--this->buffer->ref == 0)
+        {
+            free(this->buffer->msgbuf);
+            delete this->buffer;
+        }
+
+        this->buffer = NULL;
+    }
+}
+
+bool HttpMessage::share_message(HttpMessage *msg)
+{
+    http_parser_t *src = msg->parser;
+    http_parser_t *dst = this->parser;
+    http_header_cursor_t cursor;
+    struct HttpMessageHeader header;
+    const void *body;
+    size_t size;
+
+    if (!src->complete || msg == this)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    /* Segments are not shared, as get_parsed_body() on either message
+     * would replace them under the other. */
+    if (src->segsize != 0 && !msg->get_parsed_body(&body, &size))
+        return false;
+
+    if (!msg->buffer)
+    {
+        msg->buffer = new (std::nothrow) struct HttpMessageBuffer;
+        if (!msg->buffer)
+            return false;
+
+        msg->buffer->ref = 1;
+        msg->buffer->msgbuf = src->msgbuf;
+    }
+
+    this->release_buffer();
+    http_parser_deinit(dst);
+    http_parser_init(src->is_resp, dst);
+    if ((src->version && http_parser_set_version(src->version, dst) < 0) ||
+        (src->method && http_parser_set_method(src->method, dst) < 0) ||
+        (src->uri && http_parser_set_uri(src->uri, dst) < 0) ||
+        (src->code && http_parser_set_code(src->code, dst) < 0) ||
+        (src->phrase && http_parser_set_phrase(src->phrase, dst) < 0))
+    {
+        return false;
+    }
+
+    http_header_cursor_init(&cursor, src);
+    while (http_header_cursor_next(&header.name, &header.name_len,
+                                   &header.value, &header.value_len,
+                                   &cursor) == 0)
+    {
+        if (!this->add_header(&header))
+        {
+            http_header_cursor_deinit(&cursor);
+            return false;
+        }
+    }
+
+    http_header_cursor_deinit(&cursor);
+    dst->header_state = src->header_state;
+    dst->header_offset = src->header_offset;
+    dst->content_length = src->content_length;
+    dst->transfer_length = src->transfer_length;
+    dst->msgbuf = src->msgbuf;
+    dst->msgsize = src->msgsize;
+    dst->bufsize = src->bufsize;
+    dst->keep_alive = src->keep_alive;
+    dst->chunked = src->chunked;
+    dst->complete = 1;
+
+    msg->buffer->ref++;
+    this->buffer = msg->buffer;
+    this->cur_size = msg->cur_size;
+    return true;
+}
+
 struct list_head *HttpMessage::combine_from(struct list_head *pos, size_t size)
 {
     size_t n = sizeof (struct HttpMessageBlock) + size;
@@ -207,6 +334,9 @@ HttpMessage::HttpMessage(HttpMessage&& msg)
 
     this->cur_size = msg.cur_size;
     msg.cur_size = 0;
+
+    this->buffer = msg.buffer;
+    msg.buffer = NULL;
 }
 
 HttpMessage& HttpMessage::operator= (HttpMessage&& msg)
@@ -216,6 +346,7 @@ HttpMessage& HttpMessage::operator= (HttpMessage&& msg)
         this->size_limit = msg.size_limit;
         msg.size_limit = (size_t)-1;
 
+        this->release_buffer();
         http_parser_deinit(this->parser);
         delete this->parser;
 
@@ -230,6 +361,9 @@ HttpMessage& HttpMessage::operator= (HttpMessage&& msg)
 
         this->cur_size = msg.cur_size;
         msg.cur_size = 0;
+
+        this->buffer = msg.buffer;
+        msg.buffer = NULL;
     }
     return *this;
 }
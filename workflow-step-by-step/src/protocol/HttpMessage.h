@@ -16,6 +16,8 @@
 namespace protocol
 {
 
+struct HttpMessageBuffer;
+
 struct HttpMessageHeader
 {
     const void *name;
@@ -69,11 +71,23 @@ public:
         return http_parser_set_header(name, strlen(name), value, strlen(value), this->parser) == 0;
     }
 
+    /* A large body is received in pieces, and is copied into one here on
+     * the first call. get_parsed_body_iov() has it without copying.
+     * Though const, that first call changes the message: it must not run
+     * at the same time as any other call on it, and vectors got before
+     * are no longer valid. Once it has returned, later calls only read. */
     bool get_parsed_body(const void **body, size_t *size) const 
     {
         return http_parser_get_body(body, size, this->parser) == 0;
     }
 
+    /* Fills at most max vectors and returns the number the body takes,
+     * or -1 if there is no parsed body. Only reads the message. */
+    int get_parsed_body_iov(struct iovec vectors[], int max) const
+    {
+        return http_parser_get_body_iov(vectors, max, this->parser);
+    }
+
     /* Call when the message is incomplete, but you want the parsed body.
 	 * If get_parse_body() still returns false after calling this function,
 	 * even header is incomplete. In a success state task, messages are
@@ -89,11 +103,19 @@ public:
 	bool append_output_body(const void *buf, size_t size);
 	bool append_output_body_nocopy(const void *buf, size_t size);
 	void clear_output_body();
+	/* Replaces the output body with a copy of msg's, in one block. */
+	bool copy_output_body(const HttpMessage *msg);
 	size_t get_output_body_size() const
 	{
 		return this->output_body_size;
 	}
 
+	/* Makes this a copy of msg, a complete received message, sharing its
+	 * buffer rather than copying the body. Either may go first; the buffer
+	 * goes with the last of the messages sharing it. A body received in
+	 * pieces is made contiguous first. */
+	bool share_message(HttpMessage *msg);
+
 /* std::string interface */
 public:
 	bool get_http_version(std::string& version) const
@@ -146,10 +168,13 @@ protected:
 
 private:
 	struct list_head *combine_from(struct list_head *pos, size_t size);
+	void release_buffer();
 
 private:
     struct list_head output_body;
     size_t output_body_size;
+    /* Set while parser->msgbuf is shared with other messages. */
+    struct HttpMessageBuffer *buffer;
 
 public:
     HttpMessage(bool is_resp) : parser(new http_parser_t)
@@ -158,11 +183,13 @@ public:
         INIT_LIST_HEAD(&this->output_body);
         this->output_body_size = 0;
         this->cur_size = 0;
+        this->buffer = NULL;
     }
 
     virtual ~HttpMessage()
 	{
 		this->clear_output_body();
+		this->release_buffer();
 		http_parser_deinit(this->parser);
 		delete this->parser;
 	}
@@ -1,6 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
 #include "list.h"
 #include "http_parser.h"
 
@@ -12,6 +16,7 @@
 #define HTTP_CHUNK_LINE_MAX		1024
 #define HTTP_TRAILER_LINE_MAX	8192
 #define HTTP_MSGBUF_INIT_SIZE	2048
+#define HTTP_SEGMENT_POOL_MAX	64
 
 enum
 {
@@ -28,6 +33,91 @@ enum
 	CPS_CHUNK_COMPLETE
 };
 
+/* First byte in [p, end) that is 'c' or '\0', or 'end'. Header lines are
+ * found 16 or 32 bytes at a time where the CPU allows, picked on first use. */
+static const char *__find_delim_scalar(const char *p, const char *end, int c)
+{
+	while (p < end && *p != c && *p != '\0')
+		p++;
+
+	return p;
+}
+
+#if defined(__SSE2__)
+static const char *__find_delim_sse2(const char *p, const char *end, int c)
+{
+	__m128i needle = _mm_set1_epi8((char)c);
+	__m128i zero = _mm_setzero_si128();
+	__m128i v;
+	int mask;
+
+	while (end - p >= 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, needle),
+											  _mm_cmpeq_epi8(v, zero)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+
+		p += 16;
+	}
+
+	return __find_delim_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char *__find_delim_avx2(const char *p, const char *end, int c)
+{
+	__m256i needle = _mm256_set1_epi8((char)c);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i v;
+	unsigned int mask;
+
+	while (end - p >= 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)p);
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, needle),
+													_mm256_cmpeq_epi8(v, zero)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+
+		p += 32;
+	}
+
+	/* Inline, as a call into legacy SSE code would pay the AVX to SSE
+	 * transition if the upper halves are still dirty. */
+	while (p < end && *p != c && *p != '\0')
+		p++;
+
+	return p;
+}
+#endif
+
+static const char *__find_delim_init(const char *p, const char *end, int c);
+
+static const char *(*__find_delim_impl)(const char *, const char *, int) =
+	__find_delim_init;
+
+static const char *__find_delim_init(const char *p, const char *end, int c)
+{
+	const char *(*impl)(const char *, const char *, int) = __find_delim_scalar;
+
+#if defined(__SSE2__)
+	impl = __find_delim_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = __find_delim_avx2;
+#endif
+
+	__atomic_store_n(&__find_delim_impl, impl, __ATOMIC_RELAXED);
+	return impl(p, end, c);
+}
+
+static inline const char *__find_delim(const char *p, const char *end, int c)
+{
+	return __atomic_load_n(&__find_delim_impl, __ATOMIC_RELAXED)(p, end, c);
+}
+
 struct __header_line
 {
 	struct list_head list;
@@ -36,6 +126,18 @@ struct __header_line
 	char *buf;
 };
 
+struct __http_segment
+{
+	struct list_head list;
+	size_t size;
+	char data[HTTP_SEGMENT_SIZE];
+};
+
+/* Free segments, kept for the next large body. */
+static struct list_head __segment_pool = LIST_HEAD_INIT(__segment_pool);
+static size_t __segment_pool_size;
+static pthread_mutex_t __segment_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int http_parser_add_header(const void *name, size_t name_len, const void *value, size_t value_len, http_parser_t *parser)
 {
 	size_t size = sizeof (struct __header_line) + name_len + value_len + 4;
@@ -246,6 +348,7 @@ static int __parse_start_line(const char *ptr, size_t len, http_parser_t *parser
 {
 	char start_line[HTTP_START_LINE_MAX];
 	size_t min = MIN(HTTP_START_LINE_MAX, len);
+	const char *p;
 	char *p1, *p2, *p3;
 	size_t i;
 	int ret;
@@ -256,57 +359,52 @@ static int __parse_start_line(const char *ptr, size_t len, http_parser_t *parser
 		return 1;
 	}
 
-	for (i = 0; i < min; i++)
-	{
-		start_line[i] = ptr[i];
-		if (start_line[i] == '\r')
-		{
-			if (i == len - 1)
-				return 0;
-
-			if (ptr[i + 1] != '\n')
-				return -2;
+	p = __find_delim(ptr, ptr + min, '\r');
+	if (p == ptr + min)
+		return min == HTTP_START_LINE_MAX ? -2 : 0;
 
-			start_line[i] = '\0';
-			p1 = start_line;
-			p2 = strchr(p1, ' ');
-			if (p2)
-				*p2++ = '\0';
-			else
-				return -2;
+	if (*p == '\0')
+		return -2;
 
-			p3 = strchr(p2, ' ');
-			if (p3)
-				*p3++ = '\0';
-			else
-				return -2;
+	i = p - ptr;
+	if (i == len - 1)
+		return 0;
 
-			if (parser->is_resp)
-				ret = __match_status_line(p1, p2, p3, parser);
-			else
-				ret = __match_request_line(p1, p2, p3, parser);
+	if (ptr[i + 1] != '\n')
+		return -2;
 
-			if (ret < 0)
-				return -1;
+	memcpy(start_line, ptr, i);
+	start_line[i] = '\0';
+	p1 = start_line;
+	p2 = strchr(p1, ' ');
+	if (p2)
+		*p2++ = '\0';
+	else
+		return -2;
 
-			parser->header_offset += i + 2;
-			parser->header_state = HPS_HEADER_NAME;
-			return 1;
-		}
+	p3 = strchr(p2, ' ');
+	if (p3)
+		*p3++ = '\0';
+	else
+		return -2;
 
-		if (start_line[i] == '\0')
-			return -2;
-	}
+	if (parser->is_resp)
+		ret = __match_status_line(p1, p2, p3, parser);
+	else
+		ret = __match_request_line(p1, p2, p3, parser);
 
-	if (i == HTTP_START_LINE_MAX)
-		return -2;
+	if (ret < 0)
+		return -1;
 
-	return 0;
+	parser->header_offset += i + 2;
+	parser->header_state = HPS_HEADER_NAME;
+	return 1;
 }
 
 static int __parse_header_name(const char *ptr, size_t len, http_parser_t *parser)
 {
 	size_t min = MIN(HTTP_HEADER_NAME_MAX, len);
+	const char *p;
 	size_t i;
 
 	if (len >= 2 && ptr[0] == '\r' && ptr[1] == '\n')
@@ -316,26 +414,19 @@ static int __parse_header_name(const char *ptr, size_t len, http_parser_t *parse
 		return 1;
 	}
 
-	for (i = 0; i < min; i++)
-	{
-		if (ptr[i] == ':')
-		{
-			parser->namebuf[i] = '\0';
-			parser->header_offset += i + 1;
-			parser->header_state = HPS_HEADER_VALUE;
-			return 1;
-		}
-
-		if (ptr[i] == '\0')
-			return -2;
-
-		parser->namebuf[i] = ptr[i];
-	}
+	p = __find_delim(ptr, ptr + min, ':');
+	if (p == ptr + min)
+		return min == HTTP_HEADER_NAME_MAX ? -2 : 0;
 
-	if (i == HTTP_HEADER_NAME_MAX)
+	if (*p == '\0')
 		return -2;
 
-	return 0;
+	i = p - ptr;
+	memcpy(parser->namebuf, ptr, i);
+	parser->namebuf[i] = '\0';
+	parser->header_offset += i + 1;
+	parser->header_state = HPS_HEADER_VALUE;
+	return 1;
 }
 
 static int __parse_header_value(const char *ptr, size_t len, http_parser_t *parser)
@@ -343,67 +434,51 @@ static int __parse_header_value(const char *ptr, size_t len, http_parser_t *pars
     char  header_value[HTTP_HEADER_VALUE_MAX];
     const char *end = ptr + len;
     const char *begin = ptr;
-    size_t i = 0;
+    const char *p;
+    size_t min;
+    size_t i;
 
     while (1)
     {
-        while (1)
-        {
-            if (ptr == end)
-                return 0;
-            if (*ptr == ' ' || *ptr == '\t')
-                ptr++;
-            else
-                break;
-        }
-        
-        while (1)
-        {
-            if (i == HTTP_HEADER_VALUE_MAX)
-                return -2;
-            header_value[i] = *ptr++;
-            if (ptr == end)
-                return 0;
-            
-            if (header_value[i] == '\r')
-                break;
-            
-            if (header_value[i] == '\0')
-                return -2;
-            
-            i++;
-        }
-
-        if (*ptr == '\n')
-            ptr++;
-        else
-            return -2;
-        
         if (ptr == end)
             return 0;
-        
-        while (i > 0)
-        {
-            if (header_value[i - 1] == ' ' || header_value[i - 1] == '\t')
-                i--;
-            else 
-                break;
-        }
-
-        if (*ptr != ' ' || *ptr != '\t')
+        if (*ptr == ' ' || *ptr == '\t')
+            ptr++;
+        else
             break;
+    }
+
+    min = MIN(HTTP_HEADER_VALUE_MAX, end - ptr);
+    p = __find_delim(ptr, ptr + min, '\r');
+    if (p == ptr + min)
+        return min == HTTP_HEADER_VALUE_MAX && p != end ? -2 : 0;
+
+    if (p + 1 == end)
+        return 0;
 
-        ptr++;
-        header_value[i++] = ' ';
+    if (*p == '\0' || p[1] != '\n')
+        return -2;
+
+    if (p + 2 == end)
+        return 0;
+
+    i = p - ptr;
+    while (i > 0)
+    {
+        if (ptr[i - 1] == ' ' || ptr[i - 1] == '\t')
+            i--;
+        else
+            break;
     }
 
+    memcpy(header_value, ptr, i);
     header_value[i] = '\0';
     if (__match_message_header(parser->namebuf, strlen(parser->namebuf), header_value, i, parser) < 0)
         return -1;
-    parser->header_offset += ptr - begin;
+    parser->header_offset += p + 2 - begin;
     parser->header_state = HPS_HEADER_NAME;
     return 1;
-}   
+}
 
 static int __parse_message_header(const void *message, size_t size, http_parser_t *parser)
 {
@@ -444,6 +519,8 @@ void http_parser_init(int is_resp, http_parser_t *parser)
     parser->msgbuf = NULL;
     parser->msgsize = 0;
     parser->bufsize = 0;
+    INIT_LIST_HEAD(&parser->segment_list);
+    parser->segsize = 0;
     parser->expect_continue = 0;
     parser->keep_alive = 1;
     parser->chunked = 0;
@@ -488,11 +565,7 @@ static int __parse_chunk_data(const char *ptr, size_t len, http_parser_t *parser
 				parser->chunk_state = CPS_TRAILER_PART;
 			}
 			else if ((unsigned long)chunk_size < CHUNK_SIZE_MAX)
-			{
 				chunk_size += i + 4;
-				if (len < (size_t)chunk_size)
-					return 0;
-			}
 			else
 				return -2;
 
@@ -536,16 +609,77 @@ static int __parse_trailer_part(const char *ptr, size_t len, http_parser_t *pars
 	return 0;
 }
 
-static int __parse_chunk(const void *message, size_t size, http_parser_t *parser)
+/* 'size' bytes of the message from 'offset', or all there are, in place
+ * if they are in one piece, else copied to 'buf'. Looks up from the end,
+ * where the parsing is. */
+static const char *__message_at(size_t offset, size_t *size, char *buf,
+								http_parser_t *parser)
 {
+	size_t start = parser->msgsize - parser->segsize;
+	size_t want = MIN(*size, parser->msgsize - offset);
+	struct list_head *pos = &parser->segment_list;
+	struct __http_segment *seg;
+	const char *ptr;
+	size_t copied = 0;
+	size_t n;
+
+	*size = want;
+	if (want == 0)
+		return buf;
+
+	if (offset < start)
+	{
+		ptr = (const char *)parser->msgbuf + offset;
+		n = start - offset;
+	}
+	else
+	{
+		start = parser->msgsize;
+		do
+		{
+			pos = pos->prev;
+			seg = list_entry(pos, struct __http_segment, list);
+			start -= seg->size;
+		} while (offset < start);
+
+		ptr = seg->data + offset - start;
+		n = start + seg->size - offset;
+	}
+
+	if (n >= want)
+		return ptr;
+
+	while (1)
+	{
+		memcpy(buf + copied, ptr, n);
+		copied += n;
+		if (copied == want)
+			return buf;
+
+		pos = pos->next;
+		seg = list_entry(pos, struct __http_segment, list);
+		ptr = seg->data;
+		n = MIN(seg->size, want - copied);
+	}
+}
+
+static int __parse_chunk(http_parser_t *parser)
+{
+	char buf[HTTP_TRAILER_LINE_MAX + 1];
 	const char *ptr;
 	size_t len;
+	size_t n;
 	int ret;
 
 	do
 	{
-		ptr = (const char*)message + parser->chunk_offset;
-		len = size - parser->chunk_offset;
+		/* Past the end while chunk data is still coming. */
+		if (parser->chunk_offset >= parser->msgsize)
+			return 0;
+
+		len = parser->msgsize - parser->chunk_offset;
+		n = sizeof buf;
+		ptr = __message_at(parser->chunk_offset, &n, buf, parser);
 		if (parser->chunk_state == CPS_CHUNK_DATA)
 			ret = __parse_chunk_data(ptr, len, parser);
 		else /* if (parser->chunk_state == CPS_TRALIER_PART)*/
@@ -558,6 +692,113 @@ static int __parse_chunk(const void *message, size_t size, http_parser_t *parser
 	return ret;
 }
 
+static struct __http_segment *__segment_alloc()
+{
+	struct __http_segment *seg = NULL;
+
+	pthread_mutex_lock(&__segment_pool_mutex);
+	if (!list_empty(&__segment_pool))
+	{
+		seg = list_entry(__segment_pool.next, struct __http_segment, list);
+		list_del(&seg->list);
+		__segment_pool_size--;
+	}
+
+	pthread_mutex_unlock(&__segment_pool_mutex);
+	if (!seg)
+	{
+		seg = (struct __http_segment *)malloc(sizeof (struct __http_segment));
+		if (!seg)
+			return NULL;
+	}
+
+	seg->size = 0;
+	return seg;
+}
+
+static void __segment_free(struct __http_segment *seg)
+{
+	pthread_mutex_lock(&__segment_pool_mutex);
+	if (__segment_pool_size < HTTP_SEGMENT_POOL_MAX)
+	{
+		list_add(&seg->list, &__segment_pool);
+		__segment_pool_size++;
+		seg = NULL;
+	}
+
+	pthread_mutex_unlock(&__segment_pool_mutex);
+	free(seg);
+}
+
+static int __append_segments(const char *buf, size_t n, http_parser_t *parser)
+{
+	struct __http_segment *seg = NULL;
+	size_t len;
+
+	if (!list_empty(&parser->segment_list))
+		seg = list_entry(parser->segment_list.prev, struct __http_segment, list);
+
+	while (n > 0)
+	{
+		if (!seg || seg->size == HTTP_SEGMENT_SIZE)
+		{
+			seg = __segment_alloc();
+			if (!seg)
+				return -1;
+
+			list_add_tail(&seg->list, &parser->segment_list);
+		}
+
+		len = MIN(n, HTTP_SEGMENT_SIZE - seg->size);
+		memcpy(seg->data + seg->size, buf, len);
+		seg->size += len;
+		parser->segsize += len;
+		parser->msgsize += len;
+		buf += len;
+		n -= len;
+	}
+
+	return 0;
+}
+
+/* Drops what came after the end of the message. */
+static void __truncate_message(size_t size, http_parser_t *parser)
+{
+	size_t excess = parser->msgsize - size;
+	struct __http_segment *seg;
+
+	while (excess > 0 && !list_empty(&parser->segment_list))
+	{
+		seg = list_entry(parser->segment_list.prev, struct __http_segment, list);
+		if (seg->size > excess)
+		{
+			seg->size -= excess;
+			parser->segsize -= excess;
+			break;
+		}
+
+		excess -= seg->size;
+		parser->segsize -= seg->size;
+		list_del(&seg->list);
+		__segment_free(seg);
+	}
+
+	parser->msgsize = size;
+}
+
+static void __free_segments(http_parser_t *parser)
+{
+	struct list_head *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, &parser->segment_list)
+	{
+		list_del(pos);
+		__segment_free(list_entry(pos, struct __http_segment, list));
+	}
+
+	parser->segsize = 0;
+}
+
 int http_parser_append_message(const void *buf, size_t *n, http_parser_t *parser)
 {
 	int ret;
@@ -567,23 +808,36 @@ int http_parser_append_message(const void *buf, size_t *n, http_parser_t *parser
 		return 1;
 	}
 
-	if (parser->msgsize + *n + 1 > parser->bufsize)
+	/* Past one segment, the body goes to segments rather than moving all
+	 * that came before to a larger msgbuf. */
+	if (parser->header_state == HPS_HEADER_COMPLETE &&
+		(parser->segsize != 0 || parser->msgsize + *n >= HTTP_SEGMENT_SIZE))
+	{
+		if (__append_segments((const char *)buf, *n, parser) < 0)
+			return -1;
+	}
+	else
 	{
-		size_t new_size = MAX(HTTP_MSGBUF_INIT_SIZE, 2 * parser->bufsize);
-		void *new_base;
+		if (parser->msgsize + *n + 1 > parser->bufsize)
+		{
+			size_t new_size = MAX(HTTP_MSGBUF_INIT_SIZE, 2 * parser->bufsize);
+			void *new_base;
 
-		while (new_size < parser->msgsize + *n + 1)
-			new_size *= 2;
+			while (new_size < parser->msgsize + *n + 1)
+				new_size *= 2;
 		
-		new_base = realloc(parser->msgbuf, new_size);
-		if (!new_base)
-			return -1;
-		parser->msgbuf = new_base;
-		parser->bufsize = new_size;
+			new_base = realloc(parser->msgbuf, new_size);
+			if (!new_base)
+				return -1;
+			parser->msgbuf = new_base;
+			parser->bufsize = new_size;
+		}
+
+		memcpy((char *)parser->msgbuf + parser->msgsize, buf, *n);
+		parser->msgsize += *n;
 	}
 
-	memcpy((char *)parser->msgbuf + parser->msgsize, buf, *n);
-	parser->msgsize += *n;
+
 	if (parser->header_state != HPS_HEADER_COMPLETE)
 	{
 		ret = __parse_message_header(parser->msgbuf, parser->msgsize, parser);
@@ -604,7 +858,7 @@ int http_parser_append_message(const void *buf, size_t *n, http_parser_t *parser
 		if (parser->msgsize >= total)
 		{
 			*n -= parser->msgsize - total;
-			parser->msgsize = total;
+			__truncate_message(total, parser);
 			parser->complete = 1;
 			return 1;
 		}
@@ -616,20 +870,44 @@ int http_parser_append_message(const void *buf, size_t *n, http_parser_t *parser
 	
 	if (parser->chunk_state != CPS_CHUNK_COMPLETE)
 	{
-		ret = __parse_chunk(parser->msgbuf, parser->msgsize, parser);
+		ret = __parse_chunk(parser);
 		if (ret <= 0)
 			return ret;
 	}
 	*n -= parser->msgsize - parser->chunk_offset;
-	parser->msgsize = parser->chunk_offset;
+	__truncate_message(parser->chunk_offset, parser);
 	parser->complete = 1;
 	return 1;
 }						   
 
 int http_parser_get_body(const void **body, size_t *size, http_parser_t *parser)
 {
+	struct __http_segment *seg;
+	struct list_head *pos;
+	size_t offset;
+	void *new_base;
+
 	if (parser->complete && parser->header_state == HPS_HEADER_COMPLETE)
 	{
+		if (parser->segsize != 0)
+		{
+			offset = parser->msgsize - parser->segsize;
+			new_base = realloc(parser->msgbuf, parser->msgsize + 1);
+			if (!new_base)
+				return -1;
+
+			list_for_each(pos, &parser->segment_list)
+			{
+				seg = list_entry(pos, struct __http_segment, list);
+				memcpy((char *)new_base + offset, seg->data, seg->size);
+				offset += seg->size;
+			}
+
+			__free_segments(parser);
+			parser->msgbuf = new_base;
+			parser->bufsize = parser->msgsize + 1;
+		}
+
 		*body = (char *)parser->msgbuf + parser->header_offset;
 		*size = parser->msgsize - parser->header_offset;
 		((char *)parser->msgbuf)[parser->msgsize] = '\0';
@@ -638,6 +916,42 @@ int http_parser_get_body(const void **body, size_t *size, http_parser_t *parser)
 	return 1;
 }
 
+int http_parser_get_body_iov(struct iovec vectors[], int max, http_parser_t *parser)
+{
+	size_t size = parser->msgsize - parser->segsize;
+	struct __http_segment *seg;
+	struct list_head *pos;
+	int i = 0;
+
+	if (!parser->complete || parser->header_state != HPS_HEADER_COMPLETE)
+		return -1;
+
+	if (size > parser->header_offset)
+	{
+		if (i < max)
+		{
+			vectors[i].iov_base = (char *)parser->msgbuf + parser->header_offset;
+			vectors[i].iov_len = size - parser->header_offset;
+		}
+
+		i++;
+	}
+
+	list_for_each(pos, &parser->segment_list)
+	{
+		if (i < max)
+		{
+			seg = list_entry(pos, struct __http_segment, list);
+			vectors[i].iov_base = seg->data;
+			vectors[i].iov_len = seg->size;
+		}
+
+		i++;
+	}
+
+	return i;
+}
+
 int http_header_cursor_next(const void **name, size_t *name_len, const void **value, size_t *value_len, http_header_cursor_t *cursor)
 {
 	struct __header_line *line;
@@ -698,6 +1012,7 @@ void http_parser_deinit(http_parser_t *parser)
 	free(parser->code);
 	free(parser->phrase);
 	free(parser->msgbuf);
+	__free_segments(parser);
 }
 
 int http_header_cursor_find(const void *name, size_t name_len, const void **value, size_t *value_len, http_header_cursor_t *cursor)
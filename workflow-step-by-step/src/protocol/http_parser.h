@@ -2,9 +2,11 @@
 #define _HTTP_PARSER_H_
 
 #include <stddef.h>
+#include <sys/uio.h>
 #include "list.h"
 
 #define HTTP_HEADER_NAME_MAX	64
+#define HTTP_SEGMENT_SIZE		(64 * 1024)
 
 typedef struct __http_parser
 {
@@ -24,6 +26,11 @@ typedef struct __http_parser
 	void *msgbuf;
 	size_t msgsize;
 	size_t bufsize;
+	/* The header, and the body while the message fits in one segment, are
+	 * in msgbuf. The rest of the body is in segments of HTTP_SEGMENT_SIZE,
+	 * never moved once received. msgsize counts both. */
+	struct list_head segment_list;
+	size_t segsize;
 	char expect_continue;
 	char keep_alive;
 	char chunked;
@@ -45,6 +52,7 @@ extern "C"
 void http_parser_init(int is_resp, http_parser_t *parser);
 int http_parser_append_message(const void *buf, size_t *n, http_parser_t *parser);
 int http_parser_get_body(const void **body, size_t *size, http_parser_t *parser);
+int http_parser_get_body_iov(struct iovec vectors[], int max, http_parser_t *parser);
 int http_parser_header_complete(http_parser_t *parser);
 int http_parser_set_method(const char *method, http_parser_t *parser);
 int http_parser_set_uri(const char *uri, http_parser_t *parser);
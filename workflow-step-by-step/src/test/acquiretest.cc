@@ -0,0 +1,364 @@
+/* Many threads acquiring slots of the same targets, directly and through
+ * a group.
+ * Usage: acquiretest [rounds]
+ * Three local backends reply after up to 5ms. Each target has 3 slots.
+ * Clients of a group with the first two compete with clients of the
+ * first alone, so releases grant target waiters and group waiters. A
+ * third target has clients of its own. Some clients wait without limit
+ * and some for 2ms, and these are served first. No target may ever be
+ * above its limit, as sampled and as seen by the backends, and every
+ * request must finish: served, or turned away with ETIMEDOUT. A lost
+ * waiter hangs, and fails the test after 60s. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+
+#define RPC_SIZE		64
+#define BACKENDS		3
+#define SLOTS			3
+#define WAIT_TIMEOUT	2
+
+struct Backend
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	std::atomic<int> serving;
+	std::atomic<int> max_serving;
+};
+
+struct ClientContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	CommSchedObject *object;
+	CommScheduler *scheduler;
+	int wait_timeout;
+	bool done;
+	int state;
+	int error;
+};
+
+static Backend backends[BACKENDS];
+static CommSchedTarget targets[BACKENDS];
+static std::atomic<int> over_limit;
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+static void check_load(CommSchedTarget *target)
+{
+	if (target->get_cur_load() > target->get_limit())
+		over_limit++;
+}
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(ClientContext *ctx) :
+		CommRequest(ctx->object, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = ctx->wait_timeout;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual SubTask *done()
+	{
+		ClientContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state = this->state;
+		ctx->error = this->error;
+		ctx->done = true;
+		ctx->cond.notify_one();
+		delete this;
+		return NULL;
+	}
+
+	ClientContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static void serve_conn(Backend *backend, int fd)
+{
+	unsigned int seed = (unsigned int)fd;
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+	int cur;
+	int max;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			cur = ++backend->serving;
+			max = backend->max_serving;
+			while (cur > max && !backend->max_serving.compare_exchange_weak(max, cur))
+				;
+
+			usleep(rand_r(&seed) % 5000);
+			backend->serving--;
+			if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	close(fd);
+}
+
+static void run_backend(Backend *backend)
+{
+	int fd;
+
+	while ((fd = accept(backend->listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, backend, fd).detach();
+}
+
+static int backend_start(Backend *backend)
+{
+	socklen_t addrlen = sizeof backend->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	backend->addr.sin_family = AF_INET;
+	backend->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	backend->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&backend->addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)&backend->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	backend->listenfd = fd;
+	backend->serving = 0;
+	backend->max_serving = 0;
+	std::thread(run_backend, backend).detach();
+	return 0;
+}
+
+struct ClientResult
+{
+	int served;
+	int timed_out;
+	int errors;
+};
+
+static std::mutex running_mutex;
+static std::condition_variable running_cond;
+static int running;
+
+static void run_client(CommSchedObject *object, CommScheduler *scheduler,
+					   int wait_timeout, int rounds, ClientResult *result)
+{
+	ClientContext ctx;
+	int i;
+
+	ctx.object = object;
+	ctx.scheduler = scheduler;
+	ctx.wait_timeout = wait_timeout;
+	for (i = 0; i < rounds; i++)
+	{
+		ctx.done = false;
+		(new RpcRequest(&ctx))->dispatch();
+
+		std::unique_lock<std::mutex> lock(ctx.mutex);
+		while (!ctx.done)
+			ctx.cond.wait(lock);
+
+		if (ctx.state == CS_STATE_SUCCESS)
+			result->served++;
+		else if (ctx.error == ETIMEDOUT)
+			result->timed_out++;
+		else
+			result->errors++;
+	}
+
+	std::lock_guard<std::mutex> lock(running_mutex);
+	running--;
+	running_cond.notify_one();
+}
+
+static std::atomic<bool> monitor_stop;
+
+static void run_monitor()
+{
+	int i;
+
+	while (!monitor_stop)
+	{
+		for (i = 0; i < BACKENDS; i++)
+			check_load(&targets[i]);
+
+		usleep(100);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 200;
+	std::vector<std::thread> clients;
+	std::vector<ClientResult> results;
+	CommScheduler scheduler;
+	CommSchedGroup group;
+	ClientResult total = { };
+	CommSchedObject *object;
+	int failed = 0;
+	int wait_timeout;
+	int i;
+
+	if (rounds <= 0)
+	{
+		fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (scheduler.init(1, 4) < 0 || group.init() < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	for (i = 0; i < BACKENDS; i++)
+	{
+		if (backend_start(&backends[i]) < 0 ||
+			targets[i].init((const struct sockaddr *)&backends[i].addr,
+							sizeof backends[i].addr, 1000, 5000, SLOTS) < 0)
+		{
+			perror("backend");
+			return 1;
+		}
+	}
+
+	group.add(&targets[0]);
+	group.add(&targets[1]);
+
+	/* 8 on the group, 4 on its first member, 4 on the third target. */
+	results.resize(16);
+	running = 16;
+	std::thread monitor(run_monitor);
+	for (i = 0; i < 16; i++)
+	{
+		if (i < 8)
+			object = &group;
+		else if (i < 12)
+			object = &targets[0];
+		else
+			object = &targets[2];
+
+		wait_timeout = i % 2 ? WAIT_TIMEOUT : -1;
+		clients.emplace_back(run_client, object, &scheduler, wait_timeout,
+							 rounds, &results[i]);
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(running_mutex);
+
+		if (!running_cond.wait_for(lock, std::chrono::seconds(60),
+								   [] { return running == 0; }))
+		{
+			printf("%d clients still waiting: FAILED\n", running);
+			fflush(stdout);
+			_exit(1);
+		}
+	}
+
+	monitor_stop = true;
+	monitor.join();
+	for (i = 0; i < 16; i++)
+	{
+		clients[i].join();
+		total.served += results[i].served;
+		total.timed_out += results[i].timed_out;
+		total.errors += results[i].errors;
+	}
+
+	printf("requests %d  served %d  timed out %d  errors %d\n",
+		   16 * rounds, total.served, total.timed_out, total.errors);
+	/* Both grants and timeouts must have happened, or the test tested
+	 * nothing. */
+	if (total.served + total.timed_out != 16 * rounds || total.errors != 0 ||
+		total.served == 0 || total.timed_out == 0)
+	{
+		failed = 1;
+	}
+
+	printf("samples above the limit: %d\n", (int)over_limit);
+	if (over_limit != 0)
+		failed = 1;
+
+	for (i = 0; i < BACKENDS; i++)
+	{
+		printf("backend %d: at most %d served at once, load left %zu\n", i,
+			   (int)backends[i].max_serving, targets[i].get_cur_load());
+		if (backends[i].max_serving > SLOTS || targets[i].get_cur_load() != 0)
+			failed = 1;
+	}
+
+	scheduler.deinit();
+	group.remove(&targets[0]);
+	group.remove(&targets[1]);
+	group.deinit();
+	for (i = 0; i < BACKENDS; i++)
+		targets[i].deinit();
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
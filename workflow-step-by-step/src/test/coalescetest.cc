@@ -0,0 +1,400 @@
+/* Shared http messages, and coalesced requests against a local server.
+ * Usage: coalescetest
+ * A message shared by others must keep its headers and body in each of
+ * them until the last one goes, small or received in pieces. Then 200
+ * identical GETs in flight at once must go out once, and all get the one
+ * reply. Their callbacks take 2ms each, and must run on the 4 handler
+ * threads, not one after another in the leader's. A follower with a
+ * receive timeout shorter than the leader's wait must fail on its own
+ * with ETIMEDOUT, once, while one with no timeout still gets the reply. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include "WFTaskFactory.h"
+#include "HttpMessage.h"
+#include "HttpUtil.h"
+#include "WFGlobal.h"
+
+#define HANDLER_THREADS	4
+#define TASKS			200
+#define CALLBACK_US		2000
+#define SERVER_DELAY	100
+#define LEADER_DELAY	300
+#define FOLLOWER_TIMEOUT	50
+#define BIG_BODY		(200 * 1024)
+#define PIECE			(16 * 1024)
+
+using namespace protocol;
+
+struct Server
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	int delay;
+	std::atomic<int> requests;
+};
+
+struct TaskResult
+{
+	int callbacks;
+	int state;
+	int error;
+	int timeout_reason;
+	long long ms;
+	std::string body;
+};
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+	std::set<std::thread::id> threads;
+};
+
+/* A response fed by hand, as the communicator would. */
+class FedResponse : public HttpResponse
+{
+public:
+	int feed(const std::string& data, size_t piece)
+	{
+		size_t pos = 0;
+		size_t size;
+		int ret = 0;
+
+		while (ret == 0 && pos < data.size())
+		{
+			size = data.size() - pos < piece ? data.size() - pos : piece;
+			ret = this->append(data.data() + pos, &size);
+			pos += size;
+		}
+
+		return ret;
+	}
+};
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static std::string get_body(HttpMessage *msg)
+{
+	const void *body;
+	size_t size;
+
+	if (!msg->get_parsed_body(&body, &size))
+		return "";
+
+	return std::string((const char *)body, size);
+}
+
+static std::string get_header(HttpMessage *msg, const std::string& name)
+{
+	HttpHeaderCursor cursor(msg);
+	std::string value;
+
+	cursor.find(name, value);
+	return value;
+}
+
+static std::string make_reply(const std::string& body)
+{
+	return "HTTP/1.1 200 OK\r\nX-Test: shared\r\nContent-Length: " +
+		   std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+/* a, b sharing a, and c sharing b, go in turn. */
+static int test_share(const char *name, const std::string& body, size_t piece)
+{
+	FedResponse *a = new FedResponse;
+	HttpResponse *b = new HttpResponse;
+	HttpResponse *c = new HttpResponse;
+	HttpResponse moved;
+	char what[64];
+	int failed = 0;
+
+	snprintf(what, sizeof what, "%s: fed", name);
+	failed |= check(what, a->feed(make_reply(body), piece), 1, 1);
+	snprintf(what, sizeof what, "%s: shared twice", name);
+	failed |= check(what, b->share_message(a) && c->share_message(b), 1, 1);
+	delete a;
+	snprintf(what, sizeof what, "%s: body after the first", name);
+	failed |= check(what, get_body(b) == body && get_body(c) == body, 1, 1);
+	snprintf(what, sizeof what, "%s: header after the first", name);
+	failed |= check(what, get_header(c, "X-Test") == "shared", 1, 1);
+	delete b;
+	moved = std::move(*c);
+	delete c;
+	snprintf(what, sizeof what, "%s: body moved from the last", name);
+	failed |= check(what, get_body(&moved) == body, 1, 1);
+	snprintf(what, sizeof what, "%s: status moved from the last", name);
+	failed |= check(what, strcmp(moved.get_status_code(), "200") == 0, 1, 1);
+	return failed;
+}
+
+static int test_share_errors()
+{
+	FedResponse partial;
+	FedResponse full;
+	HttpResponse resp;
+	int failed = 0;
+
+	partial.feed("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc", PIECE);
+	errno = 0;
+	failed |= check("incomplete: not shared", resp.share_message(&partial),
+					0, 0);
+	failed |= check("incomplete: EINVAL", errno, EINVAL, EINVAL);
+
+	/* Sharing again lets the previous buffer go. */
+	full.feed(make_reply("first"), PIECE);
+	failed |= check("again: shared", resp.share_message(&full), 1, 1);
+	full.feed(make_reply("second"), PIECE);
+	failed |= check("again: kept", get_body(&resp) == "first", 1, 1);
+	return failed;
+}
+
+/* Reads each request up to its blank line, as all of them are GETs. */
+static void serve_conn(Server *server, int fd)
+{
+	std::string buf;
+	std::string reply;
+	size_t pos;
+	char tmp[4096];
+	ssize_t n;
+
+	while ((n = read(fd, tmp, sizeof tmp)) > 0)
+	{
+		buf.append(tmp, n);
+		while ((pos = buf.find("\r\n\r\n")) != std::string::npos)
+		{
+			buf.erase(0, pos + 4);
+			reply = make_reply(std::to_string(++server->requests));
+			usleep(server->delay * 1000);
+			if (write(fd, reply.data(), reply.size()) != (ssize_t)reply.size())
+			{
+				close(fd);
+				return;
+			}
+		}
+	}
+
+	close(fd);
+}
+
+static void run_server(Server *server)
+{
+	int fd;
+
+	while ((fd = accept(server->listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, server, fd).detach();
+}
+
+static int server_start(Server *server, int delay)
+{
+	socklen_t addrlen = sizeof server->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	server->addr.sin_family = AF_INET;
+	server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&server->addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)&server->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	server->listenfd = fd;
+	server->delay = delay;
+	server->requests = 0;
+	std::thread(run_server, server).detach();
+	return 0;
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static WFHttpTask *create_task(Server *server, int receive_timeout,
+							   long long start, TaskResult *result,
+							   TestContext *ctx)
+{
+	std::string url = "http://127.0.0.1:" +
+					  std::to_string(ntohs(server->addr.sin_port)) + "/";
+	WFHttpTask *task;
+
+	result->callbacks = 0;
+	task = WFTaskFactory::create_http_task(url, 0, 0,
+										   [result, start, ctx](WFHttpTask *task) {
+		result->state = task->get_state();
+		result->error = task->get_error();
+		result->timeout_reason = task->get_timeout_reason();
+		result->body = get_body(task->get_resp());
+		result->ms = now_ms() - start;
+		usleep(CALLBACK_US);
+
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		result->callbacks++;
+		ctx->threads.insert(std::this_thread::get_id());
+		ctx->pending--;
+		ctx->cond.notify_one();
+	});
+
+	task->set_coalesce("");
+	task->set_receive_timeout(receive_timeout);
+	return task;
+}
+
+/* False if it takes more than a minute. */
+static bool wait_all(TestContext *ctx)
+{
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+
+	return ctx->cond.wait_for(lock, std::chrono::seconds(60),
+							  [ctx] { return ctx->pending == 0; });
+}
+
+static int test_coalesce(Server *server)
+{
+	static TaskResult results[TASKS];
+	TestContext ctx;
+	long long start;
+	int same = 0;
+	int ms = 0;
+	int i;
+
+	ctx.pending = TASKS;
+	start = now_ms();
+	for (i = 0; i < TASKS; i++)
+		create_task(server, 5000, start, &results[i], &ctx)->start();
+
+	if (!wait_all(&ctx))
+	{
+		printf("coalesce: %d tasks still waiting: FAILED\n", ctx.pending);
+		fflush(stdout);
+		_exit(1);
+	}
+
+	for (i = 0; i < TASKS; i++)
+	{
+		if (results[i].callbacks == 1 && results[i].state == WFT_STATE_SUCCESS &&
+			results[i].body == "1")
+		{
+			same++;
+		}
+
+		if (results[i].ms > ms)
+			ms = results[i].ms;
+	}
+
+	int failed = 0;
+
+	failed |= check("coalesce: requests on the wire", server->requests, 1, 1);
+	failed |= check("coalesce: tasks with the reply", same, TASKS, TASKS);
+	failed |= check("coalesce: callback threads", ctx.threads.size(), 2,
+					HANDLER_THREADS);
+	/* One after another would take 400ms past the reply. */
+	failed |= check("coalesce: last callback (ms)", ms, SERVER_DELAY,
+					SERVER_DELAY + TASKS * CALLBACK_US / 1000 * 3 / 4);
+	return failed;
+}
+
+static int test_timeout(Server *server)
+{
+	TaskResult leader;
+	TaskResult quick;
+	TaskResult patient;
+	TestContext ctx;
+	long long start;
+	int failed = 0;
+
+	ctx.pending = 3;
+	start = now_ms();
+	create_task(server, 5000, start, &leader, &ctx)->start();
+	create_task(server, FOLLOWER_TIMEOUT, start, &quick, &ctx)->start();
+	create_task(server, -1, start, &patient, &ctx)->start();
+	if (!wait_all(&ctx))
+	{
+		printf("timeout: %d tasks still waiting: FAILED\n", ctx.pending);
+		fflush(stdout);
+		_exit(1);
+	}
+
+	failed |= check("timeout: requests on the wire", server->requests, 1, 1);
+	failed |= check("timeout: leader state", leader.state, WFT_STATE_SUCCESS,
+					WFT_STATE_SUCCESS);
+	failed |= check("timeout: follower state", quick.state,
+					WFT_STATE_SYS_ERROR, WFT_STATE_SYS_ERROR);
+	failed |= check("timeout: follower error", quick.error, ETIMEDOUT,
+					ETIMEDOUT);
+	failed |= check("timeout: follower reason", quick.timeout_reason,
+					TOR_TRANSMIT_TIMEOUT, TOR_TRANSMIT_TIMEOUT);
+	failed |= check("timeout: follower time (ms)", quick.ms, FOLLOWER_TIMEOUT,
+					LEADER_DELAY / 2);
+	failed |= check("timeout: patient one's reply", patient.state ==
+					WFT_STATE_SUCCESS && patient.body == "1", 1, 1);
+
+	/* The leader's reply must not finish the follower again. */
+	usleep(LEADER_DELAY * 1000);
+	std::lock_guard<std::mutex> lock(ctx.mutex);
+	failed |= check("timeout: follower callbacks", quick.callbacks, 1, 1);
+	return failed;
+}
+
+/* Server threads outlive the tests. */
+static Server servers[2];
+
+int main()
+{
+	struct WFGlobalSettings settings = GLOBAL_SETTINGS_DEFAULT;
+	std::string big;
+	int failed = 0;
+	int i;
+
+	settings.handler_threads = HANDLER_THREADS;
+	WORKFLOW_library_init(&settings);
+	signal(SIGPIPE, SIG_IGN);
+	if (server_start(&servers[0], SERVER_DELAY) < 0 ||
+		server_start(&servers[1], LEADER_DELAY) < 0)
+	{
+		perror("server");
+		return 1;
+	}
+
+	for (i = 0; i < BIG_BODY; i++)
+		big.push_back('a' + i % 26);
+
+	failed |= test_share("small", "hello", PIECE);
+	failed |= test_share("in pieces", big, PIECE);
+	failed |= test_share_errors();
+	failed |= test_coalesce(&servers[0]);
+	failed |= test_timeout(&servers[1]);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
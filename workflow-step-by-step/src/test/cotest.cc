@@ -0,0 +1,136 @@
+/* co_await on a timer, a series and a parallel. Built with C++20.
+ * Usage: cotest
+ * One coroutine awaits a 50ms timer, a series of three 20ms timers, and
+ * a parallel of four series of a 50ms timer each, which must take about
+ * 50ms, not 200ms. Each resumes it with its work done. Then a thousand
+ * coroutines await a zero length timer each, reusing freed frames. */
+
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "WFTaskFactory.h"
+#include "WFCoroutine.h"
+#include "Workflow.h"
+
+#define COROUTINES		1000
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+	int failed;
+};
+
+static std::atomic<int> timers_done;
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static WFTimerTask *create_timer(unsigned int ms)
+{
+	return WFTaskFactory::create_timer_task(ms * 1000, [](WFTimerTask *) {
+		timers_done++;
+	});
+}
+
+static void finish(TestContext *ctx, int failed)
+{
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+
+	ctx->failed |= failed;
+	ctx->pending--;
+	ctx->cond.notify_one();
+}
+
+static WFCoroutine run_awaits(TestContext *ctx)
+{
+	SeriesWork *series;
+	ParallelWork *parallel;
+	WFTimerTask *timer;
+	long long start;
+	int failed = 0;
+	int i;
+
+	start = now_ms();
+	timer = co_await await_task(WFTaskFactory::create_timer_task(50 * 1000,
+															   nullptr));
+	failed |= check("timer: state", timer->get_state(), WFT_STATE_SUCCESS,
+					WFT_STATE_SUCCESS);
+	failed |= check("timer: time (ms)", now_ms() - start, 45, 500);
+
+	timers_done = 0;
+	series = Workflow::create_series_work(create_timer(20), nullptr);
+	series->push_back(create_timer(20));
+	series->push_back(create_timer(20));
+	start = now_ms();
+	co_await await_task(series);
+	failed |= check("series: timers done", timers_done, 3, 3);
+	failed |= check("series: time (ms)", now_ms() - start, 55, 500);
+
+	timers_done = 0;
+	parallel = Workflow::create_parallel_work(nullptr);
+	for (i = 0; i < 4; i++)
+		parallel->add_series(Workflow::create_series_work(create_timer(50),
+														  nullptr));
+
+	start = now_ms();
+	parallel = co_await await_task(parallel);
+	failed |= check("parallel: series", parallel->size(), 4, 4);
+	failed |= check("parallel: timers done", timers_done, 4, 4);
+	failed |= check("parallel: time (ms)", now_ms() - start, 45, 150);
+	finish(ctx, failed);
+}
+
+static WFCoroutine run_one(TestContext *ctx)
+{
+	WFTimerTask *timer;
+
+	timer = co_await await_task(WFTaskFactory::create_timer_task(0, nullptr));
+	finish(ctx, timer->get_state() != WFT_STATE_SUCCESS);
+}
+
+int main()
+{
+	TestContext ctx;
+	int i;
+
+	ctx.pending = 1;
+	ctx.failed = 0;
+	run_awaits(&ctx);
+	{
+		std::unique_lock<std::mutex> lock(ctx.mutex);
+
+		while (ctx.pending > 0)
+			ctx.cond.wait(lock);
+	}
+
+	ctx.pending = COROUTINES;
+	for (i = 0; i < COROUTINES; i++)
+		run_one(&ctx);
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+
+	while (ctx.pending > 0)
+		ctx.cond.wait(lock);
+
+	check("coroutines: failed", ctx.failed, 0, 0);
+	printf("%s\n", ctx.failed ? "FAILED" : "OK");
+	return ctx.failed;
+}
@@ -0,0 +1,284 @@
+/* Communicator::drain() with requests in flight.
+ * Usage: draintest
+ * Requests wait 200ms for their replies from a local server. drain() must
+ * let them finish, reject new ones, close each connection with a FIN, and
+ * return as soon as the last connection is gone. Against a server that
+ * never replies, it must give up at its timeout. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "Communicator.h"
+
+#define RPC_SIZE		64
+#define REQUESTS		8
+#define REPLY_DELAY		200
+
+struct Server
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	bool reply;
+	std::atomic<int> accepted;
+	std::atomic<int> fins;
+};
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+	int succeeded;
+};
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcSession : public CommSession
+{
+public:
+	RpcSession(TestContext *ctx) { this->ctx = ctx; }
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual void handle(int state, int error)
+	{
+		TestContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		if (state == CS_STATE_SUCCESS)
+			ctx->succeeded++;
+
+		ctx->pending--;
+		ctx->cond.notify_one();
+		delete this;
+	}
+
+	TestContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static void serve_conn(Server *server, int fd)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			if (server->reply)
+			{
+				usleep(REPLY_DELAY * 1000);
+				if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+					break;
+			}
+
+			len = 0;
+		}
+	}
+
+	if (n == 0)
+		server->fins++;
+
+	close(fd);
+}
+
+static void run_server(Server *server)
+{
+	int fd;
+
+	while ((fd = accept(server->listenfd, NULL, NULL)) >= 0)
+	{
+		server->accepted++;
+		std::thread(serve_conn, server, fd).detach();
+	}
+}
+
+static int server_start(Server *server, bool reply)
+{
+	socklen_t addrlen = sizeof server->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	server->addr.sin_family = AF_INET;
+	server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&server->addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)&server->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	server->listenfd = fd;
+	server->reply = reply;
+	server->accepted = 0;
+	server->fins = 0;
+	std::thread(run_server, server).detach();
+	return 0;
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		   (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Returns the time drain() took, with its result in '*ret'. */
+static long start_and_drain(Communicator *comm, CommTarget *target,
+							TestContext *ctx, int timeout, int *ret)
+{
+	struct timespec start;
+	int i;
+
+	ctx->pending = REQUESTS;
+	ctx->succeeded = 0;
+	for (i = 0; i < REQUESTS; i++)
+	{
+		if (comm->request(new RpcSession(ctx), target) < 0)
+			return -1;
+	}
+
+	usleep(50 * 1000);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	*ret = comm->drain(timeout);
+	return elapsed_ms(&start);
+}
+
+/* In flight ones finish about 150ms into drain(), then the FINs go out. */
+static int test_drain(Server *server)
+{
+	Communicator comm;
+	CommTarget target;
+	TestContext ctx;
+	RpcSession *session;
+	int failed = 0;
+	long ms;
+	int ret;
+
+	if (server_start(server, true) < 0 || comm.init(2, 2) < 0)
+		return 1;
+
+	target.init((const struct sockaddr *)&server->addr, sizeof server->addr,
+				1000, 5000);
+	ms = start_and_drain(&comm, &target, &ctx, 5000, &ret);
+	failed |= check("drain: result", ret, 0, 0);
+	failed |= check("drain: time (ms)", ms, 100, 1000);
+	failed |= check("drain: succeeded", ctx.succeeded, REQUESTS, REQUESTS);
+	failed |= check("drain: in flight", comm.get_inflight(), 0, 0);
+	failed |= check("drain: FINs", server->fins, REQUESTS, REQUESTS);
+
+	session = new RpcSession(&ctx);
+	ret = comm.request(session, &target);
+	failed |= check("drain: new request rejected",
+					ret < 0 && errno == ESHUTDOWN, 1, 1);
+	if (ret < 0)
+		delete session;
+
+	comm.deinit();
+	target.deinit();
+	return failed;
+}
+
+/* Nothing ever replies, so drain() gives up at 300ms. */
+static int test_timeout(Server *server)
+{
+	Communicator comm;
+	CommTarget target;
+	TestContext ctx;
+	int failed = 0;
+	long ms;
+	int ret;
+
+	if (server_start(server, false) < 0 || comm.init(2, 2) < 0)
+		return 1;
+
+	target.init((const struct sockaddr *)&server->addr, sizeof server->addr,
+				1000, 5000);
+	ms = start_and_drain(&comm, &target, &ctx, 300, &ret);
+	failed |= check("timeout: result", ret < 0 && errno == ETIMEDOUT, 1, 1);
+	failed |= check("timeout: time (ms)", ms, 250, 1000);
+
+	/* The rest are stopped. */
+	comm.deinit();
+	failed |= check("timeout: succeeded", ctx.succeeded, 0, 0);
+	failed |= check("timeout: pending", ctx.pending, 0, 0);
+	target.deinit();
+	return failed;
+}
+
+/* Server threads outlive the tests. */
+static Server servers[2];
+
+int main()
+{
+	int failed = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	failed |= test_drain(&servers[0]);
+	failed |= test_timeout(&servers[1]);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,283 @@
+/* Count write syscalls of small RPCs, with and without deferred flush.
+ * Usage: flushbench [targets] [burst] [rounds]
+ * Each round sends 'burst' 64-byte requests to each of 'targets'
+ * multiplexed connections at once, then waits for all replies. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "Communicator.h"
+
+#define RPC_SIZE		64
+#define SERVER_BUFSIZE	(64 * 1024)
+
+struct BenchContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+	int errors;
+};
+
+class RpcOut : public CommMessageOut
+{
+public:
+	char buf[RPC_SIZE];
+
+private:
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcSession : public CommSession
+{
+public:
+	RpcSession(BenchContext *ctx, int deferred)
+	{
+		this->ctx = ctx;
+		this->deferred = deferred;
+	}
+
+private:
+	virtual CommMessageOut *message_out()
+	{
+		long long seq = this->get_seq();
+
+		memset(this->out.buf, 0, RPC_SIZE);
+		memcpy(this->out.buf, &seq, sizeof seq);
+		return &this->out;
+	}
+
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+	virtual int max_multiplex() { return 4096; }
+	virtual int deferred_flush() { return this->deferred; }
+
+	virtual int reply_seq(const void *buf, size_t size, long long *seq)
+	{
+		if (size < sizeof (long long))
+			return 0;
+
+		memcpy(seq, buf, sizeof (long long));
+		return 1;
+	}
+
+	virtual void handle(int state, int error)
+	{
+		BenchContext *ctx = this->ctx;
+
+		delete this;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		if (state != CS_STATE_SUCCESS)
+			ctx->errors++;
+
+		if (--ctx->pending == 0)
+			ctx->cond.notify_one();
+	}
+
+	BenchContext *ctx;
+	int deferred;
+	RpcOut out;
+	RpcIn in;
+};
+
+/* Echo every whole request back. The reply starts with the same seq. */
+static void serve_conn(int fd)
+{
+	char *p = new char[SERVER_BUFSIZE];
+	size_t len = 0;
+	size_t whole;
+	ssize_t n;
+	size_t off;
+
+	while ((n = read(fd, p + len, SERVER_BUFSIZE - len)) > 0)
+	{
+		len += n;
+		whole = len / RPC_SIZE * RPC_SIZE;
+		for (off = 0; off < whole; off += n)
+		{
+			n = write(fd, p + off, whole - off);
+			if (n < 0)
+				break;
+		}
+
+		memmove(p, p + whole, len - whole);
+		len -= whole;
+	}
+
+	delete []p;
+	close(fd);
+}
+
+static void run_server(int listenfd)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, fd).detach();
+}
+
+static long long write_syscalls()
+{
+	char line[256];
+	long long n = -1;
+	FILE *fp = fopen("/proc/self/io", "r");
+
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof line, fp))
+	{
+		if (sscanf(line, "syscw: %lld", &n) == 1)
+			break;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static int run_round(Communicator *comm, std::vector<CommTarget *>& targets,
+					 int burst, int deferred)
+{
+	BenchContext ctx;
+	int total = (int)targets.size() * burst;
+	int i;
+
+	ctx.pending = total;
+	ctx.errors = 0;
+	for (i = 0; i < total; i++)
+	{
+		auto *session = new RpcSession(&ctx, deferred);
+
+		if (comm->request(session, targets[i % targets.size()]) < 0)
+		{
+			delete session;
+			std::lock_guard<std::mutex> lock(ctx.mutex);
+			ctx.errors++;
+			ctx.pending--;
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+	while (ctx.pending > 0)
+		ctx.cond.wait(lock);
+
+	return ctx.errors;
+}
+
+static void run_bench(Communicator *comm, const struct sockaddr_in *addr,
+					  int ntargets, int burst, int rounds, int deferred)
+{
+	std::vector<CommTarget *> targets;
+	long long writes;
+	int errors = 0;
+	int i;
+
+	for (i = 0; i < ntargets; i++)
+	{
+		auto *target = new CommTarget;
+
+		target->init((const struct sockaddr *)addr, sizeof *addr, 1000, 10000);
+		targets.push_back(target);
+	}
+
+	/* Open the connections first, they are not part of the count. */
+	run_round(comm, targets, 1, deferred);
+
+	writes = write_syscalls();
+	auto start = std::chrono::steady_clock::now();
+	for (i = 0; i < rounds; i++)
+		errors += run_round(comm, targets, burst, deferred);
+
+	auto end = std::chrono::steady_clock::now();
+	writes = write_syscalls() - writes;
+	double sec = std::chrono::duration<double>(end - start).count();
+	long long requests = (long long)ntargets * burst * rounds;
+
+	printf("%-9s requests %lld  errors %d  write syscalls %lld (%.3f/request)  %.0f requests/s\n",
+		   deferred ? "deferred" : "immediate", requests, errors, writes,
+		   (double)writes / requests, requests / sec);
+}
+
+int main(int argc, char *argv[])
+{
+	int ntargets = argc > 1 ? atoi(argv[1]) : 16;
+	int burst = argc > 2 ? atoi(argv[2]) : 64;
+	int rounds = argc > 3 ? atoi(argv[3]) : 200;
+	struct sockaddr_in addr = { };
+	socklen_t addrlen = sizeof addr;
+	Communicator comm;
+	int listenfd;
+	pid_t pid;
+
+	signal(SIGPIPE, SIG_IGN);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0 || bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+		listen(listenfd, 1024) < 0 ||
+		getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0)
+	{
+		perror("listen");
+		return 1;
+	}
+
+	/* The server runs in a child, so /proc/self/io counts the client only. */
+	pid = fork();
+	if (pid == 0)
+	{
+		run_server(listenfd);
+		_exit(0);
+	}
+
+	close(listenfd);
+	if (pid < 0 || comm.init(1, 4) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	run_bench(&comm, &addr, ntargets, burst, rounds, 0);
+	run_bench(&comm, &addr, ntargets, burst, rounds, 1);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/* A layered DAG run as WFGraphTask vs as a series of parallels.
+ * Usage: graphbench [layers] [width] [max_ms]
+ * Node i of a layer depends on nodes i and i + 1 of the layer before.
+ * Each node is a timer of a random 1 to max_ms milliseconds, the same
+ * for both runs. The series/parallel encoding has to wait for a whole
+ * layer before the next one, the graph only for the inputs of a node.
+ * A second pass with zero length timers measures the cost per node. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <condition_variable>
+#include "WFTaskFactory.h"
+#include "WFGraphTask.h"
+#include "Workflow.h"
+
+struct BenchContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done;
+};
+
+static void wait_done(BenchContext *ctx)
+{
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+
+	while (!ctx->done)
+		ctx->cond.wait(lock);
+}
+
+static void set_done(BenchContext *ctx)
+{
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+
+	ctx->done = true;
+	ctx->cond.notify_one();
+}
+
+static double run_graph(const std::vector<unsigned int>& usec,
+						int layers, int width)
+{
+	WFGraphTask *graph;
+	std::vector<WFGraphNode *> prev(width);
+	std::vector<WFGraphNode *> cur(width);
+	BenchContext ctx;
+	int l, i;
+
+	ctx.done = false;
+	graph = WFTaskFactory::create_graph_task([&ctx](WFGraphTask *) {
+		set_done(&ctx);
+	});
+
+	for (l = 0; l < layers; l++)
+	{
+		for (i = 0; i < width; i++)
+		{
+			auto *timer = WFTaskFactory::create_timer_task(usec[l * width + i],
+														   nullptr);
+			cur[i] = &graph->create_graph_node(timer);
+			if (l > 0)
+			{
+				prev[i]->precede(*cur[i]);
+				prev[(i + 1) % width]->precede(*cur[i]);
+			}
+		}
+
+		prev.swap(cur);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	graph->start();
+	wait_done(&ctx);
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static double run_layers(const std::vector<unsigned int>& usec,
+						 int layers, int width)
+{
+	SeriesWork *series = NULL;
+	ParallelWork *parallel;
+	BenchContext ctx;
+	int l, i;
+
+	ctx.done = false;
+	for (l = 0; l < layers; l++)
+	{
+		parallel = Workflow::create_parallel_work(nullptr);
+		for (i = 0; i < width; i++)
+		{
+			auto *timer = WFTaskFactory::create_timer_task(usec[l * width + i],
+														   nullptr);
+			parallel->add_series(Workflow::create_series_work(timer, nullptr));
+		}
+
+		if (!series)
+		{
+			series = Workflow::create_series_work(parallel, [&ctx](const SeriesWork *) {
+				set_done(&ctx);
+			});
+		}
+		else
+			series->push_back(parallel);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	series->start();
+	wait_done(&ctx);
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+	int layers = argc > 1 ? atoi(argv[1]) : 20;
+	int width = argc > 2 ? atoi(argv[2]) : 16;
+	int max_ms = argc > 3 ? atoi(argv[3]) : 10;
+	std::vector<unsigned int> usec;
+	std::vector<unsigned int> zero;
+	unsigned int seed = 1;
+	int nodes;
+	int i;
+
+	if (layers <= 0 || width <= 1 || max_ms <= 0)
+	{
+		fprintf(stderr, "Usage: %s [layers] [width>1] [max_ms]\n", argv[0]);
+		return 1;
+	}
+
+	nodes = layers * width;
+	for (i = 0; i < nodes; i++)
+		usec.push_back((1 + rand_r(&seed) % max_ms) * 1000);
+
+	zero.assign(nodes, 0);
+	run_graph(zero, layers, width);
+
+	double graph_ms = run_graph(usec, layers, width);
+	double layers_ms = run_layers(usec, layers, width);
+
+	printf("%d layers x %d nodes, 1-%dms each\n", layers, width, max_ms);
+	printf("graph            %8.1fms\n", graph_ms);
+	printf("series/parallel  %8.1fms  (graph takes %.1f%% of it)\n",
+		   layers_ms, 100 * graph_ms / layers_ms);
+
+	graph_ms = run_graph(zero, layers, width);
+	layers_ms = run_layers(zero, layers, width);
+	printf("zero length: graph %.2fus per node, series/parallel %.2fus per node\n",
+		   1000 * graph_ms / nodes, 1000 * layers_ms / nodes);
+	return 0;
+}
@@ -0,0 +1,278 @@
+/* Hedged http requests against local servers.
+ * Usage: hedgetest
+ * A host that is no upstream has one server, so a hedge goes to it again
+ * on another connection. Each server replies with the number of the
+ * request, after a delay of its own for the first one and another for
+ * the rest. With all of them slow, a budget of 0.5 must hedge every other
+ * task, and a budget of 0 never. With only the first slow, the hedge must
+ * win, and the reply of the first attempt, the loser, must be dropped
+ * when it comes. With the first request dropped, the task must retry,
+ * and get the reply to the retry, or fail once with no retries left. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <condition_variable>
+#include "WFTaskFactory.h"
+
+#define HEDGE_DELAY		20
+#define SLOW_MS			60
+#define LOSER_MS		300
+#define BUDGET_ROUNDS	8
+
+struct Server
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	int first_delay;
+	int delay;
+	bool drop_first;			/* close the connection on the first */
+	std::atomic<int> requests;
+};
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int callbacks;
+	int state;
+	std::string body;
+};
+
+/* Reads each request up to its blank line, as all of them are GETs. */
+static void serve_conn(Server *server, int fd)
+{
+	std::string buf;
+	std::string reply;
+	std::string body;
+	size_t pos;
+	char tmp[4096];
+	ssize_t n;
+	int i;
+
+	while ((n = read(fd, tmp, sizeof tmp)) > 0)
+	{
+		buf.append(tmp, n);
+		while ((pos = buf.find("\r\n\r\n")) != std::string::npos)
+		{
+			buf.erase(0, pos + 4);
+			i = ++server->requests;
+			if (i == 1 && server->drop_first)
+			{
+				close(fd);
+				return;
+			}
+
+			usleep((i == 1 ? server->first_delay : server->delay) * 1000);
+			body = std::to_string(i);
+			reply = "HTTP/1.1 200 OK\r\nContent-Length: ";
+			reply += std::to_string(body.size());
+			reply += "\r\n\r\n";
+			reply += body;
+			if (write(fd, reply.data(), reply.size()) != (ssize_t)reply.size())
+			{
+				close(fd);
+				return;
+			}
+		}
+	}
+
+	close(fd);
+}
+
+static void run_server(Server *server)
+{
+	int fd;
+
+	while ((fd = accept(server->listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, server, fd).detach();
+}
+
+static int server_start(Server *server, int first_delay, int delay,
+						bool drop_first)
+{
+	socklen_t addrlen = sizeof server->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	server->addr.sin_family = AF_INET;
+	server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&server->addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)&server->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	server->listenfd = fd;
+	server->first_delay = first_delay;
+	server->delay = delay;
+	server->drop_first = drop_first;
+	server->requests = 0;
+	std::thread(run_server, server).detach();
+	return 0;
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+/* Returns when the callback ran. */
+static void run_request(Server *server, int retry_max, double budget,
+						TestContext *ctx)
+{
+	std::string url = "http://127.0.0.1:" +
+					  std::to_string(ntohs(server->addr.sin_port)) + "/";
+	WFHttpTask *task;
+
+	ctx->callbacks = 0;
+	task = WFTaskFactory::create_http_task(url, 0, retry_max,
+										   [ctx](WFHttpTask *task) {
+		const void *body;
+		size_t size;
+
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		ctx->state = task->get_state();
+		ctx->body.clear();
+		if (task->get_resp()->get_parsed_body(&body, &size))
+			ctx->body.assign((const char *)body, size);
+
+		ctx->callbacks++;
+		ctx->cond.notify_one();
+	});
+
+	task->set_hedge(HEDGE_DELAY, budget);
+	task->set_receive_timeout(5000);
+	task->start();
+
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+	while (ctx->callbacks == 0)
+		ctx->cond.wait(lock);
+}
+
+/* Every other task earns a whole hedge. */
+static int test_budget(Server *server, double budget, int hedges)
+{
+	TestContext ctx;
+	char what[64];
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < BUDGET_ROUNDS; i++)
+	{
+		run_request(server, 0, budget, &ctx);
+		if (ctx.state != WFT_STATE_SUCCESS)
+			failed = 1;
+	}
+
+	snprintf(what, sizeof what, "budget %g: requests on the wire", budget);
+	failed |= check(what, server->requests, BUDGET_ROUNDS + hedges,
+					BUDGET_ROUNDS + hedges);
+	return failed;
+}
+
+static int test_loser(Server *server)
+{
+	TestContext ctx;
+	int failed = 0;
+	long long start;
+	long ms;
+
+	start = now_ms();
+	run_request(server, 0, 1.0, &ctx);
+	ms = now_ms() - start;
+	failed |= check("loser: state", ctx.state, WFT_STATE_SUCCESS,
+					WFT_STATE_SUCCESS);
+	failed |= check("loser: reply to the hedge", ctx.body == "2", 1, 1);
+	failed |= check("loser: time (ms)", ms, HEDGE_DELAY / 2, LOSER_MS / 2);
+
+	/* The first attempt gets its reply, and nobody may see it. */
+	usleep(LOSER_MS * 2 * 1000);
+	std::lock_guard<std::mutex> lock(ctx.mutex);
+	failed |= check("loser: callbacks", ctx.callbacks, 1, 1);
+	failed |= check("loser: requests", server->requests, 2, 2);
+	return failed;
+}
+
+/* The first request is dropped at once, before a hedge is due. */
+static int test_retry(Server *server, int retry_max)
+{
+	TestContext ctx;
+	char what[64];
+	int failed = 0;
+
+	run_request(server, retry_max, 1.0, &ctx);
+	usleep(100 * 1000);
+	std::lock_guard<std::mutex> lock(ctx.mutex);
+	snprintf(what, sizeof what, "retry %d: callbacks", retry_max);
+	failed |= check(what, ctx.callbacks, 1, 1);
+	snprintf(what, sizeof what, "retry %d: requests", retry_max);
+	failed |= check(what, server->requests, 1 + retry_max, 1 + retry_max);
+	snprintf(what, sizeof what, "retry %d: state", retry_max);
+	if (retry_max > 0)
+	{
+		failed |= check(what, ctx.state, WFT_STATE_SUCCESS, WFT_STATE_SUCCESS);
+		snprintf(what, sizeof what, "retry %d: reply to the retry", retry_max);
+		failed |= check(what, ctx.body == "2", 1, 1);
+	}
+	else
+	{
+		failed |= check(what, ctx.state, WFT_STATE_SYS_ERROR,
+						WFT_STATE_SYS_ERROR);
+	}
+
+	return failed;
+}
+
+/* Server threads outlive the tests. */
+static Server servers[5];
+
+int main()
+{
+	int failed = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (server_start(&servers[0], SLOW_MS, SLOW_MS, false) < 0 ||
+		server_start(&servers[1], SLOW_MS, SLOW_MS, false) < 0 ||
+		server_start(&servers[2], LOSER_MS, 0, false) < 0 ||
+		server_start(&servers[3], 0, 0, true) < 0 ||
+		server_start(&servers[4], 0, 0, true) < 0)
+	{
+		perror("server");
+		return 1;
+	}
+
+	failed |= test_budget(&servers[0], 0.5, BUDGET_ROUNDS / 2);
+	failed |= test_budget(&servers[1], 0, 0);
+	failed |= test_loser(&servers[2]);
+	failed |= test_retry(&servers[3], 1);
+	failed |= test_retry(&servers[4], 0);
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
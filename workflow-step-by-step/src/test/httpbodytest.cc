@@ -0,0 +1,230 @@
+/* Bodies larger than one segment, as received by HttpResponse.
+ * Usage: httpbodytest
+ * Responses with a Content-Length, chunked and close-delimited bodies are
+ * fed whole and in reads of several sizes. The body from
+ * get_parsed_body_iov() must be the one sent, in segments, and
+ * get_parsed_body() must then join the same bytes into one piece. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include "HttpMessage.h"
+#include "HttpUtil.h"
+
+using namespace protocol;
+
+class TestResponse : public HttpResponse
+{
+public:
+	using HttpResponse::append;
+};
+
+enum
+{
+	BODY_LENGTH,
+	BODY_CHUNKED,
+	BODY_CLOSE,
+};
+
+static const char *body_types[] = { "length", "chunked", "close" };
+
+static std::string make_data(size_t size)
+{
+	std::string data(size, '\0');
+	unsigned int seed = (unsigned int)size;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char)(seed >> 16);
+	}
+
+	return data;
+}
+
+/* The body as sent. Chunks grow, so that some span several segments. */
+static std::string make_body(const std::string& data, int type)
+{
+	std::string body;
+	size_t chunk = 1000;
+	size_t off = 0;
+	size_t n;
+	char line[32];
+
+	if (type != BODY_CHUNKED)
+		return data;
+
+	while (off < data.size())
+	{
+		n = std::min(chunk, data.size() - off);
+		sprintf(line, "%zx\r\n", n);
+		body.append(line);
+		body.append(data, off, n);
+		body.append("\r\n");
+		off += n;
+		chunk *= 3;
+	}
+
+	body.append("0\r\n\r\n");
+	return body;
+}
+
+static std::string make_message(const std::string& body, int type)
+{
+	std::string msg = "HTTP/1.1 200 OK\r\nServer: httpbodytest\r\n";
+
+	if (type == BODY_LENGTH)
+		msg += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	else if (type == BODY_CHUNKED)
+		msg += "Transfer-Encoding: chunked\r\n";
+	else
+		msg += "Connection: close\r\n";
+
+	return msg + "\r\n" + body;
+}
+
+static int feed(TestResponse *resp, const std::string& msg, size_t read_size,
+				int type)
+{
+	size_t off = 0;
+	size_t n;
+	int ret = 0;
+
+	while (off < msg.size())
+	{
+		n = std::min(read_size, msg.size() - off);
+		ret = resp->append(msg.data() + off, &n);
+		if (ret != 0)
+			break;
+
+		off += n;
+	}
+
+	if (ret == 0 && type == BODY_CLOSE)
+	{
+		resp->end_parsing();
+		ret = 1;
+	}
+
+	return ret;
+}
+
+/* Returns the number of pieces the body was in, or -1. */
+static int check_body(TestResponse *resp, const std::string& data, int type)
+{
+	std::string body = make_body(data, type);
+	std::vector<struct iovec> vectors;
+	std::string joined;
+	const void *ptr;
+	size_t size;
+	int cnt;
+	int i;
+
+	cnt = resp->get_parsed_body_iov(NULL, 0);
+	if (cnt < 0)
+		return -1;
+
+	vectors.resize(cnt + 1);
+	if (cnt > 1 && resp->get_parsed_body_iov(vectors.data(), 1) != cnt)
+		return -1;
+
+	if (resp->get_parsed_body_iov(vectors.data(), cnt + 1) != cnt)
+		return -1;
+
+	for (i = 0; i < cnt; i++)
+	{
+		/* Only the first, received before the header was complete, may
+		 * be larger than a segment. */
+		if (vectors[i].iov_len == 0 ||
+			(i > 0 && vectors[i].iov_len > HTTP_SEGMENT_SIZE))
+		{
+			return -1;
+		}
+
+		joined.append((const char *)vectors[i].iov_base, vectors[i].iov_len);
+	}
+
+	if (joined != body)
+		return -1;
+
+	if (!resp->get_parsed_body(&ptr, &size) ||
+		size != body.size() || memcmp(ptr, body.data(), size) != 0)
+	{
+		return -1;
+	}
+
+	/* Joined now, and the same again on a second call. */
+	if (resp->get_parsed_body_iov(vectors.data(), cnt + 1) != (size ? 1 : 0))
+		return -1;
+
+	if (size && (vectors[0].iov_base != ptr || vectors[0].iov_len != size))
+		return -1;
+
+	if (!resp->get_parsed_body(&ptr, &size) || size != body.size())
+		return -1;
+
+	if (type == BODY_CHUNKED && HttpUtil::decode_chunked_body(resp) != data)
+		return -1;
+
+	return cnt;
+}
+
+int main()
+{
+	const size_t sizes[] = {
+		1000,
+		HTTP_SEGMENT_SIZE - 1,
+		HTTP_SEGMENT_SIZE,
+		HTTP_SEGMENT_SIZE + 1,
+		3 * HTTP_SEGMENT_SIZE + 1234,
+		20 * HTTP_SEGMENT_SIZE,
+	};
+	const size_t read_sizes[] = { (size_t)-1, 1000, 4096, HTTP_SEGMENT_SIZE, 100003 };
+	int segmented[BODY_CLOSE + 1] = { };
+	int failed = 0;
+	int cases = 0;
+	int ret;
+
+	for (size_t size : sizes)
+	{
+		std::string data = make_data(size);
+
+		for (int type = BODY_LENGTH; type <= BODY_CLOSE; type++)
+		{
+			std::string msg = make_message(make_body(data, type), type);
+
+			for (size_t read_size : read_sizes)
+			{
+				TestResponse resp;
+
+				cases++;
+				ret = feed(&resp, msg, read_size, type);
+				if (ret == 1)
+					ret = check_body(&resp, data, type);
+
+				if (ret > 1)
+					segmented[type]++;
+				else if (ret < 1)
+				{
+					printf("%s body of %zu, reads of %zd: FAILED (%d)\n",
+						   body_types[type], size, (ssize_t)read_size, ret);
+					failed = 1;
+				}
+			}
+		}
+	}
+
+	/* Reads after the header complete put a large body in segments. */
+	for (int type = BODY_LENGTH; type <= BODY_CLOSE; type++)
+	{
+		printf("%s: %d bodies in segments\n", body_types[type], segmented[type]);
+		if (segmented[type] == 0)
+			failed = 1;
+	}
+
+	printf("%d cases, %s\n", cases, failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,265 @@
+/* Header line scanning of the http parser, with each scanner the CPU has.
+ * Usage: httpparsertest
+ * The scanners are checked alone with the delimiter, NUL or neither at
+ * every offset around the 16 and 32 byte steps, and then through the
+ * parser with long header lines, each message split at every position.
+ * The parser is built in, so that a scanner can be forced. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "http_parser.c"
+
+typedef const char *(*find_delim_t)(const char *, const char *, int);
+
+struct Scanner
+{
+	const char *name;
+	find_delim_t find;
+};
+
+static struct Scanner scanners[3];
+static int scanner_cnt;
+
+static void init_scanners(void)
+{
+	scanners[scanner_cnt].name = "scalar";
+	scanners[scanner_cnt++].find = __find_delim_scalar;
+#if defined(__SSE2__)
+	scanners[scanner_cnt].name = "sse2";
+	scanners[scanner_cnt++].find = __find_delim_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		scanners[scanner_cnt].name = "avx2";
+		scanners[scanner_cnt++].find = __find_delim_avx2;
+	}
+#endif
+}
+
+#define SCAN_OFFSET_MAX		64
+#define SCAN_LEN_MAX		100
+
+static int test_scanner(const struct Scanner *scanner)
+{
+	char buf[SCAN_OFFSET_MAX + SCAN_LEN_MAX + 1];
+	const char delims[2] = { ':', '\0' };
+	const char *ret;
+	int off, len, pos, d;
+
+	for (off = 0; off < SCAN_OFFSET_MAX; off++)
+	{
+		for (len = 0; len <= SCAN_LEN_MAX; len++)
+		{
+			for (pos = 0; pos <= len; pos++)
+			{
+				for (d = 0; d < 2; d++)
+				{
+					memset(buf, 'a', sizeof buf);
+					/* Just past the end, where it must not be found. */
+					buf[off + len] = ':';
+					if (pos < len)
+						buf[off + pos] = delims[d];
+
+					ret = scanner->find(buf + off, buf + off + len, ':');
+					if (ret != buf + off + pos)
+					{
+						printf("%s: offset %d length %d %s at %d, found at %d\n",
+							   scanner->name, off, len, d ? "NUL" : "':'",
+							   pos, (int)(ret - buf - off));
+						return -1;
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+#define LINE_MAX_LEN		100
+#define NAME_LEN_MAX		(HTTP_HEADER_NAME_MAX - 1)
+
+struct Message
+{
+	char text[1024];
+	size_t len;
+	char uri[LINE_MAX_LEN + 2];
+	char name[HTTP_HEADER_NAME_MAX];
+	char value[LINE_MAX_LEN + 1];
+	int expected;		/* 1, or -2 if a NUL is in a line */
+};
+
+static void make_message(int uri_len, int name_len, int value_len,
+						 int nul_pos, struct Message *msg)
+{
+	int n;
+
+	msg->uri[0] = '/';
+	memset(msg->uri + 1, 'u', uri_len);
+	msg->uri[uri_len + 1] = '\0';
+	memset(msg->name, 'n', name_len);
+	msg->name[0] = 'X';
+	msg->name[name_len] = '\0';
+	memset(msg->value, 'v', value_len);
+	msg->value[value_len] = '\0';
+
+	n = sprintf(msg->text,
+				"GET %s HTTP/1.1\r\n"
+				"%s: %s\r\n"
+				"Host: www.example.com.a.rather.long.host.name.to.scan\r\n"
+				"\r\n", msg->uri, msg->name, msg->value);
+	msg->len = n;
+	msg->expected = 1;
+	if (nul_pos >= 0)
+	{
+		msg->text[nul_pos] = '\0';
+		msg->expected = -2;
+	}
+}
+
+static int check_headers(const struct Message *msg, http_parser_t *parser)
+{
+	static const char *host = "www.example.com.a.rather.long.host.name.to.scan";
+	const char *names[2] = { msg->name, "Host" };
+	const char *values[2] = { msg->value, host };
+	http_header_cursor_t cursor;
+	const void *name;
+	const void *value;
+	size_t name_len;
+	size_t value_len;
+	int i = 0;
+
+	if (strcmp(http_parser_get_method(parser), "GET") != 0 ||
+		strcmp(http_parser_get_uri(parser), msg->uri) != 0 ||
+		strcmp(http_parser_get_version(parser), "HTTP/1.1") != 0)
+	{
+		return -1;
+	}
+
+	http_header_cursor_init(&cursor, parser);
+	while (http_header_cursor_next(&name, &name_len, &value, &value_len,
+								   &cursor) == 0)
+	{
+		if (i == 2 ||
+			name_len != strlen(names[i]) ||
+			memcmp(name, names[i], name_len) != 0 ||
+			value_len != strlen(values[i]) ||
+			memcmp(value, values[i], value_len) != 0)
+		{
+			return -1;
+		}
+
+		i++;
+	}
+
+	http_header_cursor_deinit(&cursor);
+	return i == 2 ? 0 : -1;
+}
+
+/* Feed the message in two pieces, cut at 'split'. */
+static int parse_split(const struct Message *msg, size_t split)
+{
+	http_parser_t parser;
+	size_t n = split;
+	int ret;
+
+	http_parser_init(0, &parser);
+	ret = http_parser_append_message(msg->text, &n, &parser);
+	if (ret == 0)
+	{
+		n = msg->len - split;
+		ret = http_parser_append_message(msg->text + split, &n, &parser);
+	}
+
+	if (ret == 1 && check_headers(msg, &parser) < 0)
+		ret = -3;
+
+	http_parser_deinit(&parser);
+	return ret;
+}
+
+static int test_message(const struct Scanner *scanner, const struct Message *msg)
+{
+	size_t split;
+	int ret;
+
+	for (split = 0; split <= msg->len; split++)
+	{
+		ret = parse_split(msg, split);
+		if (ret != msg->expected)
+		{
+			printf("%s: uri %zu name %zu value %zu split at %zu, "
+				   "returned %d, expected %d\n", scanner->name,
+				   strlen(msg->uri), strlen(msg->name), strlen(msg->value),
+				   split, ret, msg->expected);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int test_parser(const struct Scanner *scanner)
+{
+	struct Message msg;
+	size_t name_start;
+	size_t value_start;
+	int k, j;
+
+	__find_delim_impl = scanner->find;
+
+	/* The '\r' and ':' of every line land on each offset. */
+	for (k = 0; k <= LINE_MAX_LEN; k++)
+	{
+		make_message(k, 1 + k % NAME_LEN_MAX, k, -1, &msg);
+		if (test_message(scanner, &msg) < 0)
+			return -1;
+	}
+
+	/* A NUL at each position of a long start line, name and value. */
+	for (j = 0; j < LINE_MAX_LEN; j++)
+	{
+		make_message(LINE_MAX_LEN, NAME_LEN_MAX, LINE_MAX_LEN, -1, &msg);
+		name_start = strlen("GET ") + strlen(msg.uri) + strlen(" HTTP/1.1\r\n");
+		value_start = name_start + NAME_LEN_MAX + strlen(": ");
+
+		make_message(LINE_MAX_LEN, NAME_LEN_MAX, LINE_MAX_LEN,
+					 strlen("GET /") + j, &msg);
+		if (test_message(scanner, &msg) < 0)
+			return -1;
+
+		if (j < NAME_LEN_MAX)
+		{
+			make_message(LINE_MAX_LEN, NAME_LEN_MAX, LINE_MAX_LEN,
+						 name_start + j, &msg);
+			if (test_message(scanner, &msg) < 0)
+				return -1;
+		}
+
+		make_message(LINE_MAX_LEN, NAME_LEN_MAX, LINE_MAX_LEN,
+					 value_start + j, &msg);
+		if (test_message(scanner, &msg) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int failed = 0;
+	int i;
+
+	init_scanners();
+	for (i = 0; i < scanner_cnt; i++)
+	{
+		if (test_scanner(&scanners[i]) < 0 || test_parser(&scanners[i]) < 0)
+			failed = 1;
+		else
+			printf("%s: OK\n", scanners[i].name);
+	}
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,295 @@
+/* The adaptive limit of a target following its backend's capacity.
+ * Usage: limittest
+ * The backend serves 4 requests at a time, 2ms each, and queues the rest,
+ * so response times grow past 4 in flight. 40 clients loop on a target
+ * of max_connections 100 with the adaptive limit on. The limit must come
+ * down from its start of 20 to about 2 x 4 + sqrt(limit), where the
+ * gradient tolerates the queueing. Then the backend serves any number at
+ * once, and the limit must grow again. A group of the target and a static
+ * one must report the sum of their current limits as its max load. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+
+#define RPC_SIZE		64
+#define CLIENTS			40
+#define SERVICE_US		2000
+#define CAPACITY		4
+#define STATIC_SLOTS	5
+
+struct Backend
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	std::mutex mutex;
+	std::condition_variable cond;
+	int capacity;		/* 0 for no limit */
+	int serving;
+};
+
+struct ClientContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	CommSchedObject *object;
+	CommScheduler *scheduler;
+	bool done;
+	int state;
+};
+
+static std::atomic<bool> clients_stop;
+static std::atomic<int> errors;
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(ClientContext *ctx) :
+		CommRequest(ctx->object, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = -1;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual SubTask *done()
+	{
+		ClientContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state = this->state;
+		ctx->done = true;
+		ctx->cond.notify_one();
+		delete this;
+		return NULL;
+	}
+
+	ClientContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+/* Wait for one of the backend's workers, then take SERVICE_US. */
+static void serve_request(Backend *backend)
+{
+	std::unique_lock<std::mutex> lock(backend->mutex);
+
+	while (backend->capacity > 0 && backend->serving >= backend->capacity)
+		backend->cond.wait(lock);
+
+	backend->serving++;
+	lock.unlock();
+	usleep(SERVICE_US);
+	lock.lock();
+	backend->serving--;
+	backend->cond.notify_one();
+}
+
+static void serve_conn(Backend *backend, int fd)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			serve_request(backend);
+			if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	close(fd);
+}
+
+static void run_backend(Backend *backend)
+{
+	int fd;
+
+	while ((fd = accept(backend->listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, backend, fd).detach();
+}
+
+static int backend_start(Backend *backend)
+{
+	socklen_t addrlen = sizeof backend->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	backend->addr.sin_family = AF_INET;
+	backend->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	backend->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&backend->addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)&backend->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	backend->listenfd = fd;
+	backend->capacity = CAPACITY;
+	backend->serving = 0;
+	std::thread(run_backend, backend).detach();
+	return 0;
+}
+
+static void run_client(CommSchedObject *object, CommScheduler *scheduler)
+{
+	ClientContext ctx;
+
+	ctx.object = object;
+	ctx.scheduler = scheduler;
+	while (!clients_stop)
+	{
+		ctx.done = false;
+		(new RpcRequest(&ctx))->dispatch();
+
+		std::unique_lock<std::mutex> lock(ctx.mutex);
+		while (!ctx.done)
+			ctx.cond.wait(lock);
+
+		if (ctx.state != CS_STATE_SUCCESS)
+			errors++;
+	}
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+/* Server threads outlive the test. */
+static Backend backend;
+
+int main()
+{
+	struct sockaddr_in addr = { };
+	std::vector<std::thread> clients;
+	CommScheduler scheduler;
+	CommSchedTarget target;
+	CommSchedTarget other;
+	CommSchedGroup group;
+	int failed = 0;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (scheduler.init(1, 4) < 0 || group.init() < 0 ||
+		backend_start(&backend) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	/* Never used, only counted by the group. */
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (target.init((const struct sockaddr *)&backend.addr, sizeof backend.addr,
+					1000, 5000, 100) < 0 ||
+		other.init((const struct sockaddr *)&addr, sizeof addr,
+				   1000, 5000, STATIC_SLOTS) < 0)
+	{
+		perror("target");
+		return 1;
+	}
+
+	target.set_adaptive_limit(true);
+	group.add(&target);
+	group.add(&other);
+	failed |= check("start: limit", target.get_limit(), 20, 20);
+	failed |= check("start: group max load", group.get_max_load(),
+					20 + STATIC_SLOTS, 20 + STATIC_SLOTS);
+
+	for (i = 0; i < CLIENTS; i++)
+		clients.emplace_back(run_client, &target, &scheduler);
+
+	/* Settles near 11 in about a second. */
+	sleep(2);
+	failed |= check("overloaded: limit", target.get_limit(), 6, 16);
+	failed |= check("overloaded: group max load",
+					group.get_max_load() - target.get_limit(),
+					STATIC_SLOTS, STATIC_SLOTS);
+
+	/* Grows by about sqrt(limit) / 5 a window, up to twice the peak in
+	 * flight. */
+	backend.mutex.lock();
+	backend.capacity = 0;
+	backend.cond.notify_all();
+	backend.mutex.unlock();
+	sleep(3);
+	failed |= check("unloaded: limit", target.get_limit(), 25, 100);
+
+	clients_stop = true;
+	for (std::thread& client : clients)
+		client.join();
+
+	failed |= check("errors", errors, 0, 0);
+	scheduler.deinit();
+	group.remove(&target);
+	group.remove(&other);
+	group.deinit();
+	target.deinit();
+	other.deinit();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
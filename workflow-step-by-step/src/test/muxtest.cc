@@ -0,0 +1,321 @@
+/* Multiplexed requests, with replies routed by sequence id.
+ * Usage: muxtest
+ * Requests of 1MB share one connection to a server that reads nothing
+ * for a while, so they are written in pieces. Two fail to make their
+ * messages: the one that makes the connection, when it is connected, and
+ * one joining later, at once. The server answers the others in reverse
+ * order. Each must get its own reply, and only the two bad ones may fail. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "Communicator.h"
+
+#define REQ_SIZE		(1024 * 1024)
+#define RPC_SIZE		64
+#define SOCK_BUFSIZE	(64 * 1024)
+#define STALL_MS		300
+#define REQUESTS		8
+#define FIRST_BATCH		4
+#define BAD_CONNECTING	0
+#define BAD_JOINING		5
+
+static bool bad_request(int id)
+{
+	return id == BAD_CONNECTING || id == BAD_JOINING;
+}
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+	int state[REQUESTS];
+	long long reply_seq[REQUESTS];
+	long long reply_id[REQUESTS];
+	long long seq[REQUESTS];
+	int error[REQUESTS];
+};
+
+/* The sequence id, the request id, and the rest. */
+class ReqOut : public CommMessageOut
+{
+public:
+	char *buf;
+
+	ReqOut() { this->buf = new char[REQ_SIZE](); }
+	virtual ~ReqOut() { delete []this->buf; }
+
+private:
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = 100;
+		vectors[1].iov_base = this->buf + 100;
+		vectors[1].iov_len = REQ_SIZE - 100;
+		return 2;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+public:
+	char buf[RPC_SIZE];
+
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+			n = *size;
+
+		memcpy(this->buf + this->len, buf, n);
+		this->len += n;
+		*size = n;
+		return this->len == RPC_SIZE;
+	}
+};
+
+class MuxSession : public CommSession
+{
+public:
+	MuxSession(TestContext *ctx, long long id)
+	{
+		this->ctx = ctx;
+		this->id = id;
+	}
+
+private:
+	virtual CommMessageOut *message_out()
+	{
+		long long seq = this->get_seq();
+
+		if (bad_request(this->id))
+		{
+			errno = EBADMSG;
+			return NULL;
+		}
+
+		memcpy(this->out.buf, &seq, sizeof seq);
+		memcpy(this->out.buf + sizeof seq, &this->id, sizeof this->id);
+		return &this->out;
+	}
+
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+	virtual int max_multiplex() { return REQUESTS; }
+
+	virtual int reply_seq(const void *buf, size_t size, long long *seq)
+	{
+		if (size < sizeof (long long))
+			return 0;
+
+		memcpy(seq, buf, sizeof (long long));
+		return 1;
+	}
+
+	virtual void handle(int state, int error)
+	{
+		TestContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state[this->id] = state;
+		ctx->error[this->id] = error;
+		ctx->seq[this->id] = this->get_seq();
+		if (state == CS_STATE_SUCCESS)
+		{
+			memcpy(&ctx->reply_seq[this->id], this->in.buf, sizeof (long long));
+			memcpy(&ctx->reply_id[this->id], this->in.buf + sizeof (long long),
+				   sizeof (long long));
+		}
+
+		ctx->pending--;
+		ctx->cond.notify_one();
+		delete this;
+	}
+
+	TestContext *ctx;
+	long long id;
+	ReqOut out;
+	RpcIn in;
+};
+
+/* Small send buffer, so that a big request never goes in one write. */
+class TestTarget : public CommTarget
+{
+private:
+	virtual int create_connect_fd()
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int size = SOCK_BUFSIZE;
+
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+
+		return fd;
+	}
+};
+
+static std::atomic<int> accepted;
+
+/* Stall, read all the good requests, then answer them last first. */
+static void serve_conn(int fd)
+{
+	char *buf = new char[REQ_SIZE];
+	std::vector<std::string> heads;
+	size_t len = 0;
+	ssize_t n;
+	int good = 0;
+	int i;
+
+	for (i = 0; i < REQUESTS; i++)
+		good += !bad_request(i);
+
+	usleep(STALL_MS * 1000);
+	while (heads.size() < (size_t)good &&
+		   (n = read(fd, buf + len, REQ_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == REQ_SIZE)
+		{
+			heads.emplace_back(buf, RPC_SIZE);
+			len = 0;
+		}
+	}
+
+	while (!heads.empty())
+	{
+		if (write(fd, heads.back().data(), RPC_SIZE) != RPC_SIZE)
+			break;
+
+		heads.pop_back();
+	}
+
+	while (read(fd, buf, REQ_SIZE) > 0)
+		;
+
+	delete []buf;
+	close(fd);
+}
+
+static void run_server(int listenfd)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+	{
+		accepted++;
+		std::thread(serve_conn, fd).detach();
+	}
+}
+
+static int request(Communicator *comm, CommTarget *target, TestContext *ctx,
+				   long long id)
+{
+	auto *session = new MuxSession(ctx, id);
+
+	if (comm->request(session, target) >= 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+	ctx->state[id] = -errno;
+	ctx->pending--;
+	delete session;
+	return -1;
+}
+
+int main()
+{
+	struct sockaddr_in addr = { };
+	socklen_t addrlen = sizeof addr;
+	int size = SOCK_BUFSIZE;
+	Communicator comm;
+	TestTarget target;
+	TestContext ctx;
+	int failed = 0;
+	int listenfd;
+	int ok;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0 ||
+		setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) < 0 ||
+		bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+		listen(listenfd, 1024) < 0 ||
+		getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+		comm.init(1, 2) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	std::thread(run_server, listenfd).detach();
+	target.init((const struct sockaddr *)&addr, addrlen, 1000, 5000);
+
+	ctx.pending = REQUESTS;
+	for (i = 0; i < FIRST_BATCH; i++)
+		request(&comm, &target, &ctx, i);
+
+	/* Connected, and the first requests are stuck in the socket. */
+	usleep(100 * 1000);
+	for (i = FIRST_BATCH; i < REQUESTS; i++)
+		request(&comm, &target, &ctx, i);
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+	while (ctx.pending > 0)
+		ctx.cond.wait(lock);
+
+	for (i = 0; i < REQUESTS; i++)
+	{
+		if (bad_request(i))
+		{
+			if (i == BAD_CONNECTING)
+				ok = (ctx.state[i] == CS_STATE_ERROR && ctx.error[i] == EBADMSG);
+			else
+				ok = (ctx.state[i] == -EBADMSG);
+
+			printf("request %d: state %d: %s\n", i, ctx.state[i],
+				   ok ? "OK" : "FAILED");
+		}
+		else
+		{
+			ok = (ctx.state[i] == CS_STATE_SUCCESS && ctx.reply_id[i] == i &&
+				  ctx.reply_seq[i] == ctx.seq[i]);
+			printf("request %d: state %d seq %lld reply %lld/%lld: %s\n", i,
+				   ctx.state[i], ctx.seq[i], ctx.reply_seq[i], ctx.reply_id[i],
+				   ok ? "OK" : "FAILED");
+		}
+
+		if (!ok)
+			failed = 1;
+	}
+
+	printf("connections: %d\n", (int)accepted);
+	if (accepted != 1)
+		failed = 1;
+
+	lock.unlock();
+	comm.deinit();
+	target.deinit();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,263 @@
+/* Tail latency of a group with one slow replica, by selection policy.
+ * Usage: p2cbench [requests] [concurrency] [slow_ms]
+ * Four local echo backends reply after 1ms and one after slow_ms. Clients
+ * run closed loops of requests through one CommSchedGroup, first with
+ * CSG_POLICY_LEAST_LOAD, then with CSG_POLICY_LEAST_LATENCY. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+#include "LatencyHistogram.h"
+
+#define BACKENDS		5
+#define RPC_SIZE		64
+
+struct BenchContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	LatencyHistogram hist;
+	CommSchedGroup *group;
+	CommScheduler *scheduler;
+	CommTarget *slow;
+	int left;		/* requests not yet started */
+	int running;	/* clients still looping */
+	int slow_cnt;
+	int errors;
+};
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(BenchContext *ctx) :
+		CommRequest(ctx->group, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = -1;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	/* The next request of this client, if any. */
+	virtual SubTask *done()
+	{
+		BenchContext *ctx = this->ctx;
+		long long usec = this->get_phase_elapsed(CS_PHASE_START, CS_PHASE_COMPLETE);
+		SubTask *next = NULL;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		if (this->state != CS_STATE_SUCCESS)
+			ctx->errors++;
+		else
+		{
+			ctx->hist.record(usec);
+			if (this->target == ctx->slow)
+				ctx->slow_cnt++;
+		}
+
+		if (ctx->left > 0)
+		{
+			ctx->left--;
+			next = new RpcRequest(ctx);
+		}
+		else if (--ctx->running == 0)
+			ctx->cond.notify_one();
+
+		delete this;
+		return next;
+	}
+
+	BenchContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static void serve_conn(int fd, int delay_us)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len < RPC_SIZE)
+			continue;
+
+		usleep(delay_us);
+		if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+			break;
+
+		len = 0;
+	}
+
+	close(fd);
+}
+
+static void run_server(int listenfd, int delay_us)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, fd, delay_us).detach();
+}
+
+static void run_bench(CommScheduler *scheduler, const struct sockaddr_in *addrs,
+					  int requests, int concurrency, int policy)
+{
+	std::vector<CommSchedTarget *> targets;
+	CommSchedGroup group;
+	BenchContext ctx;
+	int i;
+
+	group.init();
+	group.set_policy(policy);
+	for (i = 0; i < BACKENDS; i++)
+	{
+		auto *target = new CommSchedTarget;
+
+		target->init((const struct sockaddr *)&addrs[i], sizeof addrs[i],
+					 1000, 10000, 64);
+		group.add(target);
+		targets.push_back(target);
+	}
+
+	ctx.group = &group;
+	ctx.scheduler = scheduler;
+	ctx.slow = targets[BACKENDS - 1];
+	ctx.left = requests - concurrency;
+	ctx.running = concurrency;
+	ctx.slow_cnt = 0;
+	ctx.errors = 0;
+	for (i = 0; i < concurrency; i++)
+		(new RpcRequest(&ctx))->dispatch();
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+	while (ctx.running > 0)
+		ctx.cond.wait(lock);
+
+	printf("%-14s requests %d  errors %d  to slow %4.1f%%  "
+		   "p50 %.2fms  p90 %.2fms  p99 %.2fms  p99.9 %.2fms  mean %.2fms\n",
+		   policy == CSG_POLICY_LEAST_LOAD ? "least load" : "least latency",
+		   requests, ctx.errors, 100.0 * ctx.slow_cnt / requests,
+		   ctx.hist.percentile(50) / 1000.0, ctx.hist.percentile(90) / 1000.0,
+		   ctx.hist.percentile(99) / 1000.0, ctx.hist.percentile(99.9) / 1000.0,
+		   ctx.hist.mean() / 1000.0);
+
+	/* Idle connections go away with the scheduler. */
+	for (auto *target : targets)
+		group.remove(target);
+}
+
+int main(int argc, char *argv[])
+{
+	int requests = argc > 1 ? atoi(argv[1]) : 4000;
+	int concurrency = argc > 2 ? atoi(argv[2]) : 4;
+	int slow_ms = argc > 3 ? atoi(argv[3]) : 20;
+	struct sockaddr_in addrs[BACKENDS] = { };
+	CommScheduler scheduler;
+	int listenfd[BACKENDS];
+	pid_t pid;
+	int i;
+
+	if (requests <= 0 || concurrency <= 0 || concurrency > requests)
+	{
+		fprintf(stderr, "Usage: %s [requests] [concurrency] [slow_ms]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < BACKENDS; i++)
+	{
+		socklen_t addrlen = sizeof addrs[i];
+
+		addrs[i].sin_family = AF_INET;
+		addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listenfd[i] = socket(AF_INET, SOCK_STREAM, 0);
+		if (listenfd[i] < 0 ||
+			bind(listenfd[i], (struct sockaddr *)&addrs[i], addrlen) < 0 ||
+			listen(listenfd[i], 1024) < 0 ||
+			getsockname(listenfd[i], (struct sockaddr *)&addrs[i], &addrlen) < 0)
+		{
+			perror("listen");
+			return 1;
+		}
+	}
+
+	pid = fork();
+	if (pid == 0)
+	{
+		for (i = 0; i < BACKENDS - 1; i++)
+			std::thread(run_server, listenfd[i], 1000).detach();
+
+		run_server(listenfd[BACKENDS - 1], slow_ms * 1000);
+		_exit(0);
+	}
+
+	for (i = 0; i < BACKENDS; i++)
+		close(listenfd[i]);
+
+	if (pid < 0 || scheduler.init(1, 4) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	run_bench(&scheduler, addrs, requests, concurrency, CSG_POLICY_LEAST_LOAD);
+	run_bench(&scheduler, addrs, requests, concurrency, CSG_POLICY_LEAST_LATENCY);
+
+	scheduler.deinit();
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
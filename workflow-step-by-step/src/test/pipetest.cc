@@ -0,0 +1,285 @@
+/* Pipelined requests behind a write the socket can't take at once.
+ * Usage: pipetest
+ * The server reads nothing for a while, so the first 1MB request fills
+ * the socket buffers, and the next ones are pipelined behind its unwritten
+ * rest. One in the middle fails to make its message. It alone must fail;
+ * the others must get their own replies, in order, on one connection.
+ * Run with requests written at once, then with deferred flushes. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "Communicator.h"
+
+#define REQ_SIZE		(1024 * 1024)
+#define RPC_SIZE		64
+#define SOCK_BUFSIZE	(64 * 1024)
+#define STALL_MS		300
+#define REQUESTS		8
+#define BAD_REQUEST		3
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool deferred;
+	int pending;
+	int state[REQUESTS];
+	long long reply[REQUESTS];
+};
+
+class ReqOut : public CommMessageOut
+{
+public:
+	char *buf;
+
+	ReqOut() { this->buf = new char[REQ_SIZE](); }
+	virtual ~ReqOut() { delete []this->buf; }
+
+private:
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		/* Several vectors, so that a write may stop inside any. */
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = 100;
+		vectors[1].iov_base = this->buf + 100;
+		vectors[1].iov_len = REQ_SIZE - 100;
+		return 2;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+public:
+	char buf[RPC_SIZE];
+
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+			n = *size;
+
+		memcpy(this->buf + this->len, buf, n);
+		this->len += n;
+		*size = n;
+		return this->len == RPC_SIZE;
+	}
+};
+
+class PipeSession : public CommSession
+{
+public:
+	PipeSession(TestContext *ctx, long long id)
+	{
+		this->ctx = ctx;
+		this->id = id;
+		memcpy(this->out.buf, &id, sizeof id);
+	}
+
+private:
+	virtual CommMessageOut *message_out()
+	{
+		if (this->id == BAD_REQUEST)
+		{
+			errno = EBADMSG;
+			return NULL;
+		}
+
+		return &this->out;
+	}
+
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+	virtual int max_pipeline() { return REQUESTS; }
+	virtual int deferred_flush() { return this->ctx->deferred; }
+
+	virtual void handle(int state, int error)
+	{
+		TestContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state[this->id] = state;
+		if (state == CS_STATE_SUCCESS)
+			memcpy(&ctx->reply[this->id], this->in.buf, sizeof (long long));
+
+		ctx->pending--;
+		ctx->cond.notify_one();
+		delete this;
+	}
+
+	TestContext *ctx;
+	long long id;
+	ReqOut out;
+	RpcIn in;
+};
+
+/* Small send buffer, so that a big request never goes in one write. */
+class TestTarget : public CommTarget
+{
+private:
+	virtual int create_connect_fd()
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int size = SOCK_BUFSIZE;
+
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+
+		return fd;
+	}
+};
+
+static std::atomic<int> accepted;
+
+/* Stall, then answer each request with its id, in order. */
+static void serve_conn(int fd)
+{
+	char *buf = new char[REQ_SIZE];
+	char reply[RPC_SIZE] = { };
+	size_t len = 0;
+	ssize_t n;
+
+	usleep(STALL_MS * 1000);
+	while ((n = read(fd, buf + len, REQ_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == REQ_SIZE)
+		{
+			memcpy(reply, buf, sizeof (long long));
+			if (write(fd, reply, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	delete []buf;
+	close(fd);
+}
+
+static void run_server(int listenfd)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+	{
+		accepted++;
+		std::thread(serve_conn, fd).detach();
+	}
+}
+
+static int request(Communicator *comm, CommTarget *target, TestContext *ctx,
+				   long long id)
+{
+	auto *session = new PipeSession(ctx, id);
+
+	if (comm->request(session, target) >= 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+	ctx->state[id] = -errno;
+	ctx->pending--;
+	delete session;
+	return -1;
+}
+
+static int run_round(Communicator *comm, CommTarget *target, bool deferred)
+{
+	const char *name = deferred ? "deferred" : "immediate";
+	int connections = accepted;
+	TestContext ctx;
+	int failed = 0;
+	int ok;
+	int i;
+
+	ctx.deferred = deferred;
+	ctx.pending = REQUESTS;
+	request(comm, target, &ctx, 0);
+	/* Connected, and the first request is stuck in the socket. */
+	usleep(100 * 1000);
+	for (i = 1; i < REQUESTS; i++)
+		request(comm, target, &ctx, i);
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+	while (ctx.pending > 0)
+		ctx.cond.wait(lock);
+
+	for (i = 0; i < REQUESTS; i++)
+	{
+		if (i == BAD_REQUEST)
+			ok = (ctx.state[i] == -EBADMSG);
+		else
+			ok = (ctx.state[i] == CS_STATE_SUCCESS && ctx.reply[i] == i);
+
+		printf("%s request %d: state %d reply %lld: %s\n", name, i,
+			   ctx.state[i], ctx.state[i] == CS_STATE_SUCCESS ? ctx.reply[i] : -1LL,
+			   ok ? "OK" : "FAILED");
+		if (!ok)
+			failed = 1;
+	}
+
+	connections = accepted - connections;
+	printf("%s connections: %d\n", name, connections);
+	if (connections != 1)
+		failed = 1;
+
+	return failed;
+}
+
+/* Server threads and connections outlive the rounds. */
+static TestTarget targets[2];
+
+int main()
+{
+	struct sockaddr_in addr = { };
+	socklen_t addrlen = sizeof addr;
+	int size = SOCK_BUFSIZE;
+	Communicator comm;
+	int failed = 0;
+	int listenfd;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd < 0 ||
+		setsockopt(listenfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) < 0 ||
+		bind(listenfd, (struct sockaddr *)&addr, addrlen) < 0 ||
+		listen(listenfd, 1024) < 0 ||
+		getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0 ||
+		comm.init(1, 2) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	std::thread(run_server, listenfd).detach();
+	for (i = 0; i < 2; i++)
+	{
+		targets[i].init((const struct sockaddr *)&addr, addrlen, 1000, 5000);
+		failed |= run_round(&comm, &targets[i], i == 1);
+	}
+
+	comm.deinit();
+	for (i = 0; i < 2; i++)
+		targets[i].deinit();
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,315 @@
+/* The pool of pre-warmed idle connections of a target.
+ * Usage: pooltest
+ * Against local servers, the pool must be replaced when its connections
+ * idle past the keep-alive timeout, must not grow while requests reuse it,
+ * and must back off, not spin, while the peer closes every connection it
+ * accepts or refuses to connect. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+
+#define RPC_SIZE		64
+
+struct Server
+{
+	struct sockaddr_in addr;
+	int listenfd;
+	bool close_at_once;
+	std::atomic<int> accepted;
+	std::atomic<int> live;
+};
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	CommSchedTarget *target;
+	CommScheduler *scheduler;
+	int done;
+	int state;
+};
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(TestContext *ctx) :
+		CommRequest(ctx->target, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = -1;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual SubTask *done()
+	{
+		TestContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state = this->state;
+		ctx->done = 1;
+		ctx->cond.notify_one();
+		delete this;
+		return NULL;
+	}
+
+	TestContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static void serve_conn(Server *server, int fd)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	server->live++;
+	while (!server->close_at_once &&
+		   (n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	server->live--;
+	close(fd);
+}
+
+static void run_server(Server *server)
+{
+	int fd;
+
+	while ((fd = accept(server->listenfd, NULL, NULL)) >= 0)
+	{
+		server->accepted++;
+		std::thread(serve_conn, server, fd).detach();
+	}
+}
+
+/* Bound, but connects are refused until listening. */
+static int server_init(Server *server, bool close_at_once)
+{
+	socklen_t addrlen = sizeof server->addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	server->addr.sin_family = AF_INET;
+	server->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server->addr.sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)&server->addr, addrlen) < 0 ||
+		getsockname(fd, (struct sockaddr *)&server->addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	server->listenfd = fd;
+	server->close_at_once = close_at_once;
+	server->accepted = 0;
+	server->live = 0;
+	return 0;
+}
+
+static int server_start(Server *server)
+{
+	if (listen(server->listenfd, 1024) < 0)
+		return -1;
+
+	std::thread(run_server, server).detach();
+	return 0;
+}
+
+static int check(const char *what, int value, int min, int max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %d, expected %d..%d: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static void target_init(CommSchedTarget *target, const Server *server,
+						size_t min_idle, int keep_alive)
+{
+	target->init((const struct sockaddr *)&server->addr, sizeof server->addr,
+				 1000, 5000, 8);
+	target->set_min_idle_connections(min_idle, keep_alive);
+}
+
+/* Idle connections expire and are replaced, about 3 every 200ms. */
+static int test_expire(CommScheduler *scheduler, CommSchedTarget& target,
+					   Server& server)
+{
+	int failed = 0;
+
+	if (server_init(&server, false) < 0 || server_start(&server) < 0)
+		return 1;
+
+	target_init(&target, &server, 3, 200);
+	scheduler->prewarm(&target);
+	usleep(100 * 1000);
+	failed |= check("expire: pooled", server.live, 3, 3);
+	usleep(900 * 1000);
+	failed |= check("expire: accepted in 1s", server.accepted, 12, 18);
+	failed |= check("expire: pooled", server.live, 3, 6);
+	return failed;
+}
+
+static int run_request(TestContext *ctx)
+{
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+
+	ctx->done = 0;
+	(new RpcRequest(ctx))->dispatch();
+	while (!ctx->done)
+		ctx->cond.wait(lock);
+
+	return ctx->state;
+}
+
+/* Requests take pooled connections and give them back. */
+static int test_reuse(CommScheduler *scheduler, CommSchedTarget& target,
+					  Server& server)
+{
+	TestContext ctx;
+	int errors = 0;
+	int i;
+
+	if (server_init(&server, false) < 0 || server_start(&server) < 0)
+		return 1;
+
+	target_init(&target, &server, 2, 60 * 1000);
+	scheduler->prewarm(&target);
+	usleep(100 * 1000);
+	ctx.target = &target;
+	ctx.scheduler = scheduler;
+	for (i = 0; i < 100; i++)
+	{
+		if (run_request(&ctx) != CS_STATE_SUCCESS)
+			errors++;
+	}
+
+	return check("reuse: errors", errors, 0, 0) |
+		   check("reuse: accepted", server.accepted, 2, 4);
+}
+
+/* The peer closes each connection at once. Refills are 100, 200, 400 and
+ * 800ms apart, so five rounds of two in 1.5s, give or take one. */
+static int test_close(CommScheduler *scheduler, CommSchedTarget& target,
+					  Server& server)
+{
+	if (server_init(&server, true) < 0 || server_start(&server) < 0)
+		return 1;
+
+	target_init(&target, &server, 2, 60 * 1000);
+	scheduler->prewarm(&target);
+	usleep(1500 * 1000);
+	return check("close: accepted in 1.5s", server.accepted, 6, 12);
+}
+
+/* Refused for 0.5s, then the pool fills on the next try, at 0.7s. */
+static int test_refuse(CommScheduler *scheduler, CommSchedTarget& target,
+					   Server& server)
+{
+	int failed = 0;
+
+	if (server_init(&server, false) < 0)
+		return 1;
+
+	target_init(&target, &server, 2, 60 * 1000);
+	scheduler->prewarm(&target);
+	usleep(500 * 1000);
+	if (server_start(&server) < 0)
+		return 1;
+
+	failed |= check("refuse: accepted at 0.5s", server.accepted, 0, 0);
+	usleep(500 * 1000);
+	failed |= check("refuse: pooled at 1s", server.live, 2, 2);
+	return failed;
+}
+
+/* Server threads and connections outlive the tests. */
+static Server servers[4];
+static CommSchedTarget targets[4];
+
+int main()
+{
+	CommScheduler scheduler;
+	int failed = 0;
+	int i;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (scheduler.init(1, 2) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	failed |= test_expire(&scheduler, targets[0], servers[0]);
+	failed |= test_reuse(&scheduler, targets[1], servers[1]);
+	failed |= test_close(&scheduler, targets[2], servers[2]);
+	failed |= test_refuse(&scheduler, targets[3], servers[3]);
+
+	scheduler.deinit();
+	for (i = 0; i < 4; i++)
+		targets[i].deinit();
+
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
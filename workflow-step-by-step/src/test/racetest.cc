@@ -0,0 +1,247 @@
+/* Connection reuse after a connect race.
+ * Usage: racetest [requests]
+ * Target A is a listener whose accept queue is full, so its SYNs go
+ * unanswered, and it races target B, a local echo server. The first
+ * request on A is served over a connection to B and reports a lost race.
+ * The later ones reuse that connection from A's pool and must not, or A
+ * would be dropped from its group on every success. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+
+#define RPC_SIZE		64
+#define RACE_DELAY		50
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	CommSchedTarget *target;
+	CommTarget *winner;
+	CommScheduler *scheduler;
+	int done;
+	int state;
+	bool peer_ok;
+	bool lost_race;
+};
+
+class RpcOut : public CommMessageOut
+{
+private:
+	char buf[RPC_SIZE] = { };
+
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(TestContext *ctx) :
+		CommRequest(ctx->target, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = -1;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual SubTask *done()
+	{
+		TestContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state = this->state;
+		ctx->peer_ok = (this->get_peer_target() == ctx->winner);
+		ctx->lost_race = this->lost_connect_race();
+		ctx->done = 1;
+		ctx->cond.notify_one();
+		delete this;
+		return NULL;
+	}
+
+	TestContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static std::atomic<int> accepted;
+
+static void serve_conn(int fd)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	close(fd);
+}
+
+static void run_server(int listenfd)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+	{
+		accepted++;
+		std::thread(serve_conn, fd).detach();
+	}
+}
+
+static int listen_on(struct sockaddr_in *addr, int backlog)
+{
+	socklen_t addrlen = sizeof *addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)addr, addrlen) < 0 ||
+		listen(fd, backlog) < 0 ||
+		getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Connections never accepted, so further SYNs to 'addr' are dropped. */
+static void fill_accept_queue(const struct sockaddr_in *addr)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		connect(fd, (const struct sockaddr *)addr, sizeof *addr);
+	}
+
+	usleep(100000);
+}
+
+int main(int argc, char *argv[])
+{
+	int requests = argc > 1 ? atoi(argv[1]) : 5;
+	struct sockaddr_in addr_a;
+	struct sockaddr_in addr_b;
+	CommSchedTarget target_a;
+	CommSchedTarget target_b;
+	CommScheduler scheduler;
+	TestContext ctx;
+	int failed = 0;
+	int fd_a;
+	int fd_b;
+	int i;
+
+	if (requests < 2)
+	{
+		fprintf(stderr, "Usage: %s [requests >= 2]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	fd_a = listen_on(&addr_a, 0);
+	fd_b = listen_on(&addr_b, 1024);
+	if (fd_a < 0 || fd_b < 0 || scheduler.init(1, 2) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	fill_accept_queue(&addr_a);
+	std::thread(run_server, fd_b).detach();
+
+	target_a.init((const struct sockaddr *)&addr_a, sizeof addr_a, 5000, 5000, 8);
+	target_b.init((const struct sockaddr *)&addr_b, sizeof addr_b, 5000, 5000, 8);
+	target_a.set_race_target(&target_b, RACE_DELAY);
+	target_b.set_race_target(&target_a, RACE_DELAY);
+
+	ctx.target = &target_a;
+	ctx.winner = &target_b;
+	ctx.scheduler = &scheduler;
+	for (i = 0; i < requests; i++)
+	{
+		ctx.done = 0;
+		(new RpcRequest(&ctx))->dispatch();
+
+		std::unique_lock<std::mutex> lock(ctx.mutex);
+		while (!ctx.done)
+			ctx.cond.wait(lock);
+
+		/* Only the request that ran the race lost it. */
+		printf("request %d: state %d  peer B %d  lost race %d\n",
+			   i, ctx.state, ctx.peer_ok, ctx.lost_race);
+		if (ctx.state != CS_STATE_SUCCESS || !ctx.peer_ok ||
+			ctx.lost_race != (i == 0))
+		{
+			failed = 1;
+		}
+	}
+
+	printf("connections accepted by B: %d\n", (int)accepted);
+	if (accepted != 1)
+		failed = 1;
+
+	scheduler.deinit();
+	target_a.deinit();
+	target_b.deinit();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
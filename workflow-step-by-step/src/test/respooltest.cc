@@ -0,0 +1,257 @@
+/* WFResourcePool across many series, and counters counted by name.
+ * Usage: respooltest
+ * 2000 series share 8 resources, each holding one for up to 300us. No
+ * resource may be held twice, all 8 must be in use at some point, every
+ * series must finish, and none may start inside the post() that freed
+ * its resource. Then count_by_name() must go to counters of the name in
+ * the order they were made, count before a counter starts, drop counts
+ * nobody waits for, and finish a counter once under counts from many
+ * threads. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "WFTaskFactory.h"
+#include "WFResourcePool.h"
+#include "Workflow.h"
+
+#define POOL_SIZE		8
+#define SERIES			2000
+#define HOLD_US			300
+#define COUNT_THREADS	4
+#define COUNTS			1000
+
+struct TestContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	int pending;
+};
+
+struct SeriesContext
+{
+	void *res;
+	unsigned int hold;
+};
+
+static WFResourcePool *pool;
+static void *resources[POOL_SIZE];
+static std::atomic<int> in_use[POOL_SIZE];
+static std::atomic<int> held;
+static std::atomic<int> max_held;
+static std::atomic<int> held_twice;
+static std::atomic<int> started_in_post;
+static thread_local bool in_post;
+
+static void finish(TestContext *ctx)
+{
+	std::lock_guard<std::mutex> lock(ctx->mutex);
+
+	ctx->pending--;
+	ctx->cond.notify_one();
+}
+
+/* False if it takes more than a minute. */
+static bool wait_all(TestContext *ctx)
+{
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+
+	return ctx->cond.wait_for(lock, std::chrono::seconds(60),
+							  [ctx] { return ctx->pending == 0; });
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+/* Runs in place of the pool's conditional, as soon as it has a resource. */
+static void take(WFCounterTask *task)
+{
+	auto *sctx = (SeriesContext *)task->user_data;
+	int i = (int)(intptr_t)sctx->res;
+	int cur;
+	int max;
+
+	if (in_post)
+		started_in_post++;
+
+	if (in_use[i].exchange(1))
+		held_twice++;
+
+	cur = ++held;
+	max = max_held;
+	while (cur > max && !max_held.compare_exchange_weak(max, cur))
+		;
+}
+
+static void give_back(WFTimerTask *task)
+{
+	auto *sctx = (SeriesContext *)task->user_data;
+	int i = (int)(intptr_t)sctx->res;
+
+	in_use[i] = 0;
+	held--;
+	in_post = true;
+	pool->post(sctx->res);
+	in_post = false;
+}
+
+static int test_pool()
+{
+	WFResourcePool respool(resources, POOL_SIZE);
+	std::vector<SeriesContext> sctx(SERIES);
+	TestContext ctx;
+	WFCounterTask *start;
+	WFTimerTask *timer;
+	SeriesWork *series;
+	unsigned int seed = 1;
+	int failed = 0;
+	int i;
+
+	pool = &respool;
+	ctx.pending = SERIES;
+	for (i = 0; i < SERIES; i++)
+	{
+		sctx[i].hold = rand_r(&seed) % HOLD_US;
+		start = WFTaskFactory::create_counter_task(0, take);
+		start->user_data = &sctx[i];
+		timer = WFTaskFactory::create_timer_task(sctx[i].hold, give_back);
+		timer->user_data = &sctx[i];
+		series = Workflow::create_series_work(pool->get(start, &sctx[i].res),
+											  [&ctx](const SeriesWork *) {
+			finish(&ctx);
+		});
+		series->push_back(timer);
+		series->start();
+	}
+
+	if (!wait_all(&ctx))
+	{
+		printf("pool: %d series still waiting: FAILED\n", ctx.pending);
+		fflush(stdout);
+		_exit(1);
+	}
+
+	failed |= check("pool: most held at once", max_held, POOL_SIZE, POOL_SIZE);
+	failed |= check("pool: held twice", held_twice, 0, 0);
+	failed |= check("pool: started inside post()", started_in_post, 0, 0);
+	failed |= check("pool: held at the end", held, 0, 0);
+	return failed;
+}
+
+static std::mutex order_mutex;
+static std::vector<int> order;
+
+static WFCounterTask *create_counter(const std::string& name,
+									 unsigned int target, int id,
+									 TestContext *ctx)
+{
+	WFCounterTask *task;
+
+	task = WFTaskFactory::create_counter_task(name, target,
+											  [id, ctx](WFCounterTask *) {
+		{
+			std::lock_guard<std::mutex> lock(order_mutex);
+			order.push_back(id);
+		}
+
+		finish(ctx);
+	});
+
+	task->start();
+	return task;
+}
+
+static int test_counters()
+{
+	std::vector<std::thread> threads;
+	TestContext ctx;
+	WFCounterTask *task;
+	int failed = 0;
+	int i;
+
+	/* 4 counts fill the first and leave the second one short. */
+	ctx.pending = 2;
+	create_counter("order", 3, 1, &ctx);
+	create_counter("order", 2, 2, &ctx);
+	WFTaskFactory::count_by_name("order", 4);
+	failed |= check("order: finished after 4", order.size(), 1, 1);
+	failed |= check("order: first one", order.size() > 0 ? order[0] : 0, 1, 1);
+	WFTaskFactory::count_by_name("order");
+	wait_all(&ctx);
+	failed |= check("order: finished after 5", order.size(), 2, 2);
+	failed |= check("order: second one", order.size() > 1 ? order[1] : 0, 2, 2);
+
+	/* Counted before it starts, finishes as it starts. */
+	order.clear();
+	ctx.pending = 1;
+	task = WFTaskFactory::create_counter_task("early", 1,
+											  [&ctx](WFCounterTask *) {
+		order.push_back(3);
+		finish(&ctx);
+	});
+	WFTaskFactory::count_by_name("early");
+	failed |= check("early: finished before start", order.size(), 0, 0);
+	task->start();
+	failed |= check("early: finished at start", order.size(), 1, 1);
+
+	/* Counts for nobody, and more than a counter needs, are dropped. */
+	order.clear();
+	WFTaskFactory::count_by_name("nobody", 5);
+	ctx.pending = 1;
+	create_counter("nobody", 2, 4, &ctx);
+	failed |= check("nobody: earlier counts dropped", order.size(), 0, 0);
+	WFTaskFactory::count_by_name("nobody", 10);
+	failed |= check("nobody: finished", order.size(), 1, 1);
+	ctx.pending = 1;
+	create_counter("nobody", 1, 5, &ctx);
+	failed |= check("nobody: extra counts dropped", order.size(), 1, 1);
+	WFTaskFactory::count_by_name("nobody");
+	failed |= check("nobody: next one finished", order.size(), 2, 2);
+
+	/* Counts from many threads finish the counter once. */
+	order.clear();
+	ctx.pending = 1;
+	create_counter("threads", COUNT_THREADS * COUNTS, 6, &ctx);
+	for (i = 0; i < COUNT_THREADS; i++)
+	{
+		threads.emplace_back([] {
+			for (int j = 0; j < COUNTS; j++)
+				WFTaskFactory::count_by_name("threads");
+		});
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	wait_all(&ctx);
+	WFTaskFactory::count_by_name("threads");
+	failed |= check("threads: finished", order.size(), 1, 1);
+	return failed;
+}
+
+int main()
+{
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < POOL_SIZE; i++)
+		resources[i] = (void *)(intptr_t)i;
+
+	failed |= test_pool();
+	failed |= test_counters();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,99 @@
+/* Cost of short series: heap allocations and time per series.
+ * Usage: seriesbench [series] [tasks]
+ * Each series runs 'tasks' tasks that finish as soon as they are
+ * dispatched, so all the work is the series itself. Allocations are
+ * counted by replacing the global operator new. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
+#include <chrono>
+#include "Workflow.h"
+
+static size_t allocations;
+
+void *operator new(size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+
+	allocations++;
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+class NopTask : public SubTask
+{
+public:
+	virtual void dispatch()
+	{
+		this->subtask_done();
+	}
+
+private:
+	virtual SubTask *done()
+	{
+		SeriesWork *series = series_of(this);
+
+		delete this;
+		return series->pop();
+	}
+};
+
+static void run_bench(int n, int tasks, bool warm)
+{
+	size_t count = allocations;
+	size_t per_task = 0;
+	auto start = std::chrono::steady_clock::now();
+	int i, j;
+
+	for (i = 0; i < n; i++)
+	{
+		SeriesWork *series = Workflow::create_series_work(new NopTask, nullptr);
+
+		for (j = 1; j < tasks; j++)
+			series->push_back(new NopTask);
+
+		series->start();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+	count = allocations - count;
+	per_task = (size_t)n * tasks;
+	if (!warm)
+	{
+		printf("series %d  tasks %d  allocations per series %.2f "
+			   "(%.2f besides the tasks)  %.1fns per series\n",
+			   n, tasks, (double)count / n,
+			   (double)(count - per_task) / n, ns / n);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int n = argc > 1 ? atoi(argv[1]) : 2000000;
+	int tasks = argc > 2 ? atoi(argv[2]) : 3;
+
+	if (n <= 0 || tasks <= 0)
+	{
+		fprintf(stderr, "Usage: %s [series] [tasks]\n", argv[0]);
+		return 1;
+	}
+
+	run_bench(1000, tasks, true);
+	run_bench(n, tasks, false);
+	return 0;
+}
@@ -0,0 +1,275 @@
+/* Round trip latency to a local echo server, unix socket vs TCP loopback.
+ * Usage: unixbench [requests] [size]
+ * Requests go one at a time through RouteManager and the global scheduler,
+ * so each measures the full path of a client task on a kept-alive
+ * connection. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "CommScheduler.h"
+#include "EndpointParams.h"
+#include "RouteManager.h"
+#include "WFGlobal.h"
+
+#define SERVER_BUFSIZE	(64 * 1024)
+
+struct BenchContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done;
+	int state;
+};
+
+class EchoOut : public CommMessageOut
+{
+public:
+	std::vector<char> buf;
+
+private:
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf.data();
+		vectors[0].iov_len = this->buf.size();
+		return 1;
+	}
+};
+
+class EchoIn : public CommMessageIn
+{
+public:
+	size_t size = 0;
+
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = this->size - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = this->size;
+		return 1;
+	}
+};
+
+class EchoSession : public CommSession
+{
+public:
+	EchoSession(BenchContext *ctx, size_t size)
+	{
+		this->ctx = ctx;
+		this->out.buf.assign(size, 'x');
+		this->in.size = size;
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual void handle(int state, int error)
+	{
+		BenchContext *ctx = this->ctx;
+
+		delete this;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+		ctx->state = state;
+		ctx->done = true;
+		ctx->cond.notify_one();
+	}
+
+	BenchContext *ctx;
+	EchoOut out;
+	EchoIn in;
+};
+
+static void serve_conn(int fd)
+{
+	char *p = new char[SERVER_BUFSIZE];
+	ssize_t n;
+	ssize_t off;
+	ssize_t ret;
+
+	while ((n = read(fd, p, SERVER_BUFSIZE)) > 0)
+	{
+		for (off = 0; off < n; off += ret)
+		{
+			ret = write(fd, p + off, n - off);
+			if (ret < 0)
+				break;
+		}
+	}
+
+	delete []p;
+	close(fd);
+}
+
+static void run_server(int listenfd, bool nodelay)
+{
+	int flag = 1;
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+	{
+		if (nodelay)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof (int));
+
+		std::thread(serve_conn, fd).detach();
+	}
+}
+
+static int request_one(CommSchedObject *object, size_t size)
+{
+	BenchContext ctx;
+	CommTarget *target;
+	auto *session = new EchoSession(&ctx, size);
+
+	ctx.done = false;
+	if (WFGlobal::get_scheduler()->request(session, object, -1, &target) < 0)
+	{
+		delete session;
+		return -1;
+	}
+
+	std::unique_lock<std::mutex> lock(ctx.mutex);
+	while (!ctx.done)
+		ctx.cond.wait(lock);
+
+	return ctx.state == CS_STATE_SUCCESS ? 0 : -1;
+}
+
+static double run_bench(const char *name, const struct sockaddr *addr,
+						socklen_t addrlen, int requests, size_t size)
+{
+	struct addrinfo addrinfo = { };
+	RouteManager::RouteResult result;
+	std::vector<double> usec;
+	int errors = 0;
+	int i;
+
+	addrinfo.ai_family = addr->sa_family;
+	addrinfo.ai_socktype = SOCK_STREAM;
+	addrinfo.ai_addrlen = addrlen;
+	addrinfo.ai_addr = (struct sockaddr *)addr;
+	if (WFGlobal::get_route_manager()->get(TT_TCP, &addrinfo, "",
+										   &ENDPOINT_PARAMS_DEFAULT, name,
+										   result) < 0)
+	{
+		perror("route");
+		exit(1);
+	}
+
+	/* Connect and warm up, not part of the result. */
+	for (i = 0; i < 1000; i++)
+		request_one(result.request_object, size);
+
+	for (i = 0; i < requests; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		if (request_one(result.request_object, size) < 0)
+			errors++;
+
+		auto end = std::chrono::steady_clock::now();
+		usec.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+	}
+
+	std::sort(usec.begin(), usec.end());
+	double sum = 0;
+
+	for (double t : usec)
+		sum += t;
+
+	printf("%-5s size %-6zu requests %d  errors %d  mean %.1fus  p50 %.1fus  p99 %.1fus\n",
+		   name, size, requests, errors, sum / requests,
+		   usec[requests / 2], usec[requests * 99 / 100]);
+	return sum / requests;
+}
+
+int main(int argc, char *argv[])
+{
+	int requests = argc > 1 ? atoi(argv[1]) : 20000;
+	size_t size = argc > 2 ? atoi(argv[2]) : 64;
+	struct sockaddr_in in = { };
+	struct sockaddr_un un = { };
+	socklen_t inlen = sizeof in;
+	int tcpfd;
+	int unixfd;
+	pid_t pid;
+
+	if (requests <= 0 || size == 0)
+	{
+		fprintf(stderr, "Usage: %s [requests] [size]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof un.sun_path, "/tmp/unixbench.%d.sock", (int)getpid());
+	tcpfd = socket(AF_INET, SOCK_STREAM, 0);
+	unixfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (tcpfd < 0 || bind(tcpfd, (struct sockaddr *)&in, inlen) < 0 ||
+		listen(tcpfd, 64) < 0 ||
+		getsockname(tcpfd, (struct sockaddr *)&in, &inlen) < 0 ||
+		unixfd < 0 || bind(unixfd, (struct sockaddr *)&un, sizeof un) < 0 ||
+		listen(unixfd, 64) < 0)
+	{
+		perror("listen");
+		return 1;
+	}
+
+	/* Fork before the global scheduler starts any thread. */
+	pid = fork();
+	if (pid == 0)
+	{
+		std::thread(run_server, tcpfd, true).detach();
+		run_server(unixfd, false);
+		_exit(0);
+	}
+
+	close(tcpfd);
+	close(unixfd);
+	if (pid < 0)
+	{
+		perror("fork");
+		return 1;
+	}
+
+	double tcp = run_bench("tcp", (struct sockaddr *)&in, sizeof in, requests, size);
+	double local = run_bench("unix", (struct sockaddr *)&un, sizeof un, requests, size);
+
+	printf("unix socket saves %.1f%% of mean round trip time\n",
+		   (tcp - local) / tcp * 100);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	unlink(un.sun_path);
+	return 0;
+}
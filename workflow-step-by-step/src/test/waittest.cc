@@ -0,0 +1,350 @@
+/* The wait queue of a full target: deadline order, and early rejection
+ * under overload.
+ * Usage: waittest
+ * A local backend holds each request for as long as the request asks.
+ * With the one slot of a target taken, waiters with no deadline, a late
+ * one and an early one queue up in that order, and must be served early
+ * one first, no deadline last. Then 16 clients with 30ms to get a slot
+ * loop on a target of 2 slots served in 10ms, about three times what it
+ * takes. Those that can't be served in time must be turned away at once,
+ * not after 30ms in the queue, so that the target stays busy with ones
+ * that make it. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "CommRequest.h"
+#include "CommScheduler.h"
+
+#define RPC_SIZE		64
+#define CLIENTS			16
+#define SLOTS			2
+#define SERVICE_MS		10
+#define WAIT_TIMEOUT	30
+#define OVERLOAD_MS		2000
+
+struct ClientContext
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	CommSchedObject *object;
+	CommScheduler *scheduler;
+	int wait_timeout;
+	int delay;			/* milliseconds the backend holds the request */
+	bool done;
+	int state;
+	int error;
+	int order;			/* when it finished, among all */
+};
+
+static std::atomic<int> finished;
+
+/* The delay, and the rest. */
+class RpcOut : public CommMessageOut
+{
+public:
+	char buf[RPC_SIZE] = { };
+
+private:
+	virtual int encode(struct iovec vectors[], int max)
+	{
+		vectors[0].iov_base = this->buf;
+		vectors[0].iov_len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcIn : public CommMessageIn
+{
+private:
+	size_t len = 0;
+
+	virtual int append(const void *buf, size_t *size)
+	{
+		size_t n = RPC_SIZE - this->len;
+
+		if (*size < n)
+		{
+			this->len += *size;
+			return 0;
+		}
+
+		*size = n;
+		this->len = RPC_SIZE;
+		return 1;
+	}
+};
+
+class RpcRequest : public CommRequest
+{
+public:
+	RpcRequest(ClientContext *ctx) :
+		CommRequest(ctx->object, ctx->scheduler)
+	{
+		this->ctx = ctx;
+		this->wait_timeout = ctx->wait_timeout;
+		memcpy(this->out.buf, &ctx->delay, sizeof (int));
+	}
+
+private:
+	virtual CommMessageOut *message_out() { return &this->out; }
+	virtual CommMessageIn *message_in() { return &this->in; }
+	virtual int keep_alive_timeout() { return 60 * 1000; }
+
+	virtual SubTask *done()
+	{
+		ClientContext *ctx = this->ctx;
+		std::lock_guard<std::mutex> lock(ctx->mutex);
+
+		ctx->state = this->state;
+		ctx->error = this->error;
+		ctx->order = finished++;
+		ctx->done = true;
+		ctx->cond.notify_one();
+		delete this;
+		return NULL;
+	}
+
+	ClientContext *ctx;
+	RpcOut out;
+	RpcIn in;
+};
+
+static void serve_conn(int fd)
+{
+	char buf[RPC_SIZE];
+	size_t len = 0;
+	ssize_t n;
+	int delay;
+
+	while ((n = read(fd, buf + len, RPC_SIZE - len)) > 0)
+	{
+		len += n;
+		if (len == RPC_SIZE)
+		{
+			memcpy(&delay, buf, sizeof (int));
+			usleep(delay * 1000);
+			if (write(fd, buf, RPC_SIZE) != RPC_SIZE)
+				break;
+
+			len = 0;
+		}
+	}
+
+	close(fd);
+}
+
+static void run_backend(int listenfd)
+{
+	int fd;
+
+	while ((fd = accept(listenfd, NULL, NULL)) >= 0)
+		std::thread(serve_conn, fd).detach();
+}
+
+static int backend_start(struct sockaddr_in *addr)
+{
+	socklen_t addrlen = sizeof *addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	if (fd < 0 ||
+		bind(fd, (struct sockaddr *)addr, addrlen) < 0 ||
+		listen(fd, 1024) < 0 ||
+		getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0)
+	{
+		return -1;
+	}
+
+	std::thread(run_backend, fd).detach();
+	return 0;
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Returns when the request is done. */
+static void run_request(ClientContext *ctx)
+{
+	ctx->done = false;
+	(new RpcRequest(ctx))->dispatch();
+
+	std::unique_lock<std::mutex> lock(ctx->mutex);
+	while (!ctx->done)
+		ctx->cond.wait(lock);
+}
+
+static int check(const char *what, long value, long min, long max)
+{
+	int ok = (value >= min && value <= max);
+
+	printf("%s: %ld, expected %ld..%ld: %s\n", what, value, min, max,
+		   ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+/* The first takes the slot for 200ms. The others queue 20ms apart. */
+static int test_order(CommScheduler *scheduler, CommSchedTarget *target)
+{
+	static const int timeouts[3] = { -1, 1000, 500 };
+	static const char *names[3] = { "no deadline", "late", "early" };
+	ClientContext holder;
+	ClientContext waiters[3];
+	std::vector<std::thread> threads;
+	char what[64];
+	int failed = 0;
+	int i;
+
+	holder.object = target;
+	holder.scheduler = scheduler;
+	holder.wait_timeout = -1;
+	holder.delay = 200;
+	threads.emplace_back(run_request, &holder);
+	for (i = 0; i < 3; i++)
+	{
+		usleep(20 * 1000);
+		waiters[i].object = target;
+		waiters[i].scheduler = scheduler;
+		waiters[i].wait_timeout = timeouts[i];
+		waiters[i].delay = 1;
+		threads.emplace_back(run_request, &waiters[i]);
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	failed |= check("order: holder served", holder.state, CS_STATE_SUCCESS,
+					CS_STATE_SUCCESS);
+	for (i = 0; i < 3; i++)
+	{
+		/* Finished after the holder, early one first. */
+		snprintf(what, sizeof what, "order: %s finished", names[i]);
+		failed |= check(what, waiters[i].order - holder.order, 3 - i, 3 - i);
+	}
+
+	return failed;
+}
+
+struct ClientResult
+{
+	int served;
+	int rejected;		/* turned away before half the wait timeout */
+	int timed_out;		/* turned away later */
+	int errors;
+};
+
+static std::atomic<bool> clients_stop;
+
+static void run_client(CommSchedObject *object, CommScheduler *scheduler,
+					   ClientResult *result)
+{
+	ClientContext ctx;
+	long long start;
+
+	ctx.object = object;
+	ctx.scheduler = scheduler;
+	ctx.wait_timeout = WAIT_TIMEOUT;
+	ctx.delay = SERVICE_MS;
+	while (!clients_stop)
+	{
+		start = now_ms();
+		run_request(&ctx);
+		if (ctx.state == CS_STATE_SUCCESS)
+			result->served++;
+		else if (ctx.error != ETIMEDOUT)
+			result->errors++;
+		else if (now_ms() - start < WAIT_TIMEOUT / 2)
+		{
+			result->rejected++;
+			/* A client turned away backs off, as a caller would. */
+			usleep(SERVICE_MS * 1000);
+		}
+		else
+			result->timed_out++;
+	}
+}
+
+/* 2 slots of 10ms serve about 200 a second. */
+static int test_overload(CommScheduler *scheduler, CommSchedTarget *target)
+{
+	std::vector<std::thread> clients;
+	ClientResult results[CLIENTS] = { };
+	ClientResult total = { };
+	long capacity = SLOTS * OVERLOAD_MS / SERVICE_MS;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < CLIENTS; i++)
+		clients.emplace_back(run_client, target, scheduler, &results[i]);
+
+	usleep(OVERLOAD_MS * 1000);
+	clients_stop = true;
+	for (i = 0; i < CLIENTS; i++)
+	{
+		clients[i].join();
+		total.served += results[i].served;
+		total.rejected += results[i].rejected;
+		total.timed_out += results[i].timed_out;
+		total.errors += results[i].errors;
+	}
+
+	printf("overload: served %d  rejected %d  timed out %d  errors %d\n",
+		   total.served, total.rejected, total.timed_out, total.errors);
+	failed |= check("overload: served", total.served, capacity * 6 / 10,
+					capacity);
+	failed |= check("overload: rejected early", total.rejected, 1, 1000000);
+	/* Only while the latency is being learned, and by misses. */
+	failed |= check("overload: timed out in queue", total.timed_out, 0,
+					total.rejected / 10 + CLIENTS);
+	failed |= check("overload: errors", total.errors, 0, 0);
+	return failed;
+}
+
+/* Targets outlive the scheduler's connections. */
+static CommSchedTarget targets[2];
+
+int main()
+{
+	struct sockaddr_in addr;
+	CommScheduler scheduler;
+	int failed = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (scheduler.init(1, 4) < 0 || backend_start(&addr) < 0 ||
+		targets[0].init((const struct sockaddr *)&addr, sizeof addr,
+						1000, 5000, 1) < 0 ||
+		targets[1].init((const struct sockaddr *)&addr, sizeof addr,
+						1000, 5000, SLOTS) < 0)
+	{
+		perror("init");
+		return 1;
+	}
+
+	failed |= test_order(&scheduler, &targets[0]);
+	failed |= test_overload(&scheduler, &targets[1]);
+	scheduler.deinit();
+	targets[0].deinit();
+	targets[1].deinit();
+	printf("%s\n", failed ? "FAILED" : "OK");
+	return failed;
+}
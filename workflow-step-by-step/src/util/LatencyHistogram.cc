@@ -0,0 +1,96 @@
+#include <string.h>
+#include "LatencyHistogram.h"
+
+int LatencyHistogram::index_of(int64_t value)
+{
+	int shift;
+
+	if (value < 2 * SUB_HALF)
+		return (int)value;
+
+	if (value >= (int64_t)1 << MAX_BITS)
+		value = ((int64_t)1 << MAX_BITS) - 1;
+
+	// Keep the top SUB_BITS bits of the value.
+	shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+	return shift * SUB_HALF + (int)(value >> shift);
+}
+
+int64_t LatencyHistogram::value_at(int index)
+{
+	int shift;
+
+	if (index < 2 * SUB_HALF)
+		return index;
+
+	shift = index / SUB_HALF - 1;
+	return (int64_t)(index - shift * SUB_HALF) << shift;
+}
+
+void LatencyHistogram::record(int64_t usec)
+{
+	if (usec < 0)
+		usec = 0;
+
+	counts_[index_of(usec)]++;
+	if (count_ == 0 || usec < min_)
+		min_ = usec;
+
+	if (usec > max_)
+		max_ = usec;
+
+	count_++;
+	sum_ += usec;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	if (other.count_ == 0)
+		return;
+
+	for (int i = 0; i < BUCKETS; i++)
+		counts_[i] += other.counts_[i];
+
+	if (count_ == 0 || other.min_ < min_)
+		min_ = other.min_;
+
+	if (other.max_ > max_)
+		max_ = other.max_;
+
+	count_ += other.count_;
+	sum_ += other.sum_;
+}
+
+void LatencyHistogram::reset()
+{
+	memset(counts_, 0, sizeof counts_);
+	count_ = 0;
+	sum_ = 0;
+	min_ = 0;
+	max_ = 0;
+}
+
+int64_t LatencyHistogram::percentile(double percentile) const
+{
+	int64_t rank;
+	int64_t n = 0;
+
+	if (count_ == 0)
+		return 0;
+
+	rank = (int64_t)(percentile / 100 * count_ + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		n += counts_[i];
+		if (n >= rank)
+		{
+			int64_t value = value_at(i);
+			return value < max_ ? (value > min_ ? value : min_) : max_;
+		}
+	}
+
+	return max_;
+}
@@ -0,0 +1,48 @@
+#ifndef _LATENCYHISTOGRAM_H_
+#define _LATENCYHISTOGRAM_H_
+
+#include <stdint.h>
+
+/**
+ * @file   LatencyHistogram.h
+ * @brief  HDR-style histogram of latencies in microseconds
+ */
+
+// Log-linear buckets: 64 sub-buckets per power of two, so any recorded
+// value is reported within 1.6%. Values up to 2^36 us (about 19 hours).
+// Thread safety: NO
+class LatencyHistogram
+{
+public:
+	void record(int64_t usec);
+	void merge(const LatencyHistogram& other);
+	void reset();
+
+	int64_t count() const { return count_; }
+	int64_t min() const { return count_ ? min_ : 0; }
+	int64_t max() const { return max_; }
+	double mean() const { return count_ ? (double)sum_ / count_ : 0; }
+
+	// Smallest value that 'percentile' (0 - 100) of samples are below.
+	int64_t percentile(double percentile) const;
+
+public:
+	LatencyHistogram() { reset(); }
+
+private:
+	static constexpr int SUB_BITS = 7;
+	static constexpr int SUB_HALF = 1 << (SUB_BITS - 1);
+	static constexpr int MAX_BITS = 36;
+	static constexpr int BUCKETS = (MAX_BITS - SUB_BITS + 2) * SUB_HALF;
+
+	static int index_of(int64_t value);
+	static int64_t value_at(int index);
+
+	int64_t counts_[BUCKETS];
+	int64_t count_;
+	int64_t sum_;
+	int64_t min_;
+	int64_t max_;
+};
+
+#endif